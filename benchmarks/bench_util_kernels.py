@@ -0,0 +1,181 @@
+"""
+Microbenchmarks for the Cython kernels in util.pyx.
+
+Each kernel runs on synthetic atoms (see conftest.py). The work unit handed to one
+ProcessPoolExecutor task is benchmarked: an x slab of the grid for the receptor potential,
+an atom slice for the ligand charge grid and SASA. Throughput is stored as
+atoms * grid points per second in the extra_info of each benchmark.
+
+    pytest benchmarks --benchmark-autosave
+    pytest benchmarks --benchmark-compare
+"""
+import numpy as np
+import pytest
+
+from conftest import TASK_DIVISOR, GRID_COUNTS, SPACING, record_throughput
+
+try:
+    from bpmfwfft.util import c_cal_potential_grid_pp
+    from bpmfwfft.util import c_cal_charge_grid_pp_mp
+    from bpmfwfft.util import c_distr_charge_one_atom
+    from bpmfwfft.util import c_corners_within_radius
+    from bpmfwfft.util import c_capsule_occupancy, c_occupancy_segments
+    from bpmfwfft.util import c_sasa, c_asa_frame, c_generate_sphere_points
+    from bpmfwfft.util import c_points_to_grid
+    from bpmfwfft.util import get_min_dists
+    from bpmfwfft.util import c_interpolate_energies
+except ImportError:
+    pytest.skip("bpmfwfft.util is not compiled", allow_module_level=True)
+
+pytest.importorskip("pytest_benchmark")
+
+CORE_SCALING = 0.76
+SURFACE_SCALING = 0.53
+METAL_SCALING = 0.55
+N_SPHERE_POINTS = 960
+PROBE_SIZE = 1.4
+NR_POSES = 1000
+LIG_NATOMS = 50
+
+
+def _atom_slice(system):
+    natoms_i = max(1, system.natoms // TASK_DIVISOR)
+    return natoms_i, 0
+
+
+@pytest.mark.parametrize("name", ["LJr", "LJa", "electrostatic", "occupancy"])
+def test_cal_potential_grid_slab(benchmark, system, name):
+    grid_x, counts, uper_most_corner, uper_most_corner_crd = system.slab()
+    benchmark.pedantic(c_cal_potential_grid_pp,
+                       args=(name, system.crd, grid_x, system.grid_y, system.grid_z,
+                             system.origin, uper_most_corner_crd, uper_most_corner,
+                             system.spacing, counts, system.charges, system.lj_sigma,
+                             system.vdw_radii, system.clash_radii, system.no_bonds, system.atom_list,
+                             system.molecule_sasa, system.sasa_cutoffs, system.res_names,
+                             CORE_SCALING, SURFACE_SCALING, METAL_SCALING),
+                       rounds=3, iterations=1)
+    record_throughput(benchmark, system.natoms, np.prod(counts))
+
+
+@pytest.mark.parametrize("name", ["LJr", "electrostatic"])
+def test_cal_charge_grid_atom_slice(benchmark, system, name):
+    natoms_i, atomind = _atom_slice(system)
+    benchmark.pedantic(c_cal_charge_grid_pp_mp,
+                       args=(name, system.crd, system.grid_x, system.grid_y, system.grid_z,
+                             system.origin, system.uper_most_corner_crd, system.uper_most_corner,
+                             system.spacing, system.eight_corner_shifts, system.six_corner_shifts,
+                             system.counts, system.charges, system.lj_sigma, system.vdw_radii,
+                             system.clash_radii, system.no_bonds, system.atom_list, natoms_i, atomind,
+                             system.molecule_sasa, system.sasa_cutoffs, system.res_names,
+                             CORE_SCALING, SURFACE_SCALING, METAL_SCALING),
+                       rounds=3, iterations=1)
+    record_throughput(benchmark, natoms_i, np.prod(system.counts))
+
+
+def test_distr_charge_one_atom(benchmark, system):
+    natoms_i, atomind = _atom_slice(system)
+
+    def distribute():
+        for atom_ind in range(atomind, atomind + natoms_i):
+            c_distr_charge_one_atom("LJr", system.crd[atom_ind], system.charges[atom_ind],
+                                    system.origin, system.uper_most_corner_crd, system.uper_most_corner,
+                                    system.spacing, system.eight_corner_shifts, system.six_corner_shifts,
+                                    system.grid_x, system.grid_y, system.grid_z)
+    benchmark.pedantic(distribute, rounds=3, iterations=1)
+    # ten corners per atom
+    record_throughput(benchmark, natoms_i, 10)
+
+
+def test_corners_within_radius(benchmark, system):
+    natoms_i, atomind = _atom_slice(system)
+
+    def search():
+        for atom_ind in range(atomind, atomind + natoms_i):
+            c_corners_within_radius(system.crd[atom_ind], system.clash_radii[atom_ind],
+                                    system.origin, system.uper_most_corner_crd, system.uper_most_corner,
+                                    system.spacing, system.grid_x, system.grid_y, system.grid_z,
+                                    system.counts)
+    benchmark.pedantic(search, rounds=3, iterations=1)
+    # grid points in the bounding cube of the largest radius
+    half_width = np.ceil(system.clash_radii.max() / system.spacing[0])
+    record_throughput(benchmark, natoms_i, (2 * half_width + 1) ** 3)
+
+
+@pytest.mark.parametrize("with_bonds", [False, True], ids=["spheres", "capsules"])
+def test_capsule_occupancy(benchmark, system, with_bonds):
+    bonds = system.bonds if with_bonds else system.no_bonds
+    segments, radii = c_occupancy_segments(system.atom_list, bonds, system.clash_radii)
+    grid = np.zeros(system.counts, dtype=np.float64)
+    benchmark.pedantic(c_capsule_occupancy,
+                       args=(system.crd, segments, radii, system.origin, system.spacing, grid),
+                       rounds=3, iterations=1)
+    benchmark.extra_info["occupied_fraction"] = float(grid.mean())
+    half_width = np.ceil(system.clash_radii.max() / system.spacing[0])
+    record_throughput(benchmark, segments.shape[0], (2 * half_width + 1) ** 3)
+
+
+def test_sasa_atom_slice(benchmark, system):
+    natoms_i, atomind = _atom_slice(system)
+    benchmark.pedantic(c_sasa,
+                       args=(system.crd, system.vdw_radii, system.spacing, PROBE_SIZE,
+                             N_SPHERE_POINTS, natoms_i, atomind),
+                       rounds=3, iterations=1)
+    # every sphere point is tested against the neighbor list of its atom
+    record_throughput(benchmark, natoms_i, N_SPHERE_POINTS)
+
+
+def test_asa_frame_atom_slice(benchmark, system):
+    # c_sasa without the sphere point generation, which is the same for every slice
+    natoms_i, atomind = _atom_slice(system)
+    sphere_points = c_generate_sphere_points(N_SPHERE_POINTS)
+    benchmark.pedantic(c_asa_frame,
+                       args=(system.crd, system.vdw_radii + PROBE_SIZE, system.spacing, sphere_points,
+                             N_SPHERE_POINTS, natoms_i, atomind),
+                       rounds=3, iterations=1)
+    record_throughput(benchmark, natoms_i, N_SPHERE_POINTS)
+
+
+def test_points_to_grid(benchmark, system):
+    natoms_i, atomind = _atom_slice(system)
+    points = c_sasa(system.crd, system.vdw_radii, system.spacing, PROBE_SIZE,
+                    N_SPHERE_POINTS, natoms_i, atomind)
+    benchmark.pedantic(c_points_to_grid, args=(points, system.spacing, system.counts),
+                       rounds=3, iterations=1)
+    record_throughput(benchmark, natoms_i, N_SPHERE_POINTS)
+
+
+def test_get_min_dists(benchmark, system):
+    natoms_i, atomind = _atom_slice(system)
+    lig = slice(atomind, atomind + natoms_i)
+    benchmark.pedantic(get_min_dists,
+                       args=(system.crd, system.crd[lig] + 1.0, system.lj_sigma, system.lj_sigma[lig],
+                             system.vdw_radii, system.vdw_radii[lig],
+                             system.atom_names, system.atom_names[lig],
+                             system.res_names, system.res_names[lig],
+                             system.molecule_sasa, system.molecule_sasa[:, lig],
+                             0.5, True, False),
+                       rounds=3, iterations=1)
+    # receptor atoms play the role of grid points for the pairwise distance scan
+    record_throughput(benchmark, natoms_i, system.natoms)
+
+
+@pytest.mark.parametrize("count", GRID_COUNTS, ids=lambda c: "%dcube" % c)
+@pytest.mark.parametrize("order", [1, 3], ids=["trilinear", "tricubic"])
+@pytest.mark.parametrize("with_gradient", [False, True], ids=["energy", "gradient"])
+def test_interpolate_energies(benchmark, count, order, with_gradient):
+    rng = np.random.default_rng(0)
+    grids = rng.uniform(-1., 1., size=(3, count, count, count))
+    spacing = np.array([SPACING] * 3)
+    # two spacings inside the border, tricubic needs one
+    crd = rng.uniform(2. * SPACING, (count - 3) * SPACING, size=(NR_POSES, LIG_NATOMS, 3))
+    charges = rng.uniform(-1., 1., size=(3, LIG_NATOMS))
+    energies = np.empty(NR_POSES)
+    gradients = np.empty(crd.shape) if with_gradient else None
+    benchmark.pedantic(c_interpolate_energies,
+                       args=(grids, np.zeros(3), spacing, crd, charges, order, energies, gradients),
+                       rounds=3, iterations=1)
+    benchmark.extra_info["nr_poses"] = NR_POSES
+    benchmark.extra_info["lig_natoms"] = LIG_NATOMS
+    mean = benchmark.stats.stats.mean
+    if mean > 0:
+        benchmark.extra_info["poses_per_second"] = NR_POSES / mean
@@ -0,0 +1,95 @@
+"""
+Sphere-only versus sphere-and-bond (capsule) occupancy grids.
+
+For each spacing, the occupancy grid of a molecule is built twice with util.c_capsule_occupancy:
+heavy-atom spheres of the clash radii only, and the same spheres plus capsules along the heavy-atom
+bonds. Both are scored against random probe points, using the union of the unscaled van der Waals
+spheres as the true body: a probe is a clash if its nearest grid point is occupied.
+The timings, occupied volumes and false negative / false positive rates go to a JSON file.
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import argparse
+
+import numpy as np
+
+from bpmfwfft import IO
+from bpmfwfft.util import c_capsule_occupancy, c_occupancy_segments
+
+EXAMPLES = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "examples")
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--prmtop",         type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin/ligand.prmtop"))
+parser.add_argument("--inpcrd",         type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin/ligand.inpcrd"))
+parser.add_argument("--spacings",       type=float, nargs="+", default=[0.25, 0.5, 0.75, 1.0])
+parser.add_argument("--clash_scale",    type=float, default=0.8, help="clash radius / vdW radius")
+parser.add_argument("--nr_probes",      type=int, default=200000)
+parser.add_argument("--repeats",        type=int, default=3)
+parser.add_argument("--seed",           type=int, default=0)
+parser.add_argument("--out_json",       type=str, default="bond_occupancy.json")
+args = parser.parse_args()
+
+BUFFER = 3.0
+
+prmtop = IO.PrmtopLoad(args.prmtop).get_parm_for_grid_calculation()
+crd = IO.InpcrdLoad(args.inpcrd).get_coordinates()
+heavy = np.array([i for i, name in enumerate(prmtop["PDB_TEMPLATE"]["ATOM_NAME"]) if name[0] != "H"])
+vdw_radii = np.array(prmtop["VDW_RADII"], dtype=float)
+clash_radii = args.clash_scale * vdw_radii
+bonds = np.asarray(prmtop["BONDS_WITHOUT_HYDROGEN"], dtype=np.int64).reshape(-1, 3)[:, :2] // 3
+no_bonds = np.zeros((0, 2), dtype=np.int64)
+
+lower = crd[heavy].min(axis=0) - BUFFER
+upper = crd[heavy].max(axis=0) + BUFFER
+rng = np.random.default_rng(args.seed)
+probes = rng.uniform(lower, upper, size=(args.nr_probes, 3))
+
+
+def in_body(points, chunk=2000):
+    """
+    :return: 1d array of bool, points inside the union of heavy-atom vdW spheres
+    """
+    inside = np.zeros(points.shape[0], dtype=bool)
+    for start in range(0, points.shape[0], chunk):
+        d2 = ((points[start:start + chunk, None, :] - crd[None, heavy, :]) ** 2).sum(axis=2)
+        inside[start:start + chunk] = np.any(d2 <= vdw_radii[heavy] ** 2, axis=1)
+    return inside
+
+
+truth = in_body(probes)
+print("%d heavy atoms, %d bonds, %.1f%% of probes inside the vdW body" % (heavy.shape[0], bonds.shape[0],
+                                                                         100. * truth.mean()))
+
+report = {"prmtop": args.prmtop, "clash_scale": args.clash_scale, "nr_probes": args.nr_probes, "spacings": {}}
+print("spacing  mode       seconds   occupied (A^3)   false neg   false pos")
+for spacing in args.spacings:
+    spacing_3 = np.array([spacing] * 3, dtype=float)
+    counts = np.ceil((upper - lower) / spacing).astype(np.int64) + 1
+    nearest = np.rint((probes - lower) / spacing).astype(np.int64)
+    nearest = np.minimum(nearest, counts - 1)
+    report["spacings"][str(spacing)] = {}
+    for mode, mode_bonds in [("spheres", no_bonds), ("capsules", bonds)]:
+        segments, radii = c_occupancy_segments(list(heavy), mode_bonds, clash_radii)
+        times = []
+        for _ in range(args.repeats):
+            grid = np.zeros(counts, dtype=float)
+            start_time = time.time()
+            c_capsule_occupancy(crd, segments, radii, lower, spacing_3, grid)
+            times.append(time.time() - start_time)
+        predicted = grid[nearest[:, 0], nearest[:, 1], nearest[:, 2]] > 0.
+        result = {"seconds": min(times),
+                  "occupied_volume": float(grid.sum() * spacing ** 3),
+                  "false_negative_rate": float(np.mean(~predicted[truth])),
+                  "false_positive_rate": float(np.mean(predicted[~truth]))}
+        report["spacings"][str(spacing)][mode] = result
+        print("%7.2f  %-8s %9.4f %16.1f %11.4f %11.4f" % (spacing, mode, result["seconds"],
+                                                          result["occupied_volume"],
+                                                          result["false_negative_rate"],
+                                                          result["false_positive_rate"]))
+
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
@@ -0,0 +1,112 @@
+"""
+Conformer-ensemble FFT sampling against the frame-by-frame loop, on the T4 lysozyme / benzene example.
+
+frame-by-frame: every ligand MD frame crossed with every rotation goes through Sampling as an
+independent ligand pose, as run_fft_sampling.py used to do.
+ensemble: the frames are clustered by RMSD, topology and parameters are loaded once, the per atom
+SASA is computed once per representative, and the rows are weighted by cluster population.
+Wall times, the number of representatives and the gas phase BPMF of both runs go to a JSON file.
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import argparse
+import tempfile
+
+import numpy as np
+import netCDF4
+
+from bpmfwfft.grids import RecGrid
+from bpmfwfft.fft_sampling import Sampling, ConformerEnsembleSampling, KB
+from bpmfwfft.conformers import ConformerRotationEnsemble
+from bpmfwfft.rotation import _random_rotation_matrix
+
+EXAMPLES = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "examples")
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--rec_prmtop",     type=str, default=os.path.join(EXAMPLES, "amber/t4_lysozyme/receptor_579.prmtop"))
+parser.add_argument("--rec_inpcrd",     type=str, default=os.path.join(EXAMPLES, "amber/t4_lysozyme/receptor_579.inpcrd"))
+parser.add_argument("--bsite",          type=str, default=os.path.join(EXAMPLES, "amber/t4_lysozyme/measured_binding_site.py"))
+parser.add_argument("--lig_prmtop",     type=str, default=os.path.join(EXAMPLES, "amber/benzene/ligand.prmtop"))
+parser.add_argument("--lig_inpcrd",     type=str, default=os.path.join(EXAMPLES, "amber/benzene/ligand.inpcrd"))
+parser.add_argument("--lig_traj_nc",    type=str, default=os.path.join(EXAMPLES, "ligand_md/benzene/trajectory.nc"))
+parser.add_argument("--nr_conformers",  type=int, default=1000)
+parser.add_argument("--nr_rotations",   type=int, default=4)
+parser.add_argument("--rmsd_cutoff",    type=float, default=0.5)
+parser.add_argument("--spacing",        type=float, default=0.5)
+parser.add_argument("--lj_scale",       type=float, default=1.0)
+parser.add_argument("--skip_frame_by_frame", action="store_true", default=False)
+parser.add_argument("--seed",           type=int, default=0)
+parser.add_argument("--out_json",       type=str, default="conformer_ensemble.json")
+args = parser.parse_args()
+
+TEMPERATURE = 300.
+SCALINGS = (0.76, 0.53, 0.55, 0.81, 0.50, 0.54, 9.0)
+
+
+def gas_bpmf(nc_file_name):
+    """
+    -kT ln of the weighted exponential mean, without the volume correction
+    """
+    nc_handle = netCDF4.Dataset(nc_file_name, "r")
+    exponential_sums = np.array(nc_handle.variables["exponential_sums"][:], dtype=float)
+    log_of_divisors = np.array(nc_handle.variables["log_of_divisors"][:], dtype=float)
+    nr_grid_points = np.array(nc_handle.variables["nr_grid_points"][:], dtype=float)
+    weights = np.ones_like(exponential_sums)
+    if "conformer_weight" in nc_handle.variables.keys():
+        weights = np.array(nc_handle.variables["conformer_weight"][:], dtype=float)
+    nc_handle.close()
+    common_divisor = log_of_divisors.max()
+    exp_mean = np.sum(weights * exponential_sums * np.exp(log_of_divisors - common_divisor)) / \
+               np.sum(weights * nr_grid_points)
+    return -KB * TEMPERATURE * (np.log(exp_mean) + common_divisor)
+
+
+tmp_dir = tempfile.mkdtemp()
+grid_nc_file = os.path.join(tmp_dir, "grid.nc")
+start_time = time.time()
+RecGrid(args.rec_prmtop, args.lj_scale, SCALINGS[0], SCALINGS[1], SCALINGS[2], SCALINGS[6],
+        args.rec_inpcrd, args.bsite, grid_nc_file, new_calculation=True, spacing=args.spacing)
+grid_time = time.time() - start_time
+
+lig_nc_handle = netCDF4.Dataset(args.lig_traj_nc, "r")
+conformers = np.array(lig_nc_handle.variables["positions"][0:args.nr_conformers], dtype=float)
+lig_nc_handle.close()
+np.random.seed(args.seed)
+rotations = np.array([_random_rotation_matrix() for _ in range(args.nr_rotations)])
+
+report = {"nr_conformers": conformers.shape[0], "nr_rotations": args.nr_rotations,
+          "rmsd_cutoff": args.rmsd_cutoff, "spacing": args.spacing, "grid_seconds": grid_time}
+
+start_time = time.time()
+ensemble = ConformerRotationEnsemble(conformers, rotations, rmsd_cutoff=args.rmsd_cutoff)
+cluster_time = time.time() - start_time
+ensemble_nc = os.path.join(tmp_dir, "ensemble.nc")
+start_time = time.time()
+sampler = ConformerEnsembleSampling(args.rec_prmtop, args.lj_scale, *SCALINGS,
+                                    args.rec_inpcrd, args.bsite, grid_nc_file,
+                                    args.lig_prmtop, args.lig_inpcrd,
+                                    ensemble, 1, ensemble_nc, 0, temperature=TEMPERATURE)
+sampler.run_sampling()
+report["ensemble"] = {"seconds": time.time() - start_time, "cluster_seconds": cluster_time,
+                      "nr_representatives": int(ensemble.get_conformers().shape[0]),
+                      "bpmf": float(gas_bpmf(ensemble_nc))}
+
+if not args.skip_frame_by_frame:
+    frames = np.array([np.dot(conformer - conformer.mean(axis=0), rotation.T) + conformer.mean(axis=0)
+                       for conformer in conformers for rotation in rotations])
+    frame_nc = os.path.join(tmp_dir, "frame_by_frame.nc")
+    start_time = time.time()
+    sampler = Sampling(args.rec_prmtop, args.lj_scale, *SCALINGS,
+                       args.rec_inpcrd, args.bsite, grid_nc_file,
+                       args.lig_prmtop, args.lig_inpcrd,
+                       frames, 1, frame_nc, 0, temperature=TEMPERATURE)
+    sampler.run_sampling()
+    report["frame_by_frame"] = {"seconds": time.time() - start_time, "bpmf": float(gas_bpmf(frame_nc))}
+
+print(json.dumps(report, indent=2))
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
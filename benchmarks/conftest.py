@@ -0,0 +1,98 @@
+"""
+Synthetic inputs for the util.pyx microbenchmarks.
+
+Only CPU and local memory are needed. The default size matrix is small enough for a laptop;
+set BPMFWFFT_BENCH_FULL=1 to run 1k-50k atoms and 64^3-256^3 grids.
+"""
+import os
+
+import numpy as np
+import pytest
+
+FULL = os.environ.get("BPMFWFFT_BENCH_FULL", "0") == "1"
+
+NATOMS = [1000, 10000, 50000] if FULL else [1000, 5000]
+GRID_COUNTS = [64, 128, 256] if FULL else [64, 96]
+SPACING = 0.5
+# the receptor potential grid is computed in task_divisor slabs along x, benchmark one slab
+TASK_DIVISOR = 16
+BOND_LENGTH = 1.5
+
+
+class SyntheticSystem(object):
+    """
+    random atoms packed inside a cubic grid, with parameters in the ranges of protein atoms
+    """
+
+    def __init__(self, natoms, count, spacing=SPACING, seed=0):
+        rng = np.random.default_rng(seed)
+        self.natoms = natoms
+        self.counts = np.array([count] * 3, dtype=np.int64)
+        self.spacing = np.array([spacing] * 3, dtype=np.float64)
+        self.origin = np.zeros(3, dtype=np.float64)
+        self.grid_x = self.origin[0] + np.arange(count, dtype=np.float64) * spacing
+        self.grid_y = self.origin[1] + np.arange(count, dtype=np.float64) * spacing
+        self.grid_z = self.origin[2] + np.arange(count, dtype=np.float64) * spacing
+        self.uper_most_corner = self.counts - 1
+        self.uper_most_corner_crd = self.origin + self.uper_most_corner * spacing
+
+        # keep two spacings away from the border so that ten-corner charge spreading is valid
+        low = 2. * spacing
+        high = (count - 3) * spacing
+        self.crd = rng.uniform(low, high, size=(natoms, 3)).astype(np.float64)
+        self.charges = rng.uniform(-0.8, 0.8, size=natoms).astype(np.float64)
+        self.lj_sigma = rng.uniform(2.4, 3.8, size=natoms).astype(np.float64)
+        self.vdw_radii = rng.uniform(1.1, 1.9, size=natoms).astype(np.float64)
+        self.clash_radii = 0.8 * self.vdw_radii
+        self.molecule_sasa = rng.uniform(0., 30., size=(1, natoms)).astype(np.float32)
+        self.sasa_cutoffs = np.copy(self.molecule_sasa)
+        self.atom_names = ["CA"] * natoms
+        self.res_names = ["ALA"] * natoms
+        self.atom_list = list(range(natoms))
+
+        self.eight_corner_shifts = np.array([[i, j, k] for i in range(2) for j in range(2) for k in range(2)],
+                                            dtype=np.int64)
+        six = []
+        for i in [-1, 1]:
+            six.append([i, 0, 0])
+            six.append([0, i, 0])
+            six.append([0, 0, i])
+        self.six_corner_shifts = np.array(six, dtype=np.int64)
+
+        # pairs of atoms 1.5 A apart, bonded, for the bond occupancy kernel
+        directions = rng.normal(size=(natoms // 2, 3))
+        directions /= np.linalg.norm(directions, axis=1)[:, None]
+        first = np.arange(0, 2 * (natoms // 2), 2)
+        self.crd[first + 1] = np.clip(self.crd[first] + BOND_LENGTH * directions, low, high)
+        self.bonds = np.stack([first, first + 1], axis=1).astype(np.int64)
+        self.no_bonds = np.zeros((0, 2), dtype=np.int64)
+
+    def slab(self, task_divisor=TASK_DIVISOR):
+        """
+        grid axes of the first x slab, as handed to one worker by RecGrid._cal_potential_grids
+        """
+        counts = np.copy(self.counts)
+        counts[0] = max(1, counts[0] // task_divisor)
+        grid_x = self.grid_x[:counts[0]]
+        uper_most_corner = counts - 1
+        uper_most_corner_crd = self.origin + uper_most_corner * self.spacing
+        return grid_x, counts, uper_most_corner, uper_most_corner_crd
+
+
+def record_throughput(benchmark, natoms, npoints):
+    """
+    store atoms * grid points per second next to the timing statistics
+    """
+    benchmark.extra_info["natoms"] = int(natoms)
+    benchmark.extra_info["grid_points"] = int(npoints)
+    mean = benchmark.stats.stats.mean
+    if mean > 0:
+        benchmark.extra_info["atoms_gridpoints_per_second"] = float(natoms) * float(npoints) / mean
+    return None
+
+
+@pytest.fixture(scope="module", params=[(n, c) for n in NATOMS for c in GRID_COUNTS],
+                ids=lambda p: "%datoms-%dcube" % p)
+def system(request):
+    natoms, count = request.param
+    return SyntheticSystem(natoms, count)
@@ -0,0 +1,118 @@
+"""
+Core-count scaling of the multiprocess grid calculations.
+
+Every stage is run with 1, 2, 4, ... N worker processes, where N is the number of CPUs in
+this process's affinity mask. An Amdahl model T(p) = T1 * (s + (1 - s) / p) is fitted per stage.
+The curves, the fits and the task_divisor picked at each worker count are written to a JSON file
+so that runs on different machines can be diffed.
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import socket
+import argparse
+import platform
+import tempfile
+
+import numpy as np
+
+from bpmfwfft import parallel
+from bpmfwfft.grids import RecGrid, LigGrid, LIG_CHARGE_WORK_PER_ATOM
+
+EXAMPLES = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "examples")
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--rec_prmtop",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin_ligase/receptor.prmtop"))
+parser.add_argument("--rec_inpcrd",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin_ligase/receptor.inpcrd"))
+parser.add_argument("--lig_prmtop",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin/ligand.prmtop"))
+parser.add_argument("--lig_inpcrd",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin/ligand.inpcrd"))
+parser.add_argument("--spacing",        type=float, default=1.0)
+parser.add_argument("--lj_scale",       type=float, default=1.0)
+parser.add_argument("--max_workers",    type=int, default=None)
+parser.add_argument("--task_divisor",   type=int, default=None, help="fix the number of tasks instead of choosing it")
+parser.add_argument("--repeats",        type=int, default=1)
+parser.add_argument("--out_json",       type=str, default="core_scaling.json")
+args = parser.parse_args()
+
+LIG_GRID_NAMES = ["LJr", "electrostatic", "occupancy", "sasa"]
+
+
+def worker_counts(max_workers):
+    counts = []
+    nr_workers = 1
+    while nr_workers < max_workers:
+        counts.append(nr_workers)
+        nr_workers *= 2
+    counts.append(max_workers)
+    return counts
+
+
+def timed(function):
+    times = []
+    for _ in range(args.repeats):
+        start_time = time.time()
+        function()
+        times.append(time.time() - start_time)
+    return min(times)
+
+
+max_workers = args.max_workers if args.max_workers is not None else parallel.available_cpus()
+parallel.set_task_divisor(args.task_divisor)
+tmp_dir = tempfile.mkdtemp()
+grid_nc_file = os.path.join(tmp_dir, "grid.nc")
+
+stages = {}
+
+
+def record(stage, nr_workers, seconds, task_divisor):
+    stages.setdefault(stage, {"workers": [], "seconds": [], "task_divisor": []})
+    stages[stage]["workers"].append(nr_workers)
+    stages[stage]["seconds"].append(seconds)
+    stages[stage]["task_divisor"].append(task_divisor)
+    print("%-22s workers %3d  tasks %4d  %10.3f s" % (stage, nr_workers, task_divisor, seconds))
+
+
+rec_grid = None
+for nr_workers in worker_counts(max_workers):
+    parallel.set_max_workers(nr_workers)
+
+    def build_receptor():
+        global rec_grid
+        rec_grid = RecGrid(args.rec_prmtop, args.lj_scale, 0.76, 0.53, 0.55, 9.0,
+                           args.rec_inpcrd, None, grid_nc_file,
+                           new_calculation=True, spacing=args.spacing)
+    seconds = timed(build_receptor)
+    counts = rec_grid.get_grids()["counts"]
+    natoms = rec_grid.get_natoms()
+    record("receptor_grids", nr_workers, seconds,
+           parallel.choose_task_divisor(counts[0], natoms * counts[1] * counts[2]))
+
+    lig_grid = LigGrid(args.lig_prmtop, args.lj_scale, 0.81, 0.50, 0.54, args.lig_inpcrd, rec_grid)
+    lig_natoms = lig_grid.get_natoms()
+    for name in LIG_GRID_NAMES:
+        seconds = timed(lambda: lig_grid._cal_charge_grid(name))
+        if name == "sasa":
+            task_divisor = parallel.choose_task_divisor(lig_natoms, lig_natoms)
+        else:
+            task_divisor = parallel.choose_task_divisor(lig_natoms, LIG_CHARGE_WORK_PER_ATOM)
+        record("ligand_%s" % name, nr_workers, seconds, task_divisor)
+parallel.set_max_workers(None)
+
+report = {"host": socket.gethostname(), "machine": platform.machine(), "processor": platform.processor(),
+          "affinity_cpus": parallel.available_cpus(), "spacing": args.spacing,
+          "fixed_task_divisor": args.task_divisor, "stages": {}}
+print("stage                  serial_fraction   T1 (s)   max speedup")
+for stage, data in stages.items():
+    serial_fraction, t1 = parallel.fit_amdahl(data["workers"], data["seconds"])
+    max_speedup = np.inf if serial_fraction == 0. else 1. / serial_fraction
+    data["serial_fraction"] = serial_fraction
+    data["t1_seconds"] = t1
+    data["speedup"] = [data["seconds"][0] / seconds for seconds in data["seconds"]]
+    report["stages"][stage] = data
+    print("%-22s %15.3f %8.3f %13.1f" % (stage, serial_fraction, t1, max_speedup))
+
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
@@ -0,0 +1,130 @@
+"""
+Cost and accuracy of the desolvation FFT channel, on the ubiquitin ligase / ubiquitin example.
+
+The same random ligand rotations are sampled twice, with the desolvation term switched off
+(desolvation_weight=0) and at its default weight. The per-rotation wall time of every stage comes
+from the memory profiler, so the cost of the channel is read from its own stage.
+The resampled poses of the second run are then rescored in implicit solvent: the GB desolvation of
+a pose is (GBn2 - gas)(complex) - (GBn2 - gas)(receptor) - (GBn2 - gas)(ligand), from
+postprocess.cal_pot_energy. It is compared with the channel energy, from the FFT and from the direct
+pair sum grids.desolvation_energy. Timings and correlations go to a JSON file.
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import argparse
+import tempfile
+
+import numpy as np
+import netCDF4
+
+from bpmfwfft.grids import RecGrid, desolvation_energy, desolvation_weights
+from bpmfwfft.fft_sampling import Sampling
+from bpmfwfft.IO import PrmtopLoad, InpcrdLoad
+from bpmfwfft.postprocess import cal_pot_energy
+from bpmfwfft.rotation import _random_rotation_matrix
+
+EXAMPLES = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "examples")
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--rec_prmtop",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin_ligase/receptor.prmtop"))
+parser.add_argument("--rec_inpcrd",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin_ligase/receptor.inpcrd"))
+parser.add_argument("--lig_prmtop",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin/ligand.prmtop"))
+parser.add_argument("--lig_inpcrd",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin/ligand.inpcrd"))
+parser.add_argument("--complex_prmtop", type=str,
+                    default=os.path.join(EXAMPLES, "amber/ubql_ubiquitin_complex/complex.prmtop"),
+                    help="receptor atoms first, then ligand atoms")
+parser.add_argument("--nr_rotations",   type=int, default=4)
+parser.add_argument("--nr_poses",       type=int, default=25, help="resampled poses per rotation")
+parser.add_argument("--spacing",        type=float, default=1.0)
+parser.add_argument("--extra_buffer",   type=float, default=20.0)
+parser.add_argument("--lj_scale",       type=float, default=1.0)
+parser.add_argument("--phase",          type=str, default="OpenMM_GBn2")
+parser.add_argument("--skip_gb",        action="store_true", default=False)
+parser.add_argument("--seed",           type=int, default=0)
+parser.add_argument("--out_json",       type=str, default="desolvation_channel.json")
+args = parser.parse_args()
+
+TEMPERATURE = 300.
+SCALINGS = (0.76, 0.53, 0.55, 0.81, 0.50, 0.54, 9.0)
+
+
+def spearman(x, y):
+    rank_x = np.argsort(np.argsort(x))
+    rank_y = np.argsort(np.argsort(y))
+    return float(np.corrcoef(rank_x, rank_y)[0, 1])
+
+
+def solvation(prmtop_file, crd, tmp_dir):
+    return cal_pot_energy(prmtop_file, crd, args.phase, tmp_dir) - \
+           cal_pot_energy(prmtop_file, crd, "OpenMM_Gas", tmp_dir)
+
+
+tmp_dir = tempfile.mkdtemp()
+grid_nc_file = os.path.join(tmp_dir, "grid.nc")
+start_time = time.time()
+RecGrid(args.rec_prmtop, args.lj_scale, SCALINGS[0], SCALINGS[1], SCALINGS[2], SCALINGS[6],
+        args.rec_inpcrd, None, grid_nc_file, new_calculation=True, spacing=args.spacing,
+        extra_buffer=args.extra_buffer, desolvation=True)
+report = {"spacing": args.spacing, "nr_rotations": args.nr_rotations, "grid_seconds": time.time() - start_time}
+
+lig_crd = InpcrdLoad(args.lig_inpcrd).get_coordinates()
+center = lig_crd.mean(axis=0)
+np.random.seed(args.seed)
+rotations = [np.eye(3)] + [_random_rotation_matrix() for _ in range(args.nr_rotations - 1)]
+ensemble = np.array([np.dot(lig_crd - center, rotation.T) + center for rotation in rotations])
+
+output_nc = {}
+for label, weight in [("off", 0.), ("on", None)]:
+    output_nc[label] = os.path.join(tmp_dir, "sampling_%s.nc" % label)
+    sampler = Sampling(args.rec_prmtop, args.lj_scale, *SCALINGS,
+                       args.rec_inpcrd, None, grid_nc_file,
+                       args.lig_prmtop, args.lig_inpcrd,
+                       ensemble, args.nr_poses, output_nc[label], 0, temperature=TEMPERATURE,
+                       profile_memory=True, store_term_energies=True, desolvation_weight=weight)
+    sampler.run_sampling()
+    profile = sampler.get_memory_profile()
+    report[label] = dict((stage, record["seconds"] / record["calls"]) for stage, record in profile.items())
+    print(label, "seconds per rotation", report[label]["rotation"])
+# the desolvation stage itself; the difference of the rotation totals also carries the noise of the other stages
+report["desolvation_seconds_per_rotation"] = report["on"]["desolvation"]
+report["desolvation_fraction"] = report["on"]["desolvation"] / report["off"]["rotation"]
+report["extra_seconds_per_rotation"] = report["on"]["rotation"] - report["off"]["rotation"]
+
+# resampled poses of the run with the channel, in the grid frame
+nc_handle = netCDF4.Dataset(output_nc["on"], "r")
+spacing = np.array(nc_handle.variables["spacing"][:], dtype=float)
+rec_crd = np.array(nc_handle.variables["rec_positions"][:], dtype=float)
+lig_positions = np.array(nc_handle.variables["lig_positions"][:], dtype=float)
+trans_vectors = np.array(nc_handle.variables["resampled_trans_vectors"][:], dtype=int)
+fft_desolvation = np.array(nc_handle.variables["desolvation_term_energies"][:], dtype=float).ravel()
+desolvation_weight = float(nc_handle.variables["desolvation_weight"][0])
+nc_handle.close()
+poses = (lig_positions[:, np.newaxis, :, :] + trans_vectors[:, :, np.newaxis, :] * spacing).reshape(
+    (-1,) + lig_positions.shape[1:])
+finite = np.isfinite(fft_desolvation)
+poses, fft_desolvation = poses[finite], fft_desolvation[finite]
+
+rec_weights = desolvation_weights(PrmtopLoad(args.rec_prmtop).get_parm_for_grid_calculation())
+lig_weights = desolvation_weights(PrmtopLoad(args.lig_prmtop).get_parm_for_grid_calculation())
+direct_desolvation = desolvation_energy(rec_crd, rec_weights, poses, lig_weights, weight=desolvation_weight)
+report["nr_poses"] = int(poses.shape[0])
+report["fft_vs_direct_max_abs_error"] = float(np.abs(fft_desolvation - direct_desolvation).max())
+report["direct_range"] = [float(direct_desolvation.min()), float(direct_desolvation.max())]
+
+if not args.skip_gb:
+    start_time = time.time()
+    complex_crd = np.array([np.concatenate([rec_crd, pose]) for pose in poses])
+    gb_desolvation = solvation(args.complex_prmtop, complex_crd, tmp_dir) - \
+                     solvation(args.rec_prmtop, rec_crd, tmp_dir)[0] - solvation(args.lig_prmtop, poses, tmp_dir)
+    report["gb_seconds"] = time.time() - start_time
+    report["gb_range"] = [float(gb_desolvation.min()), float(gb_desolvation.max())]
+    report["pearson_vs_gb"] = float(np.corrcoef(direct_desolvation, gb_desolvation)[0, 1])
+    report["spearman_vs_gb"] = spearman(direct_desolvation, gb_desolvation)
+
+print(json.dumps(report, indent=2))
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
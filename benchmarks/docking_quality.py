@@ -0,0 +1,110 @@
+"""
+Throughput of fnat, iRMSD, LRMSD and DockQ over stored docking poses.
+
+A synthetic receptor and ligand are built as lattices of six-atom residues (N, CA, C, O, CB, H), the
+ligand stacked on one face of the receptor. Poses are --nr_rotations small rotations of the native
+ligand, each with --nr_poses Gaussian translations, as in resampled_trans_vectors.
+Reported: poses per second of DockingQuality.evaluate, the same for a per-pose loop over all
+receptor-ligand heavy-atom distances and a Kabsch fit (--nr_loop_poses poses), and the extrapolated
+minutes for 10^7 poses.
+"""
+from __future__ import print_function
+
+import json
+import time
+import argparse
+
+import numpy as np
+
+from bpmfwfft.docking_quality import DockingQuality
+from bpmfwfft.so3_search import kabsch_rotations
+from bpmfwfft.rotation import _rotation_matrix
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--rec_shape",      type=int, nargs=3, default=[10, 10, 6])
+parser.add_argument("--lig_shape",      type=int, nargs=3, default=[4, 4, 3])
+parser.add_argument("--nr_rotations",   type=int, default=200)
+parser.add_argument("--nr_poses",       type=int, default=100)
+parser.add_argument("--nr_loop_poses",  type=int, default=200)
+parser.add_argument("--seed",           type=int, default=0)
+parser.add_argument("--out_json",       type=str, default="docking_quality.json")
+args = parser.parse_args()
+
+NAMES = ["N", "CA", "C", "O", "CB", "H"]
+MASSES = [14.01, 12.01, 12.01, 16.00, 12.01, 1.008]
+SPACING = 4.5
+
+
+def molecule(shape, offset, rng):
+    centers = np.array(np.meshgrid(*[np.arange(n) for n in shape], indexing="ij"), dtype=float)
+    centers = centers.reshape((3, -1)).T * SPACING + offset
+    nres = centers.shape[0]
+    crd = (centers[:, np.newaxis, :] + rng.normal(size=(nres, 6, 3)) * 1.2).reshape((-1, 3))
+    prmtop = {"PDB_TEMPLATE": {"ATOM_NAME": NAMES * nres, "RES_ORDER": list(np.repeat(np.arange(1, nres + 1), 6))},
+              "MASS": np.array(MASSES * nres)}
+    return prmtop, crd
+
+
+def loop_metrics(quality, rec_crd, rec_prmtop, lig_prmtop, native, pose):
+    """
+    fnat, iRMSD and LRMSD of one pose from all heavy-atom distances
+    """
+    rec_res = np.array(rec_prmtop["PDB_TEMPLATE"]["RES_ORDER"])
+    lig_res = np.array(lig_prmtop["PDB_TEMPLATE"]["RES_ORDER"])
+    rec_heavy = np.array(rec_prmtop["MASS"]) > 1.5
+    lig_heavy = np.array(lig_prmtop["MASS"]) > 1.5
+    d = np.linalg.norm(rec_crd[rec_heavy][:, np.newaxis] - pose[lig_heavy][np.newaxis], axis=2)
+    rec_ind, lig_ind = np.nonzero(d <= 5.)
+    contacts = set(zip(rec_res[rec_heavy][rec_ind] - 1, lig_res[lig_heavy][lig_ind] - 1))
+    native_contacts = set(map(tuple, quality.get_native_contacts().tolist()))
+    fnat = len(native_contacts & contacts) / float(len(native_contacts))
+    lig_bb = np.isin(lig_prmtop["PDB_TEMPLATE"]["ATOM_NAME"], ["N", "CA", "C", "O"])
+    model = np.concatenate([rec_crd, pose[lig_bb]])
+    target = np.concatenate([rec_crd, native[lig_bb]])
+    rotation = kabsch_rotations(model, target[np.newaxis])[0]
+    fitted = np.dot(model - model.mean(axis=0), rotation.T) + target.mean(axis=0)
+    irmsd = np.sqrt(np.mean(np.sum((fitted - target) ** 2, axis=1)))
+    lrmsd = np.sqrt(np.mean(np.sum((pose[lig_bb] - native[lig_bb]) ** 2, axis=1)))
+    return fnat, irmsd, lrmsd
+
+
+rng = np.random.default_rng(args.seed)
+rec_prmtop, rec_crd = molecule(args.rec_shape, np.zeros(3), rng)
+lig_offset = np.array([SPACING * (args.rec_shape[0] - args.lig_shape[0]) / 2.,
+                       SPACING * (args.rec_shape[1] - args.lig_shape[1]) / 2., SPACING * args.rec_shape[2]])
+lig_prmtop, lig_crd = molecule(args.lig_shape, lig_offset, rng)
+
+start_time = time.time()
+quality = DockingQuality(rec_prmtop, lig_prmtop, rec_crd, lig_crd)
+setup_seconds = time.time() - start_time
+
+center = lig_crd.mean(axis=0)
+poses_crd = np.array([np.dot(lig_crd - center, _rotation_matrix([u0, u1, u2]).T) + center
+                      for u0, u1, u2 in zip(rng.uniform(0., 0.05, args.nr_rotations),
+                                            rng.uniform(size=args.nr_rotations), rng.uniform(size=args.nr_rotations))])
+translations = rng.normal(size=(args.nr_rotations, args.nr_poses, 3)) * 2.
+
+start_time = time.time()
+metrics = quality.evaluate(poses_crd, translations)
+evaluate_seconds = time.time() - start_time
+nr_poses = args.nr_rotations * args.nr_poses
+
+# the loop stands in for a per-pose tool; it fits all receptor atoms rather than the interface backbone
+start_time = time.time()
+for n in range(args.nr_loop_poses):
+    r, k = divmod(n, args.nr_poses)
+    loop_metrics(quality, rec_crd, rec_prmtop, lig_prmtop, lig_crd, poses_crd[r] + translations[r, k])
+loop_seconds = time.time() - start_time
+
+report = {"rec_natoms": rec_crd.shape[0], "lig_natoms": lig_crd.shape[0],
+          "nr_native_contacts": int(quality.get_native_contacts().shape[0]),
+          "nr_poses": nr_poses, "setup_seconds": setup_seconds,
+          "evaluate_seconds": evaluate_seconds, "poses_per_second": nr_poses / evaluate_seconds,
+          "loop_poses_per_second": args.nr_loop_poses / loop_seconds,
+          "speedup": (nr_poses / evaluate_seconds) / (args.nr_loop_poses / loop_seconds),
+          "minutes_for_1e7_poses": 1e7 / (nr_poses / evaluate_seconds) / 60.,
+          "mean_fnat": float(metrics["fnat"].mean()), "max_dockq": float(metrics["dockq"].max())}
+print(json.dumps(report, indent=2))
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
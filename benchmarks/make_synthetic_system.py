@@ -0,0 +1,32 @@
+"""
+Write a synthetic receptor/ligand system of any size for stress tests.
+
+    python benchmarks/make_synthetic_system.py --out_dir syn_20k --rec_natoms 20000 --lig_natoms 2000 \
+        --spacing 0.25 --grid_counts 300 --nr_rotations 10
+
+The output directory holds receptor.prmtop, receptor.inpcrd, ligand.prmtop, ligand.inpcrd,
+measured_binding_site.py and, with --nr_rotations, rotation.nc.
+"""
+from __future__ import print_function
+
+import argparse
+
+from bpmfwfft.synthetic_systems import generate_system
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--out_dir",            type=str, default="synthetic_system")
+parser.add_argument("--rec_natoms",         type=int, default=5000)
+parser.add_argument("--lig_natoms",         type=int, default=500)
+parser.add_argument("--layout",             type=str, default="random", choices=["random", "lattice"])
+parser.add_argument("--half_edge_length",   type=float, default=None)
+parser.add_argument("--spacing",            type=float, default=None)
+parser.add_argument("--grid_counts",        type=int, default=None)
+parser.add_argument("--site_R",             type=float, default=2.0)
+parser.add_argument("--nr_rotations",       type=int, default=0)
+parser.add_argument("--seed",               type=int, default=0)
+args = parser.parse_args()
+
+generate_system(args.out_dir, args.rec_natoms, args.lig_natoms, layout=args.layout,
+                half_edge_length=args.half_edge_length, spacing=args.spacing,
+                grid_counts=args.grid_counts, site_R=args.site_R,
+                nr_rotations=args.nr_rotations, seed=args.seed)
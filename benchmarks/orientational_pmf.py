@@ -0,0 +1,114 @@
+"""
+Cost of the orientational PMF on millions of rotations, and how well it finds known basins.
+
+A rigid random ligand is rotated --nr_rotations times, uniformly on SO(3), and each rotation is given
+the log weight -beta E of a sum of Gaussian wells in rotation angle around --nr_wells random
+orientations. The rotations are written to a Sampling-like nc file (lig_positions, exponential_sums,
+log_of_divisors, current_rotation_index), which orientational_pmf reads in chunks.
+Reported: the seconds to read lig_positions alone, to read, fit and bin the rotations, and find the basins, and the angle
+between every well and the basin found for it.
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import argparse
+import tempfile
+
+import numpy as np
+import netCDF4
+
+from bpmfwfft.orientational_pmf import orientational_pmf, print_basins, u_to_quaternions, \
+    quaternions_from_matrices
+from bpmfwfft.fft_sampling import KB
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--nr_rotations",   type=int, default=1000000)
+parser.add_argument("--natoms",         type=int, default=30)
+parser.add_argument("--nr_wells",       type=int, default=3)
+parser.add_argument("--well_width",     type=float, default=0.3, help="radians of rotation angle")
+parser.add_argument("--resolution",     type=int, default=12)
+parser.add_argument("--bandwidth",      type=float, default=None)
+parser.add_argument("--chunk_size",     type=int, default=1 << 16)
+parser.add_argument("--temperature",    type=float, default=300.)
+parser.add_argument("--seed",           type=int, default=0)
+parser.add_argument("--out_json",       type=str, default="orientational_pmf.json")
+args = parser.parse_args()
+
+
+def quaternion_matrices(q):
+    w, x, y, z = q.T
+    return np.stack([np.stack([w * w + x * x - y * y - z * z, 2 * (x * y - w * z), 2 * (x * z + w * y)], axis=1),
+                     np.stack([2 * (x * y + w * z), w * w - x * x + y * y - z * z, 2 * (y * z - w * x)], axis=1),
+                     np.stack([2 * (x * z - w * y), 2 * (y * z + w * x), w * w - x * x - y * y + z * z], axis=1)],
+                    axis=1)
+
+
+def rotation_angles(q, ref_q):
+    return 2. * np.arccos(np.clip(np.abs(np.dot(q, ref_q)), 0., 1.))
+
+
+rng = np.random.default_rng(args.seed)
+ligand = rng.normal(size=(args.natoms, 3)) * 5.
+ligand -= ligand.mean(axis=0)
+wells = u_to_quaternions(rng.uniform(size=(args.nr_wells, 3)))
+depths = -np.linspace(6., 4., args.nr_wells)
+
+nc_file = os.path.join(tempfile.mkdtemp(), "sampling.nc")
+nc_handle = netCDF4.Dataset(nc_file, "w", format="NETCDF4")
+nc_handle.createDimension("one", 1)
+nc_handle.createDimension("three", 3)
+nc_handle.createDimension("lig_natoms", args.natoms)
+nc_handle.createDimension("lig_sample_size", None)
+nc_handle.createVariable("lig_positions", "f8", ("lig_sample_size", "lig_natoms", "three"))
+nc_handle.createVariable("exponential_sums", "f8", ("lig_sample_size",))
+nc_handle.createVariable("log_of_divisors", "f8", ("lig_sample_size",))
+nc_handle.createVariable("current_rotation_index", "i8", ("one",))
+beta = 1. / KB / args.temperature
+start_time = time.time()
+for start in range(0, args.nr_rotations, args.chunk_size):
+    stop = min(start + args.chunk_size, args.nr_rotations)
+    q = u_to_quaternions(rng.uniform(size=(stop - start, 3)))
+    if start == 0:
+        # the reference pose
+        q[0] = [1., 0., 0., 0.]
+    energies = np.zeros(stop - start)
+    for well, depth in zip(wells, depths):
+        energies += depth * np.exp(-(rotation_angles(q, well) / args.well_width) ** 2)
+    nc_handle.variables["lig_positions"][start:stop] = np.einsum("nij,aj->nai", quaternion_matrices(q), ligand)
+    nc_handle.variables["exponential_sums"][start:stop] = np.exp(-beta * energies)
+    nc_handle.variables["log_of_divisors"][start:stop] = np.zeros(stop - start)
+nc_handle.variables["current_rotation_index"][0] = args.nr_rotations
+nc_handle.close()
+report = {"nr_rotations": args.nr_rotations, "natoms": args.natoms, "resolution": args.resolution,
+          "bandwidth": args.bandwidth, "write_seconds": time.time() - start_time}
+
+start_time = time.time()
+nc_handle = netCDF4.Dataset(nc_file, "r")
+nc_handle.variables["lig_positions"].set_auto_mask(False)
+for start in range(0, args.nr_rotations, args.chunk_size):
+    np.array(nc_handle.variables["lig_positions"][start:start + args.chunk_size])
+nc_handle.close()
+report["read_seconds"] = time.time() - start_time
+
+start_time = time.time()
+pmf = orientational_pmf(nc_file, resolution=args.resolution, temperature=args.temperature,
+                        chunk_size=args.chunk_size)
+report["pmf_seconds"] = time.time() - start_time
+
+start_time = time.time()
+basins = pmf.find_basins(bandwidth=args.bandwidth, nr_basins=args.nr_wells)
+report["basin_seconds"] = time.time() - start_time
+print_basins(basins)
+
+centers = quaternions_from_matrices(np.array([basin["center_matrix"] for basin in basins]))
+report["well_to_basin_degrees"] = [float(np.degrees(rotation_angles(centers, well).min())) for well in wells]
+report["basin_populations"] = [basin["population"] for basin in basins]
+report["basin_free_energies"] = [basin["free_energy"] for basin in basins]
+os.remove(nc_file)
+
+print(json.dumps(report, indent=2))
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
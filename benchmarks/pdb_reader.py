@@ -0,0 +1,116 @@
+"""
+Line-by-line PDB parsing, as the preparation scripts used to do, versus the fixed-width numpy
+reader protein_protein_scripts/_pdb_reader.PdbAtoms.
+
+A large multi-chain PDB file is written (or --pdb is read) and both ways do the same work: the
+lines of every chain, the residue ids of every chain and the HETATM lines of a few residue names
+in a few chains. Timings, the speedup and a check that both give the same lines go to a JSON file.
+"""
+from __future__ import print_function
+
+import os
+import sys
+import json
+import time
+import argparse
+import tempfile
+
+import numpy as np
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "protein_protein_scripts"))
+from _pdb_reader import PdbAtoms
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--pdb",            type=str, default=None, help="use this file instead of a synthetic one")
+parser.add_argument("--nr_chains",      type=int, default=20)
+parser.add_argument("--nr_residues",    type=int, default=1000, help="per chain")
+parser.add_argument("--atoms_per_residue", type=int, default=8)
+parser.add_argument("--repeats",        type=int, default=3)
+parser.add_argument("--seed",           type=int, default=0)
+parser.add_argument("--out_json",       type=str, default="pdb_reader.json")
+args = parser.parse_args()
+
+CHAIN_IDS = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+HET_RESNAMES = ["MG", "ZN", "ATP", "HOH"]
+SELECTED_RESNAMES = ["MG", "ZN", "ATP"]
+
+
+def write_synthetic_pdb(file_name):
+    rng = np.random.default_rng(args.seed)
+    serial = 1
+    with open(file_name, "w") as F:
+        F.write("REMARK  MODELLED RESIDUES: [(1, 5)]\n")
+        for chain in CHAIN_IDS[:args.nr_chains]:
+            lines = []
+            crd = rng.uniform(-99., 99., size=(args.nr_residues * args.atoms_per_residue + 40, 3))
+            for resid in range(1, args.nr_residues + 1):
+                for _ in range(args.atoms_per_residue):
+                    x, y, z = crd[serial % crd.shape[0]]
+                    lines.append("ATOM  %5d  CA  ALA %1s%4d    %8.3f%8.3f%8.3f  1.00  0.00           C\n" % (
+                        serial % 100000, chain, resid, x, y, z))
+                    serial += 1
+            for i, resname in enumerate(HET_RESNAMES):
+                for _ in range(10):
+                    x, y, z = crd[serial % crd.shape[0]]
+                    lines.append("HETATM%5d  X   %3s %1s%4d    %8.3f%8.3f%8.3f  1.00  0.00          %2s\n" % (
+                        serial % 100000, resname, chain, args.nr_residues + 1 + i, x, y, z, resname[:2]))
+                    serial += 1
+            lines.append("TER\n")
+            F.write("".join(lines))
+    return None
+
+
+def line_by_line(pdb_file, chains, het_chains):
+    text_lines = open(pdb_file, "r").readlines()
+    result = {}
+    for chain in chains:
+        atoms = [line.strip() for line in text_lines if line[0:4] == "ATOM" and line[21:22] == chain]
+        result[chain] = (atoms, sorted(set(int(atom[22:30]) for atom in atoms)))
+    hetatm = [line for line in text_lines if line.startswith("HETATM")]
+    hetatm = [line for line in hetatm if line[21:22] in het_chains]
+    hetatm = [line.strip() for line in hetatm if line[17:20].strip() in SELECTED_RESNAMES]
+    return result, hetatm
+
+
+def with_reader(pdb_file, chains, het_chains):
+    pdb = PdbAtoms(pdb_file)
+    is_atom = pdb.record_mask("ATOM")
+    result = {}
+    for chain in chains:
+        mask = is_atom & pdb.chain_mask(chain)
+        result[chain] = (pdb.get_lines(mask), pdb.unique_residues(mask))
+    hetatm = pdb.get_lines(pdb.record_mask("HETATM") & pdb.chain_mask(het_chains) &
+                           pdb.resname_mask(SELECTED_RESNAMES))
+    return result, hetatm
+
+
+pdb_file = args.pdb
+if pdb_file is None:
+    pdb_file = os.path.join(tempfile.mkdtemp(), "synthetic.pdb")
+    write_synthetic_pdb(pdb_file)
+print("PDB file %s, %.1f MB" % (pdb_file, os.path.getsize(pdb_file) / 1e6))
+
+chains = sorted(set(PdbAtoms(pdb_file).atoms["chain"].tolist()))
+het_chains = chains[::2]
+
+report = {"pdb": pdb_file, "size_mb": os.path.getsize(pdb_file) / 1e6, "nr_chains": len(chains)}
+outputs = {}
+for name, parse in [("line_by_line", line_by_line), ("pdb_reader", with_reader)]:
+    times = []
+    for _ in range(args.repeats):
+        start_time = time.time()
+        outputs[name] = parse(pdb_file, chains, het_chains)
+        times.append(time.time() - start_time)
+    report[name + "_seconds"] = min(times)
+    print("%-14s %8.3f s" % (name, min(times)))
+
+old, new = outputs["line_by_line"], outputs["pdb_reader"]
+report["same_result"] = (old[1] == new[1] and
+                         all(old[0][chain][0] == new[0][chain][0] and old[0][chain][1] == new[0][chain][1]
+                             for chain in chains))
+report["speedup"] = report["line_by_line_seconds"] / report["pdb_reader_seconds"]
+print("speedup %.2f, same result: %s" % (report["speedup"], report["same_result"]))
+
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
@@ -0,0 +1,99 @@
+"""
+Cubic versus principal-axis-aligned receptor boxes on the bundled protein-protein examples.
+
+For each receptor the grid counts of RecGrid without a binding site are computed both ways with
+grids.box_counts: the cube on the longest edge, and each edge of the box in the principal-axis
+frame sized on its own, padded to an FFT-friendly count. The number of grid points and the
+5 N log2(N) FFT estimate of both go to a JSON file. With --end_to_end, RecGrid and Sampling are also
+run both ways with the ubiquitin ligand and the wall times are reported.
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import argparse
+import tempfile
+
+import numpy as np
+
+from bpmfwfft import IO
+from bpmfwfft.grids import box_counts, principal_axes
+from bpmfwfft.perf_counters import fft_flops
+
+EXAMPLES = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "examples")
+RECEPTORS = {"ubiquitin_ligase": "amber/ubiquitin_ligase/receptor",
+             "ubiquitin": "amber/ubiquitin/ligand",
+             "ubql_ubiquitin_complex": "amber/ubql_ubiquitin_complex/complex"}
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--spacing",        type=float, default=0.5)
+parser.add_argument("--extra_buffer",   type=float, default=3.0)
+parser.add_argument("--lj_scale",       type=float, default=1.0)
+parser.add_argument("--end_to_end",     action="store_true", default=False)
+parser.add_argument("--nr_rotations",   type=int, default=2)
+parser.add_argument("--seed",           type=int, default=0)
+parser.add_argument("--out_json",       type=str, default="principal_axes_box.json")
+args = parser.parse_args()
+
+TEMPERATURE = 300.
+SCALINGS = (0.76, 0.53, 0.55, 0.81, 0.50, 0.54, 9.0)
+
+report = {"spacing": args.spacing, "extra_buffer": args.extra_buffer, "receptors": {}}
+print("receptor                 cube counts         aligned counts      points ratio  FFT ratio")
+for name, prefix in RECEPTORS.items():
+    prmtop = IO.PrmtopLoad(os.path.join(EXAMPLES, prefix + ".prmtop")).get_parm_for_grid_calculation()
+    crd = IO.InpcrdLoad(os.path.join(EXAMPLES, prefix + ".inpcrd")).get_coordinates()
+    lj_radius = np.array(prmtop["LJ_SIGMA"] * args.lj_scale / 2., dtype=float)
+
+    cube = box_counts(crd, lj_radius, args.spacing, args.extra_buffer)
+    rotation, center = principal_axes(crd, prmtop["MASS"])
+    aligned = box_counts(np.dot(crd - center, rotation.T), lj_radius, args.spacing, args.extra_buffer,
+                         anisotropic=True)
+    result = {"cube_counts": cube.tolist(), "aligned_counts": aligned.tolist(),
+              "cube_points": int(np.prod(cube)), "aligned_points": int(np.prod(aligned)),
+              "points_ratio": float(np.prod(aligned)) / np.prod(cube),
+              "fft_flops_ratio": fft_flops(aligned) / fft_flops(cube)}
+    report["receptors"][name] = result
+    print("%-24s %-19s %-19s %12.3f %10.3f" % (name, cube.tolist(), aligned.tolist(),
+                                               result["points_ratio"], result["fft_flops_ratio"]))
+
+if args.end_to_end:
+    from bpmfwfft.grids import RecGrid
+    from bpmfwfft.fft_sampling import Sampling
+    from bpmfwfft.rotation import _random_rotation_matrix
+
+    rec_prmtop = os.path.join(EXAMPLES, "amber/ubiquitin_ligase/receptor.prmtop")
+    rec_inpcrd = os.path.join(EXAMPLES, "amber/ubiquitin_ligase/receptor.inpcrd")
+    lig_prmtop = os.path.join(EXAMPLES, "amber/ubiquitin/ligand.prmtop")
+    lig_inpcrd = os.path.join(EXAMPLES, "amber/ubiquitin/ligand.inpcrd")
+    lig_crd = IO.InpcrdLoad(lig_inpcrd).get_coordinates()
+    lig_center = lig_crd.mean(axis=0)
+    np.random.seed(args.seed)
+    ensemble = np.array([np.dot(lig_crd - lig_center, _random_rotation_matrix().T) + lig_center
+                         for _ in range(args.nr_rotations)])
+
+    tmp_dir = tempfile.mkdtemp()
+    report["end_to_end"] = {}
+    for mode, principal_axes_box in [("cube", False), ("aligned", True)]:
+        grid_nc_file = os.path.join(tmp_dir, "grid_%s.nc" % mode)
+        start_time = time.time()
+        RecGrid(rec_prmtop, args.lj_scale, SCALINGS[0], SCALINGS[1], SCALINGS[2], SCALINGS[6],
+                rec_inpcrd, None, grid_nc_file, new_calculation=True, spacing=args.spacing,
+                extra_buffer=args.extra_buffer, principal_axes_box=principal_axes_box)
+        grid_time = time.time() - start_time
+
+        start_time = time.time()
+        sampler = Sampling(rec_prmtop, args.lj_scale, *SCALINGS,
+                           rec_inpcrd, None, grid_nc_file,
+                           lig_prmtop, lig_inpcrd,
+                           ensemble, 1, os.path.join(tmp_dir, "fft_%s.nc" % mode), 0, temperature=TEMPERATURE)
+        sampler.run_sampling()
+        report["end_to_end"][mode] = {"grid_seconds": grid_time, "sampling_seconds": time.time() - start_time}
+    report["end_to_end"]["speedup"] = (
+        sum(report["end_to_end"]["cube"].values()) / sum(report["end_to_end"]["aligned"].values()))
+    print(json.dumps(report["end_to_end"], indent=2))
+
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
@@ -0,0 +1,141 @@
+"""
+Neighbor against all-pairs (Gibbs) temperature exchange, with and without an adapted ladder.
+
+Default: a toy model, so the exchange schemes can be compared without OpenMM. Each replica is a
+harmonic oscillator with --dof degrees of freedom, and one MD iteration is an Ornstein-Uhlenbeck
+step with correlation --md_correlation at the replica's temperature. With --ligand_prmtop the
+ligand is run with OpenMM_TREMD instead and the numbers are read from its nc file.
+
+For every run it reports the neighbor acceptance, the number of round trips of replicas between
+the lowest and the highest temperature, and the statistical inefficiency g of the lowest
+temperature energies, as iterations and as uncorrelated samples per CPU hour.
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import argparse
+import tempfile
+
+import numpy as np
+
+from bpmfwfft.replica_exchange import TemperatureExchange, statistical_inefficiency, KB
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--ntemperatures",      type=int, default=8)
+parser.add_argument("--low_temperature",    type=float, default=300.)
+parser.add_argument("--high_temperature",   type=float, default=600.)
+parser.add_argument("--niterations",        type=int, default=5000)
+parser.add_argument("--nequilibration",     type=int, default=500)
+parser.add_argument("--dof",                type=int, default=60)
+parser.add_argument("--md_correlation",     type=float, default=0.95)
+parser.add_argument("--ligand_prmtop",      type=str, default=None)
+parser.add_argument("--ligand_inpcrd",      type=str, default=None)
+parser.add_argument("--steps_per_iteration", type=int, default=500)
+parser.add_argument("--seed",               type=int, default=0)
+parser.add_argument("--out_json",           type=str, default="replica_exchange.json")
+args = parser.parse_args()
+
+SETUPS = [("neighbor", "geometric", False), ("all_pairs", "geometric", False),
+          ("neighbor", "linear", True), ("all_pairs", "linear", True)]
+
+
+def ladder(kind):
+    if kind == "geometric":
+        return np.geomspace(args.low_temperature, args.high_temperature, args.ntemperatures)
+    return np.linspace(args.low_temperature, args.high_temperature, args.ntemperatures)
+
+
+def round_trips(replica_states, nstates):
+    """
+    number of trips lowest -> highest -> lowest temperature, summed over replicas
+    """
+    trips = 0
+    for states in replica_states.T:
+        ends = states[(states == 0) | (states == nstates - 1)]
+        # count changes of end; two changes make one round trip
+        trips += int(np.count_nonzero(np.diff(ends))) // 2
+    return trips
+
+
+def run_toy(scheme, kind, adapt):
+    rng = np.random.default_rng(args.seed)
+    exchanger = TemperatureExchange(ladder(kind), scheme=scheme, random_state=args.seed)
+    # positions of unit-stiffness oscillators, E = x^2 / 2
+    x = rng.normal(size=(args.ntemperatures, args.dof)) * np.sqrt(KB * exchanger.get_replica_temperatures())[:, None]
+    a = args.md_correlation
+
+    def md_step(x):
+        sigma = np.sqrt((1. - a ** 2) * KB * exchanger.get_replica_temperatures())[:, None]
+        return a * x + sigma * rng.normal(size=x.shape)
+
+    for iteration in range(args.nequilibration):
+        x = md_step(x)
+        energies = 0.5 * (x ** 2).sum(axis=1)
+        if adapt:
+            old = exchanger.get_replica_temperatures()
+            x *= np.sqrt(exchanger.adapt_ladder(energies) / old)[:, None]
+            energies = 0.5 * (x ** 2).sum(axis=1)
+        old = exchanger.get_replica_temperatures()
+        exchanger.exchange(energies)
+        x *= np.sqrt(exchanger.get_replica_temperatures() / old)[:, None]
+    exchanger.reset_statistics()
+
+    lowest_energies = np.empty(args.niterations)
+    replica_states = np.empty((args.niterations, args.ntemperatures), dtype=int)
+    exchange_seconds = 0.
+    start_cpu_time = time.process_time()
+    for iteration in range(args.niterations):
+        x = md_step(x)
+        energies = 0.5 * (x ** 2).sum(axis=1)
+        lowest_energies[iteration] = energies[exchanger.get_state_replicas()[0]]
+        replica_states[iteration] = exchanger.get_replica_states()
+        old = exchanger.get_replica_temperatures()
+        start_time = time.time()
+        exchanger.exchange(energies)
+        exchange_seconds += time.time() - start_time
+        x *= np.sqrt(exchanger.get_replica_temperatures() / old)[:, None]
+    cpu_hours = (time.process_time() - start_cpu_time) / 3600.
+
+    g = statistical_inefficiency(lowest_energies)
+    return {"temperatures": exchanger.get_temperatures().tolist(),
+            "neighbor_acceptance": exchanger.get_neighbor_acceptance().tolist(),
+            "round_trips": round_trips(replica_states, args.ntemperatures),
+            "statistical_inefficiency": g,
+            "uncorrelated_samples_per_cpu_hour": args.niterations / g / cpu_hours,
+            "exchange_seconds_per_iteration": exchange_seconds / args.niterations}
+
+
+def run_openmm(scheme, kind, adapt):
+    import netCDF4
+    from bpmfwfft.md_openmm import OpenMM_TREMD
+
+    nc_file = os.path.join(tempfile.mkdtemp(), "traj.nc")
+    tremd = OpenMM_TREMD(args.ligand_prmtop, args.ligand_inpcrd, "OpenMM_Gas", ladder(kind), exchange=scheme)
+    tremd.run(nc_file, args.steps_per_iteration, args.niterations, 1,
+              nequilibration=args.nequilibration, adapt_ladder=adapt)
+    nc_handle = netCDF4.Dataset(nc_file, "r")
+    result = {"temperatures": nc_handle.variables["temperatures"][:].tolist(),
+              "neighbor_acceptance": nc_handle.variables["acceptance_rate"][:].tolist(),
+              "round_trips": round_trips(nc_handle.variables["replica_states"][:], args.ntemperatures),
+              "statistical_inefficiency": float(nc_handle.variables["statistical_inefficiency"][0]),
+              "uncorrelated_samples_per_cpu_hour": float(nc_handle.variables["uncorrelated_samples_per_cpu_hour"][0])}
+    nc_handle.close()
+    return result
+
+
+report = {"model": "toy" if args.ligand_prmtop is None else args.ligand_prmtop,
+          "niterations": args.niterations, "nequilibration": args.nequilibration}
+for scheme, kind, adapt in SETUPS:
+    label = "%s_%s%s" % (scheme, kind, "_adapted" if adapt else "")
+    if args.ligand_prmtop is None:
+        report[label] = run_toy(scheme, kind, adapt)
+    else:
+        report[label] = run_openmm(scheme, kind, adapt)
+    print(label, "round trips", report[label]["round_trips"], "g", report[label]["statistical_inefficiency"])
+
+print(json.dumps(report, indent=2))
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
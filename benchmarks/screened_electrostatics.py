@@ -0,0 +1,138 @@
+"""
+Cost of the Debye-Hueckel screened electrostatic grid and the BPMF shift it brings.
+
+The electrostatic grid of the whole receptor, padded by --extra_buffer, is built in one process with
+the bare Coulomb kernel and with the screened kernel at each --ionic_strengths, cut at the default
+SCREENING_CUTOFF_DEBYE_LENGTHS Debye lengths. The bare kernel visits every atom and grid point; the
+screened one only the grid points within the cutoff of each atom.
+Then, unless --skip_bpmf, the whole-receptor grids, with the same padding, are built for each setting
+and the same ligand rotations are sampled on them. Reported: the seconds of every build, the largest change of the
+potential outside the clash radii, and the gas-phase BPMF of each setting and its shift from the bare one.
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import argparse
+import tempfile
+
+import numpy as np
+import netCDF4
+
+from bpmfwfft.grids import RecGrid, process_potential_grid_function, debye_kappa, \
+    SCREENING_CUTOFF_DEBYE_LENGTHS
+from bpmfwfft.fft_sampling import Sampling, KB
+from bpmfwfft.IO import PrmtopLoad, InpcrdLoad
+from bpmfwfft.rotation import _random_rotation_matrix
+
+EXAMPLES = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "examples")
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--rec_prmtop",     type=str, default=os.path.join(EXAMPLES, "amber/t4_lysozyme/receptor_579.prmtop"))
+parser.add_argument("--rec_inpcrd",     type=str, default=os.path.join(EXAMPLES, "amber/t4_lysozyme/receptor_579.inpcrd"))
+parser.add_argument("--lig_prmtop",     type=str, default=os.path.join(EXAMPLES, "amber/benzene/ligand.prmtop"))
+parser.add_argument("--lig_inpcrd",     type=str, default=os.path.join(EXAMPLES, "amber/benzene/ligand.inpcrd"))
+parser.add_argument("--ionic_strengths", type=float, nargs="+", default=[0.05, 0.15, 0.5], help="mol/L")
+parser.add_argument("--dielectric",     type=float, default=1.)
+parser.add_argument("--distance_dielectric", action="store_true", default=False)
+parser.add_argument("--spacing",        type=float, default=0.5)
+parser.add_argument("--extra_buffer",   type=float, default=8.0)
+parser.add_argument("--lj_scale",       type=float, default=1.0)
+parser.add_argument("--nr_rotations",   type=int, default=4)
+parser.add_argument("--nr_poses",       type=int, default=25)
+parser.add_argument("--skip_bpmf",      action="store_true", default=False)
+parser.add_argument("--seed",           type=int, default=0)
+parser.add_argument("--out_json",       type=str, default="screened_electrostatics.json")
+args = parser.parse_args()
+
+TEMPERATURE = 300.
+SCALINGS = (0.76, 0.53, 0.55, 0.81, 0.50, 0.54, 9.0)
+
+
+def gas_bpmf(nc_file_name):
+    """
+    -kT ln of the exponential mean, without the volume correction
+    """
+    nc_handle = netCDF4.Dataset(nc_file_name, "r")
+    exponential_sums = np.array(nc_handle.variables["exponential_sums"][:], dtype=float)
+    log_of_divisors = np.array(nc_handle.variables["log_of_divisors"][:], dtype=float)
+    nr_grid_points = np.array(nc_handle.variables["nr_grid_points"][:], dtype=float)
+    nc_handle.close()
+    common_divisor = log_of_divisors.max()
+    exp_mean = np.sum(exponential_sums * np.exp(log_of_divisors - common_divisor)) / np.sum(nr_grid_points)
+    return -KB * TEMPERATURE * (np.log(exp_mean) + common_divisor)
+
+
+prmtop = PrmtopLoad(args.rec_prmtop).get_parm_for_grid_calculation()
+crd = InpcrdLoad(args.rec_inpcrd).get_coordinates()
+natoms = crd.shape[0]
+origin = crd.min(axis=0) - args.extra_buffer
+counts = np.array(np.ceil((crd.max(axis=0) + args.extra_buffer - origin) / args.spacing) + 1, dtype=int)
+spacing = np.array([args.spacing] * 3)
+charges = 332.05221729 * np.array(prmtop["CHARGE_E_UNIT"], dtype=float)
+clash_radii = 0.8 * np.array(prmtop["VDW_RADII"], dtype=float)
+sasa = np.zeros((1, natoms), dtype=np.float32)
+atom_list = list(range(natoms))
+bonds = np.zeros((0, 2), dtype=int)
+
+
+def electrostatic_grid(kappa, dielectric, distance_dielectric, cutoff):
+    start_time = time.time()
+    grid = process_potential_grid_function("electrostatic", crd, origin, spacing, counts, charges,
+                                           prmtop["LJ_SIGMA"], prmtop["VDW_RADII"], clash_radii, bonds, atom_list,
+                                           sasa, sasa, prmtop["PDB_TEMPLATE"]["RES_NAME"], 1., 1., 1.,
+                                           kappa, dielectric, distance_dielectric, cutoff)
+    return grid, time.time() - start_time
+
+
+report = {"natoms": natoms, "counts": counts.tolist(), "spacing": args.spacing,
+          "dielectric": args.dielectric, "distance_dielectric": args.distance_dielectric}
+bare, report["bare_seconds"] = electrostatic_grid(0., 1., False, 0.)
+print("bare Coulomb grid", report["bare_seconds"], "s")
+report["screened"] = {}
+for ionic_strength in args.ionic_strengths:
+    kappa = debye_kappa(ionic_strength)
+    cutoff = SCREENING_CUTOFF_DEBYE_LENGTHS / kappa
+    grid, seconds = electrostatic_grid(kappa, args.dielectric, args.distance_dielectric, cutoff)
+    report["screened"][str(ionic_strength)] = {"debye_length": 1. / kappa, "cutoff": cutoff, "seconds": seconds,
+                                               "speedup": report["bare_seconds"] / seconds,
+                                               "max_abs_change": float(np.abs(grid - bare).max())}
+    print("ionic strength", ionic_strength, "M:", seconds, "s")
+
+if not args.skip_bpmf:
+    tmp_dir = tempfile.mkdtemp()
+    lig_crd = InpcrdLoad(args.lig_inpcrd).get_coordinates()
+    center = lig_crd.mean(axis=0)
+    np.random.seed(args.seed)
+    rotations = [np.eye(3)] + [_random_rotation_matrix() for _ in range(args.nr_rotations - 1)]
+    ensemble = np.array([np.dot(lig_crd - center, rotation.T) + center for rotation in rotations])
+    report["bpmf"] = {}
+    for ionic_strength in [0.] + args.ionic_strengths:
+        label = str(ionic_strength)
+        grid_nc_file = os.path.join(tmp_dir, "grid_%s.nc" % label)
+        start_time = time.time()
+        if ionic_strength == 0.:
+            RecGrid(args.rec_prmtop, args.lj_scale, SCALINGS[0], SCALINGS[1], SCALINGS[2], SCALINGS[6],
+                    args.rec_inpcrd, None, grid_nc_file, new_calculation=True, spacing=args.spacing,
+                    extra_buffer=args.extra_buffer)
+        else:
+            RecGrid(args.rec_prmtop, args.lj_scale, SCALINGS[0], SCALINGS[1], SCALINGS[2], SCALINGS[6],
+                    args.rec_inpcrd, None, grid_nc_file, new_calculation=True, spacing=args.spacing,
+                    extra_buffer=args.extra_buffer, ionic_strength=ionic_strength, dielectric=args.dielectric,
+                    distance_dielectric=args.distance_dielectric)
+        grid_seconds = time.time() - start_time
+        output_nc = os.path.join(tmp_dir, "sampling_%s.nc" % label)
+        sampler = Sampling(args.rec_prmtop, args.lj_scale, *SCALINGS,
+                           args.rec_inpcrd, None, grid_nc_file,
+                           args.lig_prmtop, args.lig_inpcrd,
+                           ensemble, args.nr_poses, output_nc, 0, temperature=TEMPERATURE)
+        sampler.run_sampling()
+        report["bpmf"][label] = {"grid_seconds": grid_seconds, "gas_bpmf": float(gas_bpmf(output_nc))}
+    for label, record in report["bpmf"].items():
+        record["shift"] = record["gas_bpmf"] - report["bpmf"]["0.0"]["gas_bpmf"]
+
+print(json.dumps(report, indent=2))
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
@@ -0,0 +1,90 @@
+"""
+Benchmark the SO(3) rotational prescreen against exhaustive FFT sampling.
+
+Exhaustive sampling runs the translational FFT for every rotation in the ligand ensemble.
+The SO(3) search ranks the same rotations from one coarse rotational energy map.
+For several kept fractions, report the recall of the exhaustive top rotations (by min_energy)
+and the speedup estimated from the measured per-rotation FFT time.
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import argparse
+import tempfile
+
+import numpy as np
+import netCDF4
+
+from bpmfwfft.fft_sampling import Sampling
+from bpmfwfft.so3_search import SO3RotationalSearch
+
+EXAMPLES = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "examples")
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--rec_prmtop",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin_ligase/receptor.prmtop"))
+parser.add_argument("--rec_inpcrd",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin_ligase/receptor.inpcrd"))
+parser.add_argument("--grid_nc_file",   type=str, default=os.path.join(EXAMPLES, "grid/ubiquitin_ligase/grid.nc"))
+parser.add_argument("--lig_prmtop",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin/ligand.prmtop"))
+parser.add_argument("--lig_inpcrd",     type=str, default=os.path.join(EXAMPLES, "amber/ubiquitin/ligand.inpcrd"))
+parser.add_argument("--lig_coor_nc",    type=str, default=os.path.join(EXAMPLES, "ligand_md/ubiquitin/rotation.nc"))
+parser.add_argument("--nr_lig_conf",    type=int, default=50)
+parser.add_argument("--bandwidth",      type=int, default=8)
+parser.add_argument("--top_n",          type=int, default=5)
+parser.add_argument("--lj_scale",       type=float, default=1.0)
+parser.add_argument("--out_json",       type=str, default="so3_recall.json")
+args = parser.parse_args()
+
+KEEP_FRACTIONS = [0.05, 0.1, 0.2, 0.3, 0.5]
+
+lig_nc_handle = netCDF4.Dataset(args.lig_coor_nc, "r")
+lig_coord_ensemble = lig_nc_handle.variables["positions"][0:args.nr_lig_conf]
+lig_nc_handle.close()
+lig_coord_ensemble = np.array(lig_coord_ensemble, dtype=float)
+nr_rotations = lig_coord_ensemble.shape[0]
+
+output_nc = os.path.join(tempfile.mkdtemp(), "fft_sampling.nc")
+start_time = time.time()
+sampler = Sampling(args.rec_prmtop, args.lj_scale,
+                   0.76, 0.53, 0.55, 0.81, 0.50, 0.54, 9.0,
+                   args.rec_inpcrd, None, args.grid_nc_file,
+                   args.lig_prmtop, args.lig_inpcrd,
+                   lig_coord_ensemble, 10, output_nc, 0, temperature=300.)
+setup_time = time.time() - start_time
+
+start_time = time.time()
+sampler.run_sampling()
+exhaustive_time = time.time() - start_time
+per_rotation_time = exhaustive_time / nr_rotations
+
+nc_handle = netCDF4.Dataset(output_nc, "r")
+min_energies = np.array(nc_handle.variables["min_energy"][:], dtype=float)
+nc_handle.close()
+
+rec_grid = sampler._create_rec_grid(args.rec_prmtop, args.lj_scale, 0.76, 0.53, 0.55, 9.0,
+                                    args.rec_inpcrd, None, args.grid_nc_file)
+start_time = time.time()
+so3_search = SO3RotationalSearch(rec_grid, sampler._lig_grid, bandwidth=args.bandwidth)
+scores = so3_search.score_ensemble(lig_coord_ensemble)
+so3_time = time.time() - start_time
+
+top_n = min(args.top_n, nr_rotations)
+exhaustive_best = set(np.argsort(min_energies)[:top_n].tolist())
+ranking = np.argsort(scores)
+
+report = {"nr_rotations": nr_rotations, "bandwidth": args.bandwidth, "top_n": top_n,
+          "exhaustive_seconds": exhaustive_time, "so3_seconds": so3_time,
+          "setup_seconds": setup_time, "rows": []}
+print("keep_fraction  kept  recall@%d  speedup" % top_n)
+for fraction in KEEP_FRACTIONS:
+    nr_kept = max(1, int(np.ceil(fraction * nr_rotations)))
+    kept = set(ranking[:nr_kept].tolist())
+    recall = len(kept & exhaustive_best) / float(top_n)
+    speedup = exhaustive_time / (so3_time + nr_kept * per_rotation_time)
+    report["rows"].append({"keep_fraction": fraction, "kept": nr_kept, "recall": recall, "speedup": speedup})
+    print("%13.2f  %4d  %9.2f  %7.2f" % (fraction, nr_kept, recall, speedup))
+
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
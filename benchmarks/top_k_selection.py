@@ -0,0 +1,156 @@
+"""
+Per-rotation cost of turning the FFT energy grids into the stored lowest energies, before and after
+the single-pass top-K selection, on a grid the size of a large receptor's.
+
+The grids are random: energy terms LJr, LJa, electrostatic, sasa and desolvation, and a clash mask
+that keeps --free_fraction of the translations. "before" replays the old Sampling._cal_energies:
+every stored component (sasa, LJ, no_sasa) and the total slices and masks the full grid again and
+sorts it with np.argsort, and the term energies are masked copies. "after" calls the Sampling
+methods: the meaningful flat indices are computed once per rotation, every grid is gathered into a
+reused buffer, and np.argpartition selects the lowest energies into preallocated arrays.
+Both give the same selections; seconds per rotation go to a JSON file.
+"""
+from __future__ import print_function
+
+import json
+import time
+import argparse
+
+import numpy as np
+
+from bpmfwfft.fft_sampling import Sampling, TERM_NAMES, COMPONENT_OF_TERM, COMPONENT_NAMES
+from bpmfwfft.memory import BufferPool
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--counts",         type=int, default=192, help="grid points along each axis")
+parser.add_argument("--border",         type=int, default=24, help="translations cut at the upper border")
+parser.add_argument("--free_fraction",  type=float, default=0.5)
+parser.add_argument("--sample_size",    type=int, default=1000, help="energy_sample_size_per_ligand")
+parser.add_argument("--nr_rotations",   type=int, default=3)
+parser.add_argument("--seed",           type=int, default=0)
+parser.add_argument("--out_json",       type=str, default="top_k_selection.json")
+args = parser.parse_args()
+
+
+class _LigGrid(object):
+    pass
+
+
+def make_sampler(counts, max_indices, sample_size):
+    """
+    a Sampling with only what the selection needs
+    """
+    sampler = object.__new__(Sampling)
+    sampler._energy_sample_size_per_ligand = sample_size
+    sampler._store_term_energies = True
+    sampler._lig_grid = _LigGrid()
+    sampler._lig_grid._buffers = BufferPool()
+    sampler._lig_grid._grid = {"counts": np.array(counts)}
+    sampler._lig_grid._max_grid_indices = max_indices
+    sampler._lig_grid._max_i, sampler._lig_grid._max_j, sampler._lig_grid._max_k = max_indices
+    sampler._resampled_energies = np.empty(sample_size)
+    sampler._resampled_trans_vectors = np.empty((sample_size, 3), dtype=int)
+    sampler._resampled_energies_components = dict((name, np.empty(sample_size)) for name in COMPONENT_NAMES)
+    sampler._resampled_trans_vectors_components = dict((name, np.empty((sample_size, 3), dtype=int))
+                                                       for name in COMPONENT_NAMES)
+    return sampler
+
+
+def set_mask(sampler, free_of_clash):
+    """
+    what Sampling._cal_free_of_clash computes from the clash mask, before and after
+    """
+    sampler._lig_grid._free_of_clash = free_of_clash
+    sampler._meaningful_flat_indices = np.flatnonzero(free_of_clash)
+    return None
+
+
+def set_grid_indices(sampler):
+    """
+    what Sampling._cal_free_of_clash adds for the single-pass selection
+    """
+    sampler._meaningful_grid_indices = np.ravel_multi_index(
+        np.unravel_index(sampler._meaningful_flat_indices, sampler._lig_grid._free_of_clash.shape),
+        tuple(sampler._lig_grid._grid["counts"]))
+    return None
+
+
+def before(sampler, term_grids, free_of_clash, sample_size):
+    max_i, max_j, max_k = free_of_clash.shape
+    meaningful = np.zeros(term_grids[TERM_NAMES[0]].shape)
+    results = {}
+    term_energies = {}
+    for name in TERM_NAMES:
+        meaningful += term_grids[name]
+        term_energies[name] = term_grids[name][0:max_i, 0:max_j, 0:max_k][free_of_clash]
+        if name in COMPONENT_OF_TERM:
+            grid = term_grids[name] if name == "sasa" else meaningful
+            energies = grid[0:max_i, 0:max_j, 0:max_k][free_of_clash]
+            sel_ind = np.argsort(energies)[:sample_size]
+            results[COMPONENT_OF_TERM[name]] = (energies[sel_ind], sampler._selected_corners(sel_ind))
+    energies = meaningful[0:max_i, 0:max_j, 0:max_k][free_of_clash]
+    sel_ind = np.argsort(energies)[:sample_size]
+    results["total"] = (np.array(energies[sel_ind], dtype=float), sampler._selected_corners(sel_ind))
+    results["terms"] = dict((name, np.array(term_energies[name][sel_ind], dtype=float)) for name in TERM_NAMES)
+    return results
+
+
+def after(sampler, term_grids):
+    meaningful = sampler._lig_grid._buffers.zeros("meaningful_energies", term_grids[TERM_NAMES[0]].shape)
+    results = {}
+    term_energies = {}
+    for name in TERM_NAMES:
+        meaningful += term_grids[name]
+        term_energies[name] = sampler._gather_meaningful(term_grids[name], "%s_term_energies" % name)
+        if name in COMPONENT_OF_TERM:
+            component = COMPONENT_OF_TERM[name]
+            energies = term_energies[name] if name == "sasa" else \
+                sampler._gather_meaningful(meaningful, "component_energies")
+            sampler._store_lowest(energies, sampler._resampled_energies_components[component],
+                                  sampler._resampled_trans_vectors_components[component])
+            results[component] = (sampler._resampled_energies_components[component],
+                                  sampler._resampled_trans_vectors_components[component])
+    energies = sampler._gather_meaningful(meaningful, "total_energies")
+    sel_ind = sampler._store_lowest(energies, sampler._resampled_energies, sampler._resampled_trans_vectors)
+    results["total"] = (sampler._resampled_energies, sampler._resampled_trans_vectors)
+    results["terms"] = dict((name, term_energies[name][sel_ind]) for name in TERM_NAMES)
+    return results
+
+
+rng = np.random.default_rng(args.seed)
+counts = (args.counts,) * 3
+max_indices = (args.counts - args.border,) * 3
+sampler = make_sampler(counts, max_indices, args.sample_size)
+report = {"counts": list(counts), "nr_translations": int(np.prod(max_indices)),
+          "free_fraction": args.free_fraction, "sample_size": args.sample_size,
+          "before_seconds": [], "after_seconds": []}
+for rotation in range(args.nr_rotations):
+    term_grids = dict((name, rng.normal(size=counts)) for name in TERM_NAMES)
+    free_of_clash = rng.random(max_indices) < args.free_fraction
+    set_mask(sampler, free_of_clash)
+
+    start_time = time.time()
+    expected = before(sampler, term_grids, free_of_clash, args.sample_size)
+    report["before_seconds"].append(time.time() - start_time)
+
+    start_time = time.time()
+    set_grid_indices(sampler)
+    results = after(sampler, term_grids)
+    report["after_seconds"].append(time.time() - start_time)
+
+    for key in list(COMPONENT_NAMES) + ["total"]:
+        assert np.array_equal(expected[key][0], results[key][0]), key
+        assert np.array_equal(expected[key][1], results[key][1]), key
+    for name in TERM_NAMES:
+        assert np.array_equal(expected["terms"][name], results["terms"][name]), name
+    print("rotation %d: before %0.3f s, after %0.3f s" % (rotation, report["before_seconds"][-1],
+                                                          report["after_seconds"][-1]))
+
+# the first rotation allocates the buffers
+report["before_seconds_per_rotation"] = float(np.median(report["before_seconds"]))
+report["after_seconds_per_rotation"] = float(np.median(report["after_seconds"]))
+report["speedup"] = report["before_seconds_per_rotation"] / report["after_seconds_per_rotation"]
+print(json.dumps(report, indent=2))
+with open(args.out_json, "w") as handle:
+    json.dump(report, handle, indent=2)
+print("Report written to %s" % args.out_json)
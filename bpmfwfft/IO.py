@@ -414,9 +414,10 @@ object 2 class gridconnections counts {0[0]} {0[1]} {0[2]}
 object 3 class array type double rank 0 items {3} data follows
 """.format(data['counts'], data['origin'], data['spacing'], n_points))
 
-    for start_n in range(0, len(data[key]), 3):
+    values = np.asarray(data[key]).ravel()
+    for start_n in range(0, n_points, 3):
         F.write(' '.join(['%6e' % c
-                          for c in data[key].ravel()[start_n:start_n + 3]]) + '\n')
+                          for c in values[start_n:start_n + 3]]) + '\n')
 
     F.write('object 4 class field\n')
     F.write('component "positions" value 1\n')
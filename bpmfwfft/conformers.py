@@ -0,0 +1,183 @@
+"""
+Conformer ensembles of a flexible ligand for FFT sampling.
+
+Conformers (e.g. frames of ligand_tremd.py at the lowest temperature) are clustered by aligned
+RMSD so that near-duplicates go through the FFT once. The representative of a cluster carries
+the number of frames in the cluster as its conformational weight; with frames drawn from the
+Boltzmann distribution of the free ligand, the BPMF of the ensemble is
+    exp(-beta BPMF) = sum_c w_c exp(-beta BPMF_c) / sum_c w_c.
+ConformerRotationEnsemble crosses the representatives with a set of rotations, conformer-major,
+so that per-conformer quantities are computed once for all of its rotations.
+"""
+from __future__ import print_function
+
+import numpy as np
+
+KB = 0.001987204134799235  # kcal/mol*K
+
+
+def center(crd):
+    """
+    :param crd: ndarray of shape (..., natoms, 3)
+    :return: ndarray, crd with the geometric center of every conformer at the origin
+    """
+    return crd - crd.mean(axis=-2, keepdims=True)
+
+
+def aligned_rmsd(reference, conformers):
+    """
+    RMSD after optimal superposition (Kabsch), for many conformers at once
+    :param reference: 2d array, (natoms, 3), centered
+    :param conformers: 3d array, (n, natoms, 3), centered
+    :return: 1d array of float, (n,)
+    """
+    natoms = reference.shape[0]
+    covariance = np.einsum("nai,aj->nij", conformers, reference)
+    u, s, vt = np.linalg.svd(covariance)
+    # no reflections
+    s[:, -1] *= np.sign(np.linalg.det(np.matmul(u, vt)))
+    msd = ((conformers ** 2).sum(axis=(1, 2)) + (reference ** 2).sum() - 2. * s.sum(axis=1)) / natoms
+    return np.sqrt(np.clip(msd, 0., None))
+
+
+def cluster_conformers(conformers, rmsd_cutoff, atom_indices=None):
+    """
+    leader clustering: a conformer joins the first representative within rmsd_cutoff,
+    otherwise it becomes a new representative
+    :param conformers: 3d array, (nconformers, natoms, 3)
+    :param rmsd_cutoff: float, in angstrom; 0 keeps every conformer
+    :param atom_indices: None or 1d array of int, atoms used for the RMSD, e.g. heavy atoms
+    :return: (representatives, labels, populations)
+        representatives: 1d array of int, indices of the representative conformers
+        labels: 1d array of int, cluster of every conformer, an index into representatives
+        populations: 1d array of int, number of conformers in every cluster
+    """
+    conformers = np.asarray(conformers, dtype=float)
+    assert len(conformers.shape) == 3, "conformers must be 3-D array."
+    nconformers = conformers.shape[0]
+    if rmsd_cutoff <= 0.:
+        return np.arange(nconformers), np.arange(nconformers), np.ones(nconformers, dtype=int)
+
+    if atom_indices is not None:
+        conformers = conformers[:, atom_indices, :]
+    conformers = center(conformers)
+
+    representatives = []
+    labels = np.zeros(nconformers, dtype=int)
+    leaders = np.zeros((0,) + conformers.shape[1:], dtype=float)
+    for i in range(nconformers):
+        if leaders.shape[0] > 0:
+            rmsd = aligned_rmsd(conformers[i], leaders)
+            close = np.flatnonzero(rmsd <= rmsd_cutoff)
+            if close.shape[0] > 0:
+                labels[i] = close[0]
+                continue
+        labels[i] = len(representatives)
+        representatives.append(i)
+        leaders = np.concatenate([leaders, conformers[i][np.newaxis]], axis=0)
+    populations = np.bincount(labels, minlength=len(representatives))
+    return np.array(representatives, dtype=int), labels, populations
+
+
+def combine_bpmfs(bpmfs, weights, temperature=300.):
+    """
+    :param bpmfs: 1d array of float, BPMF of every conformer, kcal/mol
+    :param weights: 1d array of float, conformational weights, need not be normalized
+    :param temperature: float
+    :return: float, BPMF of the ensemble
+    """
+    bpmfs = np.asarray(bpmfs, dtype=float)
+    weights = np.asarray(weights, dtype=float)
+    assert bpmfs.shape == weights.shape, "bpmfs and weights must have the same shape"
+    beta = 1. / KB / temperature
+    exponents = -beta * bpmfs
+    divisor = exponents.max()
+    exp_mean = np.sum(weights * np.exp(exponents - divisor)) / weights.sum()
+    return -(np.log(exp_mean) + divisor) / beta
+
+
+class ConformerRotationEnsemble(object):
+    """
+    conformer x rotation product, computed on the fly, usable as lig_coord_ensemble of
+    fft_sampling.ConformerEnsembleSampling
+    step = conformer_index * nr_rotations + rotation_index
+    """
+
+    def __init__(self, conformers, rotations, rmsd_cutoff=0.5, atom_indices=None):
+        """
+        :param conformers: 3d array, (nconformers, natoms, 3)
+        :param rotations: 3d array, (nrotations, 3, 3), rotation matrices applied about the conformer center
+        :param rmsd_cutoff: float, conformers closer than this to a representative are merged into it
+        :param atom_indices: None or 1d array of int, atoms used for the RMSD
+        """
+        conformers = np.asarray(conformers, dtype=float)
+        rotations = np.asarray(rotations, dtype=float)
+        assert len(rotations.shape) == 3 and rotations.shape[1:] == (3, 3), "rotations must be (n, 3, 3)"
+
+        representatives, labels, populations = cluster_conformers(conformers, rmsd_cutoff, atom_indices)
+        print("%d conformers clustered into %d with RMSD cutoff %.2f" % (conformers.shape[0],
+                                                                       representatives.shape[0], rmsd_cutoff))
+        self._conformers = conformers[representatives]
+        self._centers = self._conformers.mean(axis=1, keepdims=True)
+        self._rotations = rotations
+        self._representatives = representatives
+        self._labels = labels
+        self._populations = populations
+        self._first_step = 0
+
+    def set_first_step(self, first_step):
+        """
+        leave out the steps before first_step, e.g. those already in the output of a resumed run;
+        indexing then starts at first_step, split_step still gives indices into the whole product
+        :param first_step: int
+        :return: self
+        """
+        assert 0 <= first_step <= self._conformers.shape[0] * self._rotations.shape[0], "first_step out of range"
+        self._first_step = int(first_step)
+        return self
+
+    @property
+    def shape(self):
+        nr_steps = self._conformers.shape[0] * self._rotations.shape[0] - self._first_step
+        return (nr_steps,) + self._conformers.shape[1:]
+
+    def __len__(self):
+        return self.shape[0]
+
+    def __getitem__(self, step):
+        conformer_index, rotation_index = self.split_step(step)
+        centered = self._conformers[conformer_index] - self._centers[conformer_index]
+        return np.dot(centered, self._rotations[rotation_index].T) + self._centers[conformer_index]
+
+    def split_step(self, step):
+        """
+        :return: (conformer_index, rotation_index)
+        """
+        return divmod(int(step) + self._first_step, self._rotations.shape[0])
+
+    def get_conformers(self):
+        """
+        :return: 3d array, representative conformers
+        """
+        return self._conformers
+
+    def get_conformer(self, step):
+        return self._conformers[self.split_step(step)[0]]
+
+    def get_representatives(self):
+        """
+        :return: 1d array of int, indices of the representatives in the input conformers
+        """
+        return self._representatives
+
+    def get_labels(self):
+        return self._labels
+
+    def get_weights(self):
+        """
+        :return: 1d array of float, conformational weight of every representative
+        """
+        return np.array(self._populations, dtype=float)
+
+    def get_nr_rotations(self):
+        return self._rotations.shape[0]
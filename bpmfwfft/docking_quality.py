@@ -0,0 +1,381 @@
+"""
+Docking quality of the stored poses of a Sampling run: fnat, interface RMSD, ligand RMSD and DockQ
+(Basu and Wallner, PLoS One 11, e0161879 (2016)), against the reference complex.
+
+Pose (r, k) is lig_positions[r] moved by the grid point resampled_trans_vectors[r, k], as in
+postprocess. The receptor does not move, so the reference complex is superposed once on rec_positions
+by its receptor, and for the K poses of a rotation:
+    - LRMSD, the RMSD of the ligand backbone, is closed form in the translation t,
+      sum_a |p_a + t - n_a|^2 = sum_a |p_a - n_a|^2 + 2 t . sum_a (p_a - n_a) + N |t|^2
+    - iRMSD, after superposing the interface backbone, needs a covariance and sums of squares that are
+      sums over the rotation plus terms in t, and one batched orientational_pmf.polar_rotations
+    - fnat checks the native residue contacts only; a contact whose residue bounding spheres are apart
+      is absent, the others are checked atom by atom.
+Native contacts (heavy atoms within 5 A) and interface residues (heavy atoms within 10 A of the partner)
+are found with a cell list. Molecules without backbone atoms use their heavy atoms instead.
+    DockQ = (fnat + 1 / (1 + (iRMSD / 1.5)^2) + 1 / (1 + (LRMSD / 8.5)^2)) / 3
+"""
+from __future__ import print_function
+
+import itertools
+
+import numpy as np
+import netCDF4
+
+try:
+    from bpmfwfft.IO import PrmtopLoad
+    from bpmfwfft.orientational_pmf import polar_rotations
+    from bpmfwfft.nc_integrity import mark_incomplete, seal
+except:
+    from IO import PrmtopLoad
+    from orientational_pmf import polar_rotations
+    from nc_integrity import mark_incomplete, seal
+
+CONTACT_CUTOFF = 5.
+INTERFACE_CUTOFF = 10.
+IRMSD_SCALE = 1.5
+LRMSD_SCALE = 8.5
+BACKBONE_NAMES = ("N", "CA", "C", "O")
+# DockQ lower bounds of the CAPRI acceptable, medium and high quality classes
+DOCKQ_CLASSES = (("acceptable", 0.23), ("medium", 0.49), ("high", 0.80))
+METRIC_NAMES = ("fnat", "irmsd", "lrmsd", "dockq")
+# contacts checked atom by atom at a time
+CANDIDATE_BATCH = 1 << 14
+
+
+class CellList(object):
+    """
+    atoms sorted into cubic cells, for all pairs closer than the cell size
+    """
+    def __init__(self, crd, cell_size):
+        """
+        :param crd: ndarray of shape (natoms, 3)
+        :param cell_size: float, the largest cutoff pairs_within accepts
+        """
+        self._crd = np.asarray(crd, dtype=float)
+        self._cell_size = float(cell_size)
+        self._lower = self._crd.min(axis=0)
+        cells = np.floor((self._crd - self._lower) / self._cell_size).astype(int)
+        self._shape = cells.max(axis=0) + 1
+        keys = np.ravel_multi_index(cells.T, self._shape)
+        self._order = np.argsort(keys, kind="stable")
+        self._starts = np.searchsorted(keys[self._order], np.arange(np.prod(self._shape) + 1))
+
+    def pairs_within(self, points, cutoff):
+        """
+        :param points: ndarray of shape (npoints, 3)
+        :param cutoff: float, <= cell_size
+        :return: (point_indices, atom_indices), 1-arrays of int, all pairs with distance <= cutoff
+        """
+        assert cutoff <= self._cell_size, "cutoff must not exceed the cell size"
+        points = np.asarray(points, dtype=float)
+        cells = np.floor((points - self._lower) / self._cell_size).astype(int)
+        point_indices = []
+        atom_indices = []
+        for offset in itertools.product((-1, 0, 1), repeat=3):
+            neighbors = cells + np.array(offset)
+            inside = np.flatnonzero(np.all((neighbors >= 0) & (neighbors < self._shape), axis=1))
+            keys = np.ravel_multi_index(neighbors[inside].T, self._shape)
+            starts = self._starts[keys]
+            counts = self._starts[keys + 1] - starts
+            # expand every point into the atoms of its neighbor cell
+            within_cell = np.arange(counts.sum()) - np.repeat(np.cumsum(counts) - counts, counts)
+            points_ind = np.repeat(inside, counts)
+            atoms_ind = self._order[np.repeat(starts, counts) + within_cell]
+            d2 = np.sum((points[points_ind] - self._crd[atoms_ind]) ** 2, axis=1)
+            close = d2 <= cutoff ** 2
+            point_indices.append(points_ind[close])
+            atom_indices.append(atoms_ind[close])
+        return np.concatenate(point_indices), np.concatenate(atom_indices)
+
+
+def _load_topology(prmtop):
+    """
+    :param prmtop: str, prmtop file name, or dict with "PDB_TEMPLATE" and "MASS" as in PrmtopLoad
+    :return: dict with "residues" (0-based index of every atom), "heavy" and "backbone" (bool per atom)
+    """
+    if isinstance(prmtop, str):
+        prmtop = PrmtopLoad(prmtop).get_parm_for_grid_calculation()
+    residues = np.array(prmtop["PDB_TEMPLATE"]["RES_ORDER"], dtype=int) - 1
+    names = np.array([str(name).strip() for name in prmtop["PDB_TEMPLATE"]["ATOM_NAME"]])
+    heavy = np.array(prmtop["MASS"], dtype=float) > 1.5
+    backbone = np.isin(names, BACKBONE_NAMES) & heavy
+    if not np.any(backbone):
+        backbone = heavy.copy()
+    return {"residues": residues, "heavy": heavy, "backbone": backbone}
+
+
+def _superpose(mobile, target):
+    """
+    :return: (rotation, translation), target ~ mobile . rotation^T + translation
+    """
+    mobile_center = mobile.mean(axis=0)
+    target_center = target.mean(axis=0)
+    covariance = np.dot((target - target_center).T, mobile - mobile_center)
+    rotation = polar_rotations(covariance[np.newaxis])[0]
+    return rotation, target_center - np.dot(mobile_center, rotation.T)
+
+
+class DockingQuality(object):
+    def __init__(self, rec_prmtop, lig_prmtop, ref_rec_crd, ref_lig_crd, rec_crd=None):
+        """
+        :param rec_prmtop: str or dict, see _load_topology
+        :param lig_prmtop: str or dict
+        :param ref_rec_crd: ndarray of shape (rec_natoms, 3), receptor of the reference complex
+        :param ref_lig_crd: ndarray of shape (lig_natoms, 3), ligand of the reference complex, same frame
+        :param rec_crd: None or ndarray of shape (rec_natoms, 3), the receptor in the frame of the poses,
+        rec_positions of the sampling nc; None if the reference is already in that frame
+        """
+        self._rec = _load_topology(rec_prmtop)
+        self._lig = _load_topology(lig_prmtop)
+        ref_rec_crd = np.asarray(ref_rec_crd, dtype=float)
+        ref_lig_crd = np.asarray(ref_lig_crd, dtype=float)
+        assert ref_rec_crd.shape == (self._rec["residues"].shape[0], 3), "receptor atoms do not match"
+        assert ref_lig_crd.shape == (self._lig["residues"].shape[0], 3), "ligand atoms do not match"
+        if rec_crd is None:
+            rec_crd = ref_rec_crd
+        rec_crd = np.asarray(rec_crd, dtype=float)
+        rotation, translation = _superpose(ref_rec_crd, rec_crd)
+        self._rec_crd = rec_crd
+        self._native_lig_crd = np.dot(ref_lig_crd, rotation.T) + translation
+
+        self._set_native_contacts()
+        self._set_interface()
+
+    def _set_native_contacts(self):
+        rec_heavy = np.flatnonzero(self._rec["heavy"])
+        lig_heavy = np.flatnonzero(self._lig["heavy"])
+        cell_list = CellList(self._rec_crd[rec_heavy], CONTACT_CUTOFF)
+        lig_ind, rec_ind = cell_list.pairs_within(self._native_lig_crd[lig_heavy], CONTACT_CUTOFF)
+        contacts = np.stack([self._rec["residues"][rec_heavy[rec_ind]], self._lig["residues"][lig_heavy[lig_ind]]],
+                            axis=1)
+        self._contacts = np.unique(contacts, axis=0).reshape((-1, 2))
+        if self._contacts.shape[0] == 0:
+            raise RuntimeError("the reference complex has no residue contacts within %0.1f A" % CONTACT_CUTOFF)
+
+        # heavy atoms of the contact residues, padded; receptor padding is far away, ligand padding is masked
+        rec_atoms = self._residue_heavy_atoms(self._rec, self._contacts[:, 0])
+        lig_atoms = self._residue_heavy_atoms(self._lig, self._contacts[:, 1])
+        self._contact_rec_crd = np.where((rec_atoms >= 0)[:, :, np.newaxis], self._rec_crd[np.maximum(rec_atoms, 0)],
+                                         np.inf)
+        self._contact_lig_atoms = lig_atoms
+
+        # bounding spheres around the residue means; the ligand ones are found for every rotation
+        self._contact_rec_centers, rec_radii = self._bounding_spheres(self._rec_crd, rec_atoms)
+        self._contact_bounds = CONTACT_CUTOFF + rec_radii
+        return None
+
+    def _residue_heavy_atoms(self, topology, residues):
+        """
+        :return: 2-array of int, shape (len(residues), max atoms), heavy atom indices padded with -1
+        """
+        heavy = np.flatnonzero(topology["heavy"])
+        atom_lists = [heavy[topology["residues"][heavy] == residue] for residue in residues]
+        padded = np.full((len(atom_lists), max(len(atoms) for atoms in atom_lists)), -1, dtype=int)
+        for i, atoms in enumerate(atom_lists):
+            padded[i, :len(atoms)] = atoms
+        return padded
+
+    def _bounding_spheres(self, crd, padded_atoms):
+        """
+        :param crd: ndarray of shape (natoms, 3), or (nconfs, natoms, 3)
+        :param padded_atoms: 2-array of int, see _residue_heavy_atoms
+        :return: (centers, radii), of shapes ([nconfs,] nresidues, 3) and ([nconfs,] nresidues)
+        """
+        mask = padded_atoms >= 0
+        atoms_crd = crd[..., np.maximum(padded_atoms, 0), :]
+        centers = np.sum(atoms_crd * mask[:, :, np.newaxis], axis=-2) / mask.sum(axis=1)[:, np.newaxis]
+        radii = np.where(mask, np.linalg.norm(atoms_crd - centers[..., np.newaxis, :], axis=-1), 0.).max(axis=-1)
+        return centers, radii
+
+    def _set_interface(self):
+        rec_heavy = np.flatnonzero(self._rec["heavy"])
+        lig_heavy = np.flatnonzero(self._lig["heavy"])
+        cell_list = CellList(self._rec_crd[rec_heavy], INTERFACE_CUTOFF)
+        lig_ind, rec_ind = cell_list.pairs_within(self._native_lig_crd[lig_heavy], INTERFACE_CUTOFF)
+        rec_residues = np.unique(self._rec["residues"][rec_heavy[rec_ind]])
+        lig_residues = np.unique(self._lig["residues"][lig_heavy[lig_ind]])
+        rec_atoms = np.flatnonzero(self._rec["backbone"] & np.isin(self._rec["residues"], rec_residues))
+        self._interface_lig_atoms = np.flatnonzero(self._lig["backbone"] & np.isin(self._lig["residues"],
+                                                                                     lig_residues))
+        self._lrmsd_atoms = np.flatnonzero(self._lig["backbone"])
+
+        # interface coordinates relative to the center of the native interface
+        native = np.concatenate([self._rec_crd[rec_atoms], self._native_lig_crd[self._interface_lig_atoms]])
+        self._interface_center = native.mean(axis=0)
+        native_rec = self._rec_crd[rec_atoms] - self._interface_center
+        self._interface_native_lig = self._native_lig_crd[self._interface_lig_atoms] - self._interface_center
+        self._interface_natoms = native.shape[0]
+        self._native_sum_squares = np.sum(native_rec ** 2) + np.sum(self._interface_native_lig ** 2)
+        # parts of sum_a y_a x_a^T, sum_a x_a and sum_a |x_a|^2 from the receptor, which does not move
+        self._rec_covariance = np.dot(native_rec.T, native_rec)
+        self._rec_sum = native_rec.sum(axis=0)
+        self._rec_sum_squares = np.sum(native_rec ** 2)
+        self._native_lig_sum = self._interface_native_lig.sum(axis=0)
+        return None
+
+    def get_native_lig_crd(self):
+        return self._native_lig_crd
+
+    def get_native_contacts(self):
+        """
+        :return: 2-array of int, shape (ncontacts, 2), receptor and ligand residue indices, 0-based
+        """
+        return self._contacts
+
+    def _lrmsd(self, lig_crd, translations):
+        diff = lig_crd[:, self._lrmsd_atoms] - self._native_lig_crd[self._lrmsd_atoms]
+        natoms = self._lrmsd_atoms.shape[0]
+        sum_squares = np.sum(diff ** 2, axis=(1, 2))[:, np.newaxis] + \
+            2. * np.einsum("rki,ri->rk", translations, diff.sum(axis=1)) + natoms * np.sum(translations ** 2, axis=2)
+        return np.sqrt(np.maximum(sum_squares, 0.) / natoms)
+
+    def _irmsd(self, lig_crd, translations):
+        nrot, nposes = translations.shape[:2]
+        mobile = lig_crd[:, self._interface_lig_atoms] - self._interface_center
+        # M = sum_a y_a x_a^T over the model x and the native y, both relative to the native interface center
+        lig_covariance = np.einsum("ai,raj->rij", self._interface_native_lig, mobile)
+        covariances = (self._rec_covariance + lig_covariance)[:, np.newaxis] + \
+            np.einsum("i,rkj->rkij", self._native_lig_sum, translations)
+        model_sum = (self._rec_sum + mobile.sum(axis=1))[:, np.newaxis] + \
+            self._interface_lig_atoms.shape[0] * translations
+        model_sum_squares = (self._rec_sum_squares + np.sum(mobile ** 2, axis=(1, 2)))[:, np.newaxis] + \
+            2. * np.einsum("rki,ri->rk", translations, mobile.sum(axis=1)) + \
+            self._interface_lig_atoms.shape[0] * np.sum(translations ** 2, axis=2)
+
+        natoms = self._interface_natoms
+        model_mean = model_sum.reshape((-1, 3)) / natoms
+        # the native is centered, so sum_a y_a (x_a - <x>)^T = M
+        covariances = covariances.reshape((-1, 3, 3))
+        rotations = polar_rotations(covariances)
+        traces = np.einsum("nij,nij->n", rotations, covariances)
+        centered_squares = model_sum_squares.reshape(-1) - natoms * np.sum(model_mean ** 2, axis=1)
+        sum_squares = centered_squares + self._native_sum_squares - 2. * traces
+        return np.sqrt(np.maximum(sum_squares, 0.) / natoms).reshape((nrot, nposes))
+
+    def _fnat(self, lig_crd, translations):
+        nrot, nposes = translations.shape[:2]
+        lig_centers, lig_radii = self._bounding_spheres(lig_crd, self._contact_lig_atoms)
+        distances = np.linalg.norm(self._contact_rec_centers - lig_centers[:, np.newaxis] -
+                                   translations[:, :, np.newaxis], axis=3)
+        rot_ind, pose_ind, contact_ind = np.nonzero(distances <= (self._contact_bounds + lig_radii)[:, np.newaxis])
+
+        formed = np.zeros((nrot, nposes), dtype=int)
+        lig_mask = self._contact_lig_atoms >= 0
+        for start in range(0, rot_ind.shape[0], CANDIDATE_BATCH):
+            r = rot_ind[start:start + CANDIDATE_BATCH]
+            k = pose_ind[start:start + CANDIDATE_BATCH]
+            c = contact_ind[start:start + CANDIDATE_BATCH]
+            lig_atoms = lig_crd[r[:, np.newaxis], np.maximum(self._contact_lig_atoms[c], 0)] + \
+                translations[r, k][:, np.newaxis, :]
+            diff = self._contact_rec_crd[c][:, :, np.newaxis, :] - lig_atoms[:, np.newaxis, :, :]
+            close = (np.einsum("nabi,nabi->nab", diff, diff) <= CONTACT_CUTOFF ** 2) & lig_mask[c][:, np.newaxis, :]
+            made = np.any(close, axis=(1, 2))
+            np.add.at(formed, (r[made], k[made]), 1)
+        return formed / float(self._contacts.shape[0])
+
+    def evaluate(self, lig_crd, translations):
+        """
+        :param lig_crd: ndarray of shape (nrot, lig_natoms, 3), ligand of every rotation in the frame of rec_crd
+        :param translations: ndarray of shape (nrot, nposes, 3), displacements in angstrom
+        :return: dict, METRIC_NAMES -> ndarray of shape (nrot, nposes)
+        """
+        lig_crd = np.asarray(lig_crd, dtype=float)
+        translations = np.asarray(translations, dtype=float)
+        assert lig_crd.shape[0] == translations.shape[0], "need translations for every rotation"
+        metrics = {"fnat": self._fnat(lig_crd, translations),
+                   "irmsd": self._irmsd(lig_crd, translations),
+                   "lrmsd": self._lrmsd(lig_crd, translations)}
+        metrics["dockq"] = dockq(metrics["fnat"], metrics["irmsd"], metrics["lrmsd"])
+        return metrics
+
+
+def dockq(fnat, irmsd, lrmsd):
+    """
+    :param fnat: float or ndarray
+    :param irmsd: float or ndarray, angstrom
+    :param lrmsd: float or ndarray, angstrom
+    :return: float or ndarray, in [0, 1]
+    """
+    return (fnat + 1. / (1. + (irmsd / IRMSD_SCALE) ** 2) + 1. / (1. + (lrmsd / LRMSD_SCALE) ** 2)) / 3.
+
+
+def evaluate_sampling_nc(nc_file, rec_prmtop, lig_prmtop, ref_rec_crd, ref_lig_crd, component=None,
+                         chunk_size=64, write=True):
+    """
+    the metrics of every stored pose, written next to the energies as e.g. "dockq" or "LJ_dockq",
+    of shape (lig_sample_size, energy_sample_size_per_ligand), nan for padded poses; the file is sealed again
+    :param nc_file: str, output_nc of Sampling
+    :param rec_prmtop: str or dict
+    :param lig_prmtop: str or dict
+    :param ref_rec_crd: ndarray, receptor of the reference complex
+    :param ref_lig_crd: ndarray, ligand of the reference complex, same frame
+    :param component: None for the poses of the total energy, or "LJ", "no_sasa", "sasa"
+    :param chunk_size: int, rotations at a time
+    :param write: bool
+    :return: dict, METRIC_NAMES -> 2-array, and "summary" -> dict
+    """
+    prefix = "" if component is None else "%s_" % component
+    nc_handle = netCDF4.Dataset(nc_file, "a" if write else "r")
+    if write:
+        mark_incomplete(nc_handle)
+    quality = DockingQuality(rec_prmtop, lig_prmtop, ref_rec_crd, ref_lig_crd,
+                             rec_crd=np.array(nc_handle.variables["rec_positions"][:], dtype=float))
+    nr_rotations = int(nc_handle.variables["current_rotation_index"][0])
+    grid_x = np.array(nc_handle.variables["x"][:], dtype=float)
+    grid_y = np.array(nc_handle.variables["y"][:], dtype=float)
+    grid_z = np.array(nc_handle.variables["z"][:], dtype=float)
+    energies = nc_handle.variables["%sresampled_energies" % prefix]
+    trans_vectors = nc_handle.variables["%sresampled_trans_vectors" % prefix]
+    nposes = energies.shape[1]
+
+    metrics = dict((name, np.full((nr_rotations, nposes), np.nan, dtype=np.float32)) for name in METRIC_NAMES)
+    pose_energies = np.array(energies[:nr_rotations], dtype=float)
+    for start in range(0, nr_rotations, chunk_size):
+        stop = min(start + chunk_size, nr_rotations)
+        corners = np.array(trans_vectors[start:stop], dtype=int)
+        # the grid point of a translation index, as in postprocess
+        translations = np.stack([grid_x[corners[:, :, 0]], grid_y[corners[:, :, 1]], grid_z[corners[:, :, 2]]],
+                                axis=2)
+        chunk = quality.evaluate(np.array(nc_handle.variables["lig_positions"][start:stop], dtype=float),
+                                 translations)
+        padded = ~np.isfinite(pose_energies[start:stop])
+        for name in METRIC_NAMES:
+            chunk[name][padded] = np.nan
+            metrics[name][start:stop] = chunk[name]
+
+    if write:
+        for name in METRIC_NAMES:
+            key = prefix + name
+            if key not in nc_handle.variables.keys():
+                nc_handle.createVariable(key, "f4", energies.dimensions)
+            nc_handle.variables[key][:nr_rotations] = metrics[name]
+        seal(nc_handle)
+    nc_handle.close()
+
+    metrics["summary"] = summarize(metrics, pose_energies)
+    return metrics
+
+
+def summarize(metrics, energies, top_ns=(1, 10, 100)):
+    """
+    :param metrics: dict, METRIC_NAMES -> 2-array
+    :param energies: 2-array of float, energies of the same poses
+    :param top_ns: tuple of int
+    :return: dict, the best DockQ, the best DockQ among the top_n lowest energy poses, and the fraction
+    of poses in each DockQ class
+    """
+    dockq_values = np.asarray(metrics["dockq"], dtype=float).ravel()
+    energies = np.asarray(energies, dtype=float).ravel()
+    valid = np.isfinite(dockq_values) & np.isfinite(energies)
+    dockq_values, energies = dockq_values[valid], energies[valid]
+    summary = {"nr_poses": int(dockq_values.shape[0])}
+    if dockq_values.shape[0] == 0:
+        return summary
+    summary["best_dockq"] = float(dockq_values.max())
+    order = np.argsort(energies, kind="stable")
+    for top_n in top_ns:
+        summary["top%d_dockq" % top_n] = float(dockq_values[order[:top_n]].max())
+    for name, lower_bound in DOCKQ_CLASSES:
+        summary["%s_fraction" % name] = float(np.mean(dockq_values >= lower_bound))
+    return summary
@@ -11,12 +11,32 @@ import os
 try:
     from bpmfwfft.grids import RecGrid
     from bpmfwfft.grids import LigGrid
+    from bpmfwfft.so3_search import SO3RotationalSearch
+    from bpmfwfft.memory import MemoryProfiler
+    from bpmfwfft import perf_counters
+    from bpmfwfft.restraints import TranslationRestraints
+    from bpmfwfft.nc_integrity import mark_incomplete, seal
+    from bpmfwfft import IO
 
 except:
     from grids import RecGrid
     from grids import LigGrid
+    from so3_search import SO3RotationalSearch
+    from memory import MemoryProfiler
+    import perf_counters
+    from restraints import TranslationRestraints
+    from nc_integrity import mark_incomplete, seal
+    import IO
 
 KB = 0.001987204134799235  # kcal/mol*K
+# energy terms that are summed into the interaction energy, see Sampling._cal_energies
+TERM_NAMES = ("LJr", "LJa", "electrostatic", "sasa", "desolvation")
+# terms that may be absent, from older grid files or switched off; they are stored as zeros
+OPTIONAL_TERM_NAMES = ("desolvation",)
+# component energies whose lowest values are stored, by the term after which they are taken: sasa alone,
+# and the running sums LJr + LJa and LJr + LJa + electrostatic
+COMPONENT_OF_TERM = {"sasa": "sasa", "LJa": "LJ", "electrostatic": "no_sasa"}
+COMPONENT_NAMES = ("sasa", "LJ", "no_sasa")
 
 
 class Sampling(object):
@@ -31,7 +51,17 @@ class Sampling(object):
                  energy_sample_size_per_ligand,
                  output_nc,
                  start_index,
-                 temperature=300.):
+                 temperature=300.,
+                 so3_nr_rotations=None,
+                 so3_bandwidth=8,
+                 profile_memory=False,
+                 count_perf_events=False,
+                 store_term_energies=False,
+                 store_term_partials=False,
+                 restraint_file=None,
+                 max_violated_restraint_groups=0,
+                 desolvation_weight=None,
+                 store_density_map=False):
         """
         :param rec_prmtop: str, name of receptor prmtop file
         :param lj_sigma_scal_fact: float, used to check consitency when loading receptor and ligand grids
@@ -45,7 +75,37 @@ class Sampling(object):
         :param energy_sample_size_per_ligand: int, number of energies and translational vectors to store for each ligand crd
         :param output_nc: str, name of nc file
         :param temperature: float
+        :param so3_nr_rotations: None or int, if not None, only the so3_nr_rotations ensemble members with
+        the lowest coarse SO(3) energies (plus member 0, the native pose) go through the translational FFT.
+        The kept rows are a biased subset of the ensemble and are not reweighted, so such a run is for pose
+        prediction only and does not give a BPMF; output_nc records their ensemble indices in rotation_index
+        :param so3_bandwidth: int, bandwidth of the SO(3) rotational search
+        :param profile_memory: bool, if True record tracemalloc peaks and RSS for every stage of every rotation
+        and write them to output_nc + ".memory.json"
+        :param count_perf_events: bool, if True read hardware performance counters around every stage
+        and write a roofline summary to output_nc + ".perf.json"
+        :param store_term_energies: bool, if True also store, for every rotation, the LJr, LJa, electrostatic
+        and sasa parts of the resampled energies so that reweight.reweight() can recombine them with new weights
+        :param store_term_partials: bool, if True also store the log exponential sum and the Boltzmann mean
+        of every term over the translations that are not resampled, used by reweight() for the tail
+        :param restraint_file: None or str, receptor-ligand distance restraints, see restraints.py; translations
+        that violate them are masked out with the clashing ones, so the stored sums and energies are those of
+        the restrained ligand, and the number of translations allowed by the restraints goes to
+        restraint_nr_allowed
+        :param max_violated_restraint_groups: int, number of restraint groups a translation may violate
+        :param desolvation_weight: None or float, weight of the desolvation term, None for grids.DESOLVATION_WEIGHT,
+        0 to leave it out; grid files without the "desolvation" grid, see RecGrid(..., desolvation=True),
+        have no desolvation term
+        :param store_density_map: bool, if True accumulate, over rotations, log sum exp(-beta E) of the
+        meaningful translations at the grid point nearest to the ligand center of mass, a float32 grid of
+        the receptor grid shape written to output_nc as "log_density_map", see write_density_map_dx
         """
+        self._profiler = MemoryProfiler(enabled=profile_memory)
+        # the process-wide counters are switched off again at the end of run_sampling
+        self._count_perf_events = count_perf_events
+        if count_perf_events:
+            perf_counters.enable()
+        self._output_nc = output_nc
         self._energy_sample_size_per_ligand = energy_sample_size_per_ligand
         self._beta = 1. / temperature / KB
 
@@ -58,13 +118,37 @@ class Sampling(object):
         self._lig_grid = self._create_lig_grid(lig_prmtop, lj_sigma_scal_fact,
                                                lc_scale, ls_scale, lm_scale,
                                                lig_inpcrd, rec_grid)
+        if desolvation_weight is not None:
+            self._lig_grid.set_desolvation_weight(desolvation_weight)
+
+        self._restraints = None
+        if restraint_file is not None:
+            self._restraints = TranslationRestraints.from_file(restraint_file, max_violated_restraint_groups)
+            self._restraints.check_atoms(self._rec_crd.shape[0], self._lig_grid.get_natoms())
 
         self._lig_coord_ensemble = self._load_ligand_coor_ensemble(lig_coord_ensemble)
+        self._rotation_indices = None
+        if so3_nr_rotations is not None:
+            self._rotation_indices = self._select_rotations(rec_grid, so3_nr_rotations, so3_bandwidth)
+            self._lig_coord_ensemble = self._lig_coord_ensemble[self._rotation_indices]
         self._start_index = start_index
+        self._store_term_energies = store_term_energies or store_term_partials
+        self._store_term_partials = store_term_partials
+        self._term_energies = {}
+        self._store_density_map = store_density_map
         self._nc_handle = self._initialize_nc(output_nc)
-
-        self._resampled_energies_components = {}
-        self._resampled_trans_vectors_components = {}
+        self._density_map = None
+        if self._store_density_map:
+            self._density_map, self._density_nr_rotations = self._load_density_map()
+
+        # top-K outputs, overwritten every rotation
+        sample_size = self._energy_sample_size_per_ligand
+        self._resampled_energies = np.empty(sample_size, dtype=float)
+        self._resampled_trans_vectors = np.empty((sample_size, 3), dtype=int)
+        self._resampled_energies_components = dict((name, np.empty(sample_size, dtype=float))
+                                                   for name in COMPONENT_NAMES)
+        self._resampled_trans_vectors_components = dict((name, np.empty((sample_size, 3), dtype=int))
+                                                        for name in COMPONENT_NAMES)
 
     def _create_rec_grid(self, rec_prmtop, lj_sigma_scal_fact,
                          rc_scale, rs_scale, rm_scale, rho,
@@ -88,6 +172,17 @@ class Sampling(object):
                 raise RuntimeError("Ligand crd %d does not have correct shape" % i)
         return ensemble
 
+    def _select_rotations(self, rec_grid, nr_rotations, bandwidth):
+        """
+        rank the ligand ensemble with a coarse SO(3) rotational search
+        :return: 1-array of int, indices into the ligand ensemble, always including 0
+        """
+        so3_search = SO3RotationalSearch(rec_grid, self._lig_grid, bandwidth=bandwidth)
+        selected = so3_search.select_ensemble(self._lig_coord_ensemble, nr_rotations)
+        selected = np.union1d(np.array([0], dtype=int), selected)
+        print("SO(3) search keeps %d of %d rotations" % (selected.shape[0], self._lig_coord_ensemble.shape[0]))
+        return selected
+
     def _initialize_nc(self, output_nc):
         if not os.path.exists(output_nc):
             nc_handle = netCDF4.Dataset(output_nc, mode="w", format="NETCDF4")
@@ -145,15 +240,62 @@ class Sampling(object):
 
             nc_handle.createVariable(f"current_rotation_index", "i8", ("one"))
 
+            nc_handle.createVariable("desolvation_weight", "f8", ("one"))
+            nc_handle.variables["desolvation_weight"][:] = (self._lig_grid.get_desolvation_weight()
+                                                            if self._lig_grid.has_desolvation() else 0.)
+
+            if self._rotation_indices is not None:
+                nc_handle.createVariable("rotation_index", "i8", ("lig_sample_size"))
+
+            if self._store_term_energies:
+                for name in TERM_NAMES:
+                    nc_handle.createVariable(f"{name}_term_energies", "f8",
+                                             ("lig_sample_size", "energy_sample_size_per_ligand"))
+            if self._store_term_partials:
+                nc_handle.createVariable("tail_log_exponential_sums", "f8", ("lig_sample_size"))
+                for name in TERM_NAMES:
+                    nc_handle.createVariable(f"{name}_tail_mean_energy", "f8", ("lig_sample_size"))
+
+            if self._restraints is not None:
+                self._write_restraints(nc_handle)
+
             nc_handle.set_auto_mask(False)
 
             nc_handle = self._write_grid_info(nc_handle)
 
+            if self._store_density_map:
+                self._create_density_map_variable(nc_handle)
+
         else:
             print(f"{output_nc} exists, opening in append mode.")
             nc_handle = netCDF4.Dataset(output_nc, mode="a", format="NETCDF4")
+            # resuming a run that did not store the map
+            if self._store_density_map and "log_density_map" not in nc_handle.variables.keys():
+                self._create_density_map_variable(nc_handle)
 
+        # sealed again by run_sampling once all rotations of this run are written
+        mark_incomplete(nc_handle)
         return nc_handle
+
+    def _write_restraints(self, nc_handle):
+        """
+        the restraints, atoms numbered from 0, and the number of translations they allow in every rotation
+        """
+        restraints = self._restraints.get_restraints()
+        nc_handle.createDimension("nr_restraints", restraints["groups"].shape[0])
+        nc_handle.createDimension("two", 2)
+        nc_handle.createVariable("restraint_atoms", "i8", ("nr_restraints", "two"))
+        nc_handle.variables["restraint_atoms"][:] = np.stack([restraints["receptor_atoms"],
+                                                              restraints["ligand_atoms"]], axis=1)
+        nc_handle.createVariable("restraint_bounds", "f8", ("nr_restraints", "two"))
+        nc_handle.variables["restraint_bounds"][:] = np.stack([restraints["lower"], restraints["upper"]], axis=1)
+        nc_handle.createVariable("restraint_groups", "i8", ("nr_restraints"))
+        nc_handle.variables["restraint_groups"][:] = restraints["groups"]
+        nc_handle.createVariable("max_violated_restraint_groups", "i8", ("one"))
+        nc_handle.variables["max_violated_restraint_groups"][:] = self._restraints.get_max_violated_groups()
+        nc_handle.createVariable("restraint_nr_allowed", "i8", ("lig_sample_size"))
+        return None
+
     def _write_grid_info(self, nc_handle):
         """
         write grid info, "x", "y", "z" ...
@@ -213,6 +355,19 @@ class Sampling(object):
 
         self._nc_handle.variables["current_rotation_index"][0] = step + 1
 
+        if self._rotation_indices is not None:
+            self._nc_handle.variables["rotation_index"][step] = self._rotation_indices[step - self._start_index]
+
+        if self._store_term_energies:
+            for name in TERM_NAMES:
+                self._nc_handle.variables[f"{name}_term_energies"][step, :] = self._resampled_term_energies[name]
+        if self._store_term_partials:
+            self._nc_handle.variables["tail_log_exponential_sums"][step] = self._tail_log_exponential_sum
+            for name in TERM_NAMES:
+                self._nc_handle.variables[f"{name}_tail_mean_energy"][step] = self._tail_mean_energies[name]
+        if self._restraints is not None:
+            self._nc_handle.variables["restraint_nr_allowed"][step] = self._restraint_nr_allowed
+
         return None
 
     def _save_sub_data_to_nc(self, name, step):
@@ -233,14 +388,169 @@ class Sampling(object):
     def _cal_free_of_clash(self):
         self._lig_grid._max_i, self._lig_grid._max_j, self._lig_grid._max_k = self._lig_grid._max_grid_indices
         corr_func = self._lig_grid._cal_corr_func("occupancy")
-        self._lig_grid._free_of_clash = (corr_func < 0.001)
-        self._lig_grid._free_of_clash = self._lig_grid._free_of_clash[0:self._lig_grid._max_i, 0:self._lig_grid._max_j,
-                                        0:self._lig_grid._max_k]  # exclude positions where ligand crosses border
-        del corr_func
+        with perf_counters.perf_stage("clash_masking", flops=corr_func.size):
+            free_of_clash = self._lig_grid._buffers.empty("free_of_clash", corr_func.shape, dtype=bool)
+            np.less(corr_func, 0.001, out=free_of_clash)
+            self._lig_grid._free_of_clash = free_of_clash[0:self._lig_grid._max_i, 0:self._lig_grid._max_j,
+                                            0:self._lig_grid._max_k]  # exclude positions where ligand crosses border
+            del corr_func
+        if self._restraints is not None:
+            self._apply_restraints()
+        # flat indices of the meaningful corners, in the order of the energies selected by _free_of_clash
+        self._meaningful_flat_indices = np.flatnonzero(self._lig_grid._free_of_clash)
+        # the same corners as flat indices into the full energy grids, see _gather_meaningful
+        self._meaningful_grid_indices = np.ravel_multi_index(
+            np.unravel_index(self._meaningful_flat_indices, self._lig_grid._free_of_clash.shape),
+            tuple(self._lig_grid._grid["counts"]))
         print("Ligand positions excluding border crossers", self._lig_grid._free_of_clash.shape)
 
         return None
 
+    def _apply_restraints(self):
+        """
+        AND the translations allowed by the restraints into self._lig_grid._free_of_clash
+        """
+        free_of_clash = self._lig_grid._free_of_clash
+        with perf_counters.perf_stage("restraint_masking", flops=free_of_clash.size):
+            allowed = self._lig_grid._buffers.empty("restraint_mask", free_of_clash.shape, dtype=bool)
+            self._restraints.mask(self._rec_crd, self._lig_grid.get_crd(), self._lig_grid._grid["spacing"],
+                                  free_of_clash.shape, out=allowed)
+            self._restraint_nr_allowed = int(np.count_nonzero(allowed))
+            np.logical_and(free_of_clash, allowed, out=free_of_clash)
+        print("Translations allowed by the restraints", self._restraint_nr_allowed)
+        return None
+
+    def _set_no_energies(self):
+        """
+        no translation is free of clash (and allowed by the restraints): the rotation contributes
+        nr_grid_points zeros to the exponential mean, the resampled energies are inf
+        """
+        print("No meaningful energies")
+        self._mean_energy = np.nan
+        self._min_energy = np.inf
+        self._min_energy_ind = 0
+        self._energy_std = np.nan
+        self._exponential_sum = 0.
+        self._log_of_divisor = -np.inf
+        self._lig_grid._number_of_meaningful_energies = 0
+        self._resampled_energies.fill(np.inf)
+        self._resampled_trans_vectors.fill(0)
+        if self._store_term_energies:
+            self._resampled_term_energies = dict((name, np.full(self._energy_sample_size_per_ligand, np.inf))
+                                                 for name in TERM_NAMES)
+            self._tail_log_exponential_sum = -np.inf
+            self._tail_mean_energies = dict((name, 0.) for name in TERM_NAMES)
+            self._term_energies = {}
+        return None
+
+    def _selected_corners(self, sel_ind):
+        """
+        :param sel_ind: 1-array of int, indices into the meaningful energies
+        :return: 2-array of int, grid corners of the selected energies
+        """
+        shape = self._lig_grid._free_of_clash.shape
+        corners = np.unravel_index(self._meaningful_flat_indices[sel_ind], shape)
+        return np.array(corners, dtype=int).transpose()
+
+    def _select_lowest(self, energies):
+        """
+        :param energies: 1-array of float
+        :return: 1-array of int, indices of the energy_sample_size_per_ligand lowest energies, sorted;
+        all indices if there are fewer energies
+        """
+        sample_size = self._energy_sample_size_per_ligand
+        with perf_counters.perf_stage("top_k", flops=energies.size + sample_size * np.log2(max(sample_size, 2))):
+            if energies.size > sample_size:
+                sel_ind = np.argpartition(energies, sample_size - 1)[:sample_size]
+            else:
+                sel_ind = np.arange(energies.size)
+            sel_ind = sel_ind[np.argsort(energies[sel_ind])]
+        return sel_ind
+
+    def _store_lowest(self, energies, energies_out, trans_vectors_out):
+        """
+        write the lowest energies and their grid corners into preallocated arrays, padded with inf and
+        corner (0, 0, 0) if there are fewer meaningful energies than energy_sample_size_per_ligand
+        :param energies: 1-array of float, meaningful energies
+        :param energies_out: 1-array of float, of size energy_sample_size_per_ligand
+        :param trans_vectors_out: 2-array of int, of shape (energy_sample_size_per_ligand, 3)
+        :return: 1-array of int, indices of the selected energies
+        """
+        sel_ind = self._select_lowest(energies)
+        nr_selected = sel_ind.shape[0]
+        np.take(energies, sel_ind, out=energies_out[:nr_selected])
+        energies_out[nr_selected:] = np.inf
+        trans_vectors_out[:nr_selected] = self._selected_corners(sel_ind)
+        trans_vectors_out[nr_selected:] = 0
+        return sel_ind
+
+    def _gather_meaningful(self, grid, key):
+        """
+        values of a full size energy grid at the meaningful translations, in the order of
+        _meaningful_flat_indices, without slicing and masking the grid
+        :param grid: 3-array of float, of shape counts; may be a strided view, e.g. the real part of a complex buffer
+        :param key: str, buffer key
+        :return: 1-array of float, a buffer that the next call with the same key overwrites
+        """
+        buffer = self._lig_grid._buffers.empty(key, (np.prod(self._lig_grid._grid["counts"]),), dtype=float)
+        gathered = buffer[:self._meaningful_grid_indices.shape[0]]
+        np.take(grid.reshape(-1), self._meaningful_grid_indices, out=gathered)
+        return gathered
+
+    def _create_density_map_variable(self, nc_handle):
+        dimensions = tuple("%d" % count for count in self._lig_grid._grid["counts"])
+        for dim_name in dimensions:
+            if dim_name not in nc_handle.dimensions.keys():
+                nc_handle.createDimension(dim_name, int(dim_name))
+        nc_handle.createVariable("log_density_map", "f4", dimensions)
+        return None
+
+    def _load_density_map(self):
+        """
+        :return: (3-array of float32, int), the map and the number of rotations in it, from output_nc when
+        resuming a run, else -inf and 0
+        """
+        counts = tuple(self._lig_grid._grid["counts"])
+        if "log_density_map" in self._nc_handle.variables.keys():
+            variable = self._nc_handle.variables["log_density_map"]
+            if "nr_rotations" in variable.ncattrs():
+                print("Resuming log_density_map over %d rotations" % variable.getncattr("nr_rotations"))
+                return np.array(variable[:], dtype=np.float32), int(variable.getncattr("nr_rotations"))
+        return np.full(counts, -np.inf, dtype=np.float32), 0
+
+    def _accumulate_density_map(self, log_weights):
+        """
+        log-add the -beta E of this rotation's meaningful translations into the density map, each at the grid
+        point nearest to the ligand center of mass for that translation
+        :param log_weights: 1-array of float, -beta E of the meaningful energies
+        """
+        with perf_counters.perf_stage("density_map", flops=2. * log_weights.size):
+            counts = self._density_map.shape
+            # translation (i, j, k) moves the center of mass from its initial position by (i, j, k) grid points
+            offset = np.rint((self._lig_grid.get_initial_com() - self._lig_grid._origin_crd) /
+                             self._lig_grid._spacing).astype(int)
+            indices = self._meaningful_grid_indices + np.ravel_multi_index(offset, counts)
+            density = self._density_map.reshape(-1)
+            # only the meaningful translations, as the boltzmann_weights buffer
+            values = self._lig_grid._buffers.empty("density_values", indices.shape, dtype=np.float32)
+            np.take(density, indices, out=values)
+            np.logaddexp(values, log_weights, out=values, casting="same_kind")
+            density[indices] = values
+        return None
+
+    def _save_density_map(self):
+        variable = self._nc_handle.variables["log_density_map"]
+        variable[:] = self._density_map
+        variable.setncattr("nr_rotations", self._density_nr_rotations)
+        variable.setncattr("temperature", 1. / self._beta / KB)
+        return None
+
+    def get_density_map(self):
+        """
+        :return: None or 3-array of float32, log sum exp(-beta E) by ligand center of mass grid point
+        """
+        return self._density_map
+
     def _remove_nonphysical_energies(self, grid):
         max_i, max_j, max_k = self._lig_grid._max_i, self._lig_grid._max_j, self._lig_grid._max_k  # self._lig_grid._max_grid_indices
         grid = grid[0:max_i, 0:max_j, 0:max_k]  # exclude positions where ligand crosses border
@@ -250,95 +560,136 @@ class Sampling(object):
     def _cal_energies(self, name, step):
         max_i, max_j, max_k = self._lig_grid._max_grid_indices
         if np.any(self._lig_grid._free_of_clash[0:max_i, 0:max_j, 0:max_k]):
-            grid_energy = np.zeros((self._lig_grid._max_grid_indices))
             if name in ["electrostatic", "LJa", "LJr"]:
                 grid_energy = self._lig_grid._cal_corr_func(name)
                 # grid_energy = self._remove_nonphysical_energies(grid_energy)
                 self._lig_grid._meaningful_energies += grid_energy
             elif name == "sasa":
                 grid_energy = self._lig_grid._cal_delta_sasa_func(self._lig_grid._free_of_clash)
-                grid_energy = grid_energy * -self._lig_grid.get_gamma()
+                grid_energy *= -self._lig_grid.get_gamma()
                 # grid_energy = self._remove_nonphysical_energies(grid_energy)
                 self._lig_grid._meaningful_energies += grid_energy
+            elif name == "desolvation":
+                grid_energy = self._lig_grid._cal_desolvation_func()
+                self._lig_grid._meaningful_energies += grid_energy
+            if self._store_term_energies:
+                # meaningful positions only, in the same order as the total energies
+                self._term_energies[name] = self._gather_meaningful(grid_energy, f"{name}_term_energies")
             # save component energies for sasa, LJ, total without sasa
-            if name == "sasa":
-                grid_energy = self._remove_nonphysical_energies(grid_energy)
-                sel_ind = np.argsort(grid_energy)[:self._energy_sample_size_per_ligand]
-                self._resampled_energies_components[name] = [grid_energy[ind] for ind in sel_ind]
-                trans_vectors = self._lig_grid.get_meaningful_corners_comp()
-                self._resampled_trans_vectors_components[name] = [trans_vectors[ind] for ind in sel_ind]
-                del grid_energy
-                del trans_vectors
-                self._save_sub_data_to_nc(name, step)
-            elif name in ["LJa", "electrostatic"]:
-                grid_energy = self._lig_grid._meaningful_energies.copy()
-                grid_energy = self._remove_nonphysical_energies(grid_energy)
-                sel_ind = np.argsort(grid_energy)[:self._energy_sample_size_per_ligand]
-                if name == "LJa":
-                    name = "LJ"
-                elif name == "electrostatic":
-                    name = "no_sasa"
-                self._resampled_energies_components[name] = [grid_energy[ind] for ind in sel_ind]
-                trans_vectors = self._lig_grid.get_meaningful_corners_comp()
-                self._resampled_trans_vectors_components[name] = [trans_vectors[ind] for ind in sel_ind]
-                del grid_energy
-                del trans_vectors
-                self._save_sub_data_to_nc(name, step)
+            if name in COMPONENT_OF_TERM:
+                component = COMPONENT_OF_TERM[name]
+                if name == "sasa" and self._store_term_energies:
+                    energies = self._term_energies[name]
+                elif name == "sasa":
+                    energies = self._gather_meaningful(grid_energy, "component_energies")
+                else:
+                    # running sum of the terms so far
+                    energies = self._gather_meaningful(self._lig_grid._meaningful_energies, "component_energies")
+                self._store_lowest(energies, self._resampled_energies_components[component],
+                                   self._resampled_trans_vectors_components[component])
+                self._save_sub_data_to_nc(component, step)
+
+    def _cal_term_data(self, sel_ind, boltzmann_weights):
+        """
+        term energies of the resampled translations and, for store_term_partials, the partial sums over
+        the other translations: log of sum(exp(-beta E)) and the Boltzmann mean of every term
+        :param sel_ind: 1-array of int, indices of the resampled energies
+        :param boltzmann_weights: 1-array of float, exp(-beta E) / sum(exp(-beta E)) of all meaningful energies
+        """
+        self._resampled_term_energies = {}
+        for name in OPTIONAL_TERM_NAMES:
+            if name not in self._term_energies:
+                self._term_energies[name] = np.zeros(self._lig_grid._number_of_meaningful_energies, dtype=float)
+        nr_selected = sel_ind.shape[0]
+        for name in TERM_NAMES:
+            self._resampled_term_energies[name] = np.full(self._energy_sample_size_per_ligand, np.inf)
+            np.take(self._term_energies[name], sel_ind, out=self._resampled_term_energies[name][:nr_selected])
+        if self._store_term_partials:
+            tail_weights = np.copy(boltzmann_weights)
+            tail_weights[sel_ind] = 0.
+            tail_sum = tail_weights.sum()
+            self._tail_mean_energies = {}
+            if tail_sum > 0.:
+                self._tail_log_exponential_sum = np.log(tail_sum * self._exponential_sum) + self._log_of_divisor
+                for name in TERM_NAMES:
+                    self._tail_mean_energies[name] = np.dot(tail_weights, self._term_energies[name]) / tail_sum
+            else:
+                # every translation was resampled
+                self._tail_log_exponential_sum = -np.inf
+                for name in TERM_NAMES:
+                    self._tail_mean_energies[name] = 0.
+        self._term_energies = {}
+        return None
 
     def _do_fft(self, step):
+        with self._profiler.stage("rotation"):
+            self._do_fft_stages(step)
+        return None
+
+    def _do_fft_stages(self, step):
         print(f"Doing FFT for step {self._start_index + step}")
-        lig_conf = self._lig_coord_ensemble[step]
-        self._lig_grid._place_ligand_crd_in_grid(molecular_coord=lig_conf)
-        self._cal_free_of_clash()
-        self._lig_grid._meaningful_energies = np.zeros(self._lig_grid._grid["counts"], dtype=float)
+        with self._profiler.stage("place_ligand"):
+            lig_conf = self._lig_coord_ensemble[step]
+            self._lig_grid._place_ligand_crd_in_grid(molecular_coord=lig_conf)
+        with self._profiler.stage("free_of_clash"):
+            self._cal_free_of_clash()
+        self._lig_grid._meaningful_energies = self._lig_grid._buffers.zeros("meaningful_energies",
+                                                                            self._lig_grid._grid["counts"])
         names = [name for name in self._lig_grid._grid_func_names if name not in ["occupancy", "water"]]
+        if not self._lig_grid.has_desolvation():
+            names.remove("desolvation")
         for name in names:
-            self._cal_energies(name, step)
-
-        energies = self._lig_grid.get_meaningful_energies()
-        # energies = self._remove_nonphysical_energies
-        i_max, j_max, k_max = self._lig_grid._max_grid_indices
-        energies = energies[0:i_max, 0:j_max, 0:k_max]
-        energies = energies[self._lig_grid._free_of_clash]
-        print("Energies shape:", energies.shape)
-
-        self._mean_energy = energies.mean()
-        self._min_energy = energies.min()
-        self._min_energy_ind = np.argmax(self._min_energy)
-        self._energy_std = energies.std()
-        print("Number of finite energy samples", energies.shape[0])
-
-        exp_energies = -self._beta * energies
-        print(f"Max exp energy {exp_energies.max()}, Min exp energy {exp_energies.min()}")
-        # print out bottom 5 lowest energies
-        self._log_of_divisor = exp_energies.max()
-        exp_energies = np.exp(exp_energies - self._log_of_divisor)
-        self._exponential_sum = exp_energies.sum()
-        exp_energies /= self._exponential_sum
-        print("Number of exponential energy samples", exp_energies.sum())
-        self._lig_grid._number_of_meaningful_energies = energies.flatten().shape[0]
-        sel_ind = np.argsort(energies)[:self._energy_sample_size_per_ligand]
-        del exp_energies
-        self._resampled_energies = [energies[ind] for ind in sel_ind]
-        del energies
-
-        trans_vectors = self._lig_grid.get_meaningful_corners()
-        self._resampled_trans_vectors = [trans_vectors[ind] for ind in sel_ind]
-        del trans_vectors
-        if step == 0:
-            # get crystal pose here, use i,j,k of crystal pose
-            self._native_translation = ((self._rec_grid_displacement - self._lig_grid._new_displacement) / self._lig_grid._spacing).astype(int)
-            in_bounds = self._native_translation < (i_max, j_max, k_max)
-            
-            if np.all(in_bounds):
-                self._lig_grid._native_pose_energy = self._lig_grid._meaningful_energies[0:i_max, 0:j_max, 0:k_max][
-                    self._native_translation[0], self._native_translation[1],
-                    self._native_translation[2]]
-        self._lig_grid.set_meaningful_energies_to_none()
-        self._resampled_energies = np.array(self._resampled_energies, dtype=float)
-        self._resampled_trans_vectors = np.array(self._resampled_trans_vectors, dtype=int)
+            with self._profiler.stage(name):
+                self._cal_energies(name, step)
+
+        with self._profiler.stage("reduce"):
+            i_max, j_max, k_max = self._lig_grid._max_grid_indices
+            energies = self._gather_meaningful(self._lig_grid.get_meaningful_energies(), "total_energies")
+            print("Energies shape:", energies.shape)
+            if self._density_map is not None:
+                # rotations without meaningful energies add nothing but are counted
+                self._density_nr_rotations += 1
+
+            if energies.shape[0] == 0:
+                self._set_no_energies()
+            else:
+                self._mean_energy = energies.mean()
+                self._min_energy = energies.min()
+                self._min_energy_ind = np.argmax(self._min_energy)
+                self._energy_std = energies.std()
+                print("Number of finite energy samples", energies.shape[0])
+
+                exp_energies = self._lig_grid._buffers.empty("boltzmann_weights", energies.shape, dtype=float)
+                np.multiply(energies, -self._beta, out=exp_energies)
+                if self._density_map is not None:
+                    self._accumulate_density_map(exp_energies)
+                print(f"Max exp energy {exp_energies.max()}, Min exp energy {exp_energies.min()}")
+                # print out bottom 5 lowest energies
+                self._log_of_divisor = exp_energies.max()
+                exp_energies -= self._log_of_divisor
+                np.exp(exp_energies, out=exp_energies)
+                self._exponential_sum = exp_energies.sum()
+                exp_energies /= self._exponential_sum
+                print("Number of exponential energy samples", exp_energies.sum())
+                self._lig_grid._number_of_meaningful_energies = energies.shape[0]
+                sel_ind = self._store_lowest(energies, self._resampled_energies, self._resampled_trans_vectors)
+                if self._store_term_energies:
+                    self._cal_term_data(sel_ind, exp_energies)
+                del exp_energies
+                del energies
+            if step == 0:
+                # get crystal pose here, use i,j,k of crystal pose
+                self._native_translation = np.round((self._rec_grid_displacement - self._lig_grid._new_displacement) / self._lig_grid._spacing).astype(int)
+                in_bounds = self._native_translation < (i_max, j_max, k_max)
+
+                if np.all(in_bounds):
+                    self._lig_grid._native_pose_energy = self._lig_grid._meaningful_energies[0:i_max, 0:j_max, 0:k_max][
+                        self._native_translation[0], self._native_translation[1],
+                        self._native_translation[2]]
+            self._lig_grid.set_meaningful_energies_to_none()
 
-        self._save_data_to_nc(step)
+        with self._profiler.stage("save_nc"):
+            self._save_data_to_nc(step)
 
         return None
 
@@ -390,20 +741,123 @@ class Sampling(object):
     def run_sampling(self):
         """
         """
-        for step in range(self._lig_coord_ensemble.shape[0]):
-            self._do_fft(step)
+        try:
+            for step in range(self._lig_coord_ensemble.shape[0]):
+                self._do_fft(step)
+
+                print("Min energy", self._min_energy, "Index", self._min_energy_ind)
+                print("Mean energy", self._mean_energy)
+                print("STD energy", self._energy_std)
+                print("Initial center of mass", self._lig_grid.get_initial_com())
+                print("Grid volume", self._lig_grid.get_box_volume())
+                print("Number of translations", self._lig_grid.get_number_translations())
+                print("-------------------------------\n\n")
+
+            if self._density_map is not None:
+                self._save_density_map()
+            seal(self._nc_handle)
+            self._nc_handle.close()
+            if self._profiler.is_enabled():
+                self._profiler.print_summary()
+                self._profiler.write_json(str(self._output_nc) + ".memory.json")
+            counters = perf_counters.get_counters()
+            if counters.is_enabled():
+                counters.print_summary()
+                counters.write_json(str(self._output_nc) + ".perf.json")
+        finally:
+            if self._count_perf_events:
+                perf_counters.enable(False)
+        return None
+
+    def get_memory_profile(self):
+        """
+        :return: dict, per stage memory summary, empty unless profile_memory=True
+        """
+        return self._profiler.report()
+
+
+
+def write_density_map_dx(output_nc, dx_file, free_energy=True):
+    """
+    export the "log_density_map" of a Sampling output as a DX file
+    :param output_nc: str
+    :param dx_file: str, ends with .dx
+    :param free_energy: bool, if True write -kT log sum exp(-beta E) in kcal/mol relative to its minimum,
+    with grid points that no translation reached set to the maximum; else the log sums, with those points
+    set to the minimum
+    """
+    nc_handle = netCDF4.Dataset(output_nc, "r")
+    if "log_density_map" not in nc_handle.variables.keys():
+        nc_handle.close()
+        raise RuntimeError("%s has no log_density_map, run Sampling with store_density_map=True" % output_nc)
+    variable = nc_handle.variables["log_density_map"]
+    log_density = np.array(variable[:], dtype=float)
+    temperature = float(variable.getncattr("temperature"))
+    data = {"counts": np.array(nc_handle.variables["counts"][:], dtype=int),
+            "origin": np.array(nc_handle.variables["origin"][:], dtype=float),
+            "spacing": np.array(nc_handle.variables["spacing"][:], dtype=float)}
+    nc_handle.close()
+
+    reached = np.isfinite(log_density)
+    if not np.any(reached):
+        raise RuntimeError("%s: the log_density_map is empty" % output_nc)
+    if free_energy:
+        values = -KB * temperature * log_density
+        values -= values[reached].min()
+        values[~reached] = values[reached].max()
+    else:
+        values = log_density
+        values[~reached] = values[reached].min()
+    data["log_density_map"] = values
+    IO.write_dx(dx_file, data, "log_density_map")
+    return None
+
+
+class ConformerEnsembleSampling(Sampling):
+    """
+    FFT sampling of a flexible ligand: lig_coord_ensemble is a conformers.ConformerRotationEnsemble.
+    The ligand topology, charges and LJ parameters are loaded once, the per atom SASA once per
+    conformer, and all rotations of all conformers share the LigGrid buffers.
+    Every row of output_nc also gets conformer_index, ensemble_rotation_index and conformer_weight,
+    the number of input conformers the row's conformer stands for.
+    To resume at start_index, pass the same ensemble with set_first_step(start_index).
+    """
+
+    def _load_ligand_coor_ensemble(self, lig_coord_ensemble):
+        conformers = lig_coord_ensemble.get_conformers()
+        natoms = self._lig_grid.get_natoms()
+        if (conformers.shape[1] != natoms) or (conformers.shape[2] != 3):
+            raise RuntimeError("Ligand conformers do not have correct shape")
+        self._current_conformer = None
+        return lig_coord_ensemble
+
+    def _select_rotations(self, rec_grid, nr_rotations, bandwidth):
+        raise RuntimeError("so3_nr_rotations is not supported with a conformer ensemble")
 
-            print("Min energy", self._min_energy, "Index", self._min_energy_ind)
-            print("Mean energy", self._mean_energy)
-            print("STD energy", self._energy_std)
-            print("Initial center of mass", self._lig_grid.get_initial_com())
-            print("Grid volume", self._lig_grid.get_box_volume())
-            print("Number of translations", self._lig_grid.get_number_translations())
-            print("-------------------------------\n\n")
+    def _initialize_nc(self, output_nc):
+        nc_handle = Sampling._initialize_nc(self, output_nc)
+        for key, store_format in [("conformer_index", "i8"), ("ensemble_rotation_index", "i8"),
+                                  ("conformer_weight", "f8")]:
+            if key not in nc_handle.variables.keys():
+                nc_handle.createVariable(key, store_format, ("lig_sample_size"))
+        return nc_handle
 
-        self._nc_handle.close()
+    def _save_data_to_nc(self, step):
+        Sampling._save_data_to_nc(self, step)
+        conformer_index, rotation_index = self._lig_coord_ensemble.split_step(step)
+        row = step + self._start_index
+        self._nc_handle.variables["conformer_index"][row] = conformer_index
+        self._nc_handle.variables["ensemble_rotation_index"][row] = rotation_index
+        self._nc_handle.variables["conformer_weight"][row] = self._lig_coord_ensemble.get_weights()[conformer_index]
         return None
 
+    def _do_fft_stages(self, step):
+        conformer_index, _ = self._lig_coord_ensemble.split_step(step)
+        if conformer_index != self._current_conformer:
+            with self._profiler.stage("conformer"):
+                self._lig_grid.set_conformer(self._lig_coord_ensemble.get_conformer(step))
+            self._current_conformer = conformer_index
+        return Sampling._do_fft_stages(self, step)
 
 #
 # TODO   the class above assumes that the resample size is smaller than number of meaningful energies
@@ -444,6 +898,7 @@ class Sampling_PL(Sampling):
         """
         """
         nc_handle = netCDF4.Dataset(output_nc, mode="w", format="NETCDF4")
+        mark_incomplete(nc_handle)
 
         nc_handle.createDimension("three", 3)
         rec_natoms = self._rec_crd.shape[0]
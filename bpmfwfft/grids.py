@@ -13,33 +13,64 @@ from mdtraj.geometry.sasa import _ATOMIC_RADII
 
 try:
     from bpmfwfft import IO
+    from bpmfwfft.parallel import available_cpus, choose_task_divisor, partition
+    from bpmfwfft.memory import BufferPool
+    from bpmfwfft.perf_counters import perf_stage, fft_flops
+    from bpmfwfft.nc_integrity import mark_incomplete, seal, verify
 
     try:
         from bpmfwfft.util import c_is_in_grid, cdistance, c_containing_cube
-        from bpmfwfft.util import c_cal_charge_grid_pp_mp
-        from bpmfwfft.util import c_cal_potential_grid_pp
-        # from bpmfwfft.util import c_cal_lig_sasa_grid
-        # from bpmfwfft.util import c_cal_lig_sasa_grids
+        from bpmfwfft.util import c_cal_charge_grid_pp_mp, c_cal_desolvation_grids_pp_mp
+        from bpmfwfft.util import c_cal_potential_grid_pp, c_gaussian_sum
+        from bpmfwfft.util import c_cal_lig_sasa_grids
         from bpmfwfft.util import c_sasa, c_crd_to_grid, c_points_to_grid, c_generate_sphere_points, c_asa_frame
+        from bpmfwfft.util import c_interpolate_energies
     except:
         from util import c_is_in_grid, cdistance, c_containing_cube
-        from util import c_cal_charge_grid_pp_mp
-        from util import c_cal_potential_grid_pp
-        # from util import c_cal_lig_sasa_grid
-        # from util import c_cal_lig_sasa_grids
+        from util import c_cal_charge_grid_pp_mp, c_cal_desolvation_grids_pp_mp
+        from util import c_cal_potential_grid_pp, c_gaussian_sum
+        from util import c_cal_lig_sasa_grids
         from util import c_sasa, c_crd_to_grid, c_points_to_grid, c_generate_sphere_points, c_asa_frame
+        from util import c_interpolate_energies
 
 except:
     import IO
+    from parallel import available_cpus, choose_task_divisor, partition
+    from memory import BufferPool
+    from perf_counters import perf_stage, fft_flops
+    from nc_integrity import mark_incomplete, seal, verify
     from util import c_is_in_grid, cdistance, c_containing_cube
-    from util import c_cal_charge_grid_pp_mp
-    from util import c_cal_potential_grid_pp
-    # from util import c_cal_lig_sasa_grid
-    # from util import c_cal_lig_sasa_grids
+    from util import c_cal_charge_grid_pp_mp, c_cal_desolvation_grids_pp_mp
+    from util import c_cal_potential_grid_pp, c_gaussian_sum
+    from util import c_cal_lig_sasa_grids
     from util import c_sasa, c_crd_to_grid, c_points_to_grid, c_generate_sphere_points, c_asa_frame
+    from util import c_interpolate_energies
 
 # Gamma taken from amber manual
 GAMMA = 0.005
+# sphere points per atom of the SASA dots
+N_SPHERE_POINTS = 960
+# rough cost of spreading one ligand atom onto the grid, in atom * grid point updates
+LIG_CHARGE_WORK_PER_ATOM = 2.0e4
+# rough floating-point operation counts for the performance counter summary
+LIG_CHARGE_FLOPS_PER_ATOM = 5.0e3       # ten-corner NNLS fit
+REC_POTENTIAL_FLOPS_PER_PAIR = 20.      # distance and potential of one atom at one grid point
+# receptor potential grids summed by RecGrid.interpolated_energies and the ligand prmtop charges they multiply
+INTERPOLATED_GRID_CHARGES = {"electrostatic": "CHARGE_E_UNIT", "LJr": "R_LJ_CHARGE", "LJa": "A_LJ_CHARGE"}
+# charge-dependent desolvation of AutoDock4: each atom loses QSOLPAR * |q| for the volume of the partner
+# atoms within a Gaussian of width DESOLVATION_SIGMA, cut at DESOLVATION_CUTOFF; the sum is scaled by
+# DESOLVATION_WEIGHT, kcal/mol
+DESOLVATION_QSOLPAR = 0.01097
+DESOLVATION_SIGMA = 3.5
+DESOLVATION_CUTOFF = 8.0
+DESOLVATION_WEIGHT = 0.1322
+# Debye-Hueckel screening of the receptor electrostatic grid, see RecGrid: the Debye length is
+# DEBYE_LENGTH_1M / sqrt(ionic strength in mol/L) angstrom, for water at 298 K, and by default the
+# screened potential is cut at SCREENING_CUTOFF_DEBYE_LENGTHS Debye lengths, where exp(-5) = 0.7%
+DEBYE_LENGTH_1M = 3.04
+SCREENING_CUTOFF_DEBYE_LENGTHS = 5.
+# grids that older grid nc files may lack, their terms are then left out
+OPTIONAL_GRID_FUNC_NAMES = ("desolvation",)
 
 
 def process_potential_grid_function(
@@ -52,7 +83,7 @@ def process_potential_grid_function(
         prmtop_ljsigma,
         prmtop_vdwradii,
         clash_radii,
-        bond_list,
+        bonds,
         atom_list,
         molecule_sasa,
         sasa_cutoffs,
@@ -60,11 +91,19 @@ def process_potential_grid_function(
         rec_core_scaling,
         rec_surface_scaling,
         rec_metal_scaling,
+        kappa=0.,
+        dielectric=1.,
+        distance_dielectric=False,
+        cutoff=0.,
+        lj_cap=0.,
 ):
     """
     gets called by cal_potential_grid and assigned to a new python process
     use cython to calculate electrostatic, LJa, LJr, and water grids
     and save them to nc file
+    :param kappa, dielectric, distance_dielectric, cutoff: screening of the electrostatic grid,
+    see util.c_screened_coulomb_sum
+    :param lj_cap: float, saturation of the LJr and LJa grids, 0 for none, see util.c_cal_potential_grid_pp
     """
     grid_x = np.linspace(
         origin_crd[0],
@@ -88,9 +127,10 @@ def process_potential_grid_function(
                                    grid_x, grid_y, grid_z,
                                    origin_crd, uper_most_corner_crd, uper_most_corner,
                                    grid_spacing, grid_counts, charges, prmtop_ljsigma, prmtop_vdwradii,
-                                   clash_radii, bond_list, atom_list, molecule_sasa, sasa_cutoffs,
+                                   clash_radii, bonds, atom_list, molecule_sasa, sasa_cutoffs,
                                    rec_res_names, rec_core_scaling, rec_surface_scaling,
-                                   rec_metal_scaling)
+                                   rec_metal_scaling, kappa, dielectric, distance_dielectric, cutoff,
+                                   lj_cap)
     return grid
 
 
@@ -106,7 +146,7 @@ def process_charge_grid_function(
         prmtop_ljsigma,
         prmtop_vdwradii,
         clash_radii,
-        bond_list,
+        bonds,
         atom_list,
         natoms_i,
         atomind,
@@ -120,7 +160,7 @@ def process_charge_grid_function(
     """
     gets called by cal_charge_grid and assigned to a new python process
     use cython to calculate electrostatic, LJa, LJr, and water grids
-    and save them to nc file
+    only the nonzero grid points are sent back, as flat indices and values
     """
     grid_x = np.linspace(
         origin_crd[0],
@@ -145,13 +185,82 @@ def process_charge_grid_function(
                                    origin_crd, uper_most_corner_crd, uper_most_corner,
                                    grid_spacing, eight_corner_shifts, six_corner_shifts,
                                    grid_counts, charges, prmtop_ljsigma, prmtop_vdwradii, clash_radii,
-                                   bond_list, atom_list,
+                                   bonds, atom_list,
                                    natoms_i, atomind, molecule_sasa, sasa_cutoffs, lig_res_names,
                                    lig_core_scaling, lig_surface_scaling, lig_metal_scaling)
+    flat_indices = np.flatnonzero(grid)
+    return flat_indices, grid.ravel()[flat_indices]
+
 
+def process_desolvation_grid_function(crd, origin_crd, grid_spacing, grid_counts, weights):
+    """
+    gets called by RecGrid._cal_potential_grids and assigned to a new python process
+    the two receptor desolvation grids of one x slab, Gaussian sums of the weights
+    :param weights: 2d array of float, (2, natoms), see desolvation_weights
+    :return: 4d array of float, (2, i, j, k)
+    """
+    grid_x, grid_y, grid_z = [np.linspace(origin_crd[i], origin_crd[i] + (grid_counts[i] - 1) * grid_spacing[i],
+                                          num=grid_counts[i]) for i in range(3)]
+    grid = np.zeros((2,) + tuple(grid_counts), dtype=float)
+    for channel in range(2):
+        c_gaussian_sum(crd, weights[channel], grid_x, grid_y, grid_z, DESOLVATION_SIGMA, DESOLVATION_CUTOFF,
+                       grid[channel])
     return grid
 
 
+def process_desolvation_charge_grid_function(crd, origin_crd, grid_spacing, eight_corner_shifts,
+                                             six_corner_shifts, grid_counts, weights, natoms_i, atomind):
+    """
+    gets called by LigGrid._cal_charge_grid and assigned to a new python process
+    the two ligand desolvation grids spread from natoms_i atoms, sent back as flat indices and values
+    """
+    grid_x, grid_y, grid_z = [np.linspace(origin_crd[i], origin_crd[i] + (grid_counts[i] - 1) * grid_spacing[i],
+                                          num=grid_counts[i]) for i in range(3)]
+    uper_most_corner_crd = origin_crd + (grid_counts - 1.) * grid_spacing
+    uper_most_corner = (grid_counts - 1)
+    grid = c_cal_desolvation_grids_pp_mp(crd, grid_x, grid_y, grid_z,
+                                         origin_crd, uper_most_corner_crd, uper_most_corner,
+                                         grid_spacing, eight_corner_shifts, six_corner_shifts,
+                                         weights, natoms_i, atomind)
+    flat_indices = np.flatnonzero(grid)
+    return flat_indices, grid.ravel()[flat_indices]
+
+
+def desolvation_weights(prmtop):
+    """
+    :param prmtop: dict, loaded prmtop
+    :return: 2d array of float, (2, natoms), QSOLPAR * |q| and the atomic volumes 4/3 pi r^3 from VDW_RADII
+    """
+    charges = np.array(prmtop["CHARGE_E_UNIT"], dtype=float)
+    radii = np.array(prmtop["VDW_RADII"], dtype=float)
+    return np.array([DESOLVATION_QSOLPAR * np.abs(charges), 4. / 3. * np.pi * radii ** 3], dtype=float)
+
+
+def desolvation_energy(rec_crd, rec_weights, lig_crd, lig_weights, weight=DESOLVATION_WEIGHT):
+    """
+    the direct sum the desolvation grids are sampled from
+    :param rec_crd: 2d array, (rec_natoms, 3)
+    :param rec_weights: 2d array, (2, rec_natoms), see desolvation_weights
+    :param lig_crd: 2d array, (lig_natoms, 3), or 3d array of poses, (nposes, lig_natoms, 3)
+    :param lig_weights: 2d array, (2, lig_natoms), see desolvation_weights
+    :param weight: float
+    :return: float, or 1d array of float for 3d lig_crd
+    """
+    lig_crd = np.asarray(lig_crd, dtype=float)
+    poses = lig_crd.reshape((-1,) + lig_crd.shape[-2:])
+    energies = np.zeros(poses.shape[0], dtype=float)
+    for i, pose in enumerate(poses):
+        dif = pose[:, np.newaxis, :] - rec_crd[np.newaxis, :, :]
+        r2 = (dif * dif).sum(axis=2)
+        gaussian = np.where(r2 <= DESOLVATION_CUTOFF ** 2, np.exp(-r2 / (2. * DESOLVATION_SIGMA ** 2)), 0.)
+        energies[i] = np.dot(lig_weights[1], np.dot(gaussian, rec_weights[0])) + \
+                      np.dot(lig_weights[0], np.dot(gaussian, rec_weights[1]))
+    energies *= weight
+    if lig_crd.ndim == 2:
+        return energies[0]
+    return energies
+
+
 def process_sasa_grid_function(
         crd,
         radii,
@@ -171,24 +280,37 @@ def process_sasa_grid_function(
     return points
 
 
-def is_nc_grid_good(nc_grid_file):
+def debye_kappa(ionic_strength):
     """
-    :param nc_grid_file: name of nc file
-    :return: bool
+    :param ionic_strength: float, mol/L
+    :return: float, inverse Debye length in 1/angstrom, 0 without salt
     """
-    if not os.path.exists(nc_grid_file):
-        return False
+    assert ionic_strength >= 0, "ionic_strength must be non-negative"
+    return np.sqrt(ionic_strength) / DEBYE_LENGTH_1M
 
-    if os.path.getsize(nc_grid_file) == 0:
-        return False
 
-    nc_handle = netCDF4.Dataset(nc_grid_file, "r")
-    nc_keys = nc_handle.variables.keys()
-    grid_keys = Grid().get_allowed_keys()
-    for key in grid_keys:
-        if key not in nc_keys:
-            return False
-    return True
+def screened_coulomb(r, kappa=0., dielectric=1., distance_dielectric=False, cutoff=0.):
+    """
+    the electrostatic kernel of util.c_screened_coulomb_sum, exp(-kappa r) / (eps(r) r)
+    :param r: float or array of float, angstrom
+    :param cutoff: float, the kernel is 0 beyond it; <= 0 for no cutoff
+    :return: same shape as r
+    """
+    r = np.asarray(r, dtype=float)
+    eps = dielectric * r if distance_dielectric else dielectric
+    kernel = np.exp(-kappa * r) / (eps * r)
+    if cutoff > 0:
+        kernel = np.where(r <= cutoff, kernel, 0.)
+    return kernel
+
+
+def is_nc_grid_good(nc_grid_file, deep=False):
+    """
+    :param nc_grid_file: name of nc file
+    :param deep: bool, if True also check the checksums, see nc_integrity.verify
+    :return: bool
+    """
+    return verify(nc_grid_file, variables=Grid().get_required_keys(), deep=deep)
 
 
 # def get_min_dists_pool():
@@ -208,6 +330,72 @@ def translate_grid(grid, displacement):
     return grid
 
 
+def fft_friendly_count(count):
+    """
+    :param count: int
+    :return: int, the smallest integer >= count with no prime factor larger than 5
+    """
+    count = max(int(count), 1)
+    while True:
+        n = count
+        for factor in (2, 3, 5):
+            while n % factor == 0:
+                n //= factor
+        if n == 1:
+            return count
+        count += 1
+
+
+def principal_axes(crd, masses=None):
+    """
+    :param crd: 2d array, (natoms, 3)
+    :param masses: 1d array or None, weights of the atoms
+    :return: (rotation, center)
+        rotation: 3x3 array, rows are the principal axes, largest spread first, right-handed
+        center: 3-array, weighted center of crd
+    (crd - center) @ rotation.T is crd in the principal-axis frame
+    """
+    if masses is None:
+        masses = np.ones(crd.shape[0], dtype=float)
+    masses = np.asarray(masses, dtype=float)
+    center = np.dot(masses, crd) / masses.sum()
+    centered = crd - center
+    covariance = np.dot(centered.T * masses, centered) / masses.sum()
+    eigenvalues, eigenvectors = np.linalg.eigh(covariance)
+    rotation = eigenvectors[:, ::-1].T
+    # fix the sign of each axis so that the rotation is deterministic and proper
+    for i in range(2):
+        if rotation[i][np.argmax(np.abs(rotation[i]))] < 0:
+            rotation[i] *= -1.
+    rotation[2] = np.cross(rotation[0], rotation[1])
+    return rotation, center
+
+
+def box_counts(crd, lj_radius, spacing, extra_buffer, anisotropic=False):
+    """
+    number of grid points along x, y, z of a box enclosing the atoms plus extra_buffer
+    :param crd: 2d array, (natoms, 3)
+    :param lj_radius: 1d array, (natoms,)
+    :param spacing: float
+    :param extra_buffer: float
+    :param anisotropic: bool, if False a cube on the longest edge, as always;
+    if True each axis sized on its own and padded to an FFT-friendly count
+    :return: 3-array of int
+    """
+    edges = (crd + lj_radius[:, np.newaxis]).max(axis=0) - (crd - lj_radius[:, np.newaxis]).min(axis=0)
+    print("Receptor enclosing box [%f, %f, %f]" % tuple(edges))
+    print("extra_buffer: %f" % extra_buffer)
+    if not anisotropic:
+        length = edges.max() + 2.0 * extra_buffer
+        if np.ceil(length / spacing) % 2 != 0:
+            length = length + spacing
+        count = np.ceil(length / spacing) + 1
+        return np.array([count] * 3, dtype=int)
+
+    lengths = edges + 2.0 * extra_buffer
+    return np.array([fft_friendly_count(np.ceil(length / spacing) + 1) for length in lengths], dtype=int)
+
+
 class Grid(object):
     """
     an abstract class that defines some common methods and data attributes
@@ -216,7 +404,10 @@ class Grid(object):
 
     def __init__(self):
         self._grid = {}
-        self._grid_func_names = ("occupancy", "LJr", "LJa", "electrostatic", "sasa", "water")  # calculate all grids
+        # if True, occupancy also covers the bonds between atoms, see util.c_capsule_occupancy
+        self._bond_occupancy = False
+        self._grid_func_names = ("occupancy", "LJr", "LJa", "electrostatic", "sasa", "water",
+                                 "desolvation")  # calculate all grids
         # self._grid_func_names = ("occupancy", "LJr", "LJa", "sasa", "water")  # don't calculate electrostatic
         # self._grid_func_names = ("occupancy", "sasa", "water")  # test new sasa grid
         # self._grid_func_names = ("occupancy", "electrostatic")  # uncomment to calculate electrostatic and occupancy
@@ -434,40 +625,29 @@ class Grid(object):
     def get_allowed_keys(self):
         return self._grid_allowed_keys
 
-    def _get_bond_list(self):
-        # Ugliest function award 2023
-        bonds = {}
-        prmtop_parms = self.get_prmtop()
-        for key, value in prmtop_parms.items():
-            if key == "BONDS_WITHOUT_HYDROGEN":
-                for i in range(len(value), 3):
-                    if "H" in prmtop_parms["PDB_TEMPLATE"]["ATOM_NAME"][int(value[i] / 3)]:
-                        print(f"index {i} is an H bond")
-                    if i not in list(bonds.keys()):
-                        bonds[(value[i] / 3)] = []
-                        bonds[(value[i] / 3)].append((value[i + 1] / 3))
-                    else:
-                        bonds[(value[i] / 3)].append((value[i + 1] / 3))
-        b = []
-        for key, value in bonds.items():
-            a = [key]
-            for v in value:
-                a.append(v)
-            a.sort()
-            b.append(a)
-        b.sort()
-
-        def midpoint(a1, a2):
-            import numpy as np
-            a3 = np.zeros((3))
-            for i in range(a3.shape[0]):
-                a3[i] = (a2[i] - a1[i]) / 2.
-            return a3
-
-        bond_list = []
-        for b_s in b:
-            bond_list.append(midpoint(crd[int(b_s[0])], crd[int(b_s[1])]))
-        return bond_list
+    def get_required_keys(self):
+        """
+        keys every grid nc file must have, the allowed keys less OPTIONAL_GRID_FUNC_NAMES
+        """
+        return tuple(key for key in self._grid_allowed_keys if key not in OPTIONAL_GRID_FUNC_NAMES)
+
+    def _get_bonds(self, exclude_H=True):
+        """
+        bonded atom pairs from the prmtop BONDS_WITHOUT_HYDROGEN and BONDS_INC_HYDROGEN arrays,
+        which hold (3 * atom index, 3 * atom index, bond type) triples
+        :param exclude_H: bool, if True leave out bonds to hydrogens
+        :return: 2d array of int64, (nbonds, 2) atom indices; empty if bond occupancy is off
+        """
+        if not self._bond_occupancy:
+            return np.zeros((0, 2), dtype=np.int64)
+        keys = ["BONDS_WITHOUT_HYDROGEN"]
+        if not exclude_H:
+            keys.append("BONDS_INC_HYDROGEN")
+        triples = [np.asarray(self._prmtop[key], dtype=np.int64).reshape(-1, 3) for key in keys]
+        return np.concatenate(triples, axis=0)[:, :2] // 3
+
+    def get_bond_occupancy(self):
+        return self._bond_occupancy
 
 
 class LigGrid(Grid):
@@ -477,7 +657,7 @@ class LigGrid(Grid):
 
     def __init__(self, prmtop_file_name, lj_sigma_scaling_factor,
                  lig_core_scaling, lig_surface_scaling, lig_metal_scaling,
-                 inpcrd_file_name, receptor_grid):
+                 inpcrd_file_name, receptor_grid, bond_occupancy=None):
         """
         :param prmtop_file_name: str, name of AMBER prmtop file
         :param lj_sigma_scaling_factor: float
@@ -486,8 +666,13 @@ class LigGrid(Grid):
         :param lig_metal_scaling: float
         :param inpcrd_file_name: str, name of AMBER coordinate file
         :param receptor_grid: an instance of RecGrid class.
+        :param bond_occupancy: bool or None, if True the occupancy grid also covers bonds,
+        None follows receptor_grid
         """
         Grid.__init__(self)
+        if bond_occupancy is None:
+            bond_occupancy = receptor_grid.get_bond_occupancy()
+        self._bond_occupancy = bond_occupancy
         grid_data = receptor_grid.get_grids()
         if grid_data["lj_sigma_scaling_factor"][0] != lj_sigma_scaling_factor:
             raise RuntimeError("lj_sigma_scaling_factor is %f but in receptor_grid, it is %f" % (
@@ -500,17 +685,23 @@ class LigGrid(Grid):
         self._initialize_convenient_para()
 
         self._rec_FFTs = receptor_grid.get_FFTs()
+        # input ligand coordinates are turned with the receptor, see RecGrid(..., principal_axes_box=True)
+        self._principal_axes_rotation, self._principal_axes_center = receptor_grid.get_principal_axes()
 
         self._load_prmtop(prmtop_file_name, lj_sigma_scaling_factor)
         self._load_inpcrd(inpcrd_file_name)
+        self._crd = self.to_grid_frame(self._crd)
         self._move_ligand_to_lower_corner()
         self._displacement = self._new_displacement
-        self._molecule_sasa = self._get_molecule_sasa(0.14, 960)
-        self._sasa_cutoffs = self._get_molecule_sasa(0.086, 960)
+        self._molecule_sasa = self._get_molecule_sasa(0.14, N_SPHERE_POINTS)
+        self._sasa_cutoffs = self._get_molecule_sasa(0.086, N_SPHERE_POINTS)
         self._lig_core_scaling = lig_core_scaling
         self._lig_surface_scaling = lig_surface_scaling
         self._lig_metal_scaling = lig_metal_scaling
         self._rho = receptor_grid.get_rho()
+        self._desolvation_weight = DESOLVATION_WEIGHT
+        # grids and FFT buffers reused from one rotation to the next
+        self._buffers = BufferPool()
         # self._native_translation = ((receptor_grid._displacement - self._new_displacement) / self._spacing).astype(int)
 
     def _move_ligand_to_lower_corner(self):
@@ -585,6 +776,9 @@ class LigGrid(Grid):
             return np.array([0], dtype=float)
         elif name == "occupancy":
             return np.array([0], dtype=float)
+        elif name == "desolvation":
+            # volumes pair with the receptor charge channel, charges with the receptor volume channel
+            return desolvation_weights(self._prmtop)[::-1].copy()
         else:
             raise RuntimeError("%s is unknown" % name)
 
@@ -617,20 +811,19 @@ class LigGrid(Grid):
         atom_names = np.copy(self._prmtop["PDB_TEMPLATE"]["ATOM_NAME"])
         exclude_H = True
         probe_size = 1.4
-        n_sphere_points = 960
-        task_divisor = 16
+        n_sphere_points = N_SPHERE_POINTS
+        natoms = self._crd.shape[0]
+        if name == "sasa":
+            task_divisor = choose_task_divisor(natoms, natoms)
+        else:
+            task_divisor = choose_task_divisor(natoms, LIG_CHARGE_WORK_PER_ATOM)
+        slices = partition(natoms, task_divisor)
         print("calculating Ligand %s grid" % name)
         start_time = time.time()
-        with concurrent.futures.ProcessPoolExecutor() as executor:
+        with concurrent.futures.ProcessPoolExecutor(max_workers=available_cpus()) as executor:
             futures_array = []
             if name == "sasa":
-                for i in range(task_divisor):
-                    natoms_i = self._crd.shape[0]
-                    natoms_slice = natoms_i // task_divisor
-                    if i == task_divisor - 1:
-                        natoms_slice += natoms_i % task_divisor
-                    natoms_i = natoms_slice
-                    atomind = i * (self._crd.shape[0] // task_divisor)
+                for atomind, natoms_i in slices:
                     futures_array.append(executor.submit(
                         process_sasa_grid_function,
                         self._crd,
@@ -648,23 +841,38 @@ class LigGrid(Grid):
                 points = np.concatenate(tuple(point_array), axis=0)
                 # grid = np.zeros(self._grid["counts"], dtype=np.float64)
                 grid = c_points_to_grid(points, self._spacing, grid_counts)
+            elif name == "desolvation":
+                weights = self._get_charges(name)
+                for atomind, natoms_i in slices:
+                    futures_array.append(executor.submit(
+                        process_desolvation_charge_grid_function,
+                        self._crd,
+                        origin,
+                        self._grid["spacing"],
+                        self._eight_corner_shifts,
+                        self._six_corner_shifts,
+                        grid_counts,
+                        weights,
+                        natoms_i,
+                        atomind
+                    ))
+                grid = self._buffers.zeros("desolvation_grid", (2,) + tuple(grid_counts), dtype=np.float64)
+                flat_grid = grid.reshape(-1)
+                for i in range(task_divisor):
+                    flat_indices, values = futures_array[i].result()
+                    flat_grid[flat_indices] += values
+                    futures_array[i] = None
             else:
                 charges = self._get_charges(name)
-                for i in range(task_divisor):
-                    natoms_i = self._crd.shape[0]
-                    natoms_slice = natoms_i // task_divisor
-                    if i == task_divisor - 1:
-                        natoms_slice += natoms_i % task_divisor
-                    natoms_i = natoms_slice
-                    atomind = i * (self._crd.shape[0] // task_divisor)
+                bonds = self._get_bonds(exclude_H)
+                for atomind, natoms_i in slices:
                     atom_list = []
-                    for i in range(self._crd.shape[0])[atomind:atomind + natoms_i]:
+                    for i in range(natoms)[atomind:atomind + natoms_i]:
                         if exclude_H:
                             if atom_names[i][0] != 'H':
                                 atom_list.append(i)
                         else:
                             atom_list.append(i)
-                    bond_list = self._get_bond_list()
                     futures_array.append(executor.submit(
                         process_charge_grid_function,
                         name,
@@ -678,7 +886,7 @@ class LigGrid(Grid):
                         self._prmtop["LJ_SIGMA"],
                         self._prmtop["VDW_RADII"],
                         clash_radii,
-                        bond_list,
+                        bonds[(bonds[:, 0] >= atomind) & (bonds[:, 0] < atomind + natoms_i)],
                         atom_list,
                         natoms_i,
                         atomind,
@@ -689,81 +897,161 @@ class LigGrid(Grid):
                         self._lig_surface_scaling,
                         self._lig_metal_scaling
                     ))
-                grid = np.zeros(grid_counts, dtype=np.float64)
+                grid = self._buffers.zeros("charge_grid", grid_counts, dtype=np.float64)
+                flat_grid = grid.reshape(-1)
                 for i in range(task_divisor):
-                    partial_grid = futures_array[i].result()
-                    grid = np.add(grid, partial_grid)
-                    futures_array[i].done()
+                    flat_indices, values = futures_array[i].result()
+                    flat_grid[flat_indices] += values
+                    futures_array[i] = None
         print("--- %s calculated in %s seconds ---" % (name, time.time() - start_time))
         return grid
 
     def _cal_corr_func(self, grid_name):
         """
         :param grid_name: str
-        :return: fft correlation function
+        :return: fft correlation function, a view into a buffer that the next call overwrites
         """
         assert grid_name in self._grid_func_names, "%s is not an allowed grid name" % grid_name
-        corr_func = self._cal_charge_grid(grid_name)
+        with perf_stage("ligand_charge_spreading", flops=self._crd.shape[0] * LIG_CHARGE_FLOPS_PER_ATOM):
+            corr_func = self._cal_charge_grid(grid_name)
         self._set_grid_key_value(grid_name, corr_func)
-        corr_func = np.fft.fftn(self._grid[grid_name])
+        corr_func = self._correlate(self._grid[grid_name], self._rec_FFTs[grid_name])
         self._set_grid_key_value(grid_name, None)  # to save memory
-
-        corr_func = corr_func.conjugate()
-        corr_func = np.fft.ifftn(self._rec_FFTs[grid_name] * corr_func)
-        corr_func = np.real(corr_func)
+        return corr_func.real
+
+    def _correlate(self, grid, rec_FFT):
+        """
+        forward FFT of a ligand grid, product with the conjugate ligand spectrum, inverse FFT
+        :param grid: 3d ndarray, ligand grid
+        :param rec_FFT: 3d complex ndarray, receptor spectrum
+        :return: complex ndarray, a buffer that the next call overwrites
+        """
+        with perf_stage("forward_fft", flops=fft_flops(grid.shape)):
+            spectrum = self._buffers.fftn("corr_func", grid)
+        with perf_stage("spectral_product", flops=7. * spectrum.size):
+            np.conjugate(spectrum, out=spectrum)
+            spectrum *= rec_FFT
+        with perf_stage("inverse_fft", flops=fft_flops(spectrum.shape)):
+            corr_func = self._buffers.ifftn("corr_func", spectrum)
         return corr_func
 
     def _cal_delta_sasa_func(self, free_of_clash):
         """
         :param grid_name: str
-        :return: fft correlation function
+        :return: fft correlation function, a buffer that the next call overwrites
         """
-        grid = self._cal_charge_grid("sasa")
+        with perf_stage("ligand_charge_spreading", flops=self._crd.shape[0] * LIG_CHARGE_FLOPS_PER_ATOM):
+            grid = self._cal_charge_grid("sasa")
         self._set_grid_key_value("sasa", grid)
-        lsasa_fft = np.fft.fftn(self._grid["sasa"])
+        dsasa_score = self._buffers.empty("dsasa_score", self._grid["counts"], dtype=float)
+        dsasa_score[...] = self._correlate(self._grid["sasa"], self._rec_FFTs["water"]).real
         self._set_grid_key_value("sasa", None)  # to save memory
         del grid
-        grid = self._cal_charge_grid("water")
-        grid[grid > 0.] = 1.
+
+        with perf_stage("ligand_charge_spreading", flops=self._crd.shape[0] * LIG_CHARGE_FLOPS_PER_ATOM):
+            grid = self._cal_charge_grid("water")
+        np.copyto(grid, 1., where=np.greater(grid, 0., out=self._buffers.empty("water_mask", grid.shape, dtype=bool)))
         self._set_grid_key_value("water", grid)
-        lwater_fft = np.fft.fftn(self._grid["water"])
+        dsasa_score += self._correlate(self._grid["water"], self._rec_FFTs["sasa"]).real
         # print(self._grid["water"].sum())
         self._set_grid_key_value("water", None)
         del grid
-        lsasa_fft = lsasa_fft.conjugate()
-        lwater_fft = lwater_fft.conjugate()
-        dsasa_score = np.fft.ifftn(self._rec_FFTs["sasa"] * lwater_fft).real + np.fft.ifftn(
-            self._rec_FFTs["water"] * lsasa_fft).real
         max_i, max_j, max_k = self._max_grid_indices
         # dsasa_score = dsasa_score[0:max_i,0:max_j,0:max_k]
         # dsasa_score = dsasa_score[free_of_clash]
         # dsasa_score[~free_of_clash] = 0.
         return dsasa_score
 
-    def _cal_shape_complementarity(self):
+    def _cal_desolvation_grid(self):
         """
-        :param grid_name: str
-        :return: fft correlation function
+        :return: 3d complex ndarray, ligand volumes + i * QSOLPAR |q|, a buffer that the next call overwrites
         """
-        print("Calculating shape complementarity.")
-        counts = self._grid["counts"]
+        with perf_stage("ligand_charge_spreading", flops=self._crd.shape[0] * LIG_CHARGE_FLOPS_PER_ATOM):
+            grids = self._cal_charge_grid("desolvation")
+        grid = self._buffers.empty("desolvation_complex_grid", grids.shape[1:], dtype=complex)
+        grid.real = grids[0]
+        grid.imag = grids[1]
+        return grid
 
+    def _cal_desolvation_func(self):
+        """
+        The receptor "desolvation" spectrum is that of QSOLPAR |q| + i * volume Gaussian sums and the ligand
+        grid is volume + i * QSOLPAR |q|, so the real part of their correlation has both cross terms,
+        receptor charges against ligand volumes plus receptor volumes against ligand charges, for one
+        forward and one inverse FFT.
+        :return: fft correlation function, weighted desolvation energies, a buffer that the next call overwrites
+        """
+        desolvation = self._buffers.empty("desolvation", self._grid["counts"], dtype=float)
+        np.multiply(self._correlate(self._cal_desolvation_grid(), self._rec_FFTs["desolvation"]).real,
+                    self._desolvation_weight, out=desolvation)
+        return desolvation
+
+    def has_desolvation(self):
+        """
+        :return: bool, True if the receptor grid has the desolvation term and its weight is not zero
+        """
+        return "desolvation" in self._rec_FFTs and self._desolvation_weight != 0.
+
+    def get_desolvation_weight(self):
+        return self._desolvation_weight
+
+    def set_desolvation_weight(self, weight):
+        """
+        :param weight: float, scales the desolvation term, 0 leaves it out
+        """
+        self._desolvation_weight = float(weight)
+        return None
+
+    def _cal_shape_complementarity_spectrum(self):
+        """
+        One forward FFT of the conjugate of the complex ligand grid SASAr + i*SASAi, multiplied by the
+        cached receptor "sasa" spectrum; its inverse FFT is corr(R, SASAr) + i corr(R, SASAi).
+        The product is scaled by (1 + i) so that the real part of its inverse FFT is
+        Re(corr) - Im(corr) = corr(R, SASAr) - corr(R, SASAi), the surface layer rewarded and the core
+        penalized; it can therefore be summed with the spectra of the real grids
+        and go through the same single inverse FFT.
+        :return: complex ndarray, spectrum of the shape complementarity term
+        """
         lig_sasai_grid, lig_sasar_grid = self.get_SASA_grids()
-        lig_sasa_grid = np.add(lig_sasar_grid, lig_sasai_grid * 1.j)
+        lig_sasa_grid = np.subtract(lig_sasar_grid, lig_sasai_grid * 1.j)
+        del lig_sasai_grid, lig_sasar_grid
 
-        # self._set_grid_key_value(grid_name, lig_sasa_grid)
         # crucially takes the conjugate of the complex ligand grid BEFORE FFT
-        corr_func = np.fft.fftn(lig_sasa_grid.conjugate())
-        # self._set_grid_key_value(grid_name, None)           # to save memory
+        spectrum = np.fft.fftn(lig_sasa_grid).conjugate()
+        del lig_sasa_grid
+        spectrum *= self._rec_FFTs["sasa"]
+        spectrum *= (1. + 1.j)
+        return spectrum
 
-        rec_sasa_grid = self._rec_FFTs["SASA"]
+    def _cal_shape_complementarity(self):
+        """
+        :return: fft correlation function, corr(R, SASAr) - corr(R, SASAi) of the receptor sasa grid R and
+        the ligand SASA grids
+        """
+        print("Calculating shape complementarity.")
+        corr_func = np.fft.ifftn(self._cal_shape_complementarity_spectrum())
+        corr_func = np.real(corr_func)
+        return corr_func
 
-        rec_sasa_fft = np.fft.fftn(rec_sasa_grid)
+    def _direct_shape_complementarity(self, translation, rec_sasa_grid=None):
+        """
+        brute-force shape complementarity at one translation, used to validate the FFT path
+        :param translation: 3-array of int, grid translation of the ligand
+        :param rec_sasa_grid: ndarray or None, receptor "sasa" grid; recovered from the cached spectrum if None
+        :return: float
+        """
+        if rec_sasa_grid is None:
+            rec_sasa_grid = np.real(np.fft.ifftn(self._rec_FFTs["sasa"]))
+        lig_sasai_grid, lig_sasar_grid = self.get_SASA_grids()
+        lig_grid = lig_sasar_grid - lig_sasai_grid
 
-        corr_func = np.fft.ifftn(rec_sasa_fft * corr_func.conjugate())  # * (1/(np.prod(counts)))
-        corr_func = np.real(np.real(corr_func) - np.imag(corr_func))
-        # self._shape_complementarity_func = corr_func
-        return corr_func
+        counts = self._grid["counts"]
+        occupied = np.array(np.nonzero(lig_grid), dtype=int).transpose()
+        value = 0.
+        for i, j, k in occupied:
+            l, m, n = (np.array([i, j, k]) + translation) % counts
+            value += rec_sasa_grid[l, m, n] * lig_grid[i, j, k]
+        return value
 
     def _do_forward_fft(self, grid_name):
         assert grid_name in self._grid_func_names, "%s is not an allowed grid name" % grid_name
@@ -775,18 +1063,24 @@ class LigGrid(Grid):
 
     def _cal_corr_funcs(self, grid_names):
         """
-        :param grid_names: list of str
+        :param grid_names: list of str, "SASA" adds the shape complementarity term
         :return:
         """
         assert type(grid_names) == list, "grid_names must be a list"
 
-        grid_name = grid_names[0]
-        forward_fft = self._do_forward_fft(grid_name)
-        corr_func = self._rec_FFTs[grid_name] * forward_fft.conjugate()
-
-        for grid_name in grid_names[1:]:
-            forward_fft = self._do_forward_fft(grid_name)
-            corr_func += self._rec_FFTs[grid_name] * forward_fft.conjugate()
+        corr_func = np.zeros(self._grid["counts"], dtype=complex)
+        for grid_name in grid_names:
+            if grid_name == "SASA":
+                corr_func += self._cal_shape_complementarity_spectrum()
+            elif grid_name == "desolvation":
+                # the real part of the inverse FFT of this spectrum is that of the correlation
+                forward_fft = np.fft.fftn(self._cal_desolvation_grid())
+                corr_func += self._desolvation_weight * self._rec_FFTs[grid_name] * forward_fft.conjugate()
+                del forward_fft
+            else:
+                forward_fft = self._do_forward_fft(grid_name)
+                corr_func += self._rec_FFTs[grid_name] * forward_fft.conjugate()
+                del forward_fft
 
         corr_func = np.fft.ifftn(corr_func)
         corr_func = np.real(corr_func)
@@ -807,10 +1101,13 @@ class LigGrid(Grid):
         print("Ligand positions excluding border crossers", self._free_of_clash.shape)
         self._meaningful_energies = np.zeros(self._grid["counts"], dtype=float)
         if np.any(self._free_of_clash):
-            grid_names = [name for name in self._grid_func_names if name not in ["occupancy", "water", "sasa"]]
+            grid_names = [name for name in self._grid_func_names
+                          if name not in ["occupancy", "water", "sasa", "desolvation"]]
             print(grid_names)
             for name in grid_names:
                 self._meaningful_energies += self._cal_corr_func(name)
+            if self.has_desolvation():
+                self._meaningful_energies += self._cal_desolvation_func()
             # Add in energy for buried surface area E=SA*GAMMA, SA = SC*SLOPE + B
             if "sasa" in self._grid_func_names:
                 bsa_energy = self._cal_delta_sasa_func(corr_func)
@@ -846,12 +1143,15 @@ class LigGrid(Grid):
         print("Ligand positions excluding border crossers", self._free_of_clash.shape)
         self._meaningful_energies = np.zeros(self._grid["counts"], dtype=float)
         if np.any(self._free_of_clash):
-            grid_names = [name for name in self._grid_func_names if name not in ["occupancy", "water", "sasa"]]
+            grid_names = [name for name in self._grid_func_names
+                          if name not in ["occupancy", "water", "sasa", "desolvation"]]
             print(grid_names)
             for name in grid_names:
                 grid_func_energy = self._cal_corr_func(name)
                 self._meaningful_energies += grid_func_energy
                 del grid_func_energy
+            if self.has_desolvation():
+                self._meaningful_energies += self._cal_desolvation_func()
             # Add in energy for buried surface area E=SA*GAMMA, SA = SC*SLOPE + B
             if "sasa" in self._grid_func_names:
                 bsa_energy = self._cal_delta_sasa_func(corr_func)
@@ -885,7 +1185,7 @@ class LigGrid(Grid):
                 grid = np.add(sasar_grid, sasai_grid * 1.j)
                 grids[grid_name] = grid
             else:
-                grid = self._cal_charge_grid(grid_name)
+                grid = np.copy(self._cal_charge_grid(grid_name))
                 grids[grid_name] = grid
         return grids
 
@@ -897,17 +1197,11 @@ class LigGrid(Grid):
         multiprocessing functionality to the grid generation.
         """
 
-        task_divisor = 16
-        with concurrent.futures.ProcessPoolExecutor() as executor:
+        natoms = self._crd.shape[0]
+        task_divisor = choose_task_divisor(natoms, natoms)
+        with concurrent.futures.ProcessPoolExecutor(max_workers=available_cpus()) as executor:
             futures_array = []
-            for i in range(task_divisor):
-                natoms_i = self._crd.shape[0]
-                natoms_slice = natoms_i // task_divisor
-                if i == task_divisor - 1:
-                    natoms_slice += natoms_i % task_divisor
-                natoms_i = natoms_slice
-
-                atomind = i * (self._crd.shape[0] // task_divisor)
+            for atomind, natoms_i in partition(natoms, task_divisor):
                 futures_array.append(executor.submit(
                     process_sasa_grid_function,
                     self._crd,
@@ -964,18 +1258,39 @@ class LigGrid(Grid):
         corners = corners.transpose()
         return corners
 
+    def to_grid_frame(self, crd):
+        """
+        rotate coordinates in the frame of the input receptor into the frame of the receptor grid,
+        the identity unless the receptor grid was built with principal_axes_box
+        :param crd: ndarray (..., natoms, 3)
+        :return: ndarray of the same shape
+        """
+        crd = np.asarray(crd, dtype=float)
+        return np.dot(crd - self._principal_axes_center, self._principal_axes_rotation.T) + self._principal_axes_center
+
     def _place_ligand_crd_in_grid(self, molecular_coord):
         """
-        molecular_coord:    2-array, new ligand coordinate
+        molecular_coord:    2-array, new ligand coordinate, in the frame of the input receptor
         """
         crd = np.array(molecular_coord, dtype=float)
         natoms = self._prmtop["POINTERS"]["NATOM"]
         if (crd.shape[0] != natoms) or (crd.shape[1] != 3):
             raise RuntimeError("Input coord does not have the correct shape.")
-        self._crd = crd
+        self._crd = self.to_grid_frame(crd)
         self._move_ligand_to_lower_corner()
         return None
 
+    def set_conformer(self, molecular_coord):
+        """
+        recompute what depends on the conformer but not on its orientation, the per atom SASA;
+        topology, charges and LJ parameters are kept
+        molecular_coord:    2-array, coordinate of the new conformer
+        """
+        self._place_ligand_crd_in_grid(molecular_coord)
+        self._molecule_sasa = self._get_molecule_sasa(0.14, N_SPHERE_POINTS)
+        self._sasa_cutoffs = self._get_molecule_sasa(0.086, N_SPHERE_POINTS)
+        return None
+
     def cal_grids(self, molecular_coord=None):
         """
         molecular_coord:    2-array, new ligand coordinate
@@ -1103,7 +1418,7 @@ class LigGrid(Grid):
                                                       radii, core_atoms, surface_atoms, core_ions, surface_ions,
                                                       self._lig_core_scaling, self._lig_surface_scaling,
                                                       self._lig_metal_scaling,
-                                                      self._rho)
+                                                      float(np.ravel(self._rho)[0]))
         return sasai_grid, sasar_grid
 
     def get_ligand_grids(self, grid_names, displacement):
@@ -1149,7 +1464,10 @@ class RecGrid(Grid):
                  grid_nc_file,
                  new_calculation=False,
                  spacing=0.25, extra_buffer=3.0,
-                 radii_type="VDW_RADII", exclude_H=True):
+                 radii_type="VDW_RADII", exclude_H=True,
+                 bond_occupancy=False, principal_axes_box=False,
+                 ionic_strength=0., dielectric=1., distance_dielectric=False, screening_cutoff=None,
+                 lj_cap=None, desolvation=False):
         """
         :param prmtop_file_name: str, name of AMBER prmtop file
         :param lj_sigma_scaling_factor: float
@@ -1160,21 +1478,53 @@ class RecGrid(Grid):
         :param new_calculation: bool, if True do the new grid calculation else load data in grid_nc_file.
         :param spacing: float and in angstrom.
         :param extra_buffer: float
+        :param bond_occupancy: bool, if True the occupancy grid also covers bonds between heavy atoms,
+        closing gaps between the atom spheres at coarse spacing; ignored when loading grid_nc_file
+        :param principal_axes_box: bool, not allowed with a bsite_file; if True rotate the receptor into its
+        principal-axis frame and size each box edge independently. The rotation is saved in grid_nc_file,
+        use to_input_frame() to map coordinates back.
+        :param ionic_strength: float, mol/L; if > 0 the electrostatic grid is Debye-Hueckel screened,
+        exp(-kappa r) / (eps r) with kappa from debye_kappa
+        :param dielectric: float, eps of the electrostatic grid, 1 as in the bare Coulomb grid
+        :param distance_dielectric: bool, if True eps = dielectric * r
+        :param screening_cutoff: float or None, angstrom, the electrostatic grid leaves out atoms farther
+        away; None is SCREENING_CUTOFF_DEBYE_LENGTHS Debye lengths with salt and no cutoff without, 0 is no cutoff.
+        These four are saved in grid_nc_file and ignored when loading it.
+        :param lj_cap: float or None, if not None the LJr and LJa grids saturate smoothly at +-lj_cap,
+        g -> lj_cap * tanh(g / lj_cap), so that clashing voxels stay finite in reduced precision.
+        Ligand atoms carry R_LJ_CHARGE of ~10^2, so a cap of 100 only touches voxels worth ~10^4 kcal/mol.
+        Saved in grid_nc_file, 0 for none, and ignored when loading it.
+        :param desolvation: bool, if True also build the "desolvation" grid, whose term LigGrid then adds at
+        DESOLVATION_WEIGHT; grids without it have no desolvation term. Ignored when loading grid_nc_file.
         """
         Grid.__init__(self)
 
         self._load_prmtop(prmtop_file_name, lj_sigma_scaling_factor)
         self._FFTs = {}
+        self._bond_occupancy = bond_occupancy
+        # potential grids stacked for interpolated_energies, built on first use
+        self._grid_nc_file = grid_nc_file
+        self._stacked_grids = None
+        # identity unless principal_axes_box
+        self._principal_axes_rotation = np.eye(3, dtype=float)
+        self._principal_axes_center = np.zeros(3, dtype=float)
+        self._set_electrostatic_screening(ionic_strength, dielectric, distance_dielectric, screening_cutoff)
+        assert lj_cap is None or lj_cap > 0, "lj_cap must be positive"
+        self._lj_cap = 0. if lj_cap is None else float(lj_cap)
+        self._desolvation = desolvation
+        assert not (principal_axes_box and bsite_file is not None), \
+            "principal_axes_box can not be combined with a bsite_file, the binding site box is in the input frame"
 
         if new_calculation:
             self._load_inpcrd(inpcrd_file_name)
-            self._molecule_sasa = self._get_molecule_sasa(0.14, 960)
-            self._sasa_cutoffs = self._get_molecule_sasa(0.086, 960)
+            self._molecule_sasa = self._get_molecule_sasa(0.14, N_SPHERE_POINTS)
+            self._sasa_cutoffs = self._get_molecule_sasa(0.086, N_SPHERE_POINTS)
             self._rho = rho
             self._rec_core_scaling = rec_core_scaling
             self._rec_surface_scaling = rec_surface_scaling
             self._rec_metal_scaling = rec_metal_scaling
             nc_handle = netCDF4.Dataset(grid_nc_file, "w", format="NETCDF4")
+            mark_incomplete(nc_handle)
             self._write_to_nc(nc_handle, "lj_sigma_scaling_factor",
                               np.array([lj_sigma_scaling_factor], dtype=float))
             self._write_to_nc(nc_handle, "rec_core_scaling",
@@ -1185,6 +1535,13 @@ class RecGrid(Grid):
                               np.array([rec_metal_scaling], dtype=float))
             self._write_to_nc(nc_handle, "rho",
                               np.array([rho], dtype=float))
+            self._write_to_nc(nc_handle, "bond_occupancy",
+                              np.array([int(bond_occupancy)], dtype=int))
+            for key in ["ionic_strength", "dielectric", "screening_cutoff"]:
+                self._write_to_nc(nc_handle, key, np.array([self._screening[key]], dtype=float))
+            self._write_to_nc(nc_handle, "distance_dielectric",
+                              np.array([int(self._screening["distance_dielectric"])], dtype=int))
+            self._write_to_nc(nc_handle, "lj_cap", np.array([self._lj_cap], dtype=float))
             self._write_to_nc(nc_handle, "molecule_sasa",
                               np.array(self._molecule_sasa, dtype=float))
 
@@ -1193,16 +1550,27 @@ class RecGrid(Grid):
                 self._cal_grid_parameters_with_bsite(spacing, bsite_file, nc_handle)
                 self._cal_grid_coordinates(nc_handle)
                 self._initialize_convenient_para()
+                # the receptor stays where it is
+                self._displacement = np.zeros(3, dtype=float)
+                self._write_to_nc(nc_handle, "displacement", self._displacement)
             else:
                 print("No binding site specified, box encloses the whole receptor")
-                self._cal_grid_parameters_without_bsite(spacing, extra_buffer, nc_handle)
+                if principal_axes_box:
+                    self._rotate_receptor_to_principal_axes()
+                self._cal_grid_parameters_without_bsite(spacing, extra_buffer, nc_handle,
+                                                        anisotropic=principal_axes_box)
                 self._cal_grid_coordinates(nc_handle)
                 self._initialize_convenient_para()
                 self._move_receptor_to_grid_center()
                 self._write_to_nc(nc_handle, "displacement", self._displacement)
+            self._write_to_nc(nc_handle, "principal_axes_rotation", self._principal_axes_rotation)
+            self._write_to_nc(nc_handle, "principal_axes_center", self._principal_axes_center)
 
-            self._cal_potential_grids(nc_handle, radii_type, exclude_H)
+            nr_pairs = self._crd.shape[0] * np.prod(self._grid["counts"])
+            with perf_stage("receptor_potential", flops=nr_pairs * REC_POTENTIAL_FLOPS_PER_PAIR):
+                self._cal_potential_grids(nc_handle, radii_type, exclude_H)
             self._write_to_nc(nc_handle, "trans_crd", self._crd)
+            seal(nc_handle)
             nc_handle.close()
 
         self._load_precomputed_grids(grid_nc_file, lj_sigma_scaling_factor)
@@ -1233,7 +1601,32 @@ class RecGrid(Grid):
             raise RuntimeError("Number of atoms is wrong in %s %nc_file_name")
         self._crd = nc_handle.variables["trans_crd"][:]
         self._rho = nc_handle.variables["rho"][:]
-        self._displacement = nc_handle.variables["displacement"][:]
+        # binding-site grids were written without their (zero) displacement
+        if "displacement" in nc_handle.variables.keys():
+            self._displacement = np.array(nc_handle.variables["displacement"][:], dtype=float)
+        else:
+            self._displacement = np.zeros(3, dtype=float)
+        # grids written before bond occupancy existed are sphere-only
+        if "bond_occupancy" in nc_handle.variables.keys():
+            self._bond_occupancy = bool(nc_handle.variables["bond_occupancy"][0])
+        else:
+            self._bond_occupancy = False
+        if "principal_axes_rotation" in nc_handle.variables.keys():
+            self._principal_axes_rotation = np.array(nc_handle.variables["principal_axes_rotation"][:], dtype=float)
+            self._principal_axes_center = np.array(nc_handle.variables["principal_axes_center"][:], dtype=float)
+        # grids written before screening existed are bare Coulomb
+        if "ionic_strength" in nc_handle.variables.keys():
+            self._set_electrostatic_screening(float(nc_handle.variables["ionic_strength"][0]),
+                                              float(nc_handle.variables["dielectric"][0]),
+                                              bool(nc_handle.variables["distance_dielectric"][0]),
+                                              float(nc_handle.variables["screening_cutoff"][0]))
+        else:
+            self._set_electrostatic_screening(0., 1., False, 0.)
+        # grids written before capping existed are uncapped
+        if "lj_cap" in nc_handle.variables.keys():
+            self._lj_cap = float(nc_handle.variables["lj_cap"][0])
+        else:
+            self._lj_cap = 0.
 
         # for key in self._grid_func_names:
         for key in self._grid_func_names:
@@ -1244,6 +1637,30 @@ class RecGrid(Grid):
         nc_handle.close()
         return None
 
+    def _set_electrostatic_screening(self, ionic_strength, dielectric, distance_dielectric, screening_cutoff):
+        assert dielectric > 0, "dielectric must be positive"
+        kappa = debye_kappa(ionic_strength)
+        if screening_cutoff is None:
+            screening_cutoff = SCREENING_CUTOFF_DEBYE_LENGTHS / kappa if kappa > 0 else 0.
+        assert screening_cutoff >= 0, "screening_cutoff must be non-negative"
+        self._screening = {"ionic_strength": float(ionic_strength), "kappa": kappa,
+                           "dielectric": float(dielectric), "distance_dielectric": bool(distance_dielectric),
+                           "screening_cutoff": float(screening_cutoff)}
+        return None
+
+    def get_electrostatic_screening(self):
+        """
+        :return: dict, ionic_strength, kappa, dielectric, distance_dielectric and screening_cutoff
+        of the electrostatic grid
+        """
+        return dict(self._screening)
+
+    def get_lj_cap(self):
+        """
+        :return: float, the saturation of the LJr and LJa grids, 0 if they are not capped
+        """
+        return self._lj_cap
+
     def _cal_FFT(self, name):
         if name not in self._grid_func_names:
             raise RuntimeError("%s is not allowed.")
@@ -1252,6 +1669,10 @@ class RecGrid(Grid):
             grid = self._grid[name]
             grid[grid > 0] = 1.
             FFT = np.fft.fftn(grid)
+        elif name == "desolvation":
+            # charge channel + i * volume channel, see LigGrid._cal_desolvation_func
+            grid = self._grid[name]
+            FFT = np.fft.fftn(grid[0] + 1.j * grid[1])
         else:
             FFT = np.fft.fftn(self._grid[name])
         return FFT
@@ -1328,11 +1749,12 @@ class RecGrid(Grid):
             self._write_to_nc(nc_handle, key, self._grid[key])
         return None
 
-    def _cal_grid_parameters_without_bsite(self, spacing, extra_buffer, nc_handle):
+    def _cal_grid_parameters_without_bsite(self, spacing, extra_buffer, nc_handle, anisotropic=False):
         """
         use this when making box encompassing the whole receptor
         spacing:    float, unit in angstrom, the same in x, y, z directions
         extra_buffer: float
+        anisotropic: bool, if True size x, y, z independently, see box_counts()
         """
         assert spacing > 0 and extra_buffer > 0, "spacing and extra_buffer must be positive"
         self._set_grid_key_value("origin", np.zeros([3], dtype=float))
@@ -1344,27 +1766,37 @@ class RecGrid(Grid):
 
         # TODO: Change LJ_radius to include scaling factors instead of shifting ligand position
         lj_radius = np.array(self._prmtop["LJ_SIGMA"] / 2., dtype=float)
-        dx = (self._crd[:, 0] + lj_radius).max() - (self._crd[:, 0] - lj_radius).min()
-        dy = (self._crd[:, 1] + lj_radius).max() - (self._crd[:, 1] - lj_radius).min()
-        dz = (self._crd[:, 2] + lj_radius).max() - (self._crd[:, 2] - lj_radius).min()
-
-        print("Receptor enclosing box [%f, %f, %f]" % (dx, dy, dz))
-        print("extra_buffer: %f" % extra_buffer)
-
-        length = max([dx, dy, dz]) + 2.0 * extra_buffer
-
-        if np.ceil(length / spacing) % 2 != 0:
-            length = length + spacing
-        count = np.ceil(length / spacing) + 1
+        counts = box_counts(self._crd, lj_radius, spacing, extra_buffer, anisotropic=anisotropic)
 
-        self._set_grid_key_value("counts", np.array([count] * 3, dtype=int))
+        self._set_grid_key_value("counts", counts)
         print("counts ", self._grid["counts"])
-        print("Total box size %f" % ((count - 1) * spacing))
+        print("Total box size", (counts - 1) * spacing)
 
         for key in ["origin", "d0", "d1", "d2", "spacing", "counts"]:
             self._write_to_nc(nc_handle, key, self._grid[key])
         return None
 
+    def _rotate_receptor_to_principal_axes(self):
+        """
+        rotate the receptor about its center of mass so that its principal axes, largest spread first,
+        lie along x, y, z
+        """
+        rotation, center = principal_axes(self._crd, self._prmtop["MASS"])
+        self._crd = np.dot(self._crd - center, rotation.T) + center
+        self._principal_axes_rotation = rotation
+        self._principal_axes_center = center
+        print("Receptor rotated into its principal-axis frame", rotation)
+        return None
+
+    def to_input_frame(self, crd):
+        """
+        map coordinates in the grid frame (e.g. docked ligand poses) back to the frame of the input receptor
+        :param crd: 2d array, (natoms, 3)
+        :return: 2d array
+        """
+        crd = np.asarray(crd, dtype=float) - self._displacement - self._principal_axes_center
+        return np.dot(crd, self._principal_axes_rotation) + self._principal_axes_center
+
     def _move_receptor_to_grid_center(self):
         """
         use this when making box encompassing the whole receptor
@@ -1408,6 +1840,8 @@ class RecGrid(Grid):
 
         print('receptor_box_center', receptor_box_center)
         displacement = grid_center - receptor_box_center
+        # whole spacings, also for an even count, so that the native ligand pose is a grid translation
+        displacement = np.round(displacement / spacing) * spacing
 
         print('lower_receptor_corner_grid_aligned: ', lower_receptor_corner_grid_aligned,
               '\nupper_receptor_corner_grid_aligned: ', upper_receptor_corner_grid_aligned,
@@ -1470,6 +1904,8 @@ class RecGrid(Grid):
             return np.array([0], dtype=float)
         elif name == "water":
             return np.array([0], dtype=float)
+        elif name == "desolvation":
+            return desolvation_weights(self._prmtop)
         else:
             raise RuntimeError("%s is unknown" % name)
 
@@ -1480,6 +1916,8 @@ class RecGrid(Grid):
         the "task divisor". Remainders are calculated in the last slice.  This adds
         multiprocessing functionality to the grid generation.
         """
+        # the atomic volumes are taken before the clash scaling below, which scales VDW_RADII in place
+        desolvation_charges = self._get_charges("desolvation")
 
         if radii_type == "LJ_SIGMA":
             clash_radii = self._prmtop["LJ_SIGMA"] / 2
@@ -1507,7 +1945,7 @@ class RecGrid(Grid):
                 clash_radii[i] = clash_radii[i] * 0.8
 
         probe_size = 1.4
-        n_sphere_points = 960
+        n_sphere_points = N_SPHERE_POINTS
 
         atom_names = self._prmtop["PDB_TEMPLATE"]["ATOM_NAME"]
         atom_list = []
@@ -1517,21 +1955,38 @@ class RecGrid(Grid):
                     atom_list.append(i)
             else:
                 atom_list.append(i)
-        bond_list = self._get_bond_list()
+        bonds = self._get_bonds(exclude_H)
         if platform == 'CPU':
-            task_divisor = 16
+            natoms = self._crd.shape[0]
+            counts_x = self._grid["counts"][0]
+            slab_work = natoms * self._grid["counts"][1] * self._grid["counts"][2]
             for name in self._grid_func_names:
+                if name == "desolvation" and not self._desolvation:
+                    continue
                 print("calculating receptor %s grid" % name)
-                with concurrent.futures.ProcessPoolExecutor() as executor:
+                with concurrent.futures.ProcessPoolExecutor(max_workers=available_cpus()) as executor:
                     futures_array = []
-                    if name != "sasa":
-                        for i in range(task_divisor):
+                    if name == "desolvation":
+                        task_divisor = choose_task_divisor(counts_x, slab_work)
+                        for grid_start_x, slab_counts_x in partition(counts_x, task_divisor):
                             counts = np.copy(self._grid["counts"])
-                            counts_x = counts[0] // task_divisor
-                            if i == task_divisor - 1:
-                                counts_x += counts[0] % task_divisor
-                            counts[0] = counts_x
-                            grid_start_x = i * (self._grid["counts"][0] // task_divisor)
+                            counts[0] = slab_counts_x
+                            origin = np.copy(self._origin_crd)
+                            origin[0] = grid_start_x * self._grid["spacing"][0]
+                            futures_array.append(executor.submit(
+                                process_desolvation_grid_function,
+                                self._crd,
+                                origin,
+                                self._grid["spacing"],
+                                counts,
+                                desolvation_charges,
+                            ))
+                        grid = np.concatenate([future.result() for future in futures_array], axis=1)
+                    elif name != "sasa":
+                        task_divisor = choose_task_divisor(counts_x, slab_work)
+                        for grid_start_x, slab_counts_x in partition(counts_x, task_divisor):
+                            counts = np.copy(self._grid["counts"])
+                            counts[0] = slab_counts_x
                             origin = np.copy(self._origin_crd)
                             origin[0] = grid_start_x * self._grid["spacing"][0]
                             futures_array.append(executor.submit(
@@ -1545,7 +2000,7 @@ class RecGrid(Grid):
                                 self._prmtop["LJ_SIGMA"],
                                 self._prmtop["VDW_RADII"],
                                 clash_radii,
-                                bond_list,
+                                bonds,
                                 atom_list,
                                 self._molecule_sasa,
                                 self._sasa_cutoffs,
@@ -1553,6 +2008,11 @@ class RecGrid(Grid):
                                 self._rec_core_scaling,
                                 self._rec_surface_scaling,
                                 self._rec_metal_scaling,
+                                self._screening["kappa"],
+                                self._screening["dielectric"],
+                                self._screening["distance_dielectric"],
+                                self._screening["screening_cutoff"],
+                                self._lj_cap,
                             ))
                         grid_array = []
                         for i in range(task_divisor):
@@ -1560,13 +2020,8 @@ class RecGrid(Grid):
                             grid_array.append(partial_grid)
                         grid = np.concatenate(tuple(grid_array), axis=0)
                     else:
-                        for i in range(task_divisor):
-                            natoms_i = self._crd.shape[0]
-                            natoms_slice = natoms_i // task_divisor
-                            if i == task_divisor - 1:
-                                natoms_slice += natoms_i % task_divisor
-                            natoms_i = natoms_slice
-                            atomind = i * (self._crd.shape[0] // task_divisor)
+                        task_divisor = choose_task_divisor(natoms, natoms)
+                        for atomind, natoms_i in partition(natoms, task_divisor):
                             futures_array.append(executor.submit(
                                 process_sasa_grid_function,
                                 self._crd,
@@ -1611,80 +2066,128 @@ class RecGrid(Grid):
             lj_diameter = self._prmtop["LJ_SIGMA"][atom_ind]
 
             if R > lj_diameter:
-                values["electrostatic"] += 332.05221729 * self._prmtop["CHARGE_E_UNIT"][atom_ind] / R
+                values["electrostatic"] += 332.05221729 * self._prmtop["CHARGE_E_UNIT"][atom_ind] * \
+                    screened_coulomb(R, self._screening["kappa"], self._screening["dielectric"],
+                                     self._screening["distance_dielectric"], self._screening["screening_cutoff"])
                 values["LJr"] += self._prmtop["R_LJ_CHARGE"][atom_ind] / R ** 12
                 values["LJa"] += -2. * self._prmtop["A_LJ_CHARGE"][atom_ind] / R ** 6
+        for name in ["LJr", "LJa"]:
+            values[name] = self._cap_lj(values[name])
 
         return values
 
-    def _trilinear_interpolation(self, grid_name, coordinate):
-        """
-        grid_name is a str one of "electrostatic", "LJr" and "LJa"
-        coordinate is an array of three numbers
-        trilinear interpolation
-        https://en.wikipedia.org/wiki/Trilinear_interpolation
-        """
-        raise RuntimeError("Do not use, not tested yet")
-        assert len(coordinate) == 3, "coordinate must have len 3"
-
-        eight_corners, nearest_ind, furthest_ind = self._containing_cube(
-            coordinate)  # throw exception if coordinate is outside
-        lower_corner = eight_corners[0]
-
-        (i0, j0, k0) = lower_corner
-        (i1, j1, k1) = (i0 + 1, j0 + 1, k0 + 1)
-
-        xd = (coordinate[0] - self._grid["x"][i0, j0, k0]) / (self._grid["x"][i1, j1, k1] - self._grid["x"][i0, j0, k0])
-        yd = (coordinate[1] - self._grid["y"][i0, j0, k0]) / (self._grid["y"][i1, j1, k1] - self._grid["y"][i0, j0, k0])
-        zd = (coordinate[2] - self._grid["z"][i0, j0, k0]) / (self._grid["z"][i1, j1, k1] - self._grid["z"][i0, j0, k0])
-
-        c00 = self._grid[grid_name][i0, j0, k0] * (1. - xd) + self._grid[grid_name][i1, j0, k0] * xd
-        c10 = self._grid[grid_name][i0, j1, k0] * (1. - xd) + self._grid[grid_name][i1, j1, k0] * xd
-        c01 = self._grid[grid_name][i0, j0, k1] * (1. - xd) + self._grid[grid_name][i1, j0, k1] * xd
-        c11 = self._grid[grid_name][i0, j1, k1] * (1. - xd) + self._grid[grid_name][i1, j1, k1] * xd
-
-        c0 = c00 * (1. - yd) + c10 * yd
-        c1 = c01 * (1. - yd) + c11 * yd
-
-        c = c0 * (1. - zd) + c1 * zd
-        return c
+    def _cap_lj(self, potential):
+        """
+        the saturation of the LJr and LJa grids, lj_cap * tanh(g / lj_cap), see util.c_cal_potential_grid_pp
+        :param potential: float or ndarray, summed LJr or LJa potential
+        :return: same type as potential
+        """
+        if self._lj_cap > 0:
+            return self._lj_cap * np.tanh(potential / self._lj_cap)
+        return potential
+
+    def _interpolation_inputs(self, ligand_charges):
+        """
+        :return: (grids, charges), 4d array of the potential grids and 2d array of the matching ligand charges
+        """
+        names = [name for name in INTERPOLATED_GRID_CHARGES if name in self._grid_func_names]
+        if self._stacked_grids is None:
+            # loaded grids are dropped after their FFT, read them back
+            nc_handle = None
+            grids = []
+            for name in names:
+                grid = self._grid.get(name)
+                if grid is None:
+                    if nc_handle is None:
+                        nc_handle = netCDF4.Dataset(self._grid_nc_file, "r")
+                    grid = nc_handle.variables[name][:]
+                grids.append(np.asarray(grid, dtype=np.float64))
+            if nc_handle is not None:
+                nc_handle.close()
+            self._stacked_grids = np.ascontiguousarray(np.stack(grids))
+        charges = np.array([ligand_charges[INTERPOLATED_GRID_CHARGES[name]] for name in names], dtype=np.float64)
+        return self._stacked_grids, charges
 
     def direct_energy(self, ligand_coordinate, ligand_charges):
         """
-        :param ligand_coordinate: ndarray of shape (natoms, 3)
-        :param ligand_charges: ndarray of shape (3,)
-        :return: dic
+        the direct sum the potential grids are sampled from, with the electrostatic screening and LJ cap of
+        the grid; receptor atoms closer than their LJ_SIGMA are left out as in _exact_values
+        :param ligand_coordinate: ndarray of shape (natoms, 3), in the grid frame
+        :param ligand_charges: dict with "CHARGE_E_UNIT", "R_LJ_CHARGE" and "A_LJ_CHARGE", e.g. the ligand prmtop
+        :return: float
         """
+        ligand_coordinate = np.asarray(ligand_coordinate, dtype=float)
         assert len(ligand_coordinate) == len(
             ligand_charges["CHARGE_E_UNIT"]), "coord and charges must have the same len"
+        dif = ligand_coordinate[:, np.newaxis, :] - self._crd[np.newaxis, :, :]
+        R = np.sqrt((dif * dif).sum(axis=2))
+        far = R > np.asarray(self._prmtop["LJ_SIGMA"])[np.newaxis, :]
+        R = np.where(far, R, 1.)
+        inv_R = np.where(far, 1. / R, 0.)
+        inv_R6 = inv_R ** 6
+        coulomb = np.where(far, screened_coulomb(R, self._screening["kappa"], self._screening["dielectric"],
+                                                 self._screening["distance_dielectric"],
+                                                 self._screening["screening_cutoff"]), 0.)
+
+        potentials = {"electrostatic": np.dot(coulomb, self._get_charges("electrostatic")),
+                      "LJr": self._cap_lj(np.dot(inv_R6 * inv_R6, self._get_charges("LJr"))),
+                      "LJa": self._cap_lj(np.dot(inv_R6, self._get_charges("LJa")))}
         energy = 0.
-        for atom_ind in range(len(ligand_coordinate)):
-            potentials = self._exact_values(ligand_coordinate[atom_ind])
-            energy += potentials["electrostatic"] * ligand_charges["CHARGE_E_UNIT"][atom_ind]
-            energy += potentials["LJr"] * ligand_charges["R_LJ_CHARGE"][atom_ind]
-            energy += potentials["LJa"] * ligand_charges["A_LJ_CHARGE"][atom_ind]
+        for name, charge_key in INTERPOLATED_GRID_CHARGES.items():
+            energy += np.dot(potentials[name], np.asarray(ligand_charges[charge_key], dtype=float))
         return energy
 
-    def interpolated_energy(self, ligand_coordinate, ligand_charges):
+    def interpolated_energies(self, ligand_coordinates, ligand_charges, order=3, gradient=False):
+        """
+        energies of many ligand poses interpolated on the electrostatic, LJr and LJa grids
+        the poses are split over threads, util.c_interpolate_energies releases the GIL
+        :param ligand_coordinates: ndarray of shape (nposes, natoms, 3) or (natoms, 3), in the grid frame
+        :param ligand_charges: dict with "CHARGE_E_UNIT", "R_LJ_CHARGE" and "A_LJ_CHARGE", e.g. the ligand prmtop
+        :param order: int, 1 for trilinear, 3 for tricubic
+        :param gradient: bool, if True also return dE / dcrd
+        :return: energies, 1d array of float, inf for the poses that leave the grid,
+        and if gradient, the gradients, of the shape of ligand_coordinates
+        """
+        crd = np.asarray(ligand_coordinates, dtype=np.float64)
+        single_pose = crd.ndim == 2
+        crd = np.ascontiguousarray(crd.reshape((-1,) + crd.shape[-2:]))
+        assert crd.shape[1] == len(ligand_charges["CHARGE_E_UNIT"]), "coord and charges must have the same len"
+        grids, charges = self._interpolation_inputs(ligand_charges)
+
+        nposes = crd.shape[0]
+        energies = np.empty(nposes, dtype=np.float64)
+        gradients = np.zeros(crd.shape, dtype=np.float64) if gradient else None
+        spacing = np.ascontiguousarray(self._grid["spacing"], dtype=np.float64)
+        origin_crd = np.ascontiguousarray(self._origin_crd, dtype=np.float64)
+
+        work_per_pose = crd.shape[1] * grids.shape[0] * (order + 1) ** 3
+        task_divisor = choose_task_divisor(nposes, work_per_pose)
+        with concurrent.futures.ThreadPoolExecutor(max_workers=available_cpus()) as executor:
+            futures_array = []
+            for start, size in partition(nposes, task_divisor):
+                stop = start + size
+                futures_array.append(executor.submit(
+                    c_interpolate_energies, grids, origin_crd, spacing, crd[start:stop], charges, order,
+                    energies[start:stop], None if gradients is None else gradients[start:stop]))
+            for future in futures_array:
+                future.result()
+
+        if single_pose:
+            energies = energies[0]
+            gradients = None if gradients is None else gradients[0]
+        if gradient:
+            return energies, gradients
+        return energies
+
+    def interpolated_energy(self, ligand_coordinate, ligand_charges, order=1):
         """
         ligand_coordinate:  array of shape (natoms, 3)
-        ligand_charges: array of shape (3)
-        assume that ligand_coordinate is inside grid
+        ligand_charges: dict with "CHARGE_E_UNIT", "R_LJ_CHARGE" and "A_LJ_CHARGE"
+        order: 1 for trilinear, 3 for tricubic
         """
-        raise RuntimeError("Do not use, not tested yet")
-        assert len(ligand_coordinate) == len(
-            ligand_charges["CHARGE_E_UNIT"]), "coord and charges must have the same len"
-        grid_names = [name for name in self._grid_func_names if name[:4] != "SASA"]
-        energy = 0.
-        potentials = {}
-        for atom_ind in range(len(ligand_coordinate)):
-            for name in grid_names:
-                potentials[name] = self._trilinear_interpolation(name, ligand_coordinate[atom_ind])
-
-            energy += potentials["electrostatic"] * ligand_charges["CHARGE_E_UNIT"][atom_ind]
-            energy += potentials["LJr"] * ligand_charges["R_LJ_CHARGE"][atom_ind]
-            energy += potentials["LJa"] * ligand_charges["A_LJ_CHARGE"][atom_ind]
-
+        energy = self.interpolated_energies(ligand_coordinate, ligand_charges, order=order)
+        if energy == np.inf:
+            raise RuntimeError("atom is outside grid")
         return energy
 
     def get_FFTs(self):
@@ -1696,6 +2199,12 @@ class RecGrid(Grid):
     def get_initial_displacement(self):
         return self._displacement
 
+    def get_principal_axes(self):
+        """
+        :return: (3x3 rotation, 3-array center), the identity and zeros unless principal_axes_box
+        """
+        return self._principal_axes_rotation, self._principal_axes_center
+
     def write_box(self, file_name):
         IO.write_box(self, file_name)
         return None
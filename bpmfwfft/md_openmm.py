@@ -5,6 +5,7 @@ run MD, replica exchange (parallel tempering) and calcaulte energy using OpenMM
 from sys import stdout
 
 import copy
+import time
 
 import numpy as np
 import netCDF4
@@ -15,8 +16,12 @@ import openmm.unit
 
 try:
     from bpmfwfft.rotation import random_rotation
+    from bpmfwfft.nc_integrity import mark_incomplete, seal
+    from bpmfwfft.replica_exchange import TemperatureExchange, statistical_inefficiency
 except:
     from rotation import random_rotation
+    from nc_integrity import mark_incomplete, seal
+    from replica_exchange import TemperatureExchange, statistical_inefficiency
 
 openmm_solvent_models = {  "OpenMM_Gas":None,
                             "OpenMM_GBn":openmm.app.GBn,
@@ -27,6 +32,7 @@ openmm_solvent_models = {  "OpenMM_Gas":None,
 
 
 KB = 0.001987204134799235  # kcal/mol/K
+VELOCITY_UNIT = openmm.unit.nanometer / openmm.unit.picosecond
 
 
 class OpenMM_MD(object):
@@ -48,6 +54,7 @@ class OpenMM_MD(object):
 
     def _initialize_nc(self, nc_file_name, niterations):
         nc_handle = netCDF4.Dataset(nc_file_name, mode="w", format="NETCDF4")
+        mark_incomplete(nc_handle)
         natoms = len( list( self._prmtop.topology.atoms() ) )
 
         nc_handle.createDimension("three", 3)
@@ -74,69 +81,83 @@ class OpenMM_MD(object):
             conf = random_rotation(conf)
 
             nc_handle.variables["positions"][iteration,:,:] = conf
+        seal(nc_handle)
         nc_handle.close()
 
         return None
 
 
 class OpenMM_TREMD(object):
-    def __init__(self, prmtop, inpcrd, phase, temperatures):
+    def __init__(self, prmtop, inpcrd, phase, temperatures, exchange="neighbor", nr_swap_attempts=None):
         """
         :param prmtop: str, name of AMBER prmtop file
         :param inpcrd: str, name of AMBER coordinate file
         :param phase: str
-        :param temperatures: list or ndarray of float
+        :param temperatures: list or ndarray of float, the initial ladder, increasing
+        :param exchange: str, "neighbor" or "all_pairs", see replica_exchange.TemperatureExchange
+        :param nr_swap_attempts: None or int, swaps per iteration for "all_pairs"
         """
-        self._temperatures = list(temperatures)
+        self._exchanger = TemperatureExchange(temperatures, scheme=exchange, nr_swap_attempts=nr_swap_attempts)
         self._simulations  = self._create_simulations(prmtop, inpcrd, phase, temperatures)
-        self._acepted_exchange = np.zeros([len(self._temperatures)-1], dtype=float)
-        self._nr_attempts = np.zeros([len(self._temperatures)-1], dtype=float)
-        self._start = 0
 
-    def run(self, nc_file_name, steps_per_iteration, niterations, rotations_per_iteration):
+    def run(self, nc_file_name, steps_per_iteration, niterations, rotations_per_iteration,
+            nequilibration=0, adapt_ladder=False):
         """
+        :param nequilibration: int, iterations run before those stored, with the same exchanges
+        :param adapt_ladder: bool, if True the ladder is adapted during the equilibration iterations
+        and kept fixed afterwards
         """
+        for iteration in range(nequilibration):
+            self._md_evolve(steps_per_iteration)
+            energies, _, velocities = self._get_states()
+            if adapt_ladder:
+                self._set_temperatures(self._exchanger.adapt_ladder(energies), velocities)
+            self._exchange(energies, velocities)
+        if nequilibration > 0:
+            print("equilibrated temperatures ", self._exchanger.get_temperatures())
+            print("equilibration acceptance ", self._exchanger.get_neighbor_acceptance())
+            self._exchanger.reset_statistics()
+
         nc_handle = self._initialize_nc(nc_file_name, niterations, rotations_per_iteration)
 
         nrotations = 0
+        start_cpu_time = time.process_time()
         for iteration in range(niterations):
 
             self._md_evolve(steps_per_iteration)
 
-            energies = self._get_potential_energies()
-            nc_handle.variables["energies"][iteration, :] = np.array(energies, dtype=float)
+            energies, positions, velocities = self._get_states()
+            state_replicas = self._exchanger.get_state_replicas()
+            nc_handle.variables["energies"][iteration, :] = energies[state_replicas]
+            nc_handle.variables["positions"][iteration, :, :, :] = positions[state_replicas]
+            nc_handle.variables["replica_states"][iteration, :] = self._exchanger.get_replica_states()
 
-            positions = self._get_positions()
-            for state, p in enumerate(positions):
-                crd = np.array(p.value_in_unit(openmm.unit.angstrom), dtype=float)
-                nc_handle.variables["positions"][iteration, state, :, :] = crd
-
-            crd = np.array(positions[0].value_in_unit(openmm.unit.angstrom), dtype=float)
+            crd = positions[state_replicas[0]]
             for rotation in range(rotations_per_iteration):
                 rotated_crd = random_rotation(crd)
                 nc_handle.variables["rotated_positions"][nrotations, :, :] = rotated_crd
                 nrotations += 1
 
-            self._exchange(self._start)
-            self._switch_start()
+            self._exchange(energies, velocities)
 
             print("iteration ", iteration)
-            print("energies ", energies)
-
-        acceptance_rate = self._acepted_exchange / self._nr_attempts
-        nc_handle.variables["acceptance_rate"][:] = acceptance_rate
+            print("energies ", energies[state_replicas])
+        cpu_hours = (time.process_time() - start_cpu_time) / 3600.
+
+        nc_handle.variables["acceptance_rate"][:] = self._exchanger.get_neighbor_acceptance()
+        nc_handle.variables["acceptance_matrix"][:, :] = self._exchanger.get_acceptance_matrix()
+
+        # decorrelation of the conformations at the lowest temperature, from their potential energies
+        g = statistical_inefficiency(nc_handle.variables["energies"][:, 0])
+        nc_handle.variables["statistical_inefficiency"][:] = g
+        nc_handle.variables["uncorrelated_samples_per_cpu_hour"][:] = niterations / g / max(cpu_hours, 1e-12)
+        print("acceptance rate ", self._exchanger.get_neighbor_acceptance())
+        print("statistical inefficiency at %0.2f K: %0.2f iterations" % (self._exchanger.get_temperatures()[0], g))
+        print("uncorrelated samples per CPU hour: %0.2f" % (niterations / g / max(cpu_hours, 1e-12)))
+        seal(nc_handle)
         nc_handle.close()
         return None
 
-    def _switch_start(self):
-        if self._start == 0:
-            self._start = 1
-        elif self._start == 1:
-            self._start = 0
-        else:
-            raise RuntimeError("self._start is %d"%self._start)
-        return
-
     def _create_simulation(self, prmtop, inpcrd, phase, temperature):
         prmtop = openmm.app.AmberPrmtopFile(prmtop)
         inpcrd = openmm.app.AmberInpcrdFile(inpcrd)
@@ -162,97 +183,71 @@ class OpenMM_TREMD(object):
             sim.step(steps)
         return None
 
-    def _get_potential_energies(self):
-        energies = []
-        for sim in self._simulations:
-            state = sim.context.getState(getEnergy=True)
-            energy = copy.deepcopy(state.getPotentialEnergy())
-            e = energy.value_in_unit(openmm.unit.kilocalorie_per_mole)
-            energies.append(e)
-        return energies
-
-    def _get_positions(self):
-        positions = []
-        for sim in self._simulations:
-            state = sim.context.getState(getPositions=True)
-            pos = copy.deepcopy(state.getPositions())
-            positions.append(pos)
-        return positions
-
-    def _get_velocities(self):
-        velocities = []
+    def _get_states(self):
+        """
+        one getState per replica
+        :return: (energies, positions, velocities), arrays indexed by replica, in kcal/mol, angstrom
+        and nm/ps
+        """
+        energies, positions, velocities = [], [], []
         for sim in self._simulations:
-            state = sim.context.getState(getVelocities=True)
-            vel = copy.deepcopy(state.getVelocities())
-            velocities.append(vel)
-        return velocities
-
-    def _metropolis_prob(self, T1, E1, T2, E2):
-        assert T1 > 0 and T2 > 0, "T1 and T2 must be possitive"
-        deltaE = ((1./T1 - 1./T2) / KB) * (E2 - E1)
-        return np.exp(-deltaE)
-
-    def _exchange(self, start):
-        assert start in [0, 1], "start must be either 0 or 1"
-        simulation_pairs = zip( self._simulations[start : -1 : 2], self._simulations[start+1 : : 2] )
-
-        energies = self._get_potential_energies()
-        energy_pairs = zip( energies[start : -1 : 2], energies[start+1 : : 2] )
-
-        temperature_pairs = zip( self._temperatures[start : -1 : 2], self._temperatures[start+1 : : 2] )
+            state = sim.context.getState(getEnergy=True, getPositions=True, getVelocities=True)
+            energies.append(state.getPotentialEnergy().value_in_unit(openmm.unit.kilocalorie_per_mole))
+            positions.append(state.getPositions(asNumpy=True).value_in_unit(openmm.unit.angstrom))
+            velocities.append(state.getVelocities(asNumpy=True).value_in_unit(VELOCITY_UNIT))
+        return np.array(energies, dtype=float), np.array(positions, dtype=float), np.array(velocities, dtype=float)
 
-        positions = self._get_positions()
-        position_pairs = zip( positions[start : -1 : 2], positions[start+1 : : 2] )
-
-        velocities = self._get_velocities()
-        velocity_pairs = zip( velocities[start : -1 : 2], velocities[start+1 : : 2] )
-
-        pair_indices = range(start, len(self._temperatures)-1, 2) 
-
-        for i in range(len(simulation_pairs)):
-            E1 = energy_pairs[i][0]
-            E2 = energy_pairs[i][1]
-            T1 = temperature_pairs[i][0]
-            T2 = temperature_pairs[i][1]
-
-            x_prob = self._metropolis_prob(T1, E1, T2, E2)
-            if x_prob >= 1. or x_prob > np.random.random():
-                simulation_pairs[i][0].context.setPositions( position_pairs[i][1] )
-                simulation_pairs[i][1].context.setPositions( position_pairs[i][0] )
-
-                vel_unit = openmm.unit.nanometer/openmm.unit.picosecond
-
-                v1 = np.sqrt(T1 / T2 ) * np.array( velocity_pairs[i][1].value_in_unit(vel_unit) )
-                v2 = np.sqrt(T2 / T1 ) * np.array( velocity_pairs[i][0].value_in_unit(vel_unit) )
-
-                simulation_pairs[i][0].context.setVelocities( openmm.unit.quantity.Quantity(v1, unit=vel_unit) )
-                simulation_pairs[i][1].context.setVelocities( openmm.unit.quantity.Quantity(v2, unit=vel_unit) )
-
-                self._acepted_exchange[pair_indices[i]] += 1. 
+    def _set_temperatures(self, new_temperatures, velocities):
+        """
+        set the integrator temperatures of the replicas whose temperature changed and rescale their velocities
+        :param new_temperatures: 1d array, indexed by replica
+        :param velocities: 3d array, indexed by replica, nm/ps
+        """
+        for replica, sim in enumerate(self._simulations):
+            old_temperature = sim.integrator.getTemperature().value_in_unit(openmm.unit.kelvin)
+            if new_temperatures[replica] == old_temperature:
+                continue
+            sim.integrator.setTemperature(new_temperatures[replica] * openmm.unit.kelvin)
+            scaled = np.sqrt(new_temperatures[replica] / old_temperature) * velocities[replica]
+            velocities[replica] = scaled
+            sim.context.setVelocities(openmm.unit.Quantity(scaled, unit=VELOCITY_UNIT))
+        return None
 
-            self._nr_attempts[pair_indices[i]] += 1.
-        return 
+    def _exchange(self, energies, velocities):
+        """
+        swap temperatures, not coordinates
+        """
+        self._exchanger.exchange(energies)
+        self._set_temperatures(self._exchanger.get_replica_temperatures(), velocities)
+        return None
 
     def _initialize_nc(self, nc_file_name, niterations, rotations_per_iteration):
         """
         """
         nc_handle = netCDF4.Dataset(nc_file_name, mode="w", format="NETCDF4")
+        mark_incomplete(nc_handle)
         natoms = len( list( self._simulations[0].topology.atoms() ) )
 
         nc_handle.createDimension("three", 3)
+        nc_handle.createDimension("one", 1)
         nc_handle.createDimension("natoms", natoms)
         nc_handle.createDimension("nstates", len(self._simulations) )
         nc_handle.createDimension("niterations", niterations)
         nc_handle.createDimension("nrotations", niterations * rotations_per_iteration)
         nc_handle.createDimension("npairs", len(self._simulations) - 1)
 
+        # energies and positions are indexed by state, i.e. by temperature
         nc_handle.createVariable("energies", "f8", tuple(["niterations", "nstates"]) )
         nc_handle.createVariable("positions", "f4", tuple(["niterations", "nstates", "natoms", "three"]))
+        nc_handle.createVariable("replica_states", "i8", tuple(["niterations", "nstates"]))
         nc_handle.createVariable("rotated_positions", "f4", tuple(["nrotations", "natoms", "three"]))
         nc_handle.createVariable("acceptance_rate", "f8", tuple(["npairs"]))
+        nc_handle.createVariable("acceptance_matrix", "f8", tuple(["nstates", "nstates"]))
         nc_handle.createVariable("temperatures", "f8", tuple(["nstates"]))
+        nc_handle.createVariable("statistical_inefficiency", "f8", tuple(["one"]))
+        nc_handle.createVariable("uncorrelated_samples_per_cpu_hour", "f8", tuple(["one"]))
 
-        nc_handle.variables["temperatures"][:] = np.array(self._temperatures)
+        nc_handle.variables["temperatures"][:] = self._exchanger.get_temperatures()
         return nc_handle
 
 
@@ -0,0 +1,222 @@
+"""
+Buffer reuse and memory profiling for the per-rotation sampling loop.
+
+BufferPool keeps one array per key, so grids and FFT buffers of the same shape are allocated
+once per run instead of once per rotation. MemoryProfiler records the tracemalloc peak and the
+process RSS of named stages.
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import contextlib
+import tracemalloc
+
+import numpy as np
+
+try:
+    import pyfftw
+except ImportError:
+    pyfftw = None
+
+
+def current_rss():
+    """
+    :return: int, resident set size of this process in bytes
+    """
+    try:
+        with open("/proc/self/statm", "r") as handle:
+            resident_pages = int(handle.read().split()[1])
+        return resident_pages * os.sysconf("SC_PAGE_SIZE")
+    except (IOError, OSError, ValueError):
+        import resource
+        # ru_maxrss is the peak, in kB on Linux
+        return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024
+
+
+class BufferPool(object):
+    """
+    arrays kept across rotations, one per key
+    an array returned for a key is overwritten by the next request for the same key
+    """
+
+    def __init__(self):
+        self._buffers = {}
+        self._fft_plans = {}
+
+    def empty(self, key, shape, dtype=float):
+        """
+        :param key: str
+        :param shape: tuple of int
+        :param dtype: numpy dtype
+        :return: ndarray, uninitialized
+        """
+        shape = tuple(int(dim) for dim in shape)
+        dtype = np.dtype(dtype)
+        buffer = self._buffers.get(key)
+        if buffer is None or buffer.shape != shape or buffer.dtype != dtype:
+            buffer = np.empty(shape, dtype=dtype)
+            self._buffers[key] = buffer
+        return buffer
+
+    def zeros(self, key, shape, dtype=float):
+        buffer = self.empty(key, shape, dtype)
+        buffer.fill(0)
+        return buffer
+
+    def _fft_plan(self, key, shape):
+        """
+        two complex buffers per key; the forward transform writes the second,
+        the backward transform writes back into the first
+        """
+        shape = tuple(int(dim) for dim in shape)
+        plan = self._fft_plans.get(key)
+        if plan is not None and plan["shape"] == shape:
+            return plan
+
+        if pyfftw is not None:
+            data = pyfftw.empty_aligned(shape, dtype="complex128")
+            spectrum = pyfftw.empty_aligned(shape, dtype="complex128")
+            axes = tuple(range(len(shape)))
+            forward = pyfftw.FFTW(data, spectrum, axes=axes, direction="FFTW_FORWARD", flags=("FFTW_ESTIMATE",))
+            backward = pyfftw.FFTW(spectrum, data, axes=axes, direction="FFTW_BACKWARD", flags=("FFTW_ESTIMATE",))
+        else:
+            data = np.empty(shape, dtype=complex)
+            spectrum = np.empty(shape, dtype=complex)
+            forward = backward = None
+        plan = {"shape": shape, "data": data, "spectrum": spectrum, "forward": forward, "backward": backward}
+        self._fft_plans[key] = plan
+        return plan
+
+    def fftn(self, key, array):
+        """
+        :param key: str
+        :param array: 3d ndarray, real or complex
+        :return: complex ndarray owned by the pool, forward FFT of array
+        """
+        plan = self._fft_plan(key, array.shape)
+        if plan["forward"] is not None:
+            plan["data"][...] = array
+            plan["forward"]()
+        else:
+            _numpy_fft(np.fft.fftn, array, plan["spectrum"])
+        return plan["spectrum"]
+
+    def ifftn(self, key, spectrum):
+        """
+        :param key: str
+        :param spectrum: complex ndarray, usually the array returned by fftn(key, ...)
+        :return: complex ndarray owned by the pool, normalized inverse FFT of spectrum
+        """
+        plan = self._fft_plan(key, spectrum.shape)
+        if spectrum is not plan["spectrum"]:
+            plan["spectrum"][...] = spectrum
+        if plan["backward"] is not None:
+            plan["backward"]()
+        else:
+            _numpy_fft(np.fft.ifftn, plan["spectrum"], plan["data"])
+        return plan["data"]
+
+    def nbytes(self):
+        """
+        :return: int, bytes held by the pool
+        """
+        total = sum(buffer.nbytes for buffer in self._buffers.values())
+        total += sum(plan["data"].nbytes + plan["spectrum"].nbytes for plan in self._fft_plans.values())
+        return total
+
+
+def _numpy_fft(function, array, out):
+    # numpy >= 2.0 writes straight into out
+    try:
+        function(array, out=out)
+    except TypeError:
+        out[...] = function(array)
+    return out
+
+
+class MemoryProfiler(object):
+    """
+    per stage: number of calls, wall time, tracemalloc peak above the stage's starting point,
+    net bytes left allocated when the stage ends and RSS after the stage
+    stages can be nested
+    """
+
+    def __init__(self, enabled=False):
+        self._enabled = enabled
+        self._stack = []
+        self._stages = {}
+        if enabled and not tracemalloc.is_tracing():
+            tracemalloc.start()
+
+    def is_enabled(self):
+        return self._enabled
+
+    def _fold_peak(self):
+        """
+        hand the tracemalloc peak to every open stage, then restart peak tracking
+        """
+        current, peak = tracemalloc.get_traced_memory()
+        for frame in self._stack:
+            frame["peak"] = max(frame["peak"], peak)
+        if hasattr(tracemalloc, "reset_peak"):
+            tracemalloc.reset_peak()
+        return current
+
+    @contextlib.contextmanager
+    def stage(self, name):
+        if not self._enabled:
+            yield
+            return
+
+        current = self._fold_peak()
+        frame = {"start": current, "peak": current, "time": time.time()}
+        self._stack.append(frame)
+        try:
+            yield
+        finally:
+            current = self._fold_peak()
+            self._stack.pop()
+            record = self._stages.setdefault(name, {"calls": 0, "seconds": 0., "peak_bytes": [],
+                                                    "net_bytes": [], "rss_bytes": []})
+            record["calls"] += 1
+            record["seconds"] += time.time() - frame["time"]
+            record["peak_bytes"].append(int(frame["peak"] - frame["start"]))
+            record["net_bytes"].append(int(current - frame["start"]))
+            record["rss_bytes"].append(int(current_rss()))
+
+    def get_stages(self):
+        return self._stages
+
+    def report(self):
+        """
+        :return: dict, summary per stage
+        """
+        report = {}
+        for name, record in self._stages.items():
+            report[name] = {"calls": record["calls"],
+                            "seconds": record["seconds"],
+                            "max_peak_bytes": max(record["peak_bytes"]),
+                            "mean_peak_bytes": float(np.mean(record["peak_bytes"])),
+                            "total_net_bytes": int(np.sum(record["net_bytes"])),
+                            "max_rss_bytes": max(record["rss_bytes"]),
+                            "peak_bytes": record["peak_bytes"],
+                            "net_bytes": record["net_bytes"],
+                            "rss_bytes": record["rss_bytes"]}
+        return report
+
+    def write_json(self, file_name):
+        with open(file_name, "w") as handle:
+            json.dump(self.report(), handle, indent=2)
+        return None
+
+    def print_summary(self):
+        print("%-20s %6s %10s %14s %14s %12s" % ("stage", "calls", "seconds", "max peak (MB)",
+                                                 "net (MB)", "max RSS (MB)"))
+        for name, summary in self.report().items():
+            print("%-20s %6d %10.3f %14.2f %14.2f %12.1f" % (name, summary["calls"], summary["seconds"],
+                                                             summary["max_peak_bytes"] / 2.**20,
+                                                             summary["total_net_bytes"] / 2.**20,
+                                                             summary["max_rss_bytes"] / 2.**20))
+        return None
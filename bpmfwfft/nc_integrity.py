@@ -0,0 +1,168 @@
+"""
+Completion marks and checksums of the netCDF files the pipeline writes.
+
+A writer calls mark_incomplete() when it creates or reopens a file and seal() just before closing it.
+seal() stores, for every variable, its shape and a checksum of its data, read in chunks along the
+first axis, and sets the global completion attribute. verify() then tells a finished file from a
+half-written one by reading the header only; with deep=True it also recomputes the checksums.
+Files written before these marks existed carry no completion attribute and are checked by variable
+names and dimension lengths only.
+"""
+from __future__ import print_function
+
+import os
+import hashlib
+
+import numpy as np
+import netCDF4
+
+try:
+    import xxhash
+except ImportError:
+    xxhash = None
+
+COMPLETE_ATTR = "bpmfwfft_complete"
+ALGORITHM_ATTR = "bpmfwfft_checksum_algorithm"
+NR_VARIABLES_ATTR = "bpmfwfft_nr_variables"
+CHECKSUM_ATTR = "bpmfwfft_checksum"
+SHAPE_ATTR = "bpmfwfft_shape"
+# bytes read at a time when checksumming a variable
+CHUNK_BYTES = 1 << 26
+
+
+def _new_hasher(algorithm):
+    if algorithm == "xxh3_64":
+        if xxhash is None:
+            raise RuntimeError("the file was sealed with xxhash, which is not installed")
+        return xxhash.xxh3_64()
+    if algorithm == "blake2b":
+        return hashlib.blake2b(digest_size=16)
+    raise RuntimeError("unknown checksum algorithm %s" % algorithm)
+
+
+def default_algorithm():
+    return "xxh3_64" if xxhash is not None else "blake2b"
+
+
+def variable_checksum(variable, algorithm):
+    """
+    :param variable: netCDF4.Variable, read with auto mask off so that unwritten values hash as fill values
+    :param algorithm: str, "xxh3_64" or "blake2b"
+    :return: str, hex digest of the shape and the data, in chunks along the first axis
+    """
+    hasher = _new_hasher(algorithm)
+    shape = variable.shape
+    hasher.update(np.array(shape, dtype=np.int64).tobytes())
+    if len(shape) == 0:
+        hasher.update(np.ascontiguousarray(variable[...]).tobytes())
+        return hasher.hexdigest()
+    row_bytes = max(int(np.prod(shape[1:], dtype=np.int64)) * variable.dtype.itemsize, 1)
+    rows = max(CHUNK_BYTES // row_bytes, 1)
+    for start in range(0, shape[0], rows):
+        hasher.update(np.ascontiguousarray(variable[start:start + rows]).tobytes())
+    return hasher.hexdigest()
+
+
+def mark_incomplete(nc_handle):
+    """
+    :param nc_handle: netCDF4.Dataset opened for writing
+    """
+    nc_handle.setncattr(COMPLETE_ATTR, 0)
+    return None
+
+
+def seal(nc_handle, algorithm=None):
+    """
+    write the shape and checksum of every variable and mark the file complete; call just before close()
+    :param nc_handle: netCDF4.Dataset opened for writing
+    :param algorithm: None for default_algorithm(), or str
+    """
+    if algorithm is None:
+        algorithm = default_algorithm()
+    nc_handle.sync()
+    for name, variable in nc_handle.variables.items():
+        variable.set_auto_mask(False)
+        # rank first, attributes cannot be empty
+        variable.setncattr(SHAPE_ATTR, np.array((len(variable.shape),) + variable.shape, dtype=np.int64))
+        variable.setncattr(CHECKSUM_ATTR, variable_checksum(variable, algorithm))
+    nc_handle.setncattr(ALGORITHM_ATTR, algorithm)
+    nc_handle.setncattr(NR_VARIABLES_ATTR, len(nc_handle.variables))
+    nc_handle.setncattr(COMPLETE_ATTR, 1)
+    return None
+
+
+def is_sealed(nc_handle):
+    """
+    :return: None for a file without completion marks, else bool
+    """
+    if COMPLETE_ATTR not in nc_handle.ncattrs():
+        return None
+    return int(nc_handle.getncattr(COMPLETE_ATTR)) == 1
+
+
+def _has_records(nc_handle, variables, records):
+    for name in variables:
+        if name not in nc_handle.variables:
+            return False
+    for dim_name, length in records.items():
+        if dim_name not in nc_handle.dimensions or len(nc_handle.dimensions[dim_name]) < length:
+            return False
+    return True
+
+
+def _sealed_metadata_ok(nc_handle):
+    nr_sealed = 0
+    for variable in nc_handle.variables.values():
+        if SHAPE_ATTR not in variable.ncattrs():
+            return False
+        shape = tuple(int(dim) for dim in np.atleast_1d(variable.getncattr(SHAPE_ATTR))[1:])
+        if shape != variable.shape:
+            return False
+        nr_sealed += 1
+    return nr_sealed == int(nc_handle.getncattr(NR_VARIABLES_ATTR))
+
+
+def _checksums_ok(nc_handle):
+    algorithm = str(nc_handle.getncattr(ALGORITHM_ATTR))
+    for name, variable in nc_handle.variables.items():
+        variable.set_auto_mask(False)
+        if variable_checksum(variable, algorithm) != str(variable.getncattr(CHECKSUM_ATTR)):
+            print("%s: checksum of %s does not match" % (nc_handle.filepath(), name))
+            return False
+    return True
+
+
+def verify(nc_file, variables=(), records=None, deep=False, legacy_check=None):
+    """
+    :param nc_file: str
+    :param variables: iterable of str, variables the file must have
+    :param records: None or dict, dimension name -> minimum length, e.g. {"lig_sample_size": 100}
+    :param deep: bool, if True also recompute the checksums
+    :param legacy_check: None or callable taking the open netCDF4.Dataset and returning bool,
+    applied to files without completion marks
+    :return: bool, True if the file is complete; files without completion marks are judged by
+    variables, records and legacy_check only
+    """
+    if records is None:
+        records = {}
+    if not os.path.isfile(nc_file) or os.path.getsize(nc_file) == 0:
+        return False
+    try:
+        nc_handle = netCDF4.Dataset(nc_file, "r")
+    except (OSError, RuntimeError) as e:
+        print(nc_file, e)
+        return False
+
+    try:
+        if not _has_records(nc_handle, variables, records):
+            return False
+        sealed = is_sealed(nc_handle)
+        if sealed is None:
+            return True if legacy_check is None else bool(legacy_check(nc_handle))
+        if not sealed or not _sealed_metadata_ok(nc_handle):
+            return False
+        if deep:
+            return _checksums_ok(nc_handle)
+        return True
+    finally:
+        nc_handle.close()
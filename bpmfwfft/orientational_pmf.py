@@ -0,0 +1,441 @@
+"""
+Orientational potential of mean force from the per-rotation exponential sums of a Sampling run.
+
+Rotation r of the ligand ensemble contributes Z_r = exponential_sums[r] * exp(log_of_divisors[r]), the
+sum of exp(-beta E) over its translations. Its rotation matrix is recovered from lig_positions by a
+Kabsch fit against the reference pose (the first rotation, by default, which rotation.py leaves
+unrotated), on a few well spread atoms, with batched Newton iterations instead of 3x3 SVDs.
+
+SO(3) is cut into equal-volume cells of the coordinates u = (u0, u1, u2) of rotation._rotation_matrix,
+which maps the uniform distribution on [0, 1]^3 to the uniform distribution of rotations.
+As q and -q are the same rotation, u1 is folded into [0, 0.5); with resolution n there are n bins of u0,
+n of u1 and 2n of u2, 2 n^3 cells in all. The free energy of a cell is
+    F_c = -kT log(mean of Z_r over the rotations in c)
+optionally smoothed with a Watson kernel exp(kappa (q.q')^2) on the cell center quaternions.
+Basins are found by steepest descent of F_c over neighboring cells, and their populations are the sums
+of exp(-beta F_c) over their cells.
+"""
+from __future__ import print_function
+
+import numpy as np
+import netCDF4
+
+try:
+    from bpmfwfft.rotation import _rotation_matrix
+except:
+    from rotation import _rotation_matrix
+
+KB = 0.001987204134799235  # kcal/mol/K
+# rotations read at a time from lig_positions
+CHUNK_SIZE = 1 << 16
+
+
+def quaternions_from_matrices(rot_mats):
+    """
+    inverse of the quaternion to matrix map of rotation._rotation_matrix, q = (w, x, y, z)
+    :param rot_mats: ndarray of shape (n, 3, 3)
+    :return: ndarray of shape (n, 4), unit quaternions, sign arbitrary
+    """
+    r = np.asarray(rot_mats, dtype=float)
+    diagonals = np.stack([r[:, 0, 0] + r[:, 1, 1] + r[:, 2, 2], r[:, 0, 0], r[:, 1, 1], r[:, 2, 2]], axis=1)
+    case = np.argmax(diagonals, axis=1)
+    q = np.empty((r.shape[0], 4), dtype=float)
+
+    # the largest component is computed from the diagonal, the others from off-diagonal sums
+    sel = case == 0
+    s = 2. * np.sqrt(1. + diagonals[sel, 0])
+    q[sel] = np.stack([s / 4., (r[sel, 2, 1] - r[sel, 1, 2]) / s, (r[sel, 0, 2] - r[sel, 2, 0]) / s,
+                       (r[sel, 1, 0] - r[sel, 0, 1]) / s], axis=1)
+    sel = case == 1
+    s = 2. * np.sqrt(1. + r[sel, 0, 0] - r[sel, 1, 1] - r[sel, 2, 2])
+    q[sel] = np.stack([(r[sel, 2, 1] - r[sel, 1, 2]) / s, s / 4., (r[sel, 0, 1] + r[sel, 1, 0]) / s,
+                       (r[sel, 0, 2] + r[sel, 2, 0]) / s], axis=1)
+    sel = case == 2
+    s = 2. * np.sqrt(1. - r[sel, 0, 0] + r[sel, 1, 1] - r[sel, 2, 2])
+    q[sel] = np.stack([(r[sel, 0, 2] - r[sel, 2, 0]) / s, (r[sel, 0, 1] + r[sel, 1, 0]) / s, s / 4.,
+                       (r[sel, 1, 2] + r[sel, 2, 1]) / s], axis=1)
+    sel = case == 3
+    s = 2. * np.sqrt(1. - r[sel, 0, 0] - r[sel, 1, 1] + r[sel, 2, 2])
+    q[sel] = np.stack([(r[sel, 1, 0] - r[sel, 0, 1]) / s, (r[sel, 0, 2] + r[sel, 2, 0]) / s,
+                       (r[sel, 1, 2] + r[sel, 2, 1]) / s, s / 4.], axis=1)
+    return q / np.linalg.norm(q, axis=1)[:, np.newaxis]
+
+
+def quaternions_to_u(quaternions):
+    """
+    :param quaternions: ndarray of shape (n, 4)
+    :return: ndarray of shape (n, 3), u with rotation._rotation_matrix(u) the same rotation, u1 in [0, 0.5)
+    """
+    q = np.asarray(quaternions, dtype=float)
+    u = np.empty((q.shape[0], 3), dtype=float)
+    u[:, 0] = np.clip(q[:, 2] ** 2 + q[:, 3] ** 2, 0., 1.)
+    u[:, 1] = np.mod(np.arctan2(q[:, 0], q[:, 1]) / (2. * np.pi), 1.)
+    u[:, 2] = np.mod(np.arctan2(q[:, 2], q[:, 3]) / (2. * np.pi), 1.)
+    # q -> -q shifts u1 and u2 by one half
+    folded = u[:, 1] >= 0.5
+    u[folded, 1] -= 0.5
+    u[folded, 2] = np.mod(u[folded, 2] + 0.5, 1.)
+    return u
+
+
+def u_to_quaternions(u):
+    """
+    the quaternion of rotation._rotation_matrix, vectorized
+    :param u: ndarray of shape (n, 3)
+    :return: ndarray of shape (n, 4)
+    """
+    u = np.asarray(u, dtype=float)
+    return np.stack([np.sqrt(1. - u[:, 0]) * np.sin(2. * np.pi * u[:, 1]),
+                     np.sqrt(1. - u[:, 0]) * np.cos(2. * np.pi * u[:, 1]),
+                     np.sqrt(u[:, 0]) * np.sin(2. * np.pi * u[:, 2]),
+                     np.sqrt(u[:, 0]) * np.cos(2. * np.pi * u[:, 2])], axis=1)
+
+
+def spread_atoms(crd, nr_atoms=8):
+    """
+    farthest point sampling, enough atoms for an exact Kabsch fit of rigid rotations
+    :param crd: ndarray of shape (natoms, 3)
+    :param nr_atoms: int
+    :return: 1-array of int, sorted atom indices
+    """
+    crd = np.asarray(crd, dtype=float)
+    if crd.shape[0] <= nr_atoms:
+        return np.arange(crd.shape[0])
+    distances = np.linalg.norm(crd - crd.mean(axis=0), axis=1)
+    selected = [int(np.argmax(distances))]
+    distances = np.linalg.norm(crd - crd[selected[0]], axis=1)
+    while len(selected) < nr_atoms:
+        selected.append(int(np.argmax(distances)))
+        distances = np.minimum(distances, np.linalg.norm(crd - crd[selected[-1]], axis=1))
+    return np.sort(np.array(selected, dtype=int))
+
+
+def _cofactors(m):
+    """
+    :param m: ndarray of shape (3, 3, n), component major so that every product runs over contiguous arrays
+    :return: ndarray of shape (3, 3, n), det(m) m^-T
+    """
+    c = np.empty_like(m)
+    for i in range(3):
+        i1, i2 = (i + 1) % 3, (i + 2) % 3
+        for j in range(3):
+            j1, j2 = (j + 1) % 3, (j + 2) % 3
+            c[i, j] = m[i1, j1] * m[i2, j2] - m[i1, j2] * m[i2, j1]
+    return c
+
+
+def polar_rotations(covariances, tolerance=1e-10, max_iterations=30):
+    """
+    the rotations R maximizing trace(R^T M), M = sum_a y_a x_a^T, as the orthogonal polar factors of the M,
+    by scaled Newton iterations M <- (g M + M^-T / g) / 2 on all of them at once;
+    batched 3x3 SVDs cost some microseconds each, these iterations a few hundred nanoseconds
+    :param covariances: ndarray of shape (n, 3, 3)
+    :return: ndarray of shape (n, 3, 3)
+    """
+    m = np.ascontiguousarray(np.transpose(covariances, (1, 2, 0)), dtype=float)
+    dets = np.einsum("ijn,ijn->n", m, _cofactors(m)) / 3.
+    proper = dets > 1e-12 * np.abs(m).max(axis=(0, 1)) ** 3
+    x = np.ascontiguousarray(m[:, :, proper])
+    for _ in range(max_iterations):
+        cofactors = _cofactors(x)
+        dets = np.einsum("ijn,ijn->n", x, cofactors) / 3.
+        gammas = dets ** (-1. / 3.)
+        new_x = 0.5 * (gammas * x + cofactors / (gammas * dets))
+        change = np.abs(new_x - x).max() if x.shape[2] > 0 else 0.
+        x = new_x
+        if change < tolerance:
+            break
+    rotations = np.empty((m.shape[2], 3, 3), dtype=float)
+    rotations[proper] = x.transpose(2, 0, 1)
+    # reflections are closer than rotations, or degenerate covariances: the SVD handles them,
+    # as in so3_search.kabsch_rotations
+    if not np.all(proper):
+        u, _, vt = np.linalg.svd(covariances[~proper])
+        signs = np.sign(np.linalg.det(np.einsum("nij,njk->nik", u, vt)))
+        u[:, :, 2] *= signs[:, np.newaxis]
+        rotations[~proper] = np.einsum("nij,njk->nik", u, vt)
+    return rotations
+
+
+def fit_rotations(ref_crd, crd_ensemble, tolerance=1e-10, max_iterations=30):
+    """
+    the rotations of so3_search.kabsch_rotations, with polar_rotations
+    :param ref_crd: ndarray of shape (natoms, 3)
+    :param crd_ensemble: ndarray of shape (nconfs, natoms, 3)
+    :return: ndarray of shape (nconfs, 3, 3)
+    """
+    # centering ref is enough, sum_a (y_a - <y>) x_a^T = sum_a y_a x_a^T for sum_a x_a = 0
+    ref = ref_crd - ref_crd.mean(axis=0)
+    return polar_rotations(np.tensordot(crd_ensemble, ref, axes=([1], [0])), tolerance, max_iterations)
+
+
+class OrientationalPMF(object):
+    def __init__(self, resolution=8, temperature=300.):
+        """
+        :param resolution: int, n; cells are n bins of u0, n of u1 and 2n of u2
+        :param temperature: float, must be the sampling temperature
+        """
+        assert resolution >= 2, "resolution must be at least 2"
+        self._shape = (resolution, resolution, 2 * resolution)
+        self._nr_cells = int(np.prod(self._shape))
+        self._beta = 1. / KB / temperature
+        # sums of Z_r are kept as exp(log Z_r - self._log_shift), the shift follows the running maximum
+        self._log_shift = -np.inf
+        self._sums = np.zeros(self._nr_cells, dtype=float)
+        self._counts = np.zeros(self._nr_cells, dtype=np.int64)
+        self._best_log_weights = np.full(self._nr_cells, -np.inf, dtype=float)
+        self._best_rotations = np.full(self._nr_cells, -1, dtype=np.int64)
+        self._nr_rotations = 0
+
+    def get_nr_cells(self):
+        return self._nr_cells
+
+    def get_nr_rotations(self):
+        return self._nr_rotations
+
+    def get_counts(self):
+        return self._counts.reshape(self._shape).copy()
+
+    def cell_indices(self, quaternions):
+        """
+        :param quaternions: ndarray of shape (n, 4)
+        :return: 1-array of int, flat cell index of every rotation
+        """
+        u = quaternions_to_u(quaternions)
+        bins = np.floor(u * np.array([self._shape[0], 2 * self._shape[1], self._shape[2]])).astype(int)
+        bins = np.minimum(bins, np.array(self._shape) - 1)
+        return np.ravel_multi_index(bins.T, self._shape)
+
+    def cell_center_u(self, cells=None):
+        """
+        :param cells: None for all cells, or 1-array of int
+        :return: ndarray of shape (ncells, 3)
+        """
+        if cells is None:
+            cells = np.arange(self._nr_cells)
+        bins = np.array(np.unravel_index(cells, self._shape), dtype=float).T
+        return (bins + 0.5) / np.array([self._shape[0], 2 * self._shape[1], self._shape[2]])
+
+    def cell_center_matrix(self, cell):
+        """
+        :param cell: int
+        :return: 3x3 ndarray, rotation._rotation_matrix at the cell center
+        """
+        return _rotation_matrix(self.cell_center_u([cell])[0])
+
+    def add(self, rot_mats, log_weights, first_rotation=None):
+        """
+        :param rot_mats: ndarray of shape (n, 3, 3)
+        :param log_weights: 1-array of float, log Z_r, -inf for rotations without meaningful energies
+        :param first_rotation: None or int, index of the first of these rotations, default the number added so far
+        """
+        log_weights = np.asarray(log_weights, dtype=float)
+        assert log_weights.shape[0] == rot_mats.shape[0], "need one log weight per rotation"
+        if first_rotation is None:
+            first_rotation = self._nr_rotations
+        cells = self.cell_indices(quaternions_from_matrices(rot_mats))
+
+        chunk_max = log_weights.max() if log_weights.shape[0] > 0 else -np.inf
+        if chunk_max > self._log_shift:
+            if np.isfinite(self._log_shift):
+                self._sums *= np.exp(self._log_shift - chunk_max)
+            self._log_shift = chunk_max
+        if np.isfinite(self._log_shift):
+            self._sums += np.bincount(cells, weights=np.exp(log_weights - self._log_shift),
+                                      minlength=self._nr_cells)
+        self._counts += np.bincount(cells, minlength=self._nr_cells)
+
+        # the best rotation of every cell: first occurrence after sorting by decreasing weight
+        order = np.argsort(-log_weights, kind="stable")
+        chunk_cells, first = np.unique(cells[order], return_index=True)
+        chunk_best = order[first]
+        better = log_weights[chunk_best] > self._best_log_weights[chunk_cells]
+        self._best_log_weights[chunk_cells[better]] = log_weights[chunk_best[better]]
+        self._best_rotations[chunk_cells[better]] = first_rotation + chunk_best[better]
+        self._nr_rotations += log_weights.shape[0]
+        return None
+
+    def neighbors(self):
+        """
+        cells sharing a face, edge or corner, across the periodic u1 and u2 boundaries and the poles of u0
+        :return: list of 1-arrays of int, the neighbors of every cell, itself excluded
+        """
+        n0, n1, n2 = self._shape
+        a, b, c = np.unravel_index(np.arange(self._nr_cells), self._shape)
+        pairs = []
+        for da in (-1, 0, 1):
+            for db in (-1, 0, 1):
+                for dc in (-1, 0, 1):
+                    if da == db == dc == 0:
+                        continue
+                    na, nb, nc = a + da, b + db, c + dc
+                    inside = (na >= 0) & (na < n0)
+                    # leaving u1 through 0 or 0.5 unfolds to u2 + 0.5
+                    wrapped = (nb < 0) | (nb >= n1)
+                    nb = np.mod(nb, n1)
+                    nc = np.mod(nc + wrapped * (n2 // 2), n2)
+                    pairs.append((np.flatnonzero(inside), np.ravel_multi_index((na[inside], nb[inside], nc[inside]),
+                                                                                self._shape)))
+        # u2 is not defined at u0 = 0: cells of the first u0 bin touch along u1 whatever their u2
+        first_row = np.flatnonzero(a == 0)
+        for db in (-1, 0, 1):
+            for nc in range(n2):
+                pairs.append((first_row, np.ravel_multi_index((a[first_row], np.mod(b[first_row] + db, n1),
+                                                               np.full(first_row.shape, nc)), self._shape)))
+        # u1 is not defined at u0 = 1, where u2 and u2 + 0.5 are the same rotation
+        last_row = np.flatnonzero(a == n0 - 1)
+        for nb in range(n1):
+            for dc in (-1, 0, 1, n2 // 2 - 1, n2 // 2, n2 // 2 + 1):
+                pairs.append((last_row, np.ravel_multi_index((a[last_row], np.full(last_row.shape, nb),
+                                                              np.mod(c[last_row] + dc, n2)), self._shape)))
+        sources = np.concatenate([source for source, _ in pairs])
+        targets = np.concatenate([target for _, target in pairs])
+        keep = sources != targets
+        # symmetric and unique
+        edges = np.unique(np.stack([np.concatenate([sources[keep], targets[keep]]),
+                                    np.concatenate([targets[keep], sources[keep]])], axis=1), axis=0)
+        splits = np.searchsorted(edges[:, 0], np.arange(1, self._nr_cells))
+        return np.split(edges[:, 1], splits)
+
+    def _log_mean_weights(self, bandwidth=None, block_size=1024):
+        """
+        :param bandwidth: None or float, kernel width in radians of rotation angle
+        :return: 1-array, log mean Z_r of every cell, -inf for cells without rotations
+        """
+        with np.errstate(divide="ignore", invalid="ignore"):
+            if bandwidth is None:
+                return np.where(self._counts > 0, np.log(self._sums / self._counts), -np.inf) + self._log_shift
+            # rotation angle theta between q and q': (q.q')^2 = cos^2(theta / 2) ~ 1 - theta^2 / 4
+            kappa = 2. / bandwidth ** 2
+            occupied = np.flatnonzero(self._counts > 0)
+            centers = u_to_quaternions(self.cell_center_u())
+            sums = np.zeros(self._nr_cells, dtype=float)
+            counts = np.zeros(self._nr_cells, dtype=float)
+            for start in range(0, self._nr_cells, block_size):
+                overlaps = np.dot(centers[start:start + block_size], centers[occupied].T) ** 2
+                kernel = np.exp(kappa * (overlaps - 1.))
+                sums[start:start + block_size] = np.dot(kernel, self._sums[occupied])
+                counts[start:start + block_size] = np.dot(kernel, self._counts[occupied])
+            # cells farther than some bandwidths from any rotation stay empty
+            counts[counts < 1e-6] = 0.
+            return np.where(counts > 0, np.log(sums / counts), -np.inf) + self._log_shift
+
+    def get_free_energies(self, bandwidth=None):
+        """
+        :param bandwidth: None or float, kernel width in radians of rotation angle, None for no smoothing
+        :return: 3-array of float, F_c in kcal/mol relative to the lowest cell, inf for empty cells
+        """
+        free_energies = -self._log_mean_weights(bandwidth) / self._beta
+        free_energies -= free_energies[np.isfinite(free_energies)].min()
+        return free_energies.reshape(self._shape)
+
+    def get_populations(self, bandwidth=None):
+        """
+        :return: 3-array of float, exp(-beta F_c) normalized over the cells, the cells having equal volumes
+        """
+        log_weights = self._log_mean_weights(bandwidth)
+        finite = np.isfinite(log_weights)
+        populations = np.zeros(self._nr_cells, dtype=float)
+        populations[finite] = np.exp(log_weights[finite] - log_weights[finite].max())
+        return (populations / populations.sum()).reshape(self._shape)
+
+    def find_basins(self, bandwidth=None, nr_basins=None):
+        """
+        :param bandwidth: None or float, see get_free_energies
+        :param nr_basins: None or int, the most populated basins to return, None for all
+        :return: list of dict, by decreasing population, with keys "free_energy" (of the lowest cell),
+        "population", "nr_cells", "cells", "center_matrix" (of the lowest cell), "best_rotation"
+        (index of the rotation with the largest Z_r, -1 when the basin is smoothing only) and "best_log_weight"
+        """
+        free_energies = self.get_free_energies(bandwidth).ravel()
+        populations = self.get_populations(bandwidth).ravel()
+        finite = np.isfinite(free_energies)
+        if not np.any(finite):
+            raise RuntimeError("no rotation has meaningful energies")
+
+        # each cell points to its lowest neighbor, or to itself at a minimum
+        downhill = np.arange(self._nr_cells)
+        for cell, neighbors in enumerate(self.neighbors()):
+            if not finite[cell]:
+                continue
+            lowest = neighbors[np.argmin(free_energies[neighbors])] if neighbors.shape[0] > 0 else cell
+            if free_energies[lowest] < free_energies[cell]:
+                downhill[cell] = lowest
+        # pointer jumping to the minima
+        while True:
+            jumped = downhill[downhill]
+            if np.array_equal(jumped, downhill):
+                break
+            downhill = jumped
+
+        minima = np.unique(downhill[finite])
+        basins = []
+        for minimum in minima:
+            cells = np.flatnonzero(finite & (downhill == minimum))
+            best_cell = cells[np.argmax(self._best_log_weights[cells])]
+            basins.append({"free_energy": float(free_energies[minimum]),
+                           "population": float(populations[cells].sum()),
+                           "nr_cells": int(cells.shape[0]),
+                           "cells": cells,
+                           "center_matrix": self.cell_center_matrix(minimum),
+                           "best_rotation": int(self._best_rotations[best_cell]),
+                           "best_log_weight": float(self._best_log_weights[best_cell])})
+        basins.sort(key=lambda basin: -basin["population"])
+        if nr_basins is not None:
+            basins = basins[:nr_basins]
+        return basins
+
+
+def load_log_weights(nc_file):
+    """
+    :param nc_file: str, output_nc of Sampling
+    :return: 1-array of float, log Z_r of the finished rotations
+    """
+    nc_handle = netCDF4.Dataset(nc_file, "r")
+    nr_rotations = int(nc_handle.variables["current_rotation_index"][0])
+    exponential_sums = np.array(nc_handle.variables["exponential_sums"][:nr_rotations], dtype=float)
+    log_of_divisors = np.array(nc_handle.variables["log_of_divisors"][:nr_rotations], dtype=float)
+    nc_handle.close()
+    with np.errstate(divide="ignore"):
+        return np.log(exponential_sums) + log_of_divisors
+
+
+def orientational_pmf(nc_file, resolution=8, temperature=300., ref_crd=None, nr_fit_atoms=8,
+                      chunk_size=CHUNK_SIZE):
+    """
+    :param nc_file: str, output_nc of Sampling
+    :param resolution: int, see OrientationalPMF
+    :param temperature: float, must be the sampling temperature
+    :param ref_crd: None or ndarray of shape (natoms, 3), the unrotated ligand, default the first lig_positions
+    :param nr_fit_atoms: None or int, atoms of the Kabsch fit, None for all atoms; a rigid rotation is fit
+    exactly by a few atoms
+    :param chunk_size: int, rotations read at a time
+    :return: OrientationalPMF
+    """
+    log_weights = load_log_weights(nc_file)
+    pmf = OrientationalPMF(resolution=resolution, temperature=temperature)
+    nc_handle = netCDF4.Dataset(nc_file, "r")
+    positions = nc_handle.variables["lig_positions"]
+    positions.set_auto_mask(False)
+    if ref_crd is None:
+        ref_crd = np.array(positions[0], dtype=float)
+    if nr_fit_atoms is None:
+        fit_atoms = np.arange(ref_crd.shape[0])
+    else:
+        fit_atoms = spread_atoms(ref_crd, nr_fit_atoms)
+
+    for start in range(0, log_weights.shape[0], chunk_size):
+        stop = min(start + chunk_size, log_weights.shape[0])
+        crd = np.array(positions[start:stop], dtype=float)[:, fit_atoms, :]
+        pmf.add(fit_rotations(ref_crd[fit_atoms], crd), log_weights[start:stop], first_rotation=start)
+    nc_handle.close()
+    print("Orientational PMF of %d rotations on %d cells" % (pmf.get_nr_rotations(), pmf.get_nr_cells()))
+    return pmf
+
+
+def print_basins(basins):
+    print("%6s %12s %12s %8s %14s" % ("basin", "F (kcal/mol)", "population", "cells", "best rotation"))
+    for i, basin in enumerate(basins):
+        print("%6d %12.3f %12.4f %8d %14d" % (i, basin["free_energy"], basin["population"], basin["nr_cells"],
+                                               basin["best_rotation"]))
+    return None
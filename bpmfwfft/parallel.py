@@ -0,0 +1,115 @@
+"""
+Work partitioning for the multiprocess grid calculations.
+
+The grid code splits a job into task_divisor pieces (x slabs of the receptor grid, or atom slices)
+and hands them to a ProcessPoolExecutor. The number of pieces is chosen from the CPUs this
+process may run on and the size of the job, instead of a fixed 16.
+"""
+from __future__ import print_function
+
+import os
+
+import numpy as np
+
+# smallest amount of work (in atom * grid point updates) worth sending to another process
+MIN_TASK_WORK = 2.0e6
+# more tasks than workers smooths out slabs of unequal cost
+TASKS_PER_WORKER = 2
+
+_max_workers = None
+_task_divisor = None
+
+
+def set_max_workers(nr_workers):
+    """
+    :param nr_workers: int or None, None restores the default
+    """
+    global _max_workers
+    assert nr_workers is None or nr_workers >= 1, "nr_workers must be >= 1"
+    _max_workers = nr_workers
+    return None
+
+
+def set_task_divisor(task_divisor):
+    """
+    force a fixed number of tasks, as the code used to do with 16
+    :param task_divisor: int or None, None restores the automatic choice
+    """
+    global _task_divisor
+    assert task_divisor is None or task_divisor >= 1, "task_divisor must be >= 1"
+    _task_divisor = task_divisor
+    return None
+
+
+def available_cpus():
+    """
+    number of worker processes to use
+    set_max_workers() wins, then the environment variable BPMFWFFT_NUM_WORKERS,
+    then the CPUs in this process's affinity mask
+    :return: int
+    """
+    if _max_workers is not None:
+        return _max_workers
+    env = os.environ.get("BPMFWFFT_NUM_WORKERS")
+    if env:
+        return max(1, int(env))
+    if hasattr(os, "sched_getaffinity"):
+        return max(1, len(os.sched_getaffinity(0)))
+    return max(1, os.cpu_count() or 1)
+
+
+def choose_task_divisor(nr_units, work_per_unit, nr_workers=None, min_task_work=MIN_TASK_WORK):
+    """
+    :param nr_units: int, number of things that can be split, x slabs or atoms
+    :param work_per_unit: float, rough cost of one unit in atom * grid point updates
+    :param nr_workers: int or None, defaults to available_cpus()
+    :param min_task_work: float, tasks are not made smaller than this
+    :return: int, number of tasks, between 1 and nr_units
+    """
+    nr_units = int(nr_units)
+    if nr_units < 1:
+        return 1
+    if _task_divisor is not None:
+        return min(_task_divisor, nr_units)
+    if nr_workers is None:
+        nr_workers = available_cpus()
+
+    total_work = float(nr_units) * float(work_per_unit)
+    by_granularity = int(total_work // min_task_work)
+    task_divisor = min(TASKS_PER_WORKER * nr_workers, by_granularity, nr_units)
+    if nr_workers == 1:
+        task_divisor = 1
+    return max(1, task_divisor)
+
+
+def partition(nr_units, task_divisor):
+    """
+    split range(nr_units) into task_divisor contiguous pieces, the remainder goes to the last piece
+    :param nr_units: int
+    :param task_divisor: int
+    :return: list of (start, size)
+    """
+    size = nr_units // task_divisor
+    pieces = [(i * size, size) for i in range(task_divisor)]
+    start, last = pieces[-1]
+    pieces[-1] = (start, last + nr_units % task_divisor)
+    return pieces
+
+
+def fit_amdahl(nr_workers, times):
+    """
+    least squares fit of T(p) = T1 * (s + (1 - s) / p)
+    :param nr_workers: 1d array of int, worker counts
+    :param times: 1d array of float, wall times
+    :return: (serial_fraction, T1)
+    """
+    nr_workers = np.asarray(nr_workers, dtype=float)
+    times = np.asarray(times, dtype=float)
+    a_matrix = np.stack([np.ones_like(nr_workers), 1. / nr_workers], axis=1)
+    (serial, parallel), _, _, _ = np.linalg.lstsq(a_matrix, times, rcond=None)
+    serial = max(serial, 0.)
+    parallel = max(parallel, 0.)
+    t1 = serial + parallel
+    if t1 == 0.:
+        return 0., 0.
+    return serial / t1, t1
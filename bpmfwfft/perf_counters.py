@@ -0,0 +1,253 @@
+"""
+Hardware performance counters around the stages of the grid and sampling code.
+
+Counters are opened with the perf_event_open system call through ctypes, for this process and
+every process it forks afterwards (so the ProcessPoolExecutor workers are included). They count
+cycles, instructions, last-level cache misses and CPU time (task clock), plus floating-point
+operations when a raw event code is given in BPMFWFFT_PERF_FLOPS_EVENT (it is model specific,
+e.g. the FP_ARITH_INST_RETIRED umask of the CPU). Where counters are unavailable (no PMU in a VM,
+perf_event_paranoid too strict, not Linux) only the task clock, or failing that only wall
+times, are recorded and the summary says so.
+
+FLOPs are also estimated from the problem size given to each stage, so the roofline summary
+has an operational intensity even without a FLOPs event:
+intensity = FLOPs / (LLC misses * cache line size).
+"""
+from __future__ import print_function
+
+import os
+import json
+import time
+import ctypes
+import platform
+import contextlib
+
+import numpy as np
+
+CACHE_LINE_BYTES = 64
+
+# perf_event_open(2)
+PERF_TYPE_HARDWARE = 0
+PERF_TYPE_SOFTWARE = 1
+PERF_TYPE_RAW = 4
+PERF_COUNT_HW_CPU_CYCLES = 0
+PERF_COUNT_HW_INSTRUCTIONS = 1
+PERF_COUNT_HW_CACHE_MISSES = 3
+PERF_COUNT_SW_TASK_CLOCK = 1
+PERF_EVENT_IOC_ENABLE = 0x2400
+PERF_EVENT_IOC_DISABLE = 0x2401
+# disabled, inherit, exclude_kernel, exclude_hv
+PERF_ATTR_FLAGS = (1 << 0) | (1 << 1) | (1 << 5) | (1 << 6)
+SYSCALL_NUMBERS = {"x86_64": 298, "aarch64": 241, "ppc64le": 319, "i686": 336, "i386": 336}
+
+
+class PerfEventAttr(ctypes.Structure):
+    # struct perf_event_attr up to PERF_ATTR_SIZE_VER5 (112 bytes)
+    _fields_ = [("type", ctypes.c_uint32),
+                ("size", ctypes.c_uint32),
+                ("config", ctypes.c_uint64),
+                ("sample_period", ctypes.c_uint64),
+                ("sample_type", ctypes.c_uint64),
+                ("read_format", ctypes.c_uint64),
+                ("flags", ctypes.c_uint64),
+                ("wakeup_events", ctypes.c_uint32),
+                ("bp_type", ctypes.c_uint32),
+                ("config1", ctypes.c_uint64),
+                ("config2", ctypes.c_uint64),
+                ("branch_sample_type", ctypes.c_uint64),
+                ("sample_regs_user", ctypes.c_uint64),
+                ("sample_stack_user", ctypes.c_uint32),
+                ("clockid", ctypes.c_int32),
+                ("sample_regs_intr", ctypes.c_uint64),
+                ("aux_watermark", ctypes.c_uint32),
+                ("sample_max_stack", ctypes.c_uint16),
+                ("reserved_2", ctypes.c_uint16)]
+
+
+def _perf_event_open(event_type, config):
+    """
+    :return: int, file descriptor, or -1 if the counter cannot be opened
+    """
+    number = SYSCALL_NUMBERS.get(platform.machine())
+    if number is None or platform.system() != "Linux":
+        return -1
+    attr = PerfEventAttr()
+    attr.type = event_type
+    attr.size = ctypes.sizeof(PerfEventAttr)
+    attr.config = config
+    attr.flags = PERF_ATTR_FLAGS
+    libc = ctypes.CDLL(None, use_errno=True)
+    libc.syscall.restype = ctypes.c_long
+    fd = libc.syscall(ctypes.c_long(number), ctypes.byref(attr), ctypes.c_int(0), ctypes.c_int(-1),
+                      ctypes.c_int(-1), ctypes.c_ulong(0))
+    return int(fd)
+
+
+class PerfCounters(object):
+    """
+    stages can be nested; counters run for the life of the object and each stage records
+    the difference of the counts at its entry and exit
+    """
+
+    def __init__(self, enabled=False):
+        self._enabled = enabled
+        self._fds = {}
+        self._stages = {}
+        self.unavailable_reason = None
+        if enabled:
+            self._open_counters()
+
+    def _open_counters(self):
+        import fcntl
+
+        events = {"task_clock_ns": (PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK),
+                  "cycles": (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+                  "instructions": (PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS),
+                  "llc_misses": (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES)}
+        flops_event = os.environ.get("BPMFWFFT_PERF_FLOPS_EVENT")
+        if flops_event:
+            events["flops"] = (PERF_TYPE_RAW, int(flops_event, 0))
+
+        for name, (event_type, config) in events.items():
+            fd = _perf_event_open(event_type, config)
+            if fd < 0:
+                errno = ctypes.get_errno()
+                self.unavailable_reason = "perf_event_open(%s) failed: %s" % (name, os.strerror(errno))
+                continue
+            fcntl.ioctl(fd, PERF_EVENT_IOC_ENABLE, 0)
+            self._fds[name] = fd
+        if not self.has_counters():
+            print("Hardware counters unavailable (%s), recording %s only" % (
+                self.unavailable_reason, "CPU and wall time" if self._fds else "wall time"))
+        return None
+
+    def is_enabled(self):
+        return self._enabled
+
+    def has_counters(self):
+        """
+        :return: bool, True if any hardware counter is open
+        """
+        return any(name != "task_clock_ns" for name in self._fds)
+
+    def _read(self):
+        counts = {}
+        for name, fd in self._fds.items():
+            counts[name] = int.from_bytes(os.read(fd, 8), byteorder="little", signed=False)
+        return counts
+
+    @contextlib.contextmanager
+    def stage(self, name, flops=None):
+        """
+        :param name: str
+        :param flops: float or None, estimated floating-point operations of this call
+        """
+        if not self._enabled:
+            yield
+            return
+
+        start_counts = self._read()
+        start_time = time.time()
+        try:
+            yield
+        finally:
+            seconds = time.time() - start_time
+            end_counts = self._read()
+            record = self._stages.setdefault(name, {"calls": 0, "seconds": 0., "estimated_flops": 0.})
+            record["calls"] += 1
+            record["seconds"] += seconds
+            if flops is not None:
+                record["estimated_flops"] += float(flops)
+            for key in end_counts:
+                record[key] = record.get(key, 0) + end_counts[key] - start_counts[key]
+
+    def close(self):
+        import fcntl
+        for fd in self._fds.values():
+            fcntl.ioctl(fd, PERF_EVENT_IOC_DISABLE, 0)
+            os.close(fd)
+        self._fds = {}
+        return None
+
+    def report(self, peak_gflops=None, peak_bandwidth_gbs=None):
+        """
+        :param peak_gflops: float or None, machine peak for the roofline
+        :param peak_bandwidth_gbs: float or None, memory bandwidth for the roofline
+        :return: dict
+        """
+        ridge = None
+        if peak_gflops is not None and peak_bandwidth_gbs is not None:
+            ridge = peak_gflops / peak_bandwidth_gbs
+        stages = {}
+        for name, record in self._stages.items():
+            summary = dict(record)
+            flops = record.get("flops", record["estimated_flops"])
+            summary["gflops_per_second"] = flops / record["seconds"] / 1e9 if record["seconds"] > 0 else None
+            if record.get("task_clock_ns"):
+                # above 1 when the stage ran in several worker processes
+                summary["cpu_utilization"] = record["task_clock_ns"] / 1e9 / record["seconds"] if record["seconds"] > 0 else None
+            if record.get("cycles"):
+                summary["ipc"] = record["instructions"] / float(record["cycles"])
+            if record.get("llc_misses"):
+                dram_bytes = record["llc_misses"] * CACHE_LINE_BYTES
+                summary["dram_gb_per_second"] = dram_bytes / record["seconds"] / 1e9 if record["seconds"] > 0 else None
+                summary["operational_intensity"] = flops / dram_bytes
+                if ridge is not None:
+                    summary["bound"] = "compute" if summary["operational_intensity"] >= ridge else "memory"
+            stages[name] = summary
+        return {"counters": sorted(self._fds.keys()), "unavailable_reason": self.unavailable_reason,
+                "peak_gflops": peak_gflops, "peak_bandwidth_gbs": peak_bandwidth_gbs,
+                "ridge_point": ridge, "stages": stages}
+
+    def write_json(self, file_name, peak_gflops=None, peak_bandwidth_gbs=None):
+        with open(file_name, "w") as handle:
+            json.dump(self.report(peak_gflops, peak_bandwidth_gbs), handle, indent=2)
+        return None
+
+    def print_summary(self, peak_gflops=None, peak_bandwidth_gbs=None):
+        report = self.report(peak_gflops, peak_bandwidth_gbs)
+        if not self.has_counters():
+            print("No hardware counters: %s" % report["unavailable_reason"])
+        print("%-24s %6s %10s %6s %8s %10s %12s %10s %8s" % ("stage", "calls", "seconds", "CPUs", "IPC",
+                                                            "GFLOP/s", "DRAM GB/s", "FLOP/B", "bound"))
+        for name, summary in report["stages"].items():
+            def fmt(key, form):
+                return form % summary[key] if summary.get(key) is not None else "-"
+            print("%-24s %6d %10.3f %6s %8s %10s %12s %10s %8s" % (name, summary["calls"], summary["seconds"],
+                                                                   fmt("cpu_utilization", "%.1f"),
+                                                                   fmt("ipc", "%.2f"),
+                                                                   fmt("gflops_per_second", "%.2f"),
+                                                                   fmt("dram_gb_per_second", "%.2f"),
+                                                                   fmt("operational_intensity", "%.2f"),
+                                                                   summary.get("bound", "-")))
+        return None
+
+
+_counters = PerfCounters(enabled=False)
+
+
+def enable(enabled=True):
+    """
+    switch the process-wide counters used by perf_stage() on or off
+    :return: PerfCounters
+    """
+    global _counters
+    _counters.close()
+    _counters = PerfCounters(enabled=enabled)
+    return _counters
+
+
+def get_counters():
+    return _counters
+
+
+def perf_stage(name, flops=None):
+    return _counters.stage(name, flops)
+
+
+def fft_flops(shape):
+    """
+    :return: float, the usual 5 N log2(N) estimate for a complex FFT of N points
+    """
+    nr_points = float(np.prod(shape))
+    return 5. * nr_points * np.log2(nr_points)
@@ -242,6 +242,8 @@ class PostProcess(object):
         log_of_divisors = self._nc_handle.variables["log_of_divisors"][:]
         common_divisor  = log_of_divisors.max()
         strata_weights *= np.exp(log_of_divisors - common_divisor)
+        if "conformer_weight" in self._nc_handle.variables.keys():
+            strata_weights *= self._nc_handle.variables["conformer_weight"][:]
         strata_weights /= strata_weights.sum()
 
         conf_trans_inds = []
@@ -416,19 +418,27 @@ class PostProcess(object):
         """
         v_0 = 1661.
         beta = 1./ KB/ self._temperature
+        # rows kept by the SO(3) prescreen are the low coarse energy rotations only
+        if "rotation_index" in self._nc_handle.variables.keys():
+            print("WARNING: the rotations were pruned by an SO(3) search, the BPMF is biased to the kept rotations")
         v_binding = self._nc_handle.variables["volume"][:].mean()
         print("v_binding %f"%v_binding)
         correction = -KB * self._temperature * np.log(v_binding / v_0 / 8 / np.pi**2)
         print("Volume correction %f"%correction)
 
         nr_grid_points = np.array(self._nc_handle.variables["nr_grid_points"][:], dtype=float)
-        number_of_samples = nr_grid_points.sum()
 
         exponential_sums = self._nc_handle.variables["exponential_sums"][:]
         log_of_divisors  = self._nc_handle.variables["log_of_divisors"][:]
         common_divisor  = log_of_divisors.max()
 
         exponential_sums *= np.exp(log_of_divisors - common_divisor)
+        # rows of a clustered conformer ensemble stand for conformer_weight input conformers
+        if "conformer_weight" in self._nc_handle.variables.keys():
+            conformer_weights = np.array(self._nc_handle.variables["conformer_weight"][:], dtype=float)
+            exponential_sums *= conformer_weights
+            nr_grid_points *= conformer_weights
+        number_of_samples = nr_grid_points.sum()
         exp_mean = exponential_sums.sum() / number_of_samples
 
         gas_bpmf = -KB * self._temperature * (np.log(exp_mean) + common_divisor)
@@ -439,6 +449,16 @@ class PostProcess(object):
         if str(self._gas_bpmf_std) == "nan":
             self._gas_bpmf_std = 0.
 
+        # translations masked by distance restraints count as zeros in exp_mean, the bias is
+        # -kT ln of the allowed fraction, gas_bpmf - restraint_bias is the BPMF within the restraints
+        self._restraint_bias = 0.
+        if "restraint_nr_allowed" in self._nc_handle.variables.keys():
+            nr_allowed = np.array(self._nc_handle.variables["restraint_nr_allowed"][:], dtype=float)
+            if "conformer_weight" in self._nc_handle.variables.keys():
+                nr_allowed *= conformer_weights
+            self._restraint_bias = -KB * self._temperature * np.log(nr_allowed.sum() / number_of_samples)
+            print("Restraint bias %f" % self._restraint_bias)
+
         self._bpmf = {}
         for p in self._gas_phases:
             self._bpmf[p] = gas_bpmf
@@ -468,6 +488,8 @@ class PostProcess(object):
         data = {"bpmf" : self._bpmf, 
                 "mean_Psi" : self._mean_interaction_energies,
                 "min_Psi" : self._min_interaction_energies}
+        if "restraint_nr_allowed" in self._nc_handle.variables.keys():
+            data["restraint_bias"] = self._restraint_bias
 
         standard_dev = {}
         standard_dev["interactions_energies"] = self._std_interaction_energies
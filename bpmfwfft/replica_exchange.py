@@ -0,0 +1,199 @@
+"""
+Exchange moves of temperature replica exchange, on numpy arrays of potential energies.
+
+Replicas keep their coordinates; an accepted exchange swaps the temperatures of two replicas.
+States are the temperatures of the ladder, in increasing order, and replica_states[r] is the state of
+replica r. Swapping the states of replicas a and b, at states i and j, is accepted with probability
+    min(1, exp[(beta_i - beta_j) (E_a - E_b)])
+
+"neighbor" attempts the pairs (0, 1), (2, 3), ... and (1, 2), (3, 4), ... on alternate calls.
+"all_pairs" is the independence sampling (Gibbs) exchange of Chodera and Shirts, J Chem Phys 135,
+194110 (2011): many swaps between randomly chosen pairs of states, n_states^3 by default, so that the
+permutation of states is nearly drawn from its conditional distribution given the energies.
+
+During equilibration, adapt_ladder moves the inner temperatures so that the running mean acceptance
+probabilities of the neighbor pairs become equal; the lowest and highest temperatures are kept.
+The step shrinks as 1/sqrt(number of adaptations), so the ladder settles.
+"""
+from __future__ import print_function
+
+import numpy as np
+
+KB = 0.001987204134799235  # kcal/mol/K
+EXCHANGE_SCHEMES = ("neighbor", "all_pairs")
+
+
+class TemperatureExchange(object):
+    def __init__(self, temperatures, scheme="neighbor", nr_swap_attempts=None, random_state=None):
+        """
+        :param temperatures: list or ndarray of float, increasing
+        :param scheme: str, "neighbor" or "all_pairs"
+        :param nr_swap_attempts: None or int, swaps per exchange for "all_pairs", default n_states^3
+        :param random_state: None, int or np.random.RandomState
+        """
+        temperatures = np.array(temperatures, dtype=float)
+        assert temperatures.ndim == 1 and temperatures.shape[0] > 1, "need at least two temperatures"
+        assert np.all(temperatures > 0), "temperatures must be positive"
+        assert np.all(np.diff(temperatures) > 0), "temperatures must be increasing"
+        assert scheme in EXCHANGE_SCHEMES, "scheme must be one of " + ", ".join(EXCHANGE_SCHEMES)
+
+        self._temperatures = temperatures
+        self._scheme = scheme
+        nstates = temperatures.shape[0]
+        if nr_swap_attempts is None:
+            nr_swap_attempts = nstates ** 3
+        self._nr_swap_attempts = nr_swap_attempts
+        if isinstance(random_state, np.random.RandomState):
+            self._random = random_state
+        else:
+            self._random = np.random.RandomState(random_state)
+
+        self._replica_states = np.arange(nstates)
+        self._start = 0
+        self.reset_statistics()
+
+    def reset_statistics(self):
+        nstates = self._temperatures.shape[0]
+        self._accepted = np.zeros([nstates, nstates], dtype=float)
+        self._attempted = np.zeros([nstates, nstates], dtype=float)
+        self._mean_neighbor_prob = None
+        self._nr_adaptations = 0
+        return None
+
+    def get_temperatures(self):
+        return np.copy(self._temperatures)
+
+    def get_nstates(self):
+        return self._temperatures.shape[0]
+
+    def get_replica_states(self):
+        """
+        :return: 1d array of int, the state of every replica
+        """
+        return np.copy(self._replica_states)
+
+    def get_state_replicas(self):
+        """
+        :return: 1d array of int, the replica at every state
+        """
+        return np.argsort(self._replica_states)
+
+    def get_replica_temperatures(self):
+        return self._temperatures[self._replica_states]
+
+    def _log_acceptance(self, state_i, state_j, energy_i, energy_j):
+        betas = 1. / KB / self._temperatures
+        return (betas[state_i] - betas[state_j]) * (energy_i - energy_j)
+
+    def _neighbor_probabilities(self, state_energies):
+        log_acc = self._log_acceptance(np.arange(self.get_nstates() - 1), np.arange(1, self.get_nstates()),
+                                       state_energies[:-1], state_energies[1:])
+        return np.exp(np.minimum(log_acc, 0.))
+
+    def _attempt(self, state_replicas, energies, betas, state_i, state_j, log_uniform):
+        replica_i, replica_j = state_replicas[state_i], state_replicas[state_j]
+        self._attempted[state_i, state_j] += 1.
+        if (betas[state_i] - betas[state_j]) * (energies[replica_i] - energies[replica_j]) >= log_uniform:
+            state_replicas[state_i], state_replicas[state_j] = replica_j, replica_i
+            self._accepted[state_i, state_j] += 1.
+        return None
+
+    def exchange(self, energies):
+        """
+        :param energies: 1d array of float, potential energy of every replica in kcal/mol
+        :return: 1d array of int, the new state of every replica
+        """
+        energies = np.asarray(energies, dtype=float)
+        nstates = self.get_nstates()
+        assert energies.shape == (nstates,), "need one energy per replica"
+        state_replicas = self.get_state_replicas().tolist()
+        betas = (1. / KB / self._temperatures).tolist()
+        energies = energies.tolist()
+
+        if self._scheme == "neighbor":
+            pairs = [(state_i, state_i + 1) for state_i in range(self._start, nstates - 1, 2)]
+            self._start = 1 - self._start
+        else:
+            # draw all pairs at once, state_i < state_j
+            first = self._random.randint(nstates, size=self._nr_swap_attempts)
+            second = self._random.randint(nstates - 1, size=self._nr_swap_attempts)
+            second += second >= first
+            pairs = list(zip(np.minimum(first, second).tolist(), np.maximum(first, second).tolist()))
+        log_uniforms = np.log(self._random.random_sample(len(pairs))).tolist()
+        for (state_i, state_j), log_uniform in zip(pairs, log_uniforms):
+            self._attempt(state_replicas, energies, betas, state_i, state_j, log_uniform)
+
+        self._replica_states[state_replicas] = np.arange(nstates)
+        return self.get_replica_states()
+
+    def adapt_ladder(self, energies, gain=0.5, memory=0.9):
+        """
+        move the inner temperatures towards equal neighbor acceptance; call before exchange()
+        :param energies: 1d array of float, potential energy of every replica in kcal/mol
+        :param gain: float, first step of the log temperature gaps
+        :param memory: float in [0, 1), weight of the past in the running mean acceptance probabilities
+        :return: 1d array of float, the new temperature of every replica
+        """
+        assert 0. <= memory < 1., "memory must be in [0, 1)"
+        state_energies = np.asarray(energies, dtype=float)[self.get_state_replicas()]
+        probabilities = self._neighbor_probabilities(state_energies)
+        if self._mean_neighbor_prob is None:
+            self._mean_neighbor_prob = probabilities
+        else:
+            self._mean_neighbor_prob = memory * self._mean_neighbor_prob + (1. - memory) * probabilities
+        self._nr_adaptations += 1
+
+        # a gap with high acceptance widens, one with low acceptance narrows
+        log_gaps = np.diff(np.log(self._temperatures))
+        step = gain / np.sqrt(self._nr_adaptations)
+        log_gaps *= np.exp(step * (self._mean_neighbor_prob - self._mean_neighbor_prob.mean()))
+        log_gaps *= np.log(self._temperatures[-1] / self._temperatures[0]) / log_gaps.sum()
+        log_temperatures = np.log(self._temperatures[0]) + np.concatenate([[0.], np.cumsum(log_gaps)])
+        self._temperatures[1:-1] = np.exp(log_temperatures[1:-1])
+        return self.get_replica_temperatures()
+
+    def get_mean_neighbor_probabilities(self):
+        return None if self._mean_neighbor_prob is None else np.copy(self._mean_neighbor_prob)
+
+    def get_acceptance_matrix(self):
+        """
+        :return: 2d array, accepted / attempted swaps between states, nan for pairs never attempted
+        """
+        # attempts are counted with state_i < state_j
+        accepted = self._accepted + self._accepted.T
+        attempted = self._attempted + self._attempted.T
+        with np.errstate(invalid="ignore", divide="ignore"):
+            return accepted / attempted
+
+    def get_neighbor_acceptance(self):
+        """
+        :return: 1d array, accepted / attempted swaps between states k and k+1
+        """
+        nstates = self.get_nstates()
+        return self.get_acceptance_matrix()[np.arange(nstates - 1), np.arange(1, nstates)]
+
+
+def statistical_inefficiency(series):
+    """
+    g = 1 + 2 sum_t (1 - t/N) C(t), summed until the normalized autocorrelation C(t) first drops to 0
+    :param series: 1d array
+    :return: float, >= 1; N / g is the number of uncorrelated samples
+    """
+    series = np.asarray(series, dtype=float)
+    n = series.shape[0]
+    if n < 2:
+        return 1.
+    dx = series - series.mean()
+    variance = np.dot(dx, dx) / n
+    if variance == 0.:
+        return 1.
+    nfft = 1 << int(np.ceil(np.log2(2 * n)))
+    spectrum = np.fft.rfft(dx, nfft)
+    corr = np.fft.irfft(spectrum * np.conjugate(spectrum), nfft)[:n] / np.arange(n, 0, -1) / variance
+
+    g = 1.
+    for t in range(1, n):
+        if corr[t] <= 0.:
+            break
+        g += 2. * corr[t] * (1. - float(t) / n)
+    return max(g, 1.)
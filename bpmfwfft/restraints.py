@@ -0,0 +1,132 @@
+"""
+Receptor-ligand distance restraints as masks over the FFT translations.
+
+A restraint file has one restraint per line:
+    receptor_atom  ligand_atom  lower  upper  [group]
+atoms are numbered from 1 in prmtop order, lower and upper are distances in angstrom, and
+lines starting with # are comments. Restraints with the same group label are ambiguous, as NMR
+ambiguous restraints or a set of possible interface contacts: at least one of them must hold.
+Restraints without a label are groups of their own, e.g. crosslinks.
+
+For a ligand placed at the lower corner of the grid, translation (i, j, k) moves it by
+(i, j, k) * spacing, so a restraint between receptor atom a and ligand atom b allows the
+translations within a spherical shell, of radii lower and upper, around rec_crd[a] - lig_crd[b].
+Each shell is evaluated on the bounding box of its outer ball only.
+"""
+from __future__ import print_function
+
+import numpy as np
+
+
+def load_restraints(file_name):
+    """
+    :param file_name: str
+    :return: dict with 1-arrays "receptor_atoms", "ligand_atoms" (numbered from 0), "lower", "upper",
+    and "groups", int labels numbered from 0 in order of appearance
+    """
+    receptor_atoms, ligand_atoms, lower, upper, group_names = [], [], [], [], []
+    with open(file_name, "r") as handle:
+        for line_number, line in enumerate(handle, start=1):
+            words = line.split("#")[0].split()
+            if len(words) == 0:
+                continue
+            if len(words) not in (4, 5):
+                raise RuntimeError("%s line %d: expected receptor_atom ligand_atom lower upper [group]" % (
+                    file_name, line_number))
+            receptor_atoms.append(int(words[0]) - 1)
+            ligand_atoms.append(int(words[1]) - 1)
+            lower.append(float(words[2]))
+            upper.append(float(words[3]))
+            # unlabelled restraints are groups of their own
+            group_names.append(words[4] if len(words) == 5 else ("line", line_number))
+
+    labels = {}
+    groups = [labels.setdefault(name, len(labels)) for name in group_names]
+    restraints = {"receptor_atoms": np.array(receptor_atoms, dtype=int),
+                  "ligand_atoms": np.array(ligand_atoms, dtype=int),
+                  "lower": np.array(lower, dtype=float),
+                  "upper": np.array(upper, dtype=float),
+                  "groups": np.array(groups, dtype=int)}
+    if np.any(restraints["receptor_atoms"] < 0) or np.any(restraints["ligand_atoms"] < 0):
+        raise RuntimeError("%s: atoms are numbered from 1" % file_name)
+    if np.any(restraints["lower"] > restraints["upper"]):
+        raise RuntimeError("%s: lower bound larger than upper bound" % file_name)
+    return restraints
+
+
+class TranslationRestraints(object):
+    def __init__(self, restraints, max_violated_groups=0):
+        """
+        :param restraints: dict returned by load_restraints
+        :param max_violated_groups: int, a translation is allowed if at most this many groups are violated
+        """
+        assert max_violated_groups >= 0, "max_violated_groups must be >= 0"
+        self._restraints = restraints
+        self._max_violated_groups = max_violated_groups
+        self._nr_groups = int(restraints["groups"].max()) + 1 if restraints["groups"].shape[0] > 0 else 0
+
+    @classmethod
+    def from_file(cls, file_name, max_violated_groups=0):
+        return cls(load_restraints(file_name), max_violated_groups)
+
+    def get_restraints(self):
+        return self._restraints
+
+    def get_max_violated_groups(self):
+        return self._max_violated_groups
+
+    def check_atoms(self, rec_natoms, lig_natoms):
+        if np.any(self._restraints["receptor_atoms"] >= rec_natoms):
+            raise RuntimeError("Restraint receptor atom beyond the %d receptor atoms" % rec_natoms)
+        if np.any(self._restraints["ligand_atoms"] >= lig_natoms):
+            raise RuntimeError("Restraint ligand atom beyond the %d ligand atoms" % lig_natoms)
+        return None
+
+    def _add_shell(self, group_mask, center, lower, upper, spacing):
+        """
+        set group_mask True where lower <= |t * spacing - center| <= upper
+        """
+        shape = np.array(group_mask.shape)
+        first = np.maximum(np.floor((center - upper) / spacing).astype(int), 0)
+        last = np.minimum(np.ceil((center + upper) / spacing).astype(int) + 1, shape)
+        if np.any(last <= first):
+            return None
+        d2 = [((np.arange(first[i], last[i]) * spacing[i] - center[i]) ** 2) for i in range(3)]
+        d2 = d2[0][:, np.newaxis, np.newaxis] + d2[1][np.newaxis, :, np.newaxis] + d2[2][np.newaxis, np.newaxis, :]
+        shell = (d2 <= upper ** 2) & (d2 >= lower ** 2)
+        box = group_mask[first[0]:last[0], first[1]:last[1], first[2]:last[2]]
+        np.logical_or(box, shell, out=box)
+        return None
+
+    def mask(self, rec_crd, lig_crd, spacing, shape, out=None):
+        """
+        :param rec_crd: 2d array, receptor coordinates in the grid frame
+        :param lig_crd: 2d array, ligand coordinates at translation (0, 0, 0)
+        :param spacing: 3-array or float
+        :param shape: tuple, number of translations along x, y, z
+        :param out: None or 3d array of bool of the given shape
+        :return: 3d array of bool, True for the translations that satisfy the restraints
+        """
+        spacing = np.broadcast_to(np.asarray(spacing, dtype=float), (3,))
+        allowed = np.ones(shape, dtype=bool) if out is None else out
+        allowed[...] = True
+        if self._nr_groups == 0:
+            return allowed
+
+        restraints = self._restraints
+        centers = rec_crd[restraints["receptor_atoms"]] - lig_crd[restraints["ligand_atoms"]]
+        group_mask = np.empty(shape, dtype=bool)
+        nr_violated = None
+        if self._max_violated_groups > 0:
+            nr_violated = np.zeros(shape, dtype=np.uint16)
+        for group in range(self._nr_groups):
+            group_mask[...] = False
+            for i in np.flatnonzero(restraints["groups"] == group):
+                self._add_shell(group_mask, centers[i], restraints["lower"][i], restraints["upper"][i], spacing)
+            if nr_violated is None:
+                np.logical_and(allowed, group_mask, out=allowed)
+            else:
+                nr_violated += ~group_mask
+        if nr_violated is not None:
+            np.less_equal(nr_violated, self._max_violated_groups, out=allowed)
+        return allowed
@@ -0,0 +1,146 @@
+"""
+Recombine stored per-term energies with new term weights, without running the FFTs again.
+
+Sampling(..., store_term_energies=True) stores the LJr, LJa, electrostatic, sasa and desolvation parts of the
+resampled (lowest) energies of every rotation. For new weights w, the interaction energy of those
+translations is sum_t w_t E_t and is recomputed exactly. The translations that were not resampled
+enter through their exponential sum at the sampling weights:
+    - with store_term_partials=True, shifted to first order by exp(-beta sum_t (w_t - 1) <E_t>_tail),
+      <E_t>_tail being the Boltzmann mean of term t over those translations;
+    - otherwise, unchanged.
+The larger energy_sample_size_per_ligand, the smaller the part of the sum that is approximated.
+The first-order tail is a lower bound of the tail sum and is meant for weights within some 20% of 1.
+"""
+from __future__ import print_function
+
+import numpy as np
+import netCDF4
+
+try:
+    from bpmfwfft.fft_sampling import TERM_NAMES, OPTIONAL_TERM_NAMES, KB
+except:
+    from fft_sampling import TERM_NAMES, OPTIONAL_TERM_NAMES, KB
+
+V_0 = 1661.
+
+
+def load_term_data(nc_file_name):
+    """
+    :param nc_file_name: str, output_nc of Sampling run with store_term_energies=True
+    :return: dict
+    """
+    nc_handle = netCDF4.Dataset(nc_file_name, "r")
+    for name in TERM_NAMES:
+        if f"{name}_term_energies" not in nc_handle.variables.keys() and name not in OPTIONAL_TERM_NAMES:
+            nc_handle.close()
+            raise RuntimeError("%s has no term energies, run Sampling with store_term_energies=True" % nc_file_name)
+    nr_rotations = int(nc_handle.variables["current_rotation_index"][0])
+    data = {}
+    for key in ["volume", "nr_grid_points", "exponential_sums", "log_of_divisors", "resampled_energies"]:
+        data[key] = np.array(nc_handle.variables[key][:nr_rotations], dtype=float)
+    data["term_energies"] = {}
+    for name in TERM_NAMES:
+        if f"{name}_term_energies" not in nc_handle.variables.keys():
+            # written before the term existed
+            data["term_energies"][name] = np.zeros_like(data["resampled_energies"])
+            continue
+        data["term_energies"][name] = np.array(nc_handle.variables[f"{name}_term_energies"][:nr_rotations],
+                                               dtype=float)
+    if "tail_log_exponential_sums" in nc_handle.variables.keys():
+        data["tail_log_exponential_sums"] = np.array(nc_handle.variables["tail_log_exponential_sums"][:nr_rotations],
+                                                     dtype=float)
+        data["tail_mean_energies"] = {}
+        for name in TERM_NAMES:
+            if f"{name}_tail_mean_energy" not in nc_handle.variables.keys():
+                data["tail_mean_energies"][name] = np.zeros(nr_rotations, dtype=float)
+                continue
+            data["tail_mean_energies"][name] = np.array(nc_handle.variables[f"{name}_tail_mean_energy"][:nr_rotations],
+                                                        dtype=float)
+    nc_handle.close()
+    return data
+
+
+def _log_sum_exp(x, axis=None):
+    x_max = np.max(x, axis=axis, keepdims=True)
+    x_max = np.where(np.isfinite(x_max), x_max, 0.)
+    result = np.log(np.sum(np.exp(x - x_max), axis=axis, keepdims=True)) + x_max
+    return np.squeeze(result, axis=axis)
+
+
+def _weighted_energies(term_energies, weights):
+    """
+    sum_t w_t E_t; the inf padding of rotations with fewer translations than the sample size stays inf
+    for any weights, instead of 0 * inf or inf - inf
+    """
+    padded = np.zeros(term_energies[TERM_NAMES[0]].shape, dtype=bool)
+    for name in TERM_NAMES:
+        padded |= ~np.isfinite(term_energies[name])
+    energies = sum(weights[name] * np.where(padded, 0., term_energies[name]) for name in TERM_NAMES)
+    energies[padded] = np.inf
+    return energies
+
+
+def log_exponential_sums(data, weights, temperature=300.):
+    """
+    :param data: dict returned by load_term_data
+    :param weights: dict, term name -> weight, missing terms keep weight 1
+    :param temperature: float, must be the sampling temperature
+    :return: 1-array of float, log of sum(exp(-beta E)) over the translations of every rotation
+    """
+    for name in weights:
+        assert name in TERM_NAMES, "unknown term %s" % name
+    beta = 1. / KB / temperature
+    weights = dict((name, float(weights.get(name, 1.))) for name in TERM_NAMES)
+
+    energies = _weighted_energies(data["term_energies"], weights)
+    old_energies = _weighted_energies(data["term_energies"], dict((name, 1.) for name in TERM_NAMES))
+    head_new = _log_sum_exp(-beta * energies, axis=1)
+    head_old = _log_sum_exp(-beta * old_energies, axis=1)
+    log_total = np.log(data["exponential_sums"]) + data["log_of_divisors"]
+
+    if "tail_log_exponential_sums" in data:
+        log_tail = data["tail_log_exponential_sums"].copy()
+        shift = sum((weights[name] - 1.) * data["tail_mean_energies"][name] for name in TERM_NAMES)
+        log_tail -= beta * shift
+    else:
+        # the old sum minus the resampled part, at the old weights
+        with np.errstate(divide="ignore"):
+            log_tail = log_total + np.log(np.clip(-np.expm1(head_old - log_total), 0., None))
+    return np.logaddexp(head_new, log_tail)
+
+
+def reweight_data(data, weights, temperature=300.):
+    """
+    gas phase BPMF, as in PostProcess._estimate_gas_bpmf, for new term weights
+    :param data: dict returned by load_term_data
+    :param weights: dict, term name -> weight, e.g. {"LJr": 0.9, "LJa": 0.9, "sasa": 1.5}
+    :param temperature: float
+    :return: float, kcal/mol
+    """
+    log_sums = log_exponential_sums(data, weights, temperature)
+    number_of_samples = data["nr_grid_points"].sum()
+    v_binding = data["volume"].mean()
+    correction = -KB * temperature * np.log(v_binding / V_0 / 8 / np.pi ** 2)
+    bpmf = -KB * temperature * (_log_sum_exp(log_sums) - np.log(number_of_samples))
+    return bpmf + correction
+
+
+def reweight(nc_file_name, weights, temperature=300.):
+    """
+    :param nc_file_name: str, output_nc of Sampling run with store_term_energies=True
+    :param weights: dict, term name -> weight
+    :param temperature: float
+    :return: float, gas phase BPMF in kcal/mol
+    """
+    return reweight_data(load_term_data(nc_file_name), weights, temperature)
+
+
+def scan_weights(nc_file_name, weight_sets, temperature=300.):
+    """
+    :param nc_file_name: str
+    :param weight_sets: list of dict
+    :param temperature: float
+    :return: list of float, gas phase BPMF for every set of weights
+    """
+    data = load_term_data(nc_file_name)
+    return [reweight_data(data, weights, temperature) for weights in weight_sets]
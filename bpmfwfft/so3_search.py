@@ -0,0 +1,324 @@
+"""
+Coarse rotational search on SO(3) with spherical harmonics.
+
+Receptor potential grids are expanded in spherical harmonics on radial shells around a point c,
+ligand atom "charges" are expanded on the same shells around the ligand center.
+The interaction energy for every rotation on an Euler angle grid is then obtained at once:
+the sum over the Wigner small-d functions is done directly for each beta, and the sums over
+alpha and gamma are done with a 2D FFT (Kostelec and Rockmore, J Fourier Anal Appl 2008, 14, 145).
+
+E(alpha, beta, gamma) = sum_l sum_{m, m'} F^l_{m m'} exp(i m alpha) d^l_{m m'}(beta) exp(i m' gamma)
+F^l_{m m'} = sum_shells f_lm(r_s) g_lm'(r_s)
+
+The rotation (alpha, beta, gamma) is R = Rz(alpha) Ry(beta) Rz(gamma), applied to the ligand
+coordinates relative to the ligand center, the same way rotation.py builds ligand ensembles.
+"""
+from __future__ import print_function
+
+import time
+
+import numpy as np
+
+CHARGE_NAMES = {"electrostatic": "CHARGE_E_UNIT", "LJa": "A_LJ_CHARGE", "LJr": "R_LJ_CHARGE"}
+
+
+def _sph_harm(lmax, theta, phi):
+    """
+    orthonormal complex spherical harmonics with the Condon-Shortley phase
+    :param lmax: int
+    :param theta: 1-array, polar angles
+    :param phi: 1-array, azimuthal angles, same shape as theta
+    :return: complex ndarray of shape (lmax+1, 2*lmax+1, npoints), Y[l, m+lmax]
+    """
+    theta = np.asarray(theta, dtype=float)
+    phi = np.asarray(phi, dtype=float)
+    x = np.cos(theta)
+    s = np.sin(theta)
+
+    plm = np.zeros((lmax + 1, lmax + 1) + x.shape, dtype=float)
+    plm[0, 0] = 1. / np.sqrt(4. * np.pi)
+    for m in range(1, lmax + 1):
+        plm[m, m] = -np.sqrt((2. * m + 1.) / (2. * m)) * s * plm[m - 1, m - 1]
+    for m in range(0, lmax):
+        plm[m + 1, m] = np.sqrt(2. * m + 3.) * x * plm[m, m]
+    for m in range(0, lmax + 1):
+        for l in range(m + 2, lmax + 1):
+            a_lm = np.sqrt((4. * l * l - 1.) / (l * l - m * m))
+            a_l1m = np.sqrt((4. * (l - 1) * (l - 1) - 1.) / ((l - 1) * (l - 1) - m * m))
+            plm[l, m] = a_lm * (x * plm[l - 1, m] - plm[l - 2, m] / a_l1m)
+
+    ylm = np.zeros((lmax + 1, 2 * lmax + 1) + x.shape, dtype=complex)
+    for m in range(0, lmax + 1):
+        e_imphi = np.exp(1.j * m * phi)
+        for l in range(m, lmax + 1):
+            ylm[l, lmax + m] = plm[l, m] * e_imphi
+            if m > 0:
+                ylm[l, lmax - m] = (-1) ** m * np.conjugate(ylm[l, lmax + m])
+    return ylm
+
+
+def _wigner_small_d(lmax, betas):
+    """
+    Wigner small-d matrices d^l_{m m'}(beta) = <l m| exp(-i beta J_y) |l m'>
+    :param lmax: int
+    :param betas: 1-array
+    :return: float ndarray of shape (lmax+1, nbetas, 2*lmax+1, 2*lmax+1), zero outside |m|, |m'| <= l
+    """
+    betas = np.asarray(betas, dtype=float)
+    d = np.zeros((lmax + 1, betas.shape[0], 2 * lmax + 1, 2 * lmax + 1), dtype=float)
+    for l in range(lmax + 1):
+        ms = np.arange(-l, l + 1, dtype=float)
+        j_plus = np.diag(np.sqrt(l * (l + 1.) - ms[:-1] * (ms[:-1] + 1.)), k=-1)
+        j_y = (j_plus - j_plus.T) / 2.j
+        eigen_values, eigen_vectors = np.linalg.eigh(j_y)
+        phases = np.exp(-1.j * np.outer(betas, eigen_values))
+        d_l = np.einsum("ik,bk,jk->bij", eigen_vectors, phases, eigen_vectors.conjugate())
+        d[l, :, lmax - l:lmax + l + 1, lmax - l:lmax + l + 1] = np.real(d_l)
+    return d
+
+
+def euler_to_rotation_matrix(alpha, beta, gamma):
+    """
+    R = Rz(alpha) Ry(beta) Rz(gamma)
+    """
+    def rz(a):
+        return np.array([[np.cos(a), -np.sin(a), 0.], [np.sin(a), np.cos(a), 0.], [0., 0., 1.]], dtype=float)
+
+    def ry(b):
+        return np.array([[np.cos(b), 0., np.sin(b)], [0., 1., 0.], [-np.sin(b), 0., np.cos(b)]], dtype=float)
+
+    return np.dot(rz(alpha), np.dot(ry(beta), rz(gamma)))
+
+
+def rotation_matrix_to_euler(rot_mats):
+    """
+    inverse of euler_to_rotation_matrix
+    :param rot_mats: ndarray of shape (n, 3, 3)
+    :return: alpha, beta, gamma, each 1-array of len n
+    """
+    rot_mats = np.asarray(rot_mats, dtype=float)
+    beta = np.arccos(np.clip(rot_mats[:, 2, 2], -1., 1.))
+    alpha = np.arctan2(rot_mats[:, 1, 2], rot_mats[:, 0, 2])
+    gamma = np.arctan2(rot_mats[:, 2, 1], -rot_mats[:, 2, 0])
+    # beta == 0 or pi, only alpha + gamma (or alpha - gamma) is defined
+    degenerate = np.abs(np.sin(beta)) < 1e-8
+    alpha[degenerate] = np.arctan2(rot_mats[degenerate, 1, 0], rot_mats[degenerate, 0, 0])
+    gamma[degenerate] = 0.
+    return np.mod(alpha, 2 * np.pi), beta, np.mod(gamma, 2 * np.pi)
+
+
+def kabsch_rotations(ref_crd, crd_ensemble):
+    """
+    best-fit rotations R such that crd - center ~= R (ref_crd - ref_center)
+    :param ref_crd: ndarray of shape (natoms, 3)
+    :param crd_ensemble: ndarray of shape (nconfs, natoms, 3)
+    :return: ndarray of shape (nconfs, 3, 3)
+    """
+    ref = ref_crd - ref_crd.mean(axis=0)
+    ens = crd_ensemble - crd_ensemble.mean(axis=1)[:, np.newaxis, :]
+    covariances = np.einsum("nai,aj->nij", ens, ref)
+    u, s, vt = np.linalg.svd(covariances)
+    signs = np.sign(np.linalg.det(np.einsum("nij,njk->nik", u, vt)))
+    u[:, :, 2] *= signs[:, np.newaxis]
+    return np.einsum("nij,njk->nik", u, vt)
+
+
+def _trilinear(grid, origin, spacing, points):
+    """
+    vectorized trilinear interpolation, points outside the grid are clamped to the border
+    :param grid: 3-array
+    :param origin: 3-array
+    :param spacing: 3-array
+    :param points: ndarray of shape (npoints, 3)
+    :return: 1-array of len npoints
+    """
+    counts = np.array(grid.shape, dtype=int)
+    frac = (points - origin) / spacing
+    frac = np.clip(frac, 0., counts - 1.000001)
+    lower = np.floor(frac).astype(int)
+    t = frac - lower
+    values = np.zeros(points.shape[0], dtype=float)
+    for di in (0, 1):
+        wx = t[:, 0] if di else 1. - t[:, 0]
+        for dj in (0, 1):
+            wy = t[:, 1] if dj else 1. - t[:, 1]
+            for dk in (0, 1):
+                wz = t[:, 2] if dk else 1. - t[:, 2]
+                values += wx * wy * wz * grid[lower[:, 0] + di, lower[:, 1] + dj, lower[:, 2] + dk]
+    return values
+
+
+class SO3RotationalSearch(object):
+    """
+    coarse rotational energy map of a rigid ligand in the receptor potential grids
+    """
+
+    def __init__(self, rec_grid, lig_grid, bandwidth=8, nr_shells=8,
+                 grid_names=("LJr", "LJa", "electrostatic"), centers=None, potential_cap=10.):
+        """
+        :param rec_grid: an instance of RecGrid, its cached spectra are used to recover the potential grids
+        :param lig_grid: an instance of LigGrid, provides the reference ligand coordinate and charges
+        :param bandwidth: int B, harmonics up to l = B - 1 and a (2B)^3 Euler angle grid
+        :param nr_shells: int, number of radial shells covering the ligand
+        :param grid_names: tuple of str, receptor grids to include
+        :param centers: None or ndarray of shape (ncenters, 3), where the ligand center is put,
+        the map keeps the lowest energy over centers. If None, the receptor grid center.
+        :param potential_cap: float, receptor potentials are clipped to [-cap, cap] before the expansion
+        """
+        assert bandwidth >= 2, "bandwidth must be at least 2"
+        self._bandwidth = bandwidth
+        self._lmax = bandwidth - 1
+        self._nr_shells = nr_shells
+        self._grid_names = [name for name in grid_names if name in rec_grid.get_FFTs()]
+        self._potential_cap = potential_cap
+
+        grid_data = rec_grid.get_grids()
+        self._origin = np.array(grid_data["origin"], dtype=float)
+        self._spacing = np.array(grid_data["spacing"], dtype=float)
+        self._rec_FFTs = rec_grid.get_FFTs()
+        if centers is None:
+            upper = self._origin + (np.array(grid_data["counts"]) - 1) * self._spacing
+            centers = ((self._origin + upper) / 2.)[np.newaxis, :]
+        self._centers = np.array(centers, dtype=float).reshape(-1, 3)
+
+        prmtop = lig_grid.get_prmtop()
+        self._lig_charges = {name: np.array(prmtop[CHARGE_NAMES[name]], dtype=float) for name in self._grid_names}
+        self._lig_ref_crd = np.array(lig_grid.get_crd(), dtype=float)
+        # the ensemble is given in the input frame, lig_grid.get_crd() in the grid frame
+        self._to_grid_frame = lig_grid.to_grid_frame
+
+        self._betas = np.pi * (2. * np.arange(2 * bandwidth) + 1.) / (4. * bandwidth)
+        self._alphas = 2. * np.pi * np.arange(2 * bandwidth) / (2. * bandwidth)
+        self._gammas = np.copy(self._alphas)
+        self._small_d = _wigner_small_d(self._lmax, self._betas)
+
+        self._cal_shells()
+        self._energy_map = None
+
+    def _cal_shells(self):
+        ref = self._lig_ref_crd - self._lig_ref_crd.mean(axis=0)
+        r = np.sqrt((ref * ref).sum(axis=1))
+        shell_width = (r.max() + 1e-6) / self._nr_shells
+        self._shell_radii = (np.arange(self._nr_shells) + 0.5) * shell_width
+        self._atom_shells = np.minimum((r / shell_width).astype(int), self._nr_shells - 1)
+
+        theta = np.arccos(np.clip(ref[:, 2] / np.maximum(r, 1e-12), -1., 1.))
+        phi = np.arctan2(ref[:, 1], ref[:, 0])
+        self._lig_ylm = _sph_harm(self._lmax, theta, phi)
+
+        # Gauss-Legendre in cos(theta), uniform in phi
+        nodes, weights = np.polynomial.legendre.leggauss(self._bandwidth)
+        nr_phi = 2 * self._bandwidth
+        quad_theta = np.repeat(np.arccos(nodes), nr_phi)
+        quad_phi = np.tile(2. * np.pi * np.arange(nr_phi) / nr_phi, self._bandwidth)
+        self._quad_weights = np.repeat(weights, nr_phi) * 2. * np.pi / nr_phi
+        self._quad_ylm_conj = _sph_harm(self._lmax, quad_theta, quad_phi).conjugate()
+        self._quad_unit_vectors = np.array([np.sin(quad_theta) * np.cos(quad_phi),
+                                            np.sin(quad_theta) * np.sin(quad_phi),
+                                            np.cos(quad_theta)], dtype=float).transpose()
+        return None
+
+    def _lig_coefficients(self, name):
+        """
+        g_lm(r_s) = sum over atoms in shell s of q_a Y_lm(x_a)
+        :return: complex ndarray of shape (nr_shells, lmax+1, 2*lmax+1)
+        """
+        charges = self._lig_charges[name]
+        g = np.zeros((self._nr_shells,) + self._lig_ylm.shape[:2], dtype=complex)
+        for s in range(self._nr_shells):
+            in_shell = self._atom_shells == s
+            if np.any(in_shell):
+                g[s] = (self._lig_ylm[:, :, in_shell] * charges[in_shell]).sum(axis=-1)
+        return g
+
+    def _rec_coefficients(self, grid, center):
+        """
+        f_lm(r_s) = integral of f(c + r_s u) conj(Y_lm(u)) over the unit sphere
+        :return: complex ndarray of shape (nr_shells, lmax+1, 2*lmax+1)
+        """
+        f = np.zeros((self._nr_shells,) + self._quad_ylm_conj.shape[:2], dtype=complex)
+        for s, radius in enumerate(self._shell_radii):
+            points = center + radius * self._quad_unit_vectors
+            values = _trilinear(grid, self._origin, self._spacing, points)
+            values = np.clip(values, -self._potential_cap, self._potential_cap)
+            f[s] = (self._quad_ylm_conj * (values * self._quad_weights)).sum(axis=-1)
+        return f
+
+    def _cal_energy_map_at(self, rec_grids, center):
+        lmax = self._lmax
+        n = 2 * self._bandwidth
+        coef = np.zeros((lmax + 1, 2 * lmax + 1, 2 * lmax + 1), dtype=complex)
+        for name in self._grid_names:
+            f = self._rec_coefficients(rec_grids[name], center)
+            g = self._lig_coefficients(name)
+            coef += np.einsum("slm,sln->lmn", f, g)
+
+        energy_map = np.zeros((n, n, n), dtype=float)
+        wrapped = np.zeros((n, n), dtype=complex)
+        m_index = np.arange(-lmax, lmax + 1) % n
+        for j in range(self._betas.shape[0]):
+            t = (coef * self._small_d[:, j]).sum(axis=0)
+            wrapped[:] = 0.
+            wrapped[np.ix_(m_index, m_index)] = t
+            energy_map[:, j, :] = np.real(np.fft.ifft2(wrapped)) * n * n
+        return energy_map
+
+    def cal_energy_map(self):
+        """
+        :return: ndarray of shape (2B, 2B, 2B), energies on the (alpha, beta, gamma) grid
+        """
+        start_time = time.time()
+        rec_grids = {name: np.real(np.fft.ifftn(self._rec_FFTs[name])) for name in self._grid_names}
+        energy_map = None
+        for center in self._centers:
+            center_map = self._cal_energy_map_at(rec_grids, center)
+            energy_map = center_map if energy_map is None else np.minimum(energy_map, center_map)
+        del rec_grids
+        self._energy_map = energy_map
+        print("--- SO(3) energy map calculated in %s seconds ---" % (time.time() - start_time))
+        return self._energy_map
+
+    def get_energy_map(self):
+        if self._energy_map is None:
+            self.cal_energy_map()
+        return self._energy_map
+
+    def get_euler_grid(self):
+        return self._alphas, self._betas, self._gammas
+
+    def best_rotations(self, nr_rotations):
+        """
+        :return: ndarray of shape (nr_rotations, 3, 3), rotation matrices of the lowest map energies
+        """
+        energy_map = self.get_energy_map()
+        flat_ind = np.argsort(energy_map, axis=None)[:nr_rotations]
+        a, b, c = np.unravel_index(flat_ind, energy_map.shape)
+        return np.array([euler_to_rotation_matrix(self._alphas[i], self._betas[j], self._gammas[k])
+                         for i, j, k in zip(a, b, c)], dtype=float)
+
+    def score_ensemble(self, lig_coord_ensemble):
+        """
+        coarse energies for ligand coordinates that are rotations of the reference coordinate,
+        each one is looked up at the nearest Euler grid cell
+        :param lig_coord_ensemble: ndarray of shape (nconfs, natoms, 3), in the frame of the input receptor
+        :return: 1-array of len nconfs
+        """
+        energy_map = self.get_energy_map()
+        n = 2 * self._bandwidth
+        rot_mats = kabsch_rotations(self._lig_ref_crd, self._to_grid_frame(lig_coord_ensemble))
+        alpha, beta, gamma = rotation_matrix_to_euler(rot_mats)
+        i = np.round(alpha / (2. * np.pi) * n).astype(int) % n
+        # beta_j = pi (2j + 1) / (4B)
+        j = np.clip(np.round((beta * 4. * self._bandwidth / np.pi - 1.) / 2.).astype(int), 0, n - 1)
+        k = np.round(gamma / (2. * np.pi) * n).astype(int) % n
+        return energy_map[i, j, k]
+
+    def select_ensemble(self, lig_coord_ensemble, nr_rotations):
+        """
+        :return: 1-array of int, indices of the nr_rotations ensemble members with the lowest coarse energies,
+        in ascending order of index
+        """
+        scores = self.score_ensemble(lig_coord_ensemble)
+        nr_rotations = min(nr_rotations, scores.shape[0])
+        selected = np.argsort(scores)[:nr_rotations]
+        return np.sort(selected)
@@ -0,0 +1,309 @@
+"""
+Synthetic receptor/ligand systems of any size, written as AMBER prmtop/inpcrd files.
+
+Molecules are globular clouds of Lennard-Jones particles with element-like radii, masses and
+AMBER ff14SB-like LJ parameters, and small random partial charges summing to zero. Atoms are
+placed either randomly with a minimum separation or on a jittered cubic lattice. The receptor is
+centered in a cubic box and a matching "measured_binding_site.py" is written, so the files can
+go straight into RecGrid, LigGrid and Sampling without any download.
+"""
+from __future__ import print_function
+
+import os
+
+import numpy as np
+
+# element: (r_min / 2 in angstrom, well depth in kcal/mol, mass)
+ELEMENTS = {"C": (1.9080, 0.0860, 12.01),
+            "N": (1.8240, 0.1700, 14.01),
+            "O": (1.6612, 0.2100, 16.00),
+            "S": (2.0000, 0.2500, 32.06),
+            "H": (0.6000, 0.0157, 1.008)}
+# fraction of each element in a typical protein
+PROTEIN_COMPOSITION = {"C": 0.315, "N": 0.085, "O": 0.095, "S": 0.005, "H": 0.50}
+# atoms per cubic angstrom in a folded protein, hydrogens included
+PROTEIN_DENSITY = 0.08
+# amber charge unit
+AMBER_CHARGE = 18.2223
+ATOMS_PER_RESIDUE = 16
+# closest approach of two particles placed at random, in angstrom
+MIN_SEPARATION = 1.5
+
+
+def _element_list(natoms, composition, rng):
+    """
+    :return: list of str, element symbols in random order with the requested composition
+    """
+    elements = sorted(composition.keys())
+    fractions = np.array([composition[element] for element in elements], dtype=float)
+    fractions /= fractions.sum()
+    counts = np.floor(fractions * natoms).astype(int)
+    counts[np.argmax(fractions)] += natoms - counts.sum()
+    symbols = np.repeat(np.array(elements), counts)
+    rng.shuffle(symbols)
+    return symbols.tolist()
+
+
+def molecule_radius(natoms, density=PROTEIN_DENSITY):
+    """
+    :return: float, radius of a sphere holding natoms at the given density
+    """
+    return (3. * natoms / (4. * np.pi * density)) ** (1. / 3)
+
+
+def lattice_positions(natoms, density=PROTEIN_DENSITY, jitter=0.2, rng=None):
+    """
+    the natoms points of a cubic lattice closest to the origin, with uniform jitter
+    :return: 2-array of float, shape (natoms, 3)
+    """
+    if rng is None:
+        rng = np.random.default_rng()
+    lattice_spacing = density ** (-1. / 3)
+    half_count = int(np.ceil(molecule_radius(natoms, density) / lattice_spacing)) + 2
+    axis = np.arange(-half_count, half_count + 1, dtype=float) * lattice_spacing
+    points = np.stack(np.meshgrid(axis, axis, axis, indexing="ij"), axis=-1).reshape(-1, 3)
+    order = np.argsort(np.einsum("ij,ij->i", points, points), kind="stable")
+    points = points[order[:natoms]]
+    points += rng.uniform(-jitter, jitter, size=points.shape)
+    return points
+
+
+def random_positions(natoms, density=PROTEIN_DENSITY, min_separation=MIN_SEPARATION, rng=None,
+                     batch_size=4096):
+    """
+    random sequential addition of points in a sphere, candidates closer than min_separation
+    to an accepted point are rejected
+    :return: 2-array of float, shape (natoms, 3)
+    """
+    from scipy.spatial import cKDTree
+
+    if rng is None:
+        rng = np.random.default_rng()
+    radius = molecule_radius(natoms, density)
+    accepted = np.zeros((0, 3), dtype=float)
+    nr_empty_batches = 0
+    while accepted.shape[0] < natoms:
+        candidates = rng.uniform(-radius, radius, size=(batch_size, 3))
+        candidates = candidates[np.einsum("ij,ij->i", candidates, candidates) <= radius ** 2]
+        if accepted.shape[0] > 0:
+            distances, _ = cKDTree(accepted).query(candidates)
+            candidates = candidates[distances >= min_separation]
+        # candidates from the same batch must also be separated
+        if candidates.shape[0] > 1:
+            pairs = cKDTree(candidates).query_pairs(min_separation, output_type="ndarray")
+            keep = np.ones(candidates.shape[0], dtype=bool)
+            keep[pairs[:, 1]] = False
+            candidates = candidates[keep]
+        if candidates.shape[0] == 0:
+            nr_empty_batches += 1
+            if nr_empty_batches > 10:
+                # the sphere is jammed, let it grow
+                radius *= 1.05
+                nr_empty_batches = 0
+        accepted = np.concatenate([accepted, candidates[:natoms - accepted.shape[0]]], axis=0)
+    return accepted
+
+
+def generate_molecule(natoms, layout="random", composition=None, charge_std=0.3,
+                      density=PROTEIN_DENSITY, seed=None):
+    """
+    :param natoms: int
+    :param layout: str, "random" or "lattice"
+    :param composition: dict mapping element to fraction, PROTEIN_COMPOSITION if None
+    :param charge_std: float, standard deviation of the partial charges in e
+    :param density: float, atoms per cubic angstrom
+    :param seed: int or None
+    :return: dict with "elements", "crd", "charges" (in e, summing to zero)
+    """
+    assert layout in ["random", "lattice"], "unknown layout %s" % layout
+    assert natoms > 0, "natoms must be positive"
+    rng = np.random.default_rng(seed)
+    if composition is None:
+        composition = PROTEIN_COMPOSITION
+    elements = _element_list(natoms, composition, rng)
+    if layout == "lattice":
+        crd = lattice_positions(natoms, density=density, rng=rng)
+    else:
+        crd = random_positions(natoms, density=density, rng=rng)
+    crd -= crd.mean(axis=0)
+
+    charges = rng.normal(0., charge_std, size=natoms)
+    charges -= charges.mean()
+    return {"elements": elements, "crd": crd, "charges": charges}
+
+
+def _format_records(values, format_string, per_line):
+    lines = []
+    for start in range(0, len(values), per_line):
+        lines.append("".join(format_string % value for value in values[start: start + per_line]))
+    if len(lines) == 0:
+        lines.append("")
+    return "\n".join(lines) + "\n"
+
+
+def _write_flag(handle, flag, fortran_format, values):
+    handle.write("%%FLAG %-74s\n" % flag)
+    handle.write("%%FORMAT(%s)%s\n" % (fortran_format, " " * (72 - len(fortran_format))))
+    if fortran_format == "20a4":
+        handle.write(_format_records(values, "%-4s", 20))
+    elif fortran_format == "10I8":
+        handle.write(_format_records(values, "%8d", 10))
+    elif fortran_format == "5E16.8":
+        handle.write(_format_records(values, "%16.8E", 5))
+    else:
+        raise RuntimeError("unsupported format %s" % fortran_format)
+    return None
+
+
+def write_prmtop(molecule, prmtop_file_name, title="synthetic", res_name="SYN"):
+    """
+    write the fields read by IO.PrmtopLoad; there are no bonds, angles or dihedrals
+    :param molecule: dict returned by generate_molecule
+    :param prmtop_file_name: str
+    """
+    elements = molecule["elements"]
+    natoms = len(elements)
+    types = sorted(set(elements))
+    ntypes = len(types)
+    type_index = np.array([types.index(element) + 1 for element in elements], dtype=int)
+
+    # AMBER combining rules: Rmin_ij = r_i + r_j, eps_ij = sqrt(eps_i * eps_j)
+    nonbonded_parm_index = np.zeros(ntypes * ntypes, dtype=int)
+    acoef = []
+    bcoef = []
+    for i in range(ntypes):
+        for j in range(i + 1):
+            r_min = ELEMENTS[types[i]][0] + ELEMENTS[types[j]][0]
+            epsilon = np.sqrt(ELEMENTS[types[i]][1] * ELEMENTS[types[j]][1])
+            acoef.append(epsilon * r_min ** 12)
+            bcoef.append(2. * epsilon * r_min ** 6)
+            nonbonded_parm_index[ntypes * i + j] = len(acoef)
+            nonbonded_parm_index[ntypes * j + i] = len(acoef)
+
+    residue_pointer = np.arange(1, natoms + 1, ATOMS_PER_RESIDUE, dtype=int)
+    nres = residue_pointer.shape[0]
+    atom_names = ["%s%d" % (element, (i % 99) + 1) for i, element in enumerate(elements)]
+    masses = [ELEMENTS[element][2] for element in elements]
+
+    pointers = np.zeros(31, dtype=int)
+    pointers[0] = natoms
+    pointers[1] = ntypes
+    pointers[11] = nres
+    pointers[28] = ATOMS_PER_RESIDUE
+
+    with open(prmtop_file_name, "w") as handle:
+        handle.write("%-80s\n" % "%VERSION  VERSION_STAMP = V0001.000")
+        _write_flag(handle, "TITLE", "20a4", [title[:4]])
+        _write_flag(handle, "POINTERS", "10I8", pointers)
+        _write_flag(handle, "ATOM_NAME", "20a4", atom_names)
+        _write_flag(handle, "CHARGE", "5E16.8", np.asarray(molecule["charges"]) * AMBER_CHARGE)
+        _write_flag(handle, "MASS", "5E16.8", masses)
+        _write_flag(handle, "ATOM_TYPE_INDEX", "10I8", type_index)
+        _write_flag(handle, "NONBONDED_PARM_INDEX", "10I8", nonbonded_parm_index)
+        _write_flag(handle, "RESIDUE_LABEL", "20a4", [res_name] * nres)
+        _write_flag(handle, "RESIDUE_POINTER", "10I8", residue_pointer)
+        _write_flag(handle, "BONDS_INC_HYDROGEN", "10I8", [])
+        _write_flag(handle, "BONDS_WITHOUT_HYDROGEN", "10I8", [])
+        _write_flag(handle, "LENNARD_JONES_ACOEF", "5E16.8", acoef)
+        _write_flag(handle, "LENNARD_JONES_BCOEF", "5E16.8", bcoef)
+        _write_flag(handle, "AMBER_ATOM_TYPE", "20a4", elements)
+    return None
+
+
+def write_inpcrd(crd, inpcrd_file_name, title="synthetic"):
+    """
+    :param crd: 2-array of float, shape (natoms, 3)
+    :param inpcrd_file_name: str
+    """
+    flat = np.asarray(crd, dtype=float).ravel()
+    with open(inpcrd_file_name, "w") as handle:
+        handle.write("%s\n" % title)
+        handle.write("%6d\n" % crd.shape[0])
+        handle.write(_format_records(flat, "%12.7f", 6))
+    return None
+
+
+def write_bsite_file(bsite_file_name, site_center, site_R, half_edge_length):
+    """
+    write the fields of AlGDock's measured_binding_site.py that RecGrid reads
+    """
+    site_center = np.asarray(site_center, dtype=float)
+    com_min = site_center - site_R / np.sqrt(3.)
+    com_max = site_center + site_R / np.sqrt(3.)
+    with open(bsite_file_name, "w") as handle:
+        handle.write("# Synthetic binding site\n\n")
+        handle.write("# Minimum center of mass: \n")
+        handle.write("com_min = [%r, %r, %r]\n" % tuple(com_min.tolist()))
+        handle.write("# Maximum center of mass: \n")
+        handle.write("com_max = [%r, %r, %r]\n" % tuple(com_max.tolist()))
+        handle.write("# Site center: [%r, %r, %r]\n" % tuple(site_center.tolist()))
+        handle.write("# Site radius\n")
+        handle.write("site_R = %r\n" % float(site_R))
+        handle.write("half_edge_length = %r\n" % float(half_edge_length))
+    return None
+
+
+def generate_system(out_dir, rec_natoms, lig_natoms, layout="random", half_edge_length=None,
+                    spacing=None, grid_counts=None, site_R=2.0, nr_rotations=0, seed=0):
+    """
+    write receptor.prmtop, receptor.inpcrd, ligand.prmtop, ligand.inpcrd and measured_binding_site.py
+    (and rotation.nc if nr_rotations > 0) to out_dir
+
+    :param out_dir: str
+    :param rec_natoms: int
+    :param lig_natoms: int
+    :param layout: str, "random" or "lattice"
+    :param half_edge_length: float or None, half of the box edge in angstrom; if None it is derived from
+    spacing and grid_counts, or made large enough to hold the receptor plus a ligand on each side
+    :param spacing: float or None, grid spacing used with grid_counts
+    :param grid_counts: int or None, number of grid points per axis wanted from RecGrid
+    :param site_R: float
+    :param nr_rotations: int, number of random ligand rotations to write to rotation.nc
+    :param seed: int
+    :return: dict of file names
+    """
+    if not os.path.isdir(out_dir):
+        os.makedirs(out_dir)
+
+    receptor = generate_molecule(rec_natoms, layout=layout, seed=seed)
+    ligand = generate_molecule(lig_natoms, layout=layout, seed=seed + 1)
+
+    rec_extent = np.abs(receptor["crd"]).max() + ELEMENTS["S"][0]
+    lig_extent = np.abs(ligand["crd"]).max() + ELEMENTS["S"][0]
+    if half_edge_length is None:
+        if grid_counts is not None:
+            assert spacing is not None, "spacing is needed with grid_counts"
+            half_edge_length = (grid_counts - 1) * spacing / 2.
+        else:
+            half_edge_length = np.ceil(rec_extent + 2. * lig_extent)
+    if half_edge_length < rec_extent:
+        print("Warning: the box (half edge %0.1f) does not enclose the receptor (radius %0.1f)" % (
+            half_edge_length, rec_extent))
+
+    # RecGrid with a bsite file keeps the receptor where it is, in a box starting at the origin
+    box_center = np.array([half_edge_length] * 3, dtype=float)
+    receptor["crd"] += box_center
+    ligand["crd"] += box_center + np.array([rec_extent + lig_extent, 0., 0.])
+
+    files = {"rec_prmtop": os.path.join(out_dir, "receptor.prmtop"),
+             "rec_inpcrd": os.path.join(out_dir, "receptor.inpcrd"),
+             "lig_prmtop": os.path.join(out_dir, "ligand.prmtop"),
+             "lig_inpcrd": os.path.join(out_dir, "ligand.inpcrd"),
+             "bsite_file": os.path.join(out_dir, "measured_binding_site.py")}
+    write_prmtop(receptor, files["rec_prmtop"], title="receptor")
+    write_inpcrd(receptor["crd"], files["rec_inpcrd"], title="synthetic receptor")
+    write_prmtop(ligand, files["lig_prmtop"], title="ligand", res_name="LIG")
+    write_inpcrd(ligand["crd"], files["lig_inpcrd"], title="synthetic ligand")
+    write_bsite_file(files["bsite_file"], box_center, site_R, half_edge_length)
+
+    if nr_rotations > 0:
+        try:
+            from bpmfwfft.rotation import random_gen_rotation
+        except ImportError:
+            from rotation import random_gen_rotation
+        files["rotation_nc"] = os.path.join(out_dir, "rotation.nc")
+        random_gen_rotation(ligand["crd"], nr_rotations, files["rotation_nc"])
+
+    print("Synthetic system: %d receptor atoms, %d ligand atoms, box half edge %0.2f A, written to %s" % (
+        rec_natoms, lig_natoms, half_edge_length, out_dir))
+    return files
@@ -0,0 +1,31 @@
+import os
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "protein_protein_scripts"))
+import _amber_tleap
+
+PDB_LINE = "ATOM      1  CA  ALA A   1       0.000   0.000   0.000  1.00  0.00           C\n"
+
+
+def _complex_dir(tmp_path):
+    for pdb_file in [_amber_tleap.LIGAND_PDB_INP, _amber_tleap.RECEPTOR_PDB_INP]:
+        (tmp_path / pdb_file).write_text(PDB_LINE + "END\n")
+    _amber_tleap._write_tleap_script(_amber_tleap.LIGAND_PDB_INP, _amber_tleap.RECEPTOR_PDB_INP, {}, str(tmp_path),
+                                     _amber_tleap.LIGAND_OUT_PREFIX, _amber_tleap.RECEPTOR_OUT_PREFIX,
+                                     _amber_tleap.COMPLEX_OUT_PREFIX, _amber_tleap.TLEAP)
+    # as _run_tleap leaves a good run
+    for file in _amber_tleap._output_files(str(tmp_path)):
+        open(file, "w").write("written by tleap\n")
+    tleap_script_file = str(tmp_path / _amber_tleap.TLEAP)
+    (tmp_path / _amber_tleap.INPUT_HASH).write_text(_amber_tleap._input_hash(tleap_script_file) + "\n")
+    return tleap_script_file
+
+
+def test_editing_an_input_pdb_invalidates_the_cache(tmp_path):
+    tleap_script_file = _complex_dir(tmp_path)
+    assert _amber_tleap._is_up_to_date(tleap_script_file)
+    for pdb_file in [_amber_tleap.RECEPTOR_PDB_INP, _amber_tleap.LIGAND_PDB_INP]:
+        tleap_script_file = _complex_dir(tmp_path)
+        with open(str(tmp_path / pdb_file), "a") as handle:
+            handle.write(PDB_LINE)
+        assert not _amber_tleap._is_up_to_date(tleap_script_file)
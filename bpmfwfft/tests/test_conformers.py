@@ -0,0 +1,61 @@
+import numpy as np
+
+import bpmfwfft.conformers as conformers
+
+
+def _random_rotation(rng):
+    q, r = np.linalg.qr(rng.normal(size=(3, 3)))
+    q *= np.sign(np.diag(r))
+    if np.linalg.det(q) < 0:
+        q[:, 0] *= -1
+    return q
+
+
+def test_aligned_rmsd_ignores_rigid_motion():
+    rng = np.random.default_rng(0)
+    reference = conformers.center(rng.normal(size=(12, 3)))
+    moved = np.array([np.dot(reference, _random_rotation(rng).T) + rng.normal(size=3) for _ in range(5)])
+    assert np.allclose(conformers.aligned_rmsd(reference, conformers.center(moved)), 0., atol=1e-6)
+    # a mirror image is not a rotation
+    mirrored = conformers.center(reference * np.array([-1., 1., 1.]))[np.newaxis]
+    assert conformers.aligned_rmsd(reference, mirrored)[0] > 0.1
+
+
+def test_cluster_conformers_merges_near_duplicates():
+    rng = np.random.default_rng(1)
+    base = [rng.normal(scale=2., size=(10, 3)) for _ in range(3)]
+    frames = np.array([base[i % 3] + rng.normal(scale=0.01, size=(10, 3)) for i in range(30)])
+    representatives, labels, populations = conformers.cluster_conformers(frames, rmsd_cutoff=0.2)
+    assert representatives.tolist() == [0, 1, 2]
+    assert labels.tolist() == [i % 3 for i in range(30)]
+    assert populations.tolist() == [10, 10, 10]
+    representatives, _, populations = conformers.cluster_conformers(frames, rmsd_cutoff=0.)
+    assert representatives.shape[0] == 30 and populations.sum() == 30
+
+
+def test_combine_bpmfs():
+    assert np.isclose(conformers.combine_bpmfs([-5., -5.], [1., 3.]), -5.)
+    # the more favorable conformer dominates
+    combined = conformers.combine_bpmfs([-10., -2.], [1., 1.])
+    assert -10. < combined < -9.
+
+
+def test_conformer_rotation_ensemble():
+    rng = np.random.default_rng(2)
+    frames = np.array([rng.normal(size=(6, 3)) for _ in range(4)])
+    rotations = np.array([np.eye(3), _random_rotation(rng)])
+    ensemble = conformers.ConformerRotationEnsemble(frames, rotations, rmsd_cutoff=0.)
+    assert ensemble.shape == (8, 6, 3)
+    assert ensemble.split_step(5) == (2, 1)
+    assert np.allclose(ensemble[4], frames[2])
+    rotated = ensemble[5]
+    assert np.allclose(rotated.mean(axis=0), frames[2].mean(axis=0))
+    assert np.allclose(conformers.aligned_rmsd(conformers.center(frames[2]), conformers.center(rotated)[None]), 0.,
+                       atol=1e-6)
+
+    # a resumed run continues with the same steps
+    resumed = conformers.ConformerRotationEnsemble(frames, rotations, rmsd_cutoff=0.).set_first_step(5)
+    assert resumed.shape == (3, 6, 3) and len(resumed) == 3
+    assert resumed.split_step(0) == (2, 1)
+    assert np.allclose(resumed[0], rotated)
+    assert np.allclose(resumed.get_conformer(2), frames[3])
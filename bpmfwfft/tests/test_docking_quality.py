@@ -0,0 +1,162 @@
+import numpy as np
+import netCDF4
+
+from bpmfwfft.docking_quality import CellList, DockingQuality, evaluate_sampling_nc, dockq, METRIC_NAMES
+from bpmfwfft.so3_search import kabsch_rotations
+from bpmfwfft.rotation import _rotation_matrix
+from bpmfwfft.nc_integrity import verify
+
+NAMES = ["N", "CA", "C", "O", "CB", "H"]
+MASSES = [14.01, 12.01, 12.01, 16.00, 12.01, 1.008]
+
+
+def _molecule(residue_centers, rng):
+    """
+    residues of six atoms around the given centers
+    """
+    nres = residue_centers.shape[0]
+    crd = (residue_centers[:, np.newaxis, :] + rng.normal(size=(nres, 6, 3)) * 1.2).reshape((-1, 3))
+    prmtop = {"PDB_TEMPLATE": {"ATOM_NAME": NAMES * nres, "RES_ORDER": list(np.repeat(np.arange(1, nres + 1), 6))},
+              "MASS": np.array(MASSES * nres)}
+    return prmtop, crd
+
+
+def _complex(rng):
+    grid = np.array(np.meshgrid(np.arange(5), np.arange(5), np.arange(3), indexing="ij"), dtype=float)
+    rec_prmtop, rec_crd = _molecule(grid.reshape((3, -1)).T * 4.5, rng)
+    lig_centers = np.array(np.meshgrid(np.arange(3), np.arange(3), np.arange(2), indexing="ij"),
+                           dtype=float).reshape((3, -1)).T * 4.5
+    lig_prmtop, lig_crd = _molecule(lig_centers + np.array([4.5, 4.5, 13.5]), rng)
+    return rec_prmtop, rec_crd, lig_prmtop, lig_crd
+
+
+def _brute_force(rec_prmtop, rec_crd, lig_prmtop, native, pose):
+    rec_res = np.array(rec_prmtop["PDB_TEMPLATE"]["RES_ORDER"])
+    lig_res = np.array(lig_prmtop["PDB_TEMPLATE"]["RES_ORDER"])
+    rec_heavy = np.array(rec_prmtop["MASS"]) > 1.5
+    lig_heavy = np.array(lig_prmtop["MASS"]) > 1.5
+    rec_bb = np.isin(rec_prmtop["PDB_TEMPLATE"]["ATOM_NAME"], ["N", "CA", "C", "O"])
+    lig_bb = np.isin(lig_prmtop["PDB_TEMPLATE"]["ATOM_NAME"], ["N", "CA", "C", "O"])
+
+    def contacts(lig, cutoff):
+        d = np.linalg.norm(rec_crd[rec_heavy][:, np.newaxis] - lig[lig_heavy][np.newaxis], axis=2)
+        rec_ind, lig_ind = np.nonzero(d <= cutoff)
+        return set(zip(rec_res[rec_heavy][rec_ind], lig_res[lig_heavy][lig_ind]))
+
+    native_contacts = contacts(native, 5.)
+    fnat = len(native_contacts & contacts(pose, 5.)) / float(len(native_contacts))
+    interface = contacts(native, 10.)
+    rec_atoms = rec_bb & np.isin(rec_res, [pair[0] for pair in interface])
+    lig_atoms = lig_bb & np.isin(lig_res, [pair[1] for pair in interface])
+    model = np.concatenate([rec_crd[rec_atoms], pose[lig_atoms]])
+    target = np.concatenate([rec_crd[rec_atoms], native[lig_atoms]])
+    rotation = kabsch_rotations(model, target[np.newaxis])[0]
+    fitted = np.dot(model - model.mean(axis=0), rotation.T) + target.mean(axis=0)
+    irmsd = np.sqrt(np.mean(np.sum((fitted - target) ** 2, axis=1)))
+    lrmsd = np.sqrt(np.mean(np.sum((pose[lig_bb] - native[lig_bb]) ** 2, axis=1)))
+    return fnat, irmsd, lrmsd
+
+
+def _near_native_poses(native, nrot, nposes, rng):
+    center = native.mean(axis=0)
+    lig_crd = []
+    for _ in range(nrot):
+        rotation = _rotation_matrix([rng.uniform(0., 0.05), rng.uniform(), rng.uniform()])
+        lig_crd.append(np.dot(native - center, rotation.T) + center - 3.)
+    translations = 3. + rng.normal(size=(nrot, nposes, 3)) * 2.
+    return np.array(lig_crd), translations
+
+
+def test_cell_list_pairs():
+    rng = np.random.RandomState(0)
+    atoms = rng.uniform(0., 30., size=(500, 3))
+    points = rng.uniform(-5., 35., size=(300, 3))
+    point_ind, atom_ind = CellList(atoms, 6.).pairs_within(points, 5.)
+    distances = np.linalg.norm(points[:, np.newaxis] - atoms[np.newaxis], axis=2)
+    expected = set(zip(*np.nonzero(distances <= 5.)))
+    assert set(zip(point_ind.tolist(), atom_ind.tolist())) == expected
+    assert len(expected) == point_ind.shape[0]
+
+
+def test_native_pose_is_perfect():
+    rng = np.random.RandomState(1)
+    rec_prmtop, rec_crd, lig_prmtop, lig_crd = _complex(rng)
+    quality = DockingQuality(rec_prmtop, lig_prmtop, rec_crd, lig_crd)
+    assert quality.get_native_contacts().shape[0] > 5
+    metrics = quality.evaluate(lig_crd[np.newaxis], np.zeros((1, 1, 3)))
+    np.testing.assert_allclose(metrics["fnat"], 1.)
+    np.testing.assert_allclose(metrics["irmsd"], 0., atol=1e-6)
+    np.testing.assert_allclose(metrics["lrmsd"], 0., atol=1e-6)
+    np.testing.assert_allclose(metrics["dockq"], 1., atol=1e-9)
+
+
+def test_metrics_match_brute_force():
+    rng = np.random.RandomState(2)
+    rec_prmtop, rec_crd, lig_prmtop, lig_crd = _complex(rng)
+    # the reference in another frame, brought back by the receptor
+    rotation = _rotation_matrix([0.3, 0.6, 0.1])
+    quality = DockingQuality(rec_prmtop, lig_prmtop, np.dot(rec_crd, rotation.T) + 7., np.dot(lig_crd, rotation.T) + 7.,
+                             rec_crd=rec_crd)
+    np.testing.assert_allclose(quality.get_native_lig_crd(), lig_crd, atol=1e-9)
+
+    poses_crd, translations = _near_native_poses(lig_crd, 4, 25, rng)
+    metrics = quality.evaluate(poses_crd, translations)
+    assert metrics["fnat"].min() < 0.5 < metrics["fnat"].max() <= 1.
+    for r in range(4):
+        for k in range(25):
+            fnat, irmsd, lrmsd = _brute_force(rec_prmtop, rec_crd, lig_prmtop, lig_crd,
+                                              poses_crd[r] + translations[r, k])
+            np.testing.assert_allclose(metrics["fnat"][r, k], fnat)
+            np.testing.assert_allclose(metrics["irmsd"][r, k], irmsd, atol=1e-6)
+            np.testing.assert_allclose(metrics["lrmsd"][r, k], lrmsd, atol=1e-6)
+    np.testing.assert_allclose(metrics["dockq"], dockq(metrics["fnat"], metrics["irmsd"], metrics["lrmsd"]))
+
+
+def test_evaluate_sampling_nc(tmp_path):
+    rng = np.random.RandomState(3)
+    rec_prmtop, rec_crd, lig_prmtop, lig_crd = _complex(rng)
+    poses_crd, _ = _near_native_poses(lig_crd, 5, 8, rng)
+    trans_vectors = rng.randint(0, 4, size=(5, 8, 3))
+    energies = rng.normal(size=(5, 8))
+    energies[4, 6:] = np.inf
+
+    nc_file = str(tmp_path / "sampling.nc")
+    nc_handle = netCDF4.Dataset(nc_file, "w", format="NETCDF4")
+    nc_handle.createDimension("one", 1)
+    nc_handle.createDimension("three", 3)
+    nc_handle.createDimension("4", 4)
+    nc_handle.createDimension("rec_natoms", rec_crd.shape[0])
+    nc_handle.createDimension("lig_natoms", lig_crd.shape[0])
+    nc_handle.createDimension("lig_sample_size", None)
+    nc_handle.createDimension("energy_sample_size_per_ligand", 8)
+    nc_handle.createVariable("rec_positions", "f8", ("rec_natoms", "three"))
+    nc_handle.createVariable("lig_positions", "f8", ("lig_sample_size", "lig_natoms", "three"))
+    nc_handle.createVariable("resampled_energies", "f8", ("lig_sample_size", "energy_sample_size_per_ligand"))
+    nc_handle.createVariable("resampled_trans_vectors", "i8",
+                             ("lig_sample_size", "energy_sample_size_per_ligand", "three"))
+    nc_handle.createVariable("current_rotation_index", "i8", ("one",))
+    for axis in ("x", "y", "z"):
+        nc_handle.createVariable(axis, "f8", ("4",))
+        nc_handle.variables[axis][:] = np.arange(4) * 1.5
+    nc_handle.variables["rec_positions"][:] = rec_crd
+    nc_handle.variables["lig_positions"][:] = poses_crd
+    nc_handle.variables["resampled_energies"][:] = energies
+    nc_handle.variables["resampled_trans_vectors"][:] = trans_vectors
+    nc_handle.variables["current_rotation_index"][0] = 5
+    nc_handle.close()
+
+    metrics = evaluate_sampling_nc(nc_file, rec_prmtop, lig_prmtop, rec_crd, lig_crd, chunk_size=2)
+    expected = DockingQuality(rec_prmtop, lig_prmtop, rec_crd, lig_crd).evaluate(poses_crd, trans_vectors * 1.5)
+    assert verify(nc_file, variables=METRIC_NAMES, deep=True)
+    nc_handle = netCDF4.Dataset(nc_file, "r")
+    for name in METRIC_NAMES:
+        stored = np.array(nc_handle.variables[name][:], dtype=float)
+        assert np.all(np.isnan(stored[4, 6:]))
+        np.testing.assert_allclose(stored[:4], expected[name][:4], rtol=1e-6, atol=1e-6)
+        np.testing.assert_allclose(metrics[name][4, :6], expected[name][4, :6], rtol=1e-6, atol=1e-6)
+    nc_handle.close()
+    summary = metrics["summary"]
+    assert summary["nr_poses"] == 38
+    lowest = np.unravel_index(np.argmin(energies), energies.shape)
+    np.testing.assert_allclose(summary["top1_dockq"], expected["dockq"][lowest], rtol=1e-6)
+    np.testing.assert_allclose(summary["best_dockq"], np.nanmax(metrics["dockq"]), rtol=1e-6)
@@ -1,5 +1,7 @@
 import pytest
 import bpmfwfft.grids
+import bpmfwfft.IO
+import bpmfwfft.util
 import netCDF4
 import os
 import numpy as np
@@ -18,17 +20,28 @@ lj_sigma_scaling_factor = 0.8
 bsite_file = None
 spacing = 0.25
 
-rec_grid = bpmfwfft.grids.RecGrid(rec_prmtop_file, lj_sigma_scaling_factor, rec_inpcrd_file,
-                        bsite_file,
-                        grid_nc_file,
-                        new_calculation=False,
-                        spacing=spacing)
 lig_prmtop_file = (mod_path / "../../examples/amber/benzene/ligand.prmtop").resolve()
 lig_inpcrd_file = (mod_path / "../../examples/amber/benzene/ligand.inpcrd").resolve()
-lig_grid = bpmfwfft.grids.LigGrid(lig_prmtop_file, lj_sigma_scaling_factor, lig_inpcrd_file, rec_grid)
+ubiquitin_prmtop_file = (mod_path / "../../examples/amber/ubiquitin/ligand.prmtop").resolve()
+ubiquitin_inpcrd_file = (mod_path / "../../examples/amber/ubiquitin/ligand.inpcrd").resolve()
+rec_scalings = (0.76, 0.53, 0.55, 9.0)
+lig_scalings = (0.81, 0.50, 0.54)
 
-print(lig_grid.get_initial_com())
+# the precomputed t4 lysozyme grid is not shipped with every checkout
+if grid_nc_file.exists():
+    rec_grid = bpmfwfft.grids.RecGrid(rec_prmtop_file, lj_sigma_scaling_factor, *rec_scalings, rec_inpcrd_file,
+                            bsite_file,
+                            grid_nc_file,
+                            new_calculation=False,
+                            spacing=spacing)
+    lig_grid = bpmfwfft.grids.LigGrid(lig_prmtop_file, lj_sigma_scaling_factor, *lig_scalings, lig_inpcrd_file,
+                                      rec_grid)
+    print(lig_grid.get_initial_com())
+else:
+    rec_grid = lig_grid = None
+needs_t4_grid = pytest.mark.skipif(rec_grid is None, reason="%s not found" % grid_nc_file)
 
+@needs_t4_grid
 def test_is_nc_grid_good():
     assert bpmfwfft.grids.is_nc_grid_good(grid_nc_file) == True
     assert bpmfwfft.grids.is_nc_grid_good("trash") == False
@@ -36,10 +49,12 @@ def test_is_nc_grid_good():
 #
 # #Grid class tests
 #
+@needs_t4_grid
 def test_get_six_corner_shifts():
     print(bpmfwfft.grids.Grid._get_six_corner_shifts(rec_grid))
 #     assert bpmfwfft.grids.Grid._get_six_corner_shifts()
 #
+@needs_t4_grid
 def test_set_grid_key_value():
     good_key = 'SASAr'
     bad_key = 'this_key_is_bad'
@@ -59,11 +74,13 @@ def test_set_grid_key_value():
 # def test_move_molecule_to():
 #     assert bpmfwfft.grids.Grid._move_molecule_to()
 #
+@needs_t4_grid
 def test_get_molecule_center_of_mass():
 #    np.set_printoptions(precision=15)
 #    print(bpmfwfft.grids.Grid._get_molecule_center_of_mass(rec_grid))
     assert np.ndarray.tolist(bpmfwfft.grids.Grid._get_molecule_center_of_mass(rec_grid)) == [15.143843333007636, 12.397102311613432, 12.961784483800248]
 #
+@needs_t4_grid
 def test_get_molecule_sasa():
     test_sasa = bpmfwfft.grids.Grid._get_molecule_sasa(rec_grid, 0.14, 960)
     print("test_sasa shape", test_sasa.shape)
@@ -71,6 +88,7 @@ def test_get_molecule_sasa():
     print("sum test_sasa", test_sasa.sum())
 
 
+@needs_t4_grid
 def test_get_corner_crd():
     np.set_printoptions(precision=15)
     print(bpmfwfft.grids.Grid._get_corner_crd(rec_grid, [1,1,1]))
@@ -133,6 +151,7 @@ def test_get_corner_crd():
 # def test_get_number_translations():
 #     assert bpmfwfft.grids.LigGrid.
 #
+@needs_t4_grid
 def test_get_box_volume():
     assert lig_grid.get_box_volume() == 1374.140625
 #
@@ -143,10 +162,212 @@ def test_get_box_volume():
 #     assert lig_grid.get_meaningful_corners() == 5
 
 #
+@pytest.fixture(scope="module")
+def small_complex(tmp_path_factory):
+    """
+    benzene as the receptor, in a box padded enough to hold ubiquitin as the ligand
+    """
+    nc_file = str(tmp_path_factory.mktemp("grids") / "benzene.nc")
+    receptor = bpmfwfft.grids.RecGrid(lig_prmtop_file, lj_sigma_scaling_factor, *rec_scalings, lig_inpcrd_file,
+                                      None, nc_file, new_calculation=True, spacing=1.0, extra_buffer=32.)
+    ligand = bpmfwfft.grids.LigGrid(ubiquitin_prmtop_file, lj_sigma_scaling_factor, *lig_scalings,
+                                    ubiquitin_inpcrd_file, receptor)
+    return receptor, ligand
+
+
+def _buried_receptor_sasa(receptor, ligand, translation):
+    """
+    brute-force Shrake-Rupley area of the receptor buried by the ligand at a grid translation
+    """
+    rec_crd = receptor._crd
+    points = bpmfwfft.util.c_sasa(rec_crd, np.array(receptor._prmtop["VDW_RADII"], dtype=float),
+                                  receptor._spacing, 1.4, 960, rec_crd.shape[0], 0).reshape((-1, 4))
+    points = points[points[:, 3] > 0]
+    areas = 4. * np.pi * points[:, 3] ** 2 / 960
+    lig_crd = ligand._crd + translation * ligand._grid["spacing"]
+    lig_radii = np.array(ligand._prmtop["VDW_RADII"], dtype=float) + 1.4
+    distances = np.linalg.norm(points[:, np.newaxis, :3] - lig_crd[np.newaxis], axis=2)
+    return areas[(distances <= lig_radii).any(axis=1)].sum()
+
+
+def test_shape_complementarity_against_buried_sasa(small_complex):
+    receptor, ligand = small_complex
+    corr_func = ligand._cal_shape_complementarity()
+    rec_sasa_grid = np.real(np.fft.ifftn(ligand._rec_FFTs["sasa"]))
+    for translation in [[0, 0, 0], [3, 5, 7], [10, 2, 4]]:
+        direct = ligand._direct_shape_complementarity(np.array(translation), rec_sasa_grid)
+        assert np.isclose(corr_func[tuple(translation)], direct, rtol=1e-6, atol=1e-6)
+
+    # pull the ligand off the receptor, starting from its center on the receptor's center
+    heavy = np.array([name[0] != "H" for name in ligand._prmtop["PDB_TEMPLATE"]["ATOM_NAME"]])
+    start = np.round(receptor._crd.mean(axis=0) - ligand._crd[heavy].mean(axis=0)).astype(int)
+    # the periodic images of the ligand stay out of the box
+    extent = np.ceil(ligand._crd.max(axis=0) / ligand._grid["spacing"]).astype(int) + 1
+    for direction in np.eye(3, dtype=int)[1:]:
+        translations = [start + direction * distance for distance in range(0, 20, 2)]
+        assert np.all(np.array(translations) >= 0)
+        assert np.all(np.array(translations) + extent <= ligand._grid["counts"])
+        scores = np.array([corr_func[tuple(translation)] for translation in translations])
+        buried = np.array([_buried_receptor_sasa(receptor, ligand, translation) for translation in translations])
+        peak = np.argmax(scores)
+        # full overlap reaches the ligand core and is penalized, contact is rewarded
+        assert scores[0] < scores[peak]
+        assert buried[peak] > 0
+        # from contact to separation the score follows the buried area
+        assert np.corrcoef(scores[peak:], buried[peak:])[0, 1] > 0.7
+        assert buried[-1] == 0 and abs(scores[-1]) < 1e-6
+#
+@needs_t4_grid
 def test_set_meaningful_energies_to_none():
     assert lig_grid.set_meaningful_energies_to_none() == None
     assert lig_grid._meaningful_energies == None
 
+
+def test_fft_friendly_count():
+    assert bpmfwfft.grids.fft_friendly_count(97) == 100
+    assert bpmfwfft.grids.fft_friendly_count(128) == 128
+    assert bpmfwfft.grids.fft_friendly_count(121) == 125
+
+
+def test_principal_axes_box():
+    crd = np.random.RandomState(0).normal(size=(200, 3)) * np.array([2., 8., 4.])
+    rotation, center = bpmfwfft.grids.principal_axes(crd)
+    assert np.allclose(np.dot(rotation, rotation.T), np.eye(3))
+    assert np.isclose(np.linalg.det(rotation), 1.)
+    aligned = np.dot(crd - center, rotation.T)
+    assert np.all(np.diff(aligned.var(axis=0)) < 0)
+    radius = np.ones(crd.shape[0])
+    cube = bpmfwfft.grids.box_counts(crd, radius, 0.5, 3.0)
+    box = bpmfwfft.grids.box_counts(aligned, radius, 0.5, 3.0, anisotropic=True)
+    assert np.prod(box) < np.prod(cube)
+
+def test_desolvation_is_opt_in(tmp_path):
+    for desolvation in [False, True]:
+        nc_file = str(tmp_path / ("benzene_%d.nc" % desolvation))
+        receptor = bpmfwfft.grids.RecGrid(lig_prmtop_file, lj_sigma_scaling_factor, *rec_scalings, lig_inpcrd_file,
+                                          None, nc_file, new_calculation=True, spacing=1.0, extra_buffer=6.,
+                                          desolvation=desolvation)
+        nc_handle = netCDF4.Dataset(nc_file, "r")
+        assert ("desolvation" in nc_handle.variables.keys()) == desolvation
+        nc_handle.close()
+        ligand = bpmfwfft.grids.LigGrid(lig_prmtop_file, lj_sigma_scaling_factor, *lig_scalings, lig_inpcrd_file,
+                                        receptor)
+        assert ligand.has_desolvation() == desolvation
+    # AutoDock4 weighs the volume of the partner by |q|
+    charges = np.array(receptor._prmtop["CHARGE_E_UNIT"], dtype=float)
+    assert np.any(charges < 0)
+    weights = bpmfwfft.grids.desolvation_weights(receptor._prmtop)
+    np.testing.assert_allclose(weights[0], bpmfwfft.grids.DESOLVATION_QSOLPAR * np.abs(charges))
+
+def test_direct_energy_matches_exact_values_when_screened(tmp_path):
+    nc_file = str(tmp_path / "screened.nc")
+    receptor = bpmfwfft.grids.RecGrid(lig_prmtop_file, lj_sigma_scaling_factor, *rec_scalings, lig_inpcrd_file,
+                                      None, nc_file, new_calculation=True, spacing=1.0, extra_buffer=6.,
+                                      ionic_strength=0.15, dielectric=4., distance_dielectric=True)
+    nc_handle = netCDF4.Dataset(nc_file, "r")
+    electrostatic = np.array(nc_handle.variables["electrostatic"][:], dtype=float)
+    nc_handle.close()
+    corners = [(1, 1, 1), (2, 3, 1), (-2, -2, -2)]
+    for corner in corners:
+        coordinate = np.array([receptor._grid[axis][index] for axis, index in zip("xyz", corner)])
+        exact = receptor._exact_values(coordinate)
+        # a grid corner away from every atom holds the exact screened potential
+        assert np.isclose(electrostatic[corner], exact["electrostatic"], rtol=1e-6)
+        for name, charge_key in bpmfwfft.grids.INTERPOLATED_GRID_CHARGES.items():
+            charges = dict((key, np.zeros(1)) for key in bpmfwfft.grids.INTERPOLATED_GRID_CHARGES.values())
+            charges[charge_key] = np.ones(1)
+            assert np.isclose(receptor.direct_energy(coordinate[np.newaxis], charges), exact[name], rtol=1e-9)
+    bare = 332.05221729 * np.sum(np.array(receptor._prmtop["CHARGE_E_UNIT"]) /
+                                 np.linalg.norm(receptor._crd - coordinate, axis=1))
+    assert not np.isclose(exact["electrostatic"], bare, rtol=1e-2)
+
+def test_capped_lj_grids_match_exact_values(tmp_path):
+    lj_cap = 0.05
+    nc_files = dict((cap, str(tmp_path / ("cap_%s.nc" % cap))) for cap in [None, lj_cap])
+    for cap, nc_file in nc_files.items():
+        bpmfwfft.grids.RecGrid(lig_prmtop_file, lj_sigma_scaling_factor, *rec_scalings, lig_inpcrd_file, None,
+                               nc_file, new_calculation=True, spacing=1.0, extra_buffer=6., lj_cap=cap)
+    # the cap comes back from the nc file
+    receptor = bpmfwfft.grids.RecGrid(lig_prmtop_file, lj_sigma_scaling_factor, *rec_scalings, lig_inpcrd_file,
+                                      None, nc_files[lj_cap], new_calculation=False)
+    uncapped = bpmfwfft.grids.RecGrid(lig_prmtop_file, lj_sigma_scaling_factor, *rec_scalings, lig_inpcrd_file,
+                                      None, nc_files[None], new_calculation=False)
+    assert receptor.get_lj_cap() == lj_cap and uncapped.get_lj_cap() == 0.
+    nc_handle = netCDF4.Dataset(nc_files[lj_cap], "r")
+    grids = dict((name, np.array(nc_handle.variables[name][:], dtype=float)) for name in ["LJr", "LJa"])
+    nc_handle.close()
+    assert np.abs(grids["LJr"]).max() <= lj_cap and np.abs(grids["LJa"]).max() <= lj_cap
+
+    counts = receptor._grid["counts"]
+    lj_sigma = np.array(receptor._prmtop["LJ_SIGMA"])
+    nr_saturated = 0
+    for corner in np.random.RandomState(0).randint(1, counts - 1, size=(300, 3)):
+        corner = tuple(corner)
+        coordinate = np.array([receptor._grid[axis][index] for axis, index in zip("xyz", corner)])
+        # the grid kernel and the direct sums agree away from the clash radii
+        if np.any(np.linalg.norm(receptor._crd - coordinate, axis=1) <= lj_sigma):
+            continue
+        exact = receptor._exact_values(coordinate)
+        raw = uncapped._exact_values(coordinate)
+        for name, charge_key in [("LJr", "R_LJ_CHARGE"), ("LJa", "A_LJ_CHARGE")]:
+            assert np.isclose(exact[name], lj_cap * np.tanh(raw[name] / lj_cap), rtol=1e-9, atol=1e-12)
+            assert np.isclose(grids[name][corner], exact[name], rtol=1e-6, atol=1e-9)
+            charges = dict((key, np.zeros(1)) for key in bpmfwfft.grids.INTERPOLATED_GRID_CHARGES.values())
+            charges[charge_key] = np.ones(1)
+            assert np.isclose(receptor.direct_energy(coordinate[np.newaxis], charges), exact[name], rtol=1e-9)
+            nr_saturated += abs(raw[name]) > lj_cap
+    assert nr_saturated > 0
+
+def test_bsite_grid_keeps_the_input_frame(tmp_path):
+    # benzene moved into the binding-site box, which starts at the origin
+    crd = bpmfwfft.IO.InpcrdLoad(str(lig_inpcrd_file)).get_coordinates() + 10.
+    inpcrd_file = str(tmp_path / "benzene.inpcrd")
+    with open(inpcrd_file, "w") as handle:
+        handle.write("benzene\n%6d\n" % crd.shape[0])
+        values = crd.ravel()
+        for start in range(0, values.shape[0], 6):
+            handle.write("".join("%12.7f" % value for value in values[start:start + 6]) + "\n")
+    bsite_file = str(tmp_path / "measured_binding_site.py")
+    with open(bsite_file, "w") as handle:
+        handle.write("com_min = [9.5, 9.5, 9.5]\ncom_max = [10.5, 10.5, 10.5]\nsite_R = 1.0\n"
+                     "half_edge_length = 10.0\n")
+    nc_file = str(tmp_path / "bsite.nc")
+
+    with pytest.raises(AssertionError):
+        bpmfwfft.grids.RecGrid(lig_prmtop_file, lj_sigma_scaling_factor, *rec_scalings, inpcrd_file, bsite_file,
+                               nc_file, new_calculation=True, spacing=1.0, principal_axes_box=True)
+    for new_calculation in [True, False]:
+        receptor = bpmfwfft.grids.RecGrid(lig_prmtop_file, lj_sigma_scaling_factor, *rec_scalings, inpcrd_file,
+                                          bsite_file, nc_file, new_calculation=new_calculation, spacing=1.0)
+        np.testing.assert_allclose(receptor.get_initial_displacement(), np.zeros(3))
+        np.testing.assert_allclose(receptor.to_input_frame(receptor._crd), crd, atol=1e-6)
+
+def test_native_pose_energy_with_principal_axes_box(tmp_path):
+    import bpmfwfft.fft_sampling
+    import bpmfwfft.synthetic_systems
+    files = bpmfwfft.synthetic_systems.generate_system(str(tmp_path), 80, 12, seed=3)
+    lig_crd = bpmfwfft.IO.InpcrdLoad(files["lig_inpcrd"]).get_coordinates()
+    native_pose_energies = []
+    for principal_axes_box in [False, True]:
+        nc_file = str(tmp_path / ("grid_%d.nc" % principal_axes_box))
+        receptor = bpmfwfft.grids.RecGrid(files["rec_prmtop"], lj_sigma_scaling_factor, *rec_scalings,
+                                          files["rec_inpcrd"], None, nc_file, new_calculation=True, spacing=1.0,
+                                          extra_buffer=16., principal_axes_box=principal_axes_box)
+        output_nc = str(tmp_path / ("sampling_%d.nc" % principal_axes_box))
+        sampler = bpmfwfft.fft_sampling.Sampling(files["rec_prmtop"], lj_sigma_scaling_factor, *rec_scalings[:3],
+                                                 *lig_scalings, rec_scalings[3], files["rec_inpcrd"], None, nc_file,
+                                                 files["lig_prmtop"], files["lig_inpcrd"], lig_crd[np.newaxis], 5,
+                                                 output_nc, 0)
+        sampler.run_sampling()
+        with netCDF4.Dataset(output_nc, "r") as nc_handle:
+            native_crd = nc_handle.variables["native_crd"][:] + nc_handle.variables["native_translation"][:] * 1.0
+            native_pose_energies.append(float(nc_handle.variables["native_pose_energy"][0]))
+        # the native pose is the input ligand, turned with the receptor
+        np.testing.assert_allclose(receptor.to_input_frame(native_crd), lig_crd, atol=1e-6)
+    assert not np.allclose(receptor.get_principal_axes()[0], np.eye(3))
+    # the same pose on two grids, up to the discretization
+    assert np.isclose(native_pose_energies[0], native_pose_energies[1], rtol=0.01)
+
 # def test_get_initial_com():
 #     assert lig_grid.get_initial_com()
 #
@@ -0,0 +1,78 @@
+import numpy as np
+import pytest
+
+from bpmfwfft.memory import BufferPool, MemoryProfiler
+
+
+def test_buffer_pool_reuses_arrays():
+    pool = BufferPool()
+    first = pool.zeros("grid", (4, 5, 6))
+    first += 1.
+    second = pool.zeros("grid", (4, 5, 6))
+    assert second is first
+    assert not second.any()
+    assert pool.empty("grid", (4, 5, 7)) is not first
+    assert pool.empty("mask", (4, 5, 6), dtype=bool).dtype == bool
+
+
+def test_buffer_pool_fft_matches_numpy():
+    pool = BufferPool()
+    rng = np.random.default_rng(0)
+    grid = rng.normal(size=(8, 6, 10))
+    spectrum = pool.fftn("corr_func", grid)
+    assert np.allclose(spectrum, np.fft.fftn(grid))
+    assert pool.fftn("corr_func", grid) is spectrum
+    assert np.allclose(pool.ifftn("corr_func", spectrum).real, grid)
+
+
+def test_profiler_nested_stages():
+    profiler = MemoryProfiler(enabled=True)
+    with profiler.stage("outer"):
+        with profiler.stage("inner"):
+            block = np.ones(2**20)
+        del block
+    report = profiler.report()
+    assert report["inner"]["max_peak_bytes"] >= 8 * 2**20
+    assert report["outer"]["max_peak_bytes"] >= report["inner"]["max_peak_bytes"]
+    assert report["outer"]["total_net_bytes"] < 2**20
+
+
+def test_steady_state_allocation_per_rotation(tmp_path):
+    pytest.importorskip("bpmfwfft.util")
+    from bpmfwfft.fft_sampling import Sampling
+    from bpmfwfft.grids import RecGrid, N_SPHERE_POINTS
+    from bpmfwfft.IO import InpcrdLoad
+    from bpmfwfft.rotation import _random_rotation_matrix
+    from bpmfwfft.synthetic_systems import generate_system
+
+    # a small receptor grid built here, so that it has every key the current RecGrid writes
+    files = generate_system(str(tmp_path), 100, 20, seed=0)
+    grid_nc_file = str(tmp_path / "grid.nc")
+    RecGrid(files["rec_prmtop"], 1.0, 0.76, 0.53, 0.55, 9.0, files["rec_inpcrd"], None, grid_nc_file,
+            new_calculation=True, spacing=1.0, extra_buffer=16.)
+
+    nr_rotations = 4
+    lig_crd = InpcrdLoad(files["lig_inpcrd"]).get_coordinates()
+    lig_center = lig_crd.mean(axis=0)
+    np.random.seed(0)
+    lig_coord_ensemble = np.array([np.dot(lig_crd - lig_center, _random_rotation_matrix().T) + lig_center
+                                   for _ in range(nr_rotations)])
+    output_nc = str(tmp_path / "fft_sampling.nc")
+
+    sampler = Sampling(files["rec_prmtop"], 1.0, 0.76, 0.53, 0.55, 0.81, 0.50, 0.54, 9.0,
+                       files["rec_inpcrd"], None, grid_nc_file, files["lig_prmtop"], files["lig_inpcrd"],
+                       lig_coord_ensemble, 10, output_nc, 0, temperature=300.,
+                       profile_memory=True)
+    sampler.run_sampling()
+
+    rotation = sampler.get_memory_profile()["rotation"]
+    assert rotation["calls"] == nr_rotations
+    grid_bytes = np.prod(sampler._lig_grid.get_grids()["counts"]) * np.dtype(float).itemsize
+    # after the first rotation every grid and FFT buffer comes from the pool; what is left is the
+    # SASA grid, the clash-free energies with their sort order and the sphere points of the ligand atoms
+    sphere_points_bytes = sampler._lig_grid.get_natoms() * N_SPHERE_POINTS * 4 * np.dtype(float).itemsize
+    bound = 6 * grid_bytes + sphere_points_bytes
+    for peak_bytes in rotation["peak_bytes"][1:]:
+        assert peak_bytes < bound
+    for net_bytes in rotation["net_bytes"][1:]:
+        assert net_bytes < grid_bytes
@@ -0,0 +1,91 @@
+import numpy as np
+import netCDF4
+import pytest
+
+import bpmfwfft.nc_integrity as nc_integrity
+from bpmfwfft.nc_integrity import mark_incomplete, seal, verify, is_sealed
+
+
+def _write(file_name, nr_written=5, nr_samples=5, sealed=True, marked=True, algorithm=None):
+    nc_handle = netCDF4.Dataset(file_name, "w", format="NETCDF4")
+    if marked:
+        mark_incomplete(nc_handle)
+    nc_handle.createDimension("three", 3)
+    nc_handle.createDimension("lig_sample_size", None)
+    nc_handle.createVariable("spacing", "f8", ("three",))
+    nc_handle.variables["spacing"][:] = 0.5
+    nc_handle.createVariable("lig_positions", "f8", ("lig_sample_size", "three"))
+    nc_handle.createVariable("nr_grid_points", "i8", ("lig_sample_size",))
+    for i in range(nr_written):
+        nc_handle.variables["lig_positions"][i, :] = np.arange(3) + i
+    # the last rows of a killed run are left unwritten
+    if nr_samples > nr_written:
+        nc_handle.variables["nr_grid_points"][:nr_samples] = np.arange(nr_samples)
+    if sealed:
+        seal(nc_handle, algorithm)
+    nc_handle.close()
+    return file_name
+
+
+@pytest.mark.parametrize("algorithm", ["blake2b", "xxh3_64"])
+def test_seal_and_verify(tmp_path, algorithm):
+    if algorithm == "xxh3_64" and nc_integrity.xxhash is None:
+        pytest.skip("xxhash is not installed")
+    file_name = _write(str(tmp_path / "sealed.nc"), algorithm=algorithm)
+    with netCDF4.Dataset(file_name, "r") as nc_handle:
+        assert is_sealed(nc_handle)
+        assert nc_handle.getncattr(nc_integrity.ALGORITHM_ATTR) == algorithm
+    assert verify(file_name, ["spacing", "lig_positions"], {"lig_sample_size": 5})
+    assert verify(file_name, ["spacing", "lig_positions"], {"lig_sample_size": 5}, deep=True)
+    assert not verify(file_name, ["spacing", "lig_positions"], {"lig_sample_size": 6})
+    assert not verify(file_name, ["missing"])
+    assert not verify(str(tmp_path / "trash.nc"))
+
+
+def test_incomplete_file(tmp_path):
+    file_name = _write(str(tmp_path / "killed.nc"), sealed=False)
+    with netCDF4.Dataset(file_name, "r") as nc_handle:
+        assert is_sealed(nc_handle) == False
+    assert not verify(file_name, ["lig_positions"], {"lig_sample_size": 5})
+
+    empty = tmp_path / "empty.nc"
+    empty.write_bytes(b"")
+    assert not verify(str(empty))
+
+
+def test_deep_check_catches_changed_data(tmp_path):
+    file_name = _write(str(tmp_path / "changed.nc"))
+    with netCDF4.Dataset(file_name, "a") as nc_handle:
+        nc_handle.variables["lig_positions"][2, 1] = -1.
+    # the header is unchanged, only the checksums tell
+    assert verify(file_name, ["lig_positions"])
+    assert not verify(file_name, ["lig_positions"], deep=True)
+
+    # rows appended after sealing change the shape
+    file_name = _write(str(tmp_path / "grown.nc"))
+    with netCDF4.Dataset(file_name, "a") as nc_handle:
+        nc_handle.variables["lig_positions"][5, :] = 0.
+    assert not verify(file_name, ["lig_positions"])
+
+
+def test_checksum_in_chunks(tmp_path, monkeypatch):
+    file_name = _write(str(tmp_path / "chunks.nc"), nr_written=40, nr_samples=40)
+    with netCDF4.Dataset(file_name, "r") as nc_handle:
+        variable = nc_handle.variables["lig_positions"]
+        variable.set_auto_mask(False)
+        whole = nc_integrity.variable_checksum(variable, "blake2b")
+        monkeypatch.setattr(nc_integrity, "CHUNK_BYTES", 7 * 3 * 8)
+        assert nc_integrity.variable_checksum(variable, "blake2b") == whole
+
+
+def test_legacy_file(tmp_path):
+    file_name = _write(str(tmp_path / "legacy.nc"), nr_written=3, nr_samples=5, sealed=False, marked=False)
+    with netCDF4.Dataset(file_name, "r") as nc_handle:
+        assert is_sealed(nc_handle) is None
+    assert verify(file_name, ["lig_positions"], {"lig_sample_size": 5})
+    assert verify(file_name, ["lig_positions"], {"lig_sample_size": 5}, deep=True)
+
+    def all_written(nc_handle):
+        return type(nc_handle.variables["lig_positions"][:]) == np.ndarray
+
+    assert not verify(file_name, ["lig_positions"], {"lig_sample_size": 5}, legacy_check=all_written)
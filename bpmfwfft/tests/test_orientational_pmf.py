@@ -0,0 +1,121 @@
+import numpy as np
+import netCDF4
+
+from bpmfwfft.orientational_pmf import OrientationalPMF, orientational_pmf, quaternions_from_matrices, \
+    quaternions_to_u, u_to_quaternions, fit_rotations
+from bpmfwfft.rotation import _rotation_matrix
+from bpmfwfft.fft_sampling import KB
+from bpmfwfft.so3_search import kabsch_rotations
+
+
+def _rotation_matrices(u):
+    return np.array([_rotation_matrix(x) for x in u])
+
+
+def _angles_to(rot_mats, ref):
+    # rotation angle of ref^T R
+    cosines = (np.einsum("ij,nij->n", ref, rot_mats) - 1.) / 2.
+    return np.arccos(np.clip(cosines, -1., 1.))
+
+
+def test_quaternion_round_trip():
+    rng = np.random.RandomState(0)
+    u = rng.uniform(size=(500, 3))
+    rot_mats = _rotation_matrices(u)
+    q = quaternions_from_matrices(rot_mats)
+    back = _rotation_matrices(quaternions_to_u(q))
+    np.testing.assert_allclose(back, rot_mats, atol=1e-10)
+    # u_to_quaternions is the quaternion of rotation._rotation_matrix, up to sign
+    overlaps = np.abs(np.sum(u_to_quaternions(u) * q, axis=1))
+    np.testing.assert_allclose(overlaps, 1., atol=1e-10)
+
+
+def test_fit_rotations_match_kabsch():
+    rng = np.random.RandomState(4)
+    ref = rng.normal(size=(12, 3)) * 3.
+    rot_mats = _rotation_matrices(rng.uniform(size=(200, 3)))
+    crd = np.einsum("nij,aj->nai", rot_mats, ref) + rng.normal(size=(200, 12, 3)) * 0.5
+    # the last two are mirror images, for which the closest rotation needs the SVD
+    crd[-2:] *= -1.
+    np.testing.assert_allclose(fit_rotations(ref, crd), kabsch_rotations(ref, crd), atol=1e-9)
+    np.testing.assert_allclose(fit_rotations(ref, crd[:5] * 0. + ref)[:5], np.array([np.eye(3)] * 5), atol=1e-12)
+
+
+def test_close_rotations_are_neighbors():
+    pmf = OrientationalPMF(resolution=6)
+    neighbors = pmf.neighbors()
+    for cell, cell_neighbors in enumerate(neighbors):
+        assert cell not in cell_neighbors
+        for other in cell_neighbors:
+            assert cell in neighbors[other]
+
+    rng = np.random.RandomState(1)
+    rot_mats = _rotation_matrices(rng.uniform(size=(5000, 3)))
+    # u0 = 0.001 and u1 = 0.25 is a rotation by 3.6 degrees, about an axis set by u2
+    perturbations = _rotation_matrices(np.column_stack([np.full(5000, 0.001), np.full(5000, 0.25),
+                                                        rng.uniform(size=5000)]))
+    moved = np.einsum("nij,njk->nik", perturbations, rot_mats)
+    cells = pmf.cell_indices(quaternions_from_matrices(rot_mats))
+    moved_cells = pmf.cell_indices(quaternions_from_matrices(moved))
+    for cell, other in zip(cells, moved_cells):
+        assert cell == other or other in neighbors[cell]
+
+
+def test_basins_and_populations():
+    rng = np.random.RandomState(2)
+    temperature = 300.
+    beta = 1. / KB / temperature
+    rot_mats = _rotation_matrices(rng.uniform(size=(40000, 3)))
+    wells = [_rotation_matrix([0.3, 0.2, 0.7]), _rotation_matrix([0.8, 0.1, 0.2])]
+    depths = [-6., -5.]
+    energies = np.zeros(rot_mats.shape[0])
+    for well, depth in zip(wells, depths):
+        energies += depth * np.exp(-(_angles_to(rot_mats, well) / 0.35) ** 2)
+
+    pmf = OrientationalPMF(resolution=8, temperature=temperature)
+    for start in range(0, rot_mats.shape[0], 15000):
+        pmf.add(rot_mats[start:start + 15000], -beta * energies[start:start + 15000])
+    assert pmf.get_nr_rotations() == rot_mats.shape[0]
+    assert pmf.get_counts().sum() == rot_mats.shape[0]
+    np.testing.assert_allclose(pmf.get_populations().sum(), 1.)
+
+    basins = pmf.find_basins(bandwidth=0.25)
+    assert len(basins) >= 2
+    for basin, well in zip(basins[:2], wells):
+        assert _angles_to(basin["center_matrix"][np.newaxis], well)[0] < 0.5
+        assert _angles_to(rot_mats[basin["best_rotation"]][np.newaxis], well)[0] < 0.1
+    assert basins[0]["population"] > basins[1]["population"] > 0.1
+
+
+def test_from_sampling_nc(tmp_path):
+    rng = np.random.RandomState(3)
+    ligand = rng.normal(size=(20, 3)) * 4.
+    center = ligand.mean(axis=0)
+    u = rng.uniform(size=(300, 3))
+    rot_mats = _rotation_matrices(u)
+    rot_mats[0] = np.eye(3)
+    positions = np.einsum("nij,aj->nai", rot_mats, ligand - center) + center + 10.
+    log_weights = rng.normal(size=300) * 3.
+
+    nc_file = str(tmp_path / "sampling.nc")
+    nc_handle = netCDF4.Dataset(nc_file, "w", format="NETCDF4")
+    nc_handle.createDimension("one", 1)
+    nc_handle.createDimension("three", 3)
+    nc_handle.createDimension("lig_natoms", 20)
+    nc_handle.createDimension("lig_sample_size", None)
+    nc_handle.createVariable("lig_positions", "f8", ("lig_sample_size", "lig_natoms", "three"))
+    nc_handle.createVariable("exponential_sums", "f8", ("lig_sample_size",))
+    nc_handle.createVariable("log_of_divisors", "f8", ("lig_sample_size",))
+    nc_handle.createVariable("current_rotation_index", "i8", ("one",))
+    nc_handle.variables["lig_positions"][:] = positions
+    nc_handle.variables["exponential_sums"][:] = np.exp(log_weights - 1.)
+    nc_handle.variables["log_of_divisors"][:] = np.ones(300)
+    nc_handle.variables["current_rotation_index"][0] = 250
+    nc_handle.close()
+
+    pmf = orientational_pmf(nc_file, resolution=4, chunk_size=64)
+    expected = OrientationalPMF(resolution=4)
+    expected.add(rot_mats[:250], log_weights[:250])
+    assert pmf.get_nr_rotations() == 250
+    np.testing.assert_array_equal(pmf.get_counts(), expected.get_counts())
+    np.testing.assert_allclose(pmf.get_free_energies(), expected.get_free_energies())
@@ -0,0 +1,40 @@
+import numpy as np
+
+import bpmfwfft.parallel as parallel
+
+
+def test_partition_covers_range():
+    for nr_units, task_divisor in [(100, 16), (7, 3), (5, 5), (1, 1)]:
+        pieces = parallel.partition(nr_units, task_divisor)
+        assert len(pieces) == task_divisor
+        covered = np.concatenate([np.arange(start, start + size) for start, size in pieces])
+        assert covered.tolist() == list(range(nr_units))
+
+
+def test_choose_task_divisor():
+    # one worker never splits
+    assert parallel.choose_task_divisor(128, 1e9, nr_workers=1) == 1
+    # big jobs get TASKS_PER_WORKER tasks per worker
+    assert parallel.choose_task_divisor(128, 1e9, nr_workers=8) == 8 * parallel.TASKS_PER_WORKER
+    # small jobs are not split below the granularity floor
+    assert parallel.choose_task_divisor(100, parallel.MIN_TASK_WORK / 50., nr_workers=8) == 2
+    # never more tasks than units
+    assert parallel.choose_task_divisor(3, 1e9, nr_workers=8) == 3
+    parallel.set_task_divisor(16)
+    assert parallel.choose_task_divisor(128, 1., nr_workers=1) == 16
+    parallel.set_task_divisor(None)
+
+
+def test_available_cpus_override():
+    parallel.set_max_workers(3)
+    assert parallel.available_cpus() == 3
+    parallel.set_max_workers(None)
+    assert parallel.available_cpus() >= 1
+
+
+def test_fit_amdahl():
+    workers = np.array([1, 2, 4, 8])
+    times = 10. * (0.2 + 0.8 / workers)
+    serial_fraction, t1 = parallel.fit_amdahl(workers, times)
+    assert np.isclose(serial_fraction, 0.2)
+    assert np.isclose(t1, 10.)
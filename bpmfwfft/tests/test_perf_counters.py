@@ -0,0 +1,37 @@
+import numpy as np
+
+import bpmfwfft.perf_counters as perf_counters
+
+
+def test_disabled_stage_records_nothing():
+    counters = perf_counters.PerfCounters(enabled=False)
+    with counters.stage("forward_fft", flops=1e6):
+        pass
+    assert counters.report()["stages"] == {}
+
+
+def test_stage_records_time_and_flops():
+    counters = perf_counters.PerfCounters(enabled=True)
+    for _ in range(2):
+        with counters.stage("spectral_product", flops=1e6):
+            np.fft.fftn(np.random.rand(16, 16, 16))
+    report = counters.report(peak_gflops=100., peak_bandwidth_gbs=10.)
+    counters.close()
+    summary = report["stages"]["spectral_product"]
+    assert summary["calls"] == 2
+    assert summary["estimated_flops"] == 2e6
+    assert summary["seconds"] > 0.
+    assert report["ridge_point"] == 10.
+
+
+def test_module_level_stage():
+    perf_counters.enable()
+    with perf_counters.perf_stage("top_k", flops=10.):
+        pass
+    assert "top_k" in perf_counters.get_counters().report()["stages"]
+    perf_counters.enable(False)
+    assert not perf_counters.get_counters().is_enabled()
+
+
+def test_fft_flops():
+    assert np.isclose(perf_counters.fft_flops((8, 8, 8)), 5. * 512 * 9)
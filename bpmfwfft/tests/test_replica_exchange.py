@@ -0,0 +1,69 @@
+import itertools
+
+import numpy as np
+import pytest
+
+from bpmfwfft.replica_exchange import TemperatureExchange, statistical_inefficiency, KB
+
+
+def _harmonic_energies(rng, temperatures, dof=30):
+    # potential energy of a harmonic oscillator with dof degrees of freedom, at equilibrium
+    return KB * temperatures * rng.gamma(dof / 2., 1., size=temperatures.shape[0])
+
+
+def test_neighbor_pairs_alternate():
+    exchanger = TemperatureExchange([300., 350., 400., 450., 500.], scheme="neighbor", random_state=0)
+    energies = np.zeros(5)
+    exchanger.exchange(energies)
+    attempted = exchanger._attempted[np.arange(4), np.arange(1, 5)]
+    assert attempted.tolist() == [1., 0., 1., 0.]
+    exchanger.exchange(energies)
+    attempted = exchanger._attempted[np.arange(4), np.arange(1, 5)]
+    assert attempted.tolist() == [1., 1., 1., 1.]
+    # equal energies are always swapped
+    assert np.all(exchanger.get_neighbor_acceptance() == 1.)
+    assert sorted(exchanger.get_replica_states().tolist()) == list(range(5))
+
+
+@pytest.mark.parametrize("scheme", ["neighbor", "all_pairs"])
+def test_exchange_samples_boltzmann_permutations(scheme):
+    temperatures = np.array([300., 360., 450.])
+    energies = np.array([-10.3, -9.6, -9.9])
+    exchanger = TemperatureExchange(temperatures, scheme=scheme, nr_swap_attempts=1, random_state=1)
+    betas = 1. / KB / temperatures
+
+    permutations = list(itertools.permutations(range(3)))
+    weights = np.array([np.exp(-np.dot(betas[list(p)], energies)) for p in permutations])
+    counts = dict((p, 0) for p in permutations)
+    nr_samples = 40000
+    for _ in range(nr_samples):
+        counts[tuple(exchanger.exchange(energies))] += 1
+    observed = np.array([counts[p] for p in permutations]) / float(nr_samples)
+    assert np.allclose(observed, weights / weights.sum(), atol=0.015)
+
+
+def test_adapt_ladder_equalizes_acceptance():
+    rng = np.random.default_rng(2)
+    # for a constant heat capacity the geometric ladder has equal acceptance; start from a linear one
+    exchanger = TemperatureExchange(np.linspace(300., 900., 8), scheme="neighbor", random_state=2)
+    for iteration in range(1000):
+        energies = _harmonic_energies(rng, exchanger.get_replica_temperatures())
+        exchanger.adapt_ladder(energies)
+        exchanger.exchange(energies)
+    temperatures = exchanger.get_temperatures()
+    assert temperatures[0] == 300. and temperatures[-1] == 900.
+    assert np.all(np.diff(temperatures) > 0)
+    assert np.allclose(temperatures, np.geomspace(300., 900., 8), rtol=0.03)
+
+
+def test_statistical_inefficiency_of_ar1():
+    rng = np.random.default_rng(3)
+    phi = 0.8
+    noise = rng.normal(size=200000)
+    series = np.empty_like(noise)
+    series[0] = noise[0]
+    for t in range(1, noise.shape[0]):
+        series[t] = phi * series[t - 1] + noise[t]
+    assert np.isclose(statistical_inefficiency(series), (1. + phi) / (1. - phi), rtol=0.1)
+    assert np.isclose(statistical_inefficiency(noise), 1., atol=0.1)
+    assert statistical_inefficiency(np.ones(10)) == 1.
@@ -0,0 +1,59 @@
+import numpy as np
+
+from bpmfwfft.restraints import load_restraints, TranslationRestraints
+
+
+def _brute_force(restraints, rec_crd, lig_crd, spacing, shape, max_violated_groups=0):
+    translations = np.stack(np.meshgrid(*[np.arange(n) for n in shape], indexing="ij"), axis=-1) * spacing
+    nr_groups = restraints["groups"].max() + 1
+    nr_violated = np.zeros(shape, dtype=int)
+    for group in range(nr_groups):
+        satisfied = np.zeros(shape, dtype=bool)
+        for i in np.flatnonzero(restraints["groups"] == group):
+            moved = lig_crd[restraints["ligand_atoms"][i]] + translations
+            d = np.linalg.norm(moved - rec_crd[restraints["receptor_atoms"][i]], axis=-1)
+            satisfied |= (d >= restraints["lower"][i]) & (d <= restraints["upper"][i])
+        nr_violated += ~satisfied
+    return nr_violated <= max_violated_groups
+
+
+def test_load_restraints(tmp_path):
+    file_name = tmp_path / "restraints.dat"
+    file_name.write_text("# rec lig lower upper group\n"
+                         "10 3 0.0 8.0 site\n"
+                         "\n"
+                         "12 4 2.0 9.0 site  # ambiguous with the line above\n"
+                         "5 1 0.0 12.0\n")
+    restraints = load_restraints(str(file_name))
+    assert restraints["receptor_atoms"].tolist() == [9, 11, 4]
+    assert restraints["ligand_atoms"].tolist() == [2, 3, 0]
+    assert restraints["upper"].tolist() == [8.0, 9.0, 12.0]
+    assert restraints["groups"].tolist() == [0, 0, 1]
+
+
+def test_mask_matches_brute_force():
+    rng = np.random.default_rng(0)
+    rec_crd = rng.uniform(5., 15., size=(20, 3))
+    lig_crd = rng.uniform(0., 4., size=(6, 3))
+    restraints = {"receptor_atoms": np.array([0, 3, 7, 11]),
+                  "ligand_atoms": np.array([1, 2, 0, 5]),
+                  "lower": np.array([0., 3., 0., 1.]),
+                  "upper": np.array([6., 7., 5., 8.]),
+                  "groups": np.array([0, 0, 1, 2])}
+    spacing, shape = 0.5, (40, 36, 38)
+    for max_violated_groups in (0, 1, 2):
+        mask = TranslationRestraints(restraints, max_violated_groups).mask(rec_crd, lig_crd, spacing, shape)
+        expected = _brute_force(restraints, rec_crd, lig_crd, spacing, shape, max_violated_groups)
+        assert mask.any()
+        assert np.array_equal(mask, expected)
+
+
+def test_mask_outside_grid_and_empty():
+    rec_crd = np.array([[100., 100., 100.]])
+    lig_crd = np.zeros((1, 3))
+    restraints = {"receptor_atoms": np.array([0]), "ligand_atoms": np.array([0]),
+                  "lower": np.array([0.]), "upper": np.array([5.]), "groups": np.array([0])}
+    assert not TranslationRestraints(restraints).mask(rec_crd, lig_crd, 1., (10, 10, 10)).any()
+    assert TranslationRestraints(restraints, 1).mask(rec_crd, lig_crd, 1., (10, 10, 10)).all()
+    empty = dict((key, value[:0]) for key, value in restraints.items())
+    assert TranslationRestraints(empty).mask(rec_crd, lig_crd, 1., (4, 4, 4)).all()
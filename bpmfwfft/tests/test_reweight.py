@@ -0,0 +1,87 @@
+import numpy as np
+
+from bpmfwfft.fft_sampling import TERM_NAMES, KB
+import bpmfwfft.reweight as reweight
+
+TEMPERATURE = 300.
+BETA = 1. / KB / TEMPERATURE
+
+
+def _sampled_data(nr_rotations=4, nr_translations=500, sample_size=50, partials=True, seed=0):
+    """
+    per-term energies as Sampling stores them, plus every energy for the exact answer
+    """
+    rng = np.random.default_rng(seed)
+    terms = {"LJr": rng.gamma(2., 1., (nr_rotations, nr_translations)),
+             "LJa": -rng.gamma(3., 1., (nr_rotations, nr_translations)),
+             "electrostatic": rng.normal(0., 1., (nr_rotations, nr_translations)),
+             "sasa": -rng.gamma(1., 0.5, (nr_rotations, nr_translations)),
+             "desolvation": rng.gamma(1., 0.3, (nr_rotations, nr_translations))}
+    data = {"volume": np.full(nr_rotations, 1000.), "nr_grid_points": np.full(nr_rotations, float(nr_translations)),
+            "exponential_sums": np.zeros(nr_rotations), "log_of_divisors": np.zeros(nr_rotations),
+            "term_energies": dict((name, np.full((nr_rotations, sample_size), np.inf)) for name in TERM_NAMES)}
+    if partials:
+        data["tail_log_exponential_sums"] = np.zeros(nr_rotations)
+        data["tail_mean_energies"] = dict((name, np.zeros(nr_rotations)) for name in TERM_NAMES)
+    for rot in range(nr_rotations):
+        energies = sum(terms[name][rot] for name in TERM_NAMES)
+        exp_energies = -BETA * energies
+        data["log_of_divisors"][rot] = exp_energies.max()
+        exp_energies = np.exp(exp_energies - exp_energies.max())
+        data["exponential_sums"][rot] = exp_energies.sum()
+        exp_energies /= exp_energies.sum()
+        sel_ind = np.argsort(energies)[:sample_size]
+        for name in TERM_NAMES:
+            data["term_energies"][name][rot, :sel_ind.shape[0]] = terms[name][rot][sel_ind]
+        if partials:
+            tail = np.copy(exp_energies)
+            tail[sel_ind] = 0.
+            if tail.sum() == 0.:
+                # every translation was resampled
+                data["tail_log_exponential_sums"][rot] = -np.inf
+                continue
+            data["tail_log_exponential_sums"][rot] = np.log(tail.sum() * data["exponential_sums"][rot]) + \
+                                                     data["log_of_divisors"][rot]
+            for name in TERM_NAMES:
+                data["tail_mean_energies"][name][rot] = np.dot(tail, terms[name][rot]) / tail.sum()
+    return data, terms
+
+
+def _exact_bpmf(terms, weights, data):
+    energies = sum(weights.get(name, 1.) * terms[name] for name in TERM_NAMES)
+    log_sum = reweight._log_sum_exp(-BETA * energies.ravel())
+    correction = -KB * TEMPERATURE * np.log(data["volume"].mean() / reweight.V_0 / 8 / np.pi ** 2)
+    return -KB * TEMPERATURE * (log_sum - np.log(data["nr_grid_points"].sum())) + correction
+
+
+def test_unit_weights_reproduce_sampling():
+    for partials in [True, False]:
+        data, terms = _sampled_data(partials=partials)
+        assert np.isclose(reweight.reweight_data(data, {}, TEMPERATURE), _exact_bpmf(terms, {}, data))
+
+
+def test_all_translations_stored_is_exact():
+    data, terms = _sampled_data(nr_translations=60, sample_size=60, partials=False)
+    weights = {"LJr": 0.8, "LJa": 0.8, "sasa": 2.}
+    assert np.isclose(reweight.reweight_data(data, weights, TEMPERATURE), _exact_bpmf(terms, weights, data))
+
+
+def test_partials_improve_tail():
+    weights = {"electrostatic": 0.9, "sasa": 1.2}
+    data, terms = _sampled_data(sample_size=5, partials=True)
+    exact = _exact_bpmf(terms, weights, data)
+    with_partials = reweight.reweight_data(data, weights, TEMPERATURE)
+    data.pop("tail_log_exponential_sums")
+    without_partials = reweight.reweight_data(data, weights, TEMPERATURE)
+    assert abs(with_partials - exact) < abs(without_partials - exact)
+
+
+def test_padded_rotations_and_zero_weight():
+    # fewer translations than the sample size leaves inf padding in every rotation
+    weights = {"electrostatic": 0., "desolvation": -0.5}
+    for partials in [True, False]:
+        data, terms = _sampled_data(nr_translations=30, sample_size=50, partials=partials)
+        assert np.all(np.isinf(data["term_energies"]["LJr"][:, 30:]))
+        bpmf = reweight.reweight_data(data, weights, TEMPERATURE)
+        assert np.isfinite(bpmf)
+        assert np.isclose(bpmf, _exact_bpmf(terms, weights, data))
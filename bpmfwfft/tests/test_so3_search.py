@@ -0,0 +1,95 @@
+import numpy as np
+
+from bpmfwfft.so3_search import SO3RotationalSearch, euler_to_rotation_matrix
+
+SPACING = 0.25
+COUNTS = 41
+RADIUS = 4.
+
+
+class _RecGrid(object):
+    def __init__(self, potential):
+        self._FFTs = {"electrostatic": np.fft.fftn(potential)}
+
+    def get_FFTs(self):
+        return self._FFTs
+
+    def get_grids(self):
+        return {"origin": np.zeros(3), "spacing": np.array([SPACING] * 3), "counts": np.array([COUNTS] * 3)}
+
+
+class _LigGrid(object):
+    def __init__(self, crd, charges):
+        self._crd = crd
+        self._prmtop = {"CHARGE_E_UNIT": charges}
+
+    def get_prmtop(self):
+        return self._prmtop
+
+    def get_crd(self):
+        return self._crd
+
+    def to_grid_frame(self, crd):
+        return np.asarray(crd, dtype=float)
+
+
+def _search(bandwidth):
+    """
+    a linear plus quadrupolar potential around the grid center, and six charges at RADIUS from their mean
+    """
+    rng = np.random.RandomState(0)
+    field = rng.normal(size=3)
+    quadrupole = rng.normal(size=(3, 3))
+    quadrupole = (quadrupole + quadrupole.T) / 2. - np.trace(quadrupole) / 6. * np.eye(3)
+    center = np.array([(COUNTS - 1) * SPACING / 2.] * 3)
+
+    def potential(points):
+        d = points - center
+        return np.dot(d, field) + np.einsum("ni,ij,nj->n", d, quadrupole, d) / 4.
+
+    x = np.arange(COUNTS) * SPACING
+    points = np.array(np.meshgrid(x, x, x, indexing="ij")).reshape((3, -1)).T
+    rec_grid = _RecGrid(potential(points).reshape((COUNTS,) * 3))
+
+    directions = np.linalg.qr(rng.normal(size=(3, 3)))[0].T
+    lig_crd = np.concatenate([directions, -directions]) * RADIUS + np.array([1., 2., 3.])
+    lig_grid = _LigGrid(lig_crd, rng.normal(size=6))
+    so3_search = SO3RotationalSearch(rec_grid, lig_grid, bandwidth=bandwidth, nr_shells=1)
+    return so3_search, potential, center, lig_crd
+
+
+def _rotated(lig_crd, rot_mats):
+    lig_center = lig_crd.mean(axis=0)
+    return np.array([np.dot(lig_crd - lig_center, rot_mat.T) + lig_center for rot_mat in rot_mats])
+
+
+def test_score_ensemble_of_best_rotations():
+    so3_search, _, _, lig_crd = _search(bandwidth=6)
+    energy_map = so3_search.get_energy_map()
+    nr_rotations = 50
+    best = so3_search.best_rotations(nr_rotations)
+    scores = so3_search.score_ensemble(_rotated(lig_crd, best))
+    np.testing.assert_allclose(scores, np.sort(energy_map, axis=None)[:nr_rotations])
+
+    # every beta of the grid, including those above pi / 2
+    alphas, betas, gammas = so3_search.get_euler_grid()
+    rot_mats = [euler_to_rotation_matrix(alphas[1], beta, gammas[2]) for beta in betas]
+    scores = so3_search.score_ensemble(_rotated(lig_crd, rot_mats))
+    np.testing.assert_allclose(scores, energy_map[1, :, 2])
+
+
+def test_energy_map_matches_direct_sum():
+    so3_search, potential, center, lig_crd = _search(bandwidth=4)
+    energy_map = so3_search.get_energy_map()
+    charges = so3_search._lig_charges["electrostatic"]
+    # with one shell, every atom is expanded at the shell radius
+    scale = so3_search._shell_radii[0] / RADIUS
+    ref = (lig_crd - lig_crd.mean(axis=0)) * scale
+
+    alphas, betas, gammas = so3_search.get_euler_grid()
+    direct = np.zeros(energy_map.shape)
+    for i, j, k in np.ndindex(energy_map.shape):
+        rot_mat = euler_to_rotation_matrix(alphas[i], betas[j], gammas[k])
+        direct[i, j, k] = np.dot(charges, potential(np.dot(ref, rot_mat.T) + center))
+    # the quadrupole is only trilinear on the grid
+    np.testing.assert_allclose(energy_map, direct, atol=1e-2 * np.abs(direct).max())
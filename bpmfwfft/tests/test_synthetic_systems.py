@@ -0,0 +1,41 @@
+import tempfile
+
+import numpy as np
+import pytest
+
+import bpmfwfft.synthetic_systems as synthetic_systems
+
+
+def test_lattice_molecule():
+    molecule = synthetic_systems.generate_molecule(500, layout="lattice", seed=1)
+    assert molecule["crd"].shape == (500, 3)
+    assert len(molecule["elements"]) == 500
+    assert np.isclose(molecule["charges"].sum(), 0.)
+    assert np.allclose(molecule["crd"].mean(axis=0), 0.)
+
+
+def test_random_molecule_separation():
+    pytest.importorskip("scipy")
+    from scipy.spatial import cKDTree
+    molecule = synthetic_systems.generate_molecule(800, layout="random", seed=2)
+    distances, _ = cKDTree(molecule["crd"]).query(molecule["crd"], k=2)
+    assert distances[:, 1].min() >= synthetic_systems.MIN_SEPARATION
+
+
+def test_written_files_load():
+    pytest.importorskip("mdtraj")
+    from bpmfwfft.IO import PrmtopLoad, InpcrdLoad
+    out_dir = tempfile.mkdtemp()
+    files = synthetic_systems.generate_system(out_dir, 300, 40, layout="lattice", spacing=0.5, grid_counts=81)
+
+    prmtop = PrmtopLoad(files["rec_prmtop"]).get_parm_for_grid_calculation()
+    crd = InpcrdLoad(files["rec_inpcrd"]).get_coordinates()
+    assert prmtop["POINTERS"]["NATOM"] == 300
+    assert crd.shape == (300, 3)
+    assert np.isclose(prmtop["CHARGE_E_UNIT"].sum(), 0., atol=1e-6)
+    assert np.all(prmtop["LJ_SIGMA"] > 0)
+    # the receptor sits inside the box [0, 2 * half_edge_length] of the binding site file
+    assert crd.min() > 0. and crd.max() < 40.
+
+    lig_prmtop = PrmtopLoad(files["lig_prmtop"]).get_parm_for_grid_calculation()
+    assert lig_prmtop["POINTERS"]["NATOM"] == 40
@@ -0,0 +1,237 @@
+import numpy as np
+import pytest
+import scipy.fft
+
+try:
+    from bpmfwfft.util import c_cal_potential_grid_pp, c_interpolate_energies
+    from bpmfwfft.util import c_gaussian_sum, c_cal_desolvation_grids_pp_mp, c_screened_coulomb_sum
+except ImportError:
+    pytest.skip("bpmfwfft.util is not compiled", allow_module_level=True)
+
+SPACING = 0.25
+COUNT = 57
+GRID_NAMES = ("electrostatic", "LJr", "LJa")
+
+
+def _receptor(rng, natoms=6):
+    crd = rng.uniform(5., 9., size=(natoms, 3))
+    charges = {"electrostatic": 332.05221729 * rng.uniform(-0.8, 0.8, size=natoms),
+               "LJr": rng.uniform(1e5, 1e6, size=natoms),
+               "LJa": -2. * rng.uniform(10., 50., size=natoms)}
+    return crd, charges
+
+
+def _potential_grids(crd, charges, names=GRID_NAMES, clash_radius=1., **options):
+    counts = np.array([COUNT] * 3, dtype=np.int64)
+    spacing = np.array([SPACING] * 3)
+    origin = np.zeros(3)
+    grid_x = np.arange(COUNT) * SPACING
+    uper_most_corner = counts - 1
+    natoms = crd.shape[0]
+    radii = np.full(natoms, clash_radius)
+    sasa = np.zeros((1, natoms), dtype=np.float32)
+    grids = [c_cal_potential_grid_pp(name, crd, grid_x, grid_x, grid_x, origin, uper_most_corner * SPACING,
+                                     uper_most_corner, spacing, counts, charges[name], radii, radii, radii,
+                                     np.zeros((0, 2), dtype=np.int64), list(range(natoms)), sasa, sasa,
+                                     ["ALA"] * natoms, 1., 1., 1., **options)
+             for name in names]
+    return np.ascontiguousarray(np.stack(grids)), origin, spacing
+
+
+def _direct_energies(rec_crd, rec_charges, lig_crd, lig_charges):
+    R = np.linalg.norm(lig_crd[:, :, np.newaxis, :] - rec_crd[np.newaxis, np.newaxis, :, :], axis=3)
+    energies = np.einsum("paj,j,a->p", 1. / R, rec_charges["electrostatic"], lig_charges[0])
+    energies += np.einsum("paj,j,a->p", R ** -12, rec_charges["LJr"], lig_charges[1])
+    energies += np.einsum("paj,j,a->p", R ** -6, rec_charges["LJa"], lig_charges[2])
+    return energies
+
+
+def _ligand_poses(rng, rec_crd, nposes, natoms=3, min_distance=3.5):
+    poses = []
+    while len(poses) < nposes:
+        pose = rng.uniform(1., 13., size=(natoms, 3))
+        if np.linalg.norm(pose[:, np.newaxis] - rec_crd[np.newaxis], axis=2).min() > min_distance:
+            poses.append(pose)
+    return np.array(poses)
+
+
+def _interpolate(grids, origin, spacing, crd, charges, order, gradient=False):
+    energies = np.empty(crd.shape[0])
+    gradients = np.zeros(crd.shape) if gradient else None
+    c_interpolate_energies(grids, origin, spacing, np.ascontiguousarray(crd), charges, order, energies, gradients)
+    return energies, gradients
+
+
+def test_interpolate_energies_matches_direct_sums():
+    rng = np.random.default_rng(0)
+    rec_crd, rec_charges = _receptor(rng)
+    grids, origin, spacing = _potential_grids(rec_crd, rec_charges)
+    poses = _ligand_poses(rng, rec_crd, 50)
+    lig_charges = np.stack([rng.uniform(-0.8, 0.8, 3), rng.uniform(1e2, 1e3, 3), rng.uniform(1., 5., 3)])
+
+    exact = _direct_energies(rec_crd, rec_charges, poses, lig_charges)
+    trilinear, _ = _interpolate(grids, origin, spacing, poses, lig_charges, 1)
+    tricubic, _ = _interpolate(grids, origin, spacing, poses, lig_charges, 3)
+    trilinear_error = np.abs(trilinear - exact) / np.abs(exact)
+    tricubic_error = np.abs(tricubic - exact) / np.abs(exact)
+    assert trilinear_error.max() < 0.1
+    assert tricubic_error.max() < 0.01
+    assert np.median(tricubic_error) < 0.2 * np.median(trilinear_error)
+
+    # on the lattice both reproduce the grid
+    on_lattice = np.round(poses / SPACING) * SPACING
+    trilinear, _ = _interpolate(grids, origin, spacing, on_lattice, lig_charges, 1)
+    tricubic, _ = _interpolate(grids, origin, spacing, on_lattice, lig_charges, 3)
+    assert np.allclose(trilinear, tricubic, rtol=1e-10, atol=1e-10)
+
+
+@pytest.mark.parametrize("order", [1, 3])
+def test_interpolate_energies_gradients(order):
+    rng = np.random.default_rng(1)
+    rec_crd, rec_charges = _receptor(rng)
+    grids, origin, spacing = _potential_grids(rec_crd, rec_charges)
+    poses = _ligand_poses(rng, rec_crd, 5)
+    lig_charges = rng.uniform(0.5, 1., size=(3, 3))
+
+    energies, gradients = _interpolate(grids, origin, spacing, poses, lig_charges, order, gradient=True)
+    h = 1e-6
+    for atom in range(3):
+        for dim in range(3):
+            moved = np.copy(poses)
+            moved[:, atom, dim] += h
+            moved_energies, _ = _interpolate(grids, origin, spacing, moved, lig_charges, order)
+            numerical = (moved_energies - energies) / h
+            assert np.allclose(gradients[:, atom, dim], numerical, rtol=1e-4, atol=1e-4)
+
+
+def test_interpolate_energies_outside_grid():
+    grids = np.ones((1, 8, 8, 8))
+    origin, spacing = np.zeros(3), np.ones(3)
+    charges = np.ones((1, 1))
+    crd = np.array([[[0., 0., 0.]], [[7., 7., 7.]], [[1., 1., 1.]], [[6., 6., 6.]], [[-0.1, 3., 3.]]])
+    trilinear, _ = _interpolate(grids, origin, spacing, crd, charges, 1)
+    tricubic, _ = _interpolate(grids, origin, spacing, crd, charges, 3)
+    assert trilinear.tolist() == [1., 1., 1., 1., np.inf]
+    # tricubic needs one more grid point on each side
+    assert tricubic.tolist() == [np.inf, np.inf, 1., 1., np.inf]
+
+
+def _gaussian_sums(crd, weights, grid_x, sigma=3.5, cutoff=8.):
+    d2 = ((grid_x[:, None] - crd[:, 0]) ** 2)[:, None, None, :] + \
+         ((grid_x[:, None] - crd[:, 1]) ** 2)[None, :, None, :] + \
+         ((grid_x[:, None] - crd[:, 2]) ** 2)[None, None, :, :]
+    return np.dot(np.where(d2 <= cutoff ** 2, np.exp(-d2 / (2. * sigma ** 2)), 0.), weights)
+
+
+def test_gaussian_sum_matches_direct_sum():
+    rng = np.random.default_rng(2)
+    crd = rng.uniform(-2., 12., size=(20, 3))
+    weights = rng.uniform(0., 1., size=20)
+    grid_x = np.arange(41) * SPACING
+    grid = np.zeros((41, 41, 41))
+    c_gaussian_sum(crd, weights, grid_x, grid_x, grid_x, 3.5, 8., grid)
+    assert np.allclose(grid, _gaussian_sums(crd, weights, grid_x), rtol=1e-12, atol=1e-12)
+
+
+@pytest.mark.parametrize("distance_dielectric", [False, True])
+def test_screened_coulomb_matches_direct_sum(distance_dielectric):
+    rng = np.random.default_rng(3)
+    rec_crd, rec_charges = _receptor(rng)
+    kappa, dielectric, cutoff = 0.13, 4., 6.
+    grid = _potential_grids(rec_crd, rec_charges, names=("electrostatic",), kappa=kappa, dielectric=dielectric,
+                            distance_dielectric=distance_dielectric, cutoff=cutoff)[0][0]
+    grid_x = np.arange(COUNT) * SPACING
+    points = np.stack(np.meshgrid(grid_x, grid_x, grid_x, indexing="ij"), axis=-1)
+    r = np.linalg.norm(points[..., np.newaxis, :] - rec_crd, axis=-1)
+    eps = dielectric * r if distance_dielectric else dielectric
+    kernel = np.where((r > 1.) & (r <= cutoff), np.exp(-kappa * r) / (eps * r), 0.)
+    assert np.allclose(grid, np.dot(kernel, rec_charges["electrostatic"]), rtol=1e-12, atol=1e-12)
+
+
+def test_screened_coulomb_without_screening_is_bare_coulomb():
+    rng = np.random.default_rng(4)
+    rec_crd, rec_charges = _receptor(rng)
+    bare = _potential_grids(rec_crd, rec_charges, names=("electrostatic",))[0]
+    # a cutoff beyond the box diagonal takes the new kernel but leaves nothing out
+    unscreened = _potential_grids(rec_crd, rec_charges, names=("electrostatic",), cutoff=100.)[0]
+    assert np.allclose(unscreened, bare, rtol=1e-12, atol=1e-12)
+    # the cutoff only visits the grid points within it of each atom
+    grid_x = np.arange(COUNT) * SPACING
+    grid = np.zeros((COUNT, COUNT, COUNT))
+    c_screened_coulomb_sum(rec_crd[:1], np.ones(1), np.zeros(1), grid_x, grid_x, grid_x, 0.5, 1., False, 2., grid)
+    assert np.count_nonzero(grid) == np.count_nonzero(
+        np.linalg.norm(np.stack(np.meshgrid(grid_x, grid_x, grid_x, indexing="ij"), axis=-1) - rec_crd[0],
+                       axis=-1) <= 2.)
+
+
+def test_capped_lj_grid_in_single_precision():
+    rng = np.random.default_rng(5)
+    rec_crd = rng.uniform(5., 9., size=(6, 3))
+    rec_charges = {"LJr": rng.uniform(1e2, 2e3, size=6)}
+    # clash radii of scaled hydrogens and oxygens
+    raw = _potential_grids(rec_crd, rec_charges, names=("LJr",), clash_radius=0.6)[0][0]
+    capped = _potential_grids(rec_crd, rec_charges, names=("LJr",), clash_radius=0.6, lj_cap=100.)[0][0]
+    assert raw.max() > 1e5 and np.abs(capped).max() <= 100.
+
+    # a three-atom ligand on lattice points, correlated with the receptor grid at every translation
+    lig_corners = np.array([[0, 0, 0], [6, 0, 0], [0, 6, 2]])
+    lig_grid = np.zeros((COUNT, COUNT, COUNT))
+    lig_grid[tuple(lig_corners.T)] = rng.uniform(75., 900., size=3)
+
+    def correlate(grid, dtype):
+        spectrum = np.conjugate(scipy.fft.fftn(lig_grid.astype(dtype))) * scipy.fft.fftn(grid.astype(dtype))
+        return scipy.fft.ifftn(spectrum).real
+
+    # translations without wrap-around that keep every ligand atom 2.5 A from the receptor
+    translations = np.stack(np.meshgrid(*[np.arange(COUNT - 7)] * 3, indexing="ij"), axis=-1).reshape((-1, 3))
+    lig_crd = (translations[:, np.newaxis, :] + lig_corners) * SPACING
+    distances = np.linalg.norm(lig_crd[:, :, np.newaxis, :] - rec_crd, axis=-1).min(axis=(1, 2))
+    free_of_clash = tuple(translations[distances > 2.5].T)
+    exact = correlate(raw, np.float64)[free_of_clash]
+
+    # capping leaves the clash-free energies as they are and bounds the float32 error
+    assert np.allclose(correlate(capped, np.float64)[free_of_clash], exact, rtol=0., atol=1e-4)
+    raw_error = np.abs(correlate(raw, np.float32)[free_of_clash] - exact).max()
+    capped_error = np.abs(correlate(capped, np.float32)[free_of_clash] - exact).max()
+    assert capped_error < 0.05 and capped_error < 0.1 * raw_error
+
+    # nor does it move the free energy over those translations, here kT = 0.596 kcal/mol
+    def free_energy(energies):
+        return -0.596 * np.log(np.mean(np.exp(-energies / 0.596)))
+    assert abs(free_energy(correlate(capped, np.float32)[free_of_clash]) - free_energy(exact)) < 1e-3
+
+
+def test_desolvation_channel_matches_pair_sum():
+    rng = np.random.default_rng(3)
+    count = 48
+    grid_x = np.arange(count) * SPACING
+    counts = np.array([count] * 3, dtype=np.int64)
+    spacing = np.array([SPACING] * 3)
+    eight_corner_shifts = np.array([[i, j, k] for i in range(2) for j in range(2) for k in range(2)], dtype=np.int64)
+    six_corner_shifts = np.array([[-1, 0, 0], [0, -1, 0], [0, 0, -1], [1, 0, 0], [0, 1, 0], [0, 0, 1]],
+                                 dtype=np.int64)
+    # receptor weights: charge and volume channels; ligand: volume and charge, paired the other way round
+    rec_crd = rng.uniform(5., 7., size=(8, 3))
+    rec_weights = np.stack([rng.uniform(0., 0.01, 8), rng.uniform(5., 30., 8)])
+    lig_crd = rng.uniform(0.6, 2.4, size=(4, 3))
+    lig_weights = np.stack([rng.uniform(5., 30., 4), rng.uniform(0., 0.01, 4)])
+
+    rec_grids = np.zeros((2, count, count, count))
+    for channel in range(2):
+        c_gaussian_sum(rec_crd, rec_weights[channel], grid_x, grid_x, grid_x, 3.5, 8., rec_grids[channel])
+    lig_grids = c_cal_desolvation_grids_pp_mp(lig_crd, grid_x, grid_x, grid_x, np.zeros(3), (counts - 1) * SPACING,
+                                              counts - 1, spacing, eight_corner_shifts, six_corner_shifts,
+                                              lig_weights, 4, 0)
+    # the least-squares spreading keeps the total weight of both channels
+    assert np.allclose(lig_grids.sum(axis=(1, 2, 3)), lig_weights.sum(axis=1), rtol=1e-3)
+
+    # one complex correlation gives both cross terms
+    spectrum = np.conjugate(np.fft.fftn(lig_grids[0] + 1.j * lig_grids[1])) * np.fft.fftn(rec_grids[0] + 1.j * rec_grids[1])
+    corr = np.fft.ifftn(spectrum).real
+    for translation in [(0, 0, 0), (4, 8, 2), (10, 3, 12), (16, 16, 16)]:
+        moved = lig_crd + np.array(translation) * SPACING
+        r2 = ((moved[:, None, :] - rec_crd[None, :, :]) ** 2).sum(axis=2)
+        gaussian = np.where(r2 <= 64., np.exp(-r2 / (2. * 3.5 ** 2)), 0.)
+        exact = np.dot(lig_weights[0], np.dot(gaussian, rec_weights[0])) + \
+                np.dot(lig_weights[1], np.dot(gaussian, rec_weights[1]))
+        assert np.isclose(corr[translation], exact, rtol=0.02)
@@ -7,11 +7,14 @@ from cython cimport view
 from scipy.optimize import nnls
 
 
-cdef extern from "math.h":
+cdef extern from "math.h" nogil:
     double sqrt(double)
     double cos(double)
     double sin(double)
     double fmod(double x, double y)
+    double floor(double)
+    double ceil(double)
+    double exp(double)
     double M_PI
 
 @cython.boundscheck(False)
@@ -276,6 +279,228 @@ def c_corners_within_radius(np.ndarray[np.float64_t, ndim=1] atom_coordinate,
             return corners
 
 
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def c_capsule_occupancy(np.ndarray[np.float64_t, ndim=2] crd,
+                        np.ndarray[np.int64_t, ndim=2]   segments,
+                        np.ndarray[np.float64_t, ndim=1] radii,
+                        np.ndarray[np.float64_t, ndim=1] origin_crd,
+                        np.ndarray[np.float64_t, ndim=1] spacing,
+                        np.ndarray[np.float64_t, ndim=3] grid):
+    """
+    set grid to 1 at every grid point within radii[s] of the segment from crd[segments[s, 0]]
+    to crd[segments[s, 1]], in one pass over the segments
+    a segment whose two ends are the same atom is a sphere, so atoms and bonds can be mixed
+    :param crd: 2d array of float, (natoms, 3)
+    :param segments: 2d array of int, (nsegments, 2) atom indices
+    :param radii: 1d array of float, (nsegments,)
+    :param origin_crd: 1d array of float, coordinate of grid[0, 0, 0]
+    :param spacing: 1d array of float
+    :param grid: 3d array of float, modified in place
+    """
+    cdef:
+        Py_ssize_t nsegments = segments.shape[0]
+        Py_ssize_t s, i, j, k, dim
+        Py_ssize_t lower[3]
+        Py_ssize_t upper[3]
+        Py_ssize_t counts[3]
+        double start[3]
+        double axis[3]
+        double low, high, radius, radius2, axis2
+        double px, py, pz, t, dx, dy, dz
+        double[:,:] crd_view = crd
+        long[:,:] segments_view = segments
+        double[:] radii_view = radii
+        double[:,:,:] grid_view = grid
+
+    assert segments.shape[0] == radii.shape[0], "segments and radii must have the same length"
+    for dim in range(3):
+        counts[dim] = grid.shape[dim]
+
+    for s in range(nsegments):
+        radius = radii_view[s]
+        if radius <= 0.:
+            continue
+        radius2 = radius * radius
+        axis2 = 0.
+        for dim in range(3):
+            start[dim] = crd_view[segments_view[s, 0], dim]
+            axis[dim] = crd_view[segments_view[s, 1], dim] - start[dim]
+            axis2 += axis[dim] * axis[dim]
+            low = min(start[dim], start[dim] + axis[dim]) - radius
+            high = max(start[dim], start[dim] + axis[dim]) + radius
+            lower[dim] = max(<Py_ssize_t>ceil((low - origin_crd[dim]) / spacing[dim]), 0)
+            upper[dim] = min(<Py_ssize_t>floor((high - origin_crd[dim]) / spacing[dim]), counts[dim] - 1)
+
+        for i in range(lower[0], upper[0] + 1):
+            px = origin_crd[0] + i * spacing[0] - start[0]
+            for j in range(lower[1], upper[1] + 1):
+                py = origin_crd[1] + j * spacing[1] - start[1]
+                for k in range(lower[2], upper[2] + 1):
+                    pz = origin_crd[2] + k * spacing[2] - start[2]
+                    # closest point on the segment
+                    t = 0.
+                    if axis2 > 0.:
+                        t = (px * axis[0] + py * axis[1] + pz * axis[2]) / axis2
+                        t = min(max(t, 0.), 1.)
+                    dx = px - t * axis[0]
+                    dy = py - t * axis[1]
+                    dz = pz - t * axis[2]
+                    if dx * dx + dy * dy + dz * dz <= radius2:
+                        grid_view[i, j, k] = 1.
+    return None
+
+
+cdef inline void _linear_weights(double t, double* w, double* dw) noexcept nogil:
+    w[0] = 1. - t
+    w[1] = t
+    dw[0] = -1.
+    dw[1] = 1.
+
+
+cdef inline void _cubic_weights(double t, double* w, double* dw) noexcept nogil:
+    # 1d cubic Hermite with central difference derivatives (Catmull-Rom) on points -1, 0, 1, 2
+    cdef double t2 = t * t
+    cdef double t3 = t2 * t
+    w[0] = 0.5 * (-t3 + 2. * t2 - t)
+    w[1] = 0.5 * (3. * t3 - 5. * t2 + 2.)
+    w[2] = 0.5 * (-3. * t3 + 4. * t2 + t)
+    w[3] = 0.5 * (t3 - t2)
+    dw[0] = 0.5 * (-3. * t2 + 4. * t - 1.)
+    dw[1] = 0.5 * (9. * t2 - 10. * t)
+    dw[2] = 0.5 * (-9. * t2 + 8. * t + 1.)
+    dw[3] = 0.5 * (3. * t2 - 2. * t)
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+def c_interpolate_energies(double[:, :, :, ::1] grids,
+                           double[::1] origin_crd,
+                           double[::1] spacing,
+                           double[:, :, ::1] crd,
+                           double[:, ::1] charges,
+                           int order,
+                           double[::1] energies,
+                           double[:, :, ::1] gradients=None):
+    """
+    energies of many ligand poses on precomputed receptor potential grids,
+    sum over grids g and atoms a of charges[g, a] * grids[g] interpolated at crd[pose, a]
+    order 1 is trilinear, order 3 is tricubic: the Lekien-Marsden interpolant with its 8 derivatives at the
+    corners taken by central differences, which is the tensor product of 1d Catmull-Rom splines on the 4x4x4
+    points around the atom, so it is evaluated that way without the 64x64 coefficient matrix
+    the GIL is released, callers can run slices of the poses in threads
+    :param grids: 4d array of float, (ngrids, i, j, k)
+    :param origin_crd: 1d array of float, coordinate of grids[:, 0, 0, 0]
+    :param spacing: 1d array of float
+    :param crd: 3d array of float, (nposes, natoms, 3)
+    :param charges: 2d array of float, (ngrids, natoms)
+    :param order: int, 1 or 3
+    :param energies: 1d array of float, (nposes,), output; inf for a pose with an atom outside the grid,
+    within one spacing of the border for order 3
+    :param gradients: None or 3d array of float, (nposes, natoms, 3), output, dE / dcrd
+    """
+    cdef:
+        Py_ssize_t nposes = crd.shape[0]
+        Py_ssize_t natoms = crd.shape[1]
+        Py_ssize_t ngrids = grids.shape[0]
+        Py_ssize_t p, a, g, dim, i, j, k
+        Py_ssize_t npoints = order + 1
+        Py_ssize_t offset = -1 if order == 3 else 0
+        Py_ssize_t counts[3]
+        Py_ssize_t lower[3]
+        double w[3][4]
+        double dw[3][4]
+        double u, t, value, row, drow, wij, v, energy, charge
+        double grad[3]
+        double inf = np.inf
+        bint with_gradient = gradients is not None
+        bint outside
+
+    assert order == 1 or order == 3, "order must be 1 or 3"
+    assert charges.shape[0] == ngrids and charges.shape[1] == natoms, "charges must be (ngrids, natoms)"
+    assert energies.shape[0] == nposes, "energies must be (nposes,)"
+    if with_gradient:
+        assert gradients.shape[0] == nposes and gradients.shape[1] == natoms, "gradients must be (nposes, natoms, 3)"
+    for dim in range(3):
+        counts[dim] = grids.shape[dim + 1]
+
+    with nogil:
+        for p in range(nposes):
+            energy = 0.
+            outside = False
+            for a in range(natoms):
+                for dim in range(3):
+                    u = (crd[p, a, dim] - origin_crd[dim]) / spacing[dim]
+                    lower[dim] = <Py_ssize_t>floor(u)
+                    t = u - lower[dim]
+                    # a point on the upper border belongs to the last cell
+                    if t == 0. and lower[dim] + offset + npoints == counts[dim] + 1:
+                        lower[dim] -= 1
+                        t = 1.
+                    lower[dim] += offset
+                    if lower[dim] < 0 or lower[dim] + npoints > counts[dim]:
+                        outside = True
+                        break
+                    if order == 3:
+                        _cubic_weights(t, w[dim], dw[dim])
+                    else:
+                        _linear_weights(t, w[dim], dw[dim])
+                if outside:
+                    break
+
+                for dim in range(3):
+                    grad[dim] = 0.
+                for g in range(ngrids):
+                    charge = charges[g, a]
+                    if charge == 0.:
+                        continue
+                    value = 0.
+                    for i in range(npoints):
+                        for j in range(npoints):
+                            # along z first, then the x and y weights once per row
+                            row = 0.
+                            drow = 0.
+                            for k in range(npoints):
+                                v = grids[g, lower[0] + i, lower[1] + j, lower[2] + k]
+                                row += w[2][k] * v
+                                drow += dw[2][k] * v
+                            wij = w[0][i] * w[1][j]
+                            value += wij * row
+                            if with_gradient:
+                                grad[0] += charge * dw[0][i] * w[1][j] * row
+                                grad[1] += charge * w[0][i] * dw[1][j] * row
+                                grad[2] += charge * wij * drow
+                    energy += charge * value
+                if with_gradient:
+                    for dim in range(3):
+                        gradients[p, a, dim] = grad[dim] / spacing[dim]
+
+            if outside:
+                energies[p] = inf
+                if with_gradient:
+                    for a in range(natoms):
+                        for dim in range(3):
+                            gradients[p, a, dim] = 0.
+            else:
+                energies[p] = energy
+    return None
+
+
+def c_occupancy_segments(list atom_list,
+                         np.ndarray[np.int64_t, ndim=2]   bonds,
+                         np.ndarray[np.float64_t, ndim=1] clash_radii):
+    """
+    atoms as zero-length segments with their clash radius, followed by bonds with
+    the smaller clash radius of their two atoms
+    :return: (segments, radii), arguments of c_capsule_occupancy
+    """
+    cdef np.ndarray[np.int64_t, ndim=1] atoms = np.array(atom_list, dtype=np.int64)
+    segments = np.concatenate([np.stack([atoms, atoms], axis=1), bonds], axis=0)
+    radii = np.concatenate([clash_radii[atoms], np.minimum(clash_radii[bonds[:, 0]], clash_radii[bonds[:, 1]])])
+    return segments, radii
+
+
 @cython.boundscheck(False)
 def c_is_row_in_matrix( np.ndarray[np.int64_t, ndim=1] row, 
                         list matrix):
@@ -634,6 +859,171 @@ def calculate_distances(np.ndarray[double, ndim=2] array1,
                 rows.append(row)
     return rows
 
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+def c_gaussian_sum(np.ndarray[np.float64_t, ndim=2] crd,
+                   np.ndarray[np.float64_t, ndim=1] weights,
+                   np.ndarray[np.float64_t, ndim=1] grid_x,
+                   np.ndarray[np.float64_t, ndim=1] grid_y,
+                   np.ndarray[np.float64_t, ndim=1] grid_z,
+                   double sigma,
+                   double cutoff,
+                   np.ndarray[np.float64_t, ndim=3] grid):
+    """
+    add sum over atoms of weights[a] * exp(-r^2 / (2 sigma^2)) to grid, within cutoff of every atom
+    :param grid_x, grid_y, grid_z: 1d arrays of float, evenly spaced grid coordinates, e.g. of one x slab
+    :param grid: 3d array of float, modified in place
+    """
+    cdef:
+        Py_ssize_t natoms = crd.shape[0]
+        Py_ssize_t a, i, j, k, dim
+        Py_ssize_t lower[3]
+        Py_ssize_t upper[3]
+        Py_ssize_t counts[3]
+        double first[3]
+        double step[3]
+        double weight, dx2, dy2, r2
+        double cutoff2 = cutoff * cutoff
+        double inv_two_sigma2 = 1. / (2. * sigma * sigma)
+        double[:,:] crd_view = crd
+        double[:] gx = grid_x
+        double[:] gy = grid_y
+        double[:] gz = grid_z
+        double[:,:,:] grid_view = grid
+
+    counts[0] = gx.shape[0]
+    counts[1] = gy.shape[0]
+    counts[2] = gz.shape[0]
+    first[0] = gx[0]
+    first[1] = gy[0]
+    first[2] = gz[0]
+    for dim in range(3):
+        step[dim] = 1.
+    if counts[0] > 1:
+        step[0] = gx[1] - gx[0]
+    if counts[1] > 1:
+        step[1] = gy[1] - gy[0]
+    if counts[2] > 1:
+        step[2] = gz[1] - gz[0]
+
+    with nogil:
+        for a in range(natoms):
+            weight = weights[a]
+            if weight == 0.:
+                continue
+            for dim in range(3):
+                lower[dim] = max(<Py_ssize_t>ceil((crd_view[a, dim] - cutoff - first[dim]) / step[dim]), 0)
+                upper[dim] = min(<Py_ssize_t>floor((crd_view[a, dim] + cutoff - first[dim]) / step[dim]),
+                                 counts[dim] - 1)
+            for i in range(lower[0], upper[0] + 1):
+                dx2 = (gx[i] - crd_view[a, 0]) * (gx[i] - crd_view[a, 0])
+                for j in range(lower[1], upper[1] + 1):
+                    dy2 = dx2 + (gy[j] - crd_view[a, 1]) * (gy[j] - crd_view[a, 1])
+                    if dy2 > cutoff2:
+                        continue
+                    for k in range(lower[2], upper[2] + 1):
+                        r2 = dy2 + (gz[k] - crd_view[a, 2]) * (gz[k] - crd_view[a, 2])
+                        if r2 <= cutoff2:
+                            grid_view[i, j, k] += weight * exp(-r2 * inv_two_sigma2)
+    return None
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+def c_screened_coulomb_sum(np.ndarray[np.float64_t, ndim=2] crd,
+                           np.ndarray[np.float64_t, ndim=1] charges,
+                           np.ndarray[np.float64_t, ndim=1] clash_radii,
+                           np.ndarray[np.float64_t, ndim=1] grid_x,
+                           np.ndarray[np.float64_t, ndim=1] grid_y,
+                           np.ndarray[np.float64_t, ndim=1] grid_z,
+                           double kappa,
+                           double dielectric,
+                           bint distance_dielectric,
+                           double cutoff,
+                           np.ndarray[np.float64_t, ndim=3] grid):
+    """
+    add sum over atoms of charges[a] * exp(-kappa r) / (eps(r) r) to grid, the Debye-Hueckel potential,
+    eps(r) = dielectric * r if distance_dielectric else dielectric
+    grid points within clash_radii[a] of atom a get nothing from it, as in c_cal_potential_grid_pp
+    only the grid points within cutoff of an atom are visited, so the cost is natoms * (cutoff / spacing)^3
+    :param kappa: float, inverse Debye length, 1/angstrom; 0 for no screening
+    :param cutoff: float, angstrom; <= 0 for every grid point
+    :param grid_x, grid_y, grid_z: 1d arrays of float, evenly spaced grid coordinates, e.g. of one x slab
+    :param grid: 3d array of float, modified in place
+    """
+    cdef:
+        Py_ssize_t natoms = crd.shape[0]
+        Py_ssize_t a, i, j, k, dim
+        Py_ssize_t lower[3]
+        Py_ssize_t upper[3]
+        Py_ssize_t counts[3]
+        double first[3]
+        double step[3]
+        double charge, dx2, dy2, r2, r, clash2
+        bint has_cutoff = cutoff > 0.
+        double cutoff2 = cutoff * cutoff
+        double[:,:] crd_view = crd
+        double[:] charges_view = charges
+        double[:] clash_view = clash_radii
+        double[:] gx = grid_x
+        double[:] gy = grid_y
+        double[:] gz = grid_z
+        double[:,:,:] grid_view = grid
+
+    assert dielectric > 0., "dielectric must be positive"
+    assert kappa >= 0., "kappa must be non-negative"
+    counts[0] = gx.shape[0]
+    counts[1] = gy.shape[0]
+    counts[2] = gz.shape[0]
+    first[0] = gx[0]
+    first[1] = gy[0]
+    first[2] = gz[0]
+    for dim in range(3):
+        step[dim] = 1.
+    if counts[0] > 1:
+        step[0] = gx[1] - gx[0]
+    if counts[1] > 1:
+        step[1] = gy[1] - gy[0]
+    if counts[2] > 1:
+        step[2] = gz[1] - gz[0]
+
+    with nogil:
+        for a in range(natoms):
+            charge = charges_view[a] / dielectric
+            if charge == 0.:
+                continue
+            clash2 = clash_view[a] * clash_view[a]
+            for dim in range(3):
+                if has_cutoff:
+                    lower[dim] = max(<Py_ssize_t>ceil((crd_view[a, dim] - cutoff - first[dim]) / step[dim]), 0)
+                    upper[dim] = min(<Py_ssize_t>floor((crd_view[a, dim] + cutoff - first[dim]) / step[dim]),
+                                     counts[dim] - 1)
+                else:
+                    lower[dim] = 0
+                    upper[dim] = counts[dim] - 1
+            for i in range(lower[0], upper[0] + 1):
+                dx2 = (gx[i] - crd_view[a, 0]) * (gx[i] - crd_view[a, 0])
+                for j in range(lower[1], upper[1] + 1):
+                    dy2 = dx2 + (gy[j] - crd_view[a, 1]) * (gy[j] - crd_view[a, 1])
+                    if has_cutoff and dy2 > cutoff2:
+                        continue
+                    for k in range(lower[2], upper[2] + 1):
+                        r2 = dy2 + (gz[k] - crd_view[a, 2]) * (gz[k] - crd_view[a, 2])
+                        if r2 <= clash2 or (has_cutoff and r2 > cutoff2):
+                            continue
+                        if distance_dielectric:
+                            if kappa > 0.:
+                                grid_view[i, j, k] += charge * exp(-kappa * sqrt(r2)) / r2
+                            else:
+                                grid_view[i, j, k] += charge / r2
+                        else:
+                            r = sqrt(r2)
+                            grid_view[i, j, k] += charge * exp(-kappa * r) / r
+    return None
+
+
 @cython.boundscheck(False)
 def c_cal_potential_grid_pp(   str name,
                             np.ndarray[np.float64_t, ndim=2] crd,
@@ -649,15 +1039,25 @@ def c_cal_potential_grid_pp(   str name,
                             np.ndarray[np.float64_t, ndim=1] lj_sigma,
                             np.ndarray[np.float64_t, ndim=1] vdw_radii,
                             np.ndarray[np.float64_t, ndim=1] clash_radii,
-                            list bond_list,
+                            np.ndarray[np.int64_t, ndim=2] bonds,
                             list atom_list,
                             np.ndarray[float, ndim=2] molecule_sasa,
                             np.ndarray[float, ndim=2] sasa_cutoffs,
                             list rec_res_names,
                             float rec_core_scaling,
                             float rec_surface_scaling,
-                            float rec_metal_scaling):
-
+                            float rec_metal_scaling,
+                            double kappa=0.,
+                            double dielectric=1.,
+                            bint distance_dielectric=False,
+                            double cutoff=0.,
+                            double lj_cap=0.):
+    """
+    :param kappa, dielectric, distance_dielectric, cutoff: electrostatic only, see c_screened_coulomb_sum;
+    the defaults keep the bare Coulomb sum over all atoms and grid points
+    :param lj_cap: float, LJr and LJa only; if > 0 the summed grid g becomes lj_cap * tanh(g / lj_cap),
+    which keeps |g| << lj_cap within (g / lj_cap)^2 / 3 and never exceeds lj_cap inside the receptor
+    """
     cdef:
         list corners
         list metal_ions = ["ZN", "CA", "MG", "SR"]
@@ -676,7 +1076,10 @@ def c_cal_potential_grid_pp(   str name,
         np.ndarray[np.float64_t, ndim=1] atom_coordinate
         np.ndarray[np.float64_t, ndim=1] dx2, dy2, dz2
 
-    if name in ["LJa","LJr","electrostatic","water"]:
+    if name == "electrostatic" and (kappa > 0. or dielectric != 1. or distance_dielectric or cutoff > 0.):
+        c_screened_coulomb_sum(crd, charges, clash_radii, grid_x, grid_y, grid_z,
+                               kappa, dielectric, distance_dielectric, cutoff, grid)
+    elif name in ["LJa","LJr","electrostatic","water"]:
         if name == "LJa":
             exponent = 3.
         elif name == "LJr":
@@ -731,20 +1134,13 @@ def c_cal_potential_grid_pp(   str name,
                     grid_tmp[i,j,k] = 0
 
             grid += grid_tmp
+        if name in ["LJa","LJr"] and lj_cap > 0.:
+            np.divide(grid, lj_cap, out=grid)
+            np.tanh(grid, out=grid)
+            grid *= lj_cap
     else:
-        for atom_ind in atom_list:
-            atom_coordinate = crd[atom_ind]
-            lj_diameter = clash_radii[atom_ind]
-            corners = c_corners_within_radius(atom_coordinate, lj_diameter, origin_crd, uper_most_corner_crd,
-                                              uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
-            for i, j, k in corners:
-                grid[i, j, k] = 1.
-        for bond_crd in bond_list:
-            lj_diameter = 1.
-            corners = c_corners_within_radius(bond_crd, lj_diameter, origin_crd, uper_most_corner_crd,
-                                              uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
-            for i, j, k in corners:
-                grid[i, j, k] = 1.
+        segments, radii = c_occupancy_segments(atom_list, bonds, clash_radii)
+        c_capsule_occupancy(crd, segments, radii, origin_crd, spacing, grid)
 
     return grid
 
@@ -898,7 +1294,7 @@ def c_cal_charge_grid_pp_mp(  str name,
                         np.ndarray[np.float64_t, ndim=1] lj_sigma,
                         np.ndarray[np.float64_t, ndim=1] vdw_radii,
                         np.ndarray[np.float64_t, ndim=1] clash_radii,
-                        list bond_list,
+                        np.ndarray[np.int64_t, ndim=2]   bonds,
                         list atom_list,
                         int natoms_i,
                         int atomind,
@@ -979,23 +1375,160 @@ def c_cal_charge_grid_pp_mp(  str name,
             # grid += grid_tmp
 
     else:
-        for atom_ind in atom_list:
-            atom_coordinate = crd[atom_ind]
-            lj_diameter = clash_radii[atom_ind]
-            corners = c_corners_within_radius(atom_coordinate, lj_diameter, origin_crd, uper_most_corner_crd,
-                                              uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
-            for i, j, k in corners:
-                grid[i, j, k] = 1.
-
-        for bond_crd in bond_list:
-            lj_diameter = 1.
-            corners = c_corners_within_radius(bond_crd, lj_diameter, origin_crd, uper_most_corner_crd,
-                                              uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
-            for i, j, k in corners:
-                grid[i, j, k] = 1.
+        segments, radii = c_occupancy_segments(atom_list, bonds, clash_radii)
+        c_capsule_occupancy(crd, segments, radii, origin_crd, spacing, grid)
 
     return grid
 
+@cython.boundscheck(False)
+def c_cal_desolvation_grids_pp_mp(np.ndarray[np.float64_t, ndim=2] crd,
+                                  np.ndarray[np.float64_t, ndim=1] grid_x,
+                                  np.ndarray[np.float64_t, ndim=1] grid_y,
+                                  np.ndarray[np.float64_t, ndim=1] grid_z,
+                                  np.ndarray[np.float64_t, ndim=1] origin_crd,
+                                  np.ndarray[np.float64_t, ndim=1] uper_most_corner_crd,
+                                  np.ndarray[np.int64_t, ndim=1]   uper_most_corner,
+                                  np.ndarray[np.float64_t, ndim=1] spacing,
+                                  np.ndarray[np.int64_t, ndim=2]   eight_corner_shifts,
+                                  np.ndarray[np.int64_t, ndim=2]   six_corner_shifts,
+                                  np.ndarray[np.float64_t, ndim=2] weights,
+                                  int natoms_i,
+                                  int atomind):
+    """
+    the two ligand grids of the desolvation term, atoms natoms_i atoms from atomind
+    the ten-corner NNLS spreading is linear in a non-negative charge, so it is solved once per atom
+    for a unit charge and scaled by both weights
+    :param weights: 2d array of float, (2, natoms), non-negative, atomic volumes and squared charges
+    :return: 4d array of float, (2, i, j, k)
+    """
+    cdef:
+        int atom_ind, i, l, m, n
+        int i_max = grid_x.shape[0]
+        int j_max = grid_y.shape[0]
+        int k_max = grid_z.shape[0]
+        list ten_corners
+        np.ndarray[np.float64_t, ndim=1] distributed_charges
+        np.ndarray[np.float64_t, ndim=4] grid = np.zeros([2, i_max, j_max, k_max], dtype=float)
+        double[:,:,:,:] grid_view = grid
+        double[:,:] weights_view = weights
+        long[:,:] ten_corners_view
+
+    for atom_ind in range(atomind, atomind + natoms_i):
+        if weights_view[0, atom_ind] == 0. and weights_view[1, atom_ind] == 0.:
+            continue
+        ten_corners, distributed_charges = c_distr_charge_one_atom("desolvation", crd[atom_ind], 1.,
+                                                                   origin_crd, uper_most_corner_crd,
+                                                                   uper_most_corner, spacing,
+                                                                   eight_corner_shifts, six_corner_shifts,
+                                                                   grid_x, grid_y, grid_z)
+        ten_corners_view = c_list_to_array_long(ten_corners)
+        for i in range(10):
+            l = ten_corners_view[i][0]
+            m = ten_corners_view[i][1]
+            n = ten_corners_view[i][2]
+            grid_view[0, l, m, n] += weights_view[0, atom_ind] * distributed_charges[i]
+            grid_view[1, l, m, n] += weights_view[1, atom_ind] * distributed_charges[i]
+    return grid
+
+@cython.boundscheck(False)
+def c_cal_lig_sasa_grids(np.ndarray[np.float64_t, ndim=2] crd,
+                        np.ndarray[np.float64_t, ndim=1] grid_x,
+                        np.ndarray[np.float64_t, ndim=1] grid_y,
+                        np.ndarray[np.float64_t, ndim=1] grid_z,
+                        np.ndarray[np.float64_t, ndim=1] origin_crd,
+                        np.ndarray[np.float64_t, ndim=1] uper_most_corner_crd,
+                        np.ndarray[np.int64_t, ndim=1]   uper_most_corner,
+                        np.ndarray[np.float64_t, ndim=1] spacing,
+                        np.ndarray[np.int64_t, ndim=2]   nearest_neighbor_shifts,
+                        np.ndarray[np.int64_t, ndim=1]   grid_counts,
+                        np.ndarray[np.float64_t, ndim=1] radii,
+                        list core_atoms,
+                        list surface_atoms,
+                        list core_ions,
+                        list surface_ions,
+                        float lig_core_scaling,
+                        float lig_surface_scaling,
+                        float lig_metal_scaling,
+                        float rho):
+    """
+    SASAi (interior, value rho) and SASAr (surface layer, value 1) grids of the ligand.
+    Interior points with more than one empty nearest neighbor are moved to the surface layer.
+    """
+    cdef:
+        int atom_ind, i, j, k, l, m, n, s
+        int nshifts = nearest_neighbor_shifts.shape[0]
+        int nzeros
+        int i_max = grid_x.shape[0]
+        int j_max = grid_y.shape[0]
+        int k_max = grid_z.shape[0]
+        double radius
+        list corners, changes_list
+        np.ndarray[np.float64_t, ndim=1] atom_coordinate
+        np.ndarray[np.float64_t, ndim=3] sasai_grid = np.zeros([i_max, j_max, k_max], dtype=float)
+        np.ndarray[np.float64_t, ndim=3] sasar_grid = np.zeros([i_max, j_max, k_max], dtype=float)
+        double[:,:,:] sasai_view = sasai_grid
+        double[:,:,:] sasar_view = sasar_grid
+        long[:,:] shifts_view = nearest_neighbor_shifts
+
+    for atom_ind in core_atoms:
+        atom_coordinate = crd[atom_ind]
+        radius = radii[atom_ind] * lig_core_scaling
+        corners = c_corners_within_radius(atom_coordinate, radius, origin_crd, uper_most_corner_crd,
+                                          uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
+        for i, j, k in corners:
+            sasai_view[i, j, k] = rho
+
+    for atom_ind in core_ions:
+        atom_coordinate = crd[atom_ind]
+        radius = radii[atom_ind] * lig_metal_scaling
+        corners = c_corners_within_radius(atom_coordinate, radius, origin_crd, uper_most_corner_crd,
+                                          uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
+        for i, j, k in corners:
+            sasai_view[i, j, k] = rho
+
+    for atom_ind in surface_atoms:
+        atom_coordinate = crd[atom_ind]
+        radius = radii[atom_ind] * lig_surface_scaling
+        corners = c_corners_within_radius(atom_coordinate, radius, origin_crd, uper_most_corner_crd,
+                                          uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
+        for i, j, k in corners:
+            if sasai_view[i, j, k] == 0:
+                sasar_view[i, j, k] = 1.
+
+    for atom_ind in surface_ions:
+        atom_coordinate = crd[atom_ind]
+        radius = radii[atom_ind] * lig_metal_scaling
+        corners = c_corners_within_radius(atom_coordinate, radius, origin_crd, uper_most_corner_crd,
+                                          uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
+        for i, j, k in corners:
+            if sasai_view[i, j, k] == 0:
+                sasar_view[i, j, k] = 1.
+
+    # if 2 or more nearest neighbors of a rho*i point are 0, it becomes a surface point
+    changes_list = []
+    for i in range(i_max):
+        for j in range(j_max):
+            for k in range(k_max):
+                if sasai_view[i, j, k] != rho:
+                    continue
+                nzeros = 0
+                for s in range(nshifts):
+                    l = i + shifts_view[s, 0]
+                    m = j + shifts_view[s, 1]
+                    n = k + shifts_view[s, 2]
+                    if l < 0 or m < 0 or n < 0 or l >= i_max or m >= j_max or n >= k_max:
+                        nzeros += 1
+                    elif sasai_view[l, m, n] == 0:
+                        nzeros += 1
+                if nzeros > 1:
+                    changes_list.append((i, j, k))
+
+    for i, j, k in changes_list:
+        sasai_view[i, j, k] = 0.
+        sasar_view[i, j, k] = 1.
+
+    return sasai_grid, sasar_grid
+
 # TODO: Delete these old functions as they don't serve any purpose currently
 # @cython.boundscheck(False)
 # def c_cal_charge_grid_pp(  str name,
@@ -1382,90 +1915,6 @@ def c_cal_charge_grid_pp_mp(  str name,
 #
 #     return sasai_grid, grid, rho_i_corners
 #
-# @cython.boundscheck(False)
-# def c_cal_lig_sasa_grids(np.ndarray[np.float64_t, ndim=2] crd,
-#                         np.ndarray[np.float64_t, ndim=1] grid_x,
-#                         np.ndarray[np.float64_t, ndim=1] grid_y,
-#                         np.ndarray[np.float64_t, ndim=1] grid_z,
-#                         np.ndarray[np.float64_t, ndim=1] origin_crd,
-#                         np.ndarray[np.float64_t, ndim=1] uper_most_corner_crd,
-#                         np.ndarray[np.int64_t, ndim=1]   uper_most_corner,
-#                         np.ndarray[np.float64_t, ndim=1] spacing,
-#                         np.ndarray[np.int64_t, ndim=2]   nearest_neighbor_shifts,
-#                         np.ndarray[np.int64_t, ndim=1]   grid_counts,
-#                         np.ndarray[np.float64_t, ndim=1] radii,
-#                         list core_atoms,
-#                         list surface_atoms,
-#                         list core_ions,
-#                         list surface_ions,
-#                         float lig_core_scaling,
-#                         float lig_surface_scaling,
-#                         float lig_metal_scaling,
-#                         float rho,
-#                            ):
-#
-#     cdef:
-#         int atom_ind, i, j, k
-#         int natoms = crd.shape[0]
-#         int i_max = grid_x.shape[0]
-#         int j_max = grid_y.shape[0]
-#         int k_max = grid_z.shape[0]
-#         list nearest_neighbors, rho_i_zeros, changes_list
-#         np.ndarray[np.float64_t, ndim=1] atom_coordinate
-#         np.ndarray[np.float64_t, ndim=3] sasai_grid = np.zeros([i_max, j_max, k_max], dtype=float)
-#         np.ndarray[np.float64_t, ndim=3] sasar_grid = np.zeros([i_max, j_max, k_max], dtype=float)
-#
-#
-#     for atom_ind in core_atoms:
-#         atom_coordinate = crd[atom_ind]
-#         radius = radii[atom_ind] * lig_core_scaling
-#         corners = c_corners_within_radius(atom_coordinate, radius, origin_crd, uper_most_corner_crd,
-#                                           uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
-#         for i, j, k in corners:
-#             sasai_grid[i, j, k] = rho
-#
-#     for atom_ind in core_ions:
-#         atom_coordinate = crd[atom_ind]
-#         radius = radii[atom_ind] * lig_metal_scaling
-#         corners = c_corners_within_radius(atom_coordinate, radius, origin_crd, uper_most_corner_crd,
-#                                                   uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
-#         for i, j, k in corners:
-#             sasai_grid[i, j, k] = rho
-#
-#     for atom_ind in surface_atoms:
-#         atom_coordinate = crd[atom_ind]
-#         radius = radii[atom_ind] * lig_surface_scaling
-#         corners = c_corners_within_radius(atom_coordinate, radius, origin_crd, uper_most_corner_crd,
-#                                                   uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
-#         for i, j, k in corners:
-#             if sasai_grid[i][j][k] == 0:
-#                 sasar_grid[i][j][k] = 1.
-#
-#     for atom_ind in surface_ions:
-#         atom_coordinate = crd[atom_ind]
-#         radius = radii[atom_ind] * lig_metal_scaling
-#         corners = c_corners_within_radius(atom_coordinate, radius, origin_crd, uper_most_corner_crd,
-#                                                   uper_most_corner, spacing, grid_x, grid_y, grid_z, grid_counts)
-#         for i, j, k in corners:
-#             if sasai_grid[i][j][k] == 0:
-#                 sasar_grid[i][j][k] = 1.
-#
-#     rho_i_hits = np.array(np.where(sasai_grid == rho)).transpose()
-#     # print(rho_i_hits[0])
-#     changes_list = []
-#     if len(rho_i_hits) > 0:
-#         for i, j, k in rho_i_hits: # if 2 or more grid points are 0 next to a roh*i point, set to 1
-#             nearest_neighbors = [[i,j,k] + corner for corner in nearest_neighbor_shifts]
-#             rho_i_zeros = [[l,m,n] for [l,m,n] in nearest_neighbors if sasai_grid[l][m][n] == 0]
-#             if len(rho_i_zeros) > 1:
-#                 changes_list.append([i,j,k])
-#     if len(changes_list) > 0:
-#         for [i, j, k] in changes_list:
-#             sasai_grid[i][j][k] = 0.
-#             sasar_grid[i][j][k] = 1.
-#
-#     return sasai_grid, sasar_grid
-
 # @cython.boundscheck(False)
 # def c_asa_frame(      np.ndarray[np.float64_t, ndim=2] crd,
 #                             np.ndarray[np.float64_t, ndim=1] atom_radii,
@@ -13,6 +13,7 @@ import netCDF4
 # change this 
 sys.path.append("../bpmfwfft/")
 from md_openmm import OpenMM_TREMD
+from nc_integrity import verify
 
 parser = argparse.ArgumentParser()
 parser.add_argument( "--ligand_prmtop",             type=str, default="ligand.prmtop")
@@ -28,24 +29,25 @@ parser.add_argument( "--low_temperature",           type=float, default = 300.)
 parser.add_argument( "--high_temperature",          type=float, default = 600.)
 parser.add_argument( "--ntemperatures",             type=int, default = 8)
 
+parser.add_argument( "--exchange",                  type=str, default = "neighbor", choices=["neighbor", "all_pairs"])
+parser.add_argument( "--nr_swap_attempts",          type=int, default = None,
+                     help="swaps per iteration for all_pairs, default ntemperatures^3")
+parser.add_argument( "--nequilibration",            type=int, default = 0,
+                     help="iterations run before those stored")
+parser.add_argument( "--adapt_ladder",              action="store_true", default=False,
+                     help="adapt the temperatures during equilibration to equalize neighbor acceptance")
+
 parser.add_argument( "--nc_traj_file",              type=str, default = "traj.nc")
 
 args = parser.parse_args()
 
-def is_md_done(nc_file, niterations):
-    if not os.path.isfile(nc_file):
-        return False
-
-    if os.path.getsize(nc_file) == 0:
-        return False
+def is_md_done(nc_file, niterations, deep=False):
+    # files written before the completion marks: the last frame must be written
+    def last_frame_written(nc_handle):
+        return type(nc_handle.variables["positions"][-1]) != np.ma.core.MaskedArray
 
-    nc_handle = netCDF4.Dataset(nc_file)
-    if nc_handle.variables["positions"].shape[0] < niterations:
-        return False
-    
-    if type(nc_handle.variables["positions"][-1]) == np.ma.core.MaskedArray:
-        return False
-    return True
+    return verify(nc_file, variables=["positions"], records={"niterations": niterations},
+                  deep=deep, legacy_check=last_frame_written)
 
 
 def geometric_progression(low, high, n):
@@ -58,8 +60,10 @@ def geometric_progression(low, high, n):
 if not is_md_done(args.nc_traj_file, args.niterations):
     temperatures = geometric_progression(args.low_temperature, args.high_temperature, args.ntemperatures)
 
-    tremd = OpenMM_TREMD(args.ligand_prmtop, args.ligand_inpcrd, args.phase, temperatures)
-    tremd.run(args.nc_traj_file, args.steps_per_iteration, args.niterations, args.rotations_per_iteration)
+    tremd = OpenMM_TREMD(args.ligand_prmtop, args.ligand_inpcrd, args.phase, temperatures,
+                         exchange=args.exchange, nr_swap_attempts=args.nr_swap_attempts)
+    tremd.run(args.nc_traj_file, args.steps_per_iteration, args.niterations, args.rotations_per_iteration,
+              nequilibration=args.nequilibration, adapt_ladder=args.adapt_ladder)
 
 else:
     print(args.nc_traj_file + " is good, so nothing to be done!")
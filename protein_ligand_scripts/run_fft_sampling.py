@@ -12,7 +12,10 @@ import netCDF4 as nc
 
 # change this 
 sys.path.append("../bpmfwfft")
-from fft_sampling import Sampling_PL
+from fft_sampling import Sampling_PL, ConformerEnsembleSampling
+from conformers import ConformerRotationEnsemble
+from rotation import _random_rotation_matrix
+from nc_integrity import verify
 
 parser = argparse.ArgumentParser()
 
@@ -33,27 +36,28 @@ parser.add_argument( "--number_translations_per_ligand_sample_stored", type=int,
 
 parser.add_argument( "--nc_out_file",   type=str, default="fft_sample.nc")
 
-args = parser.parse_args()
-
-
-def is_sampling_done(nc_file, number_ligand_samples):
-    if not os.path.exists(nc_file):
-        return False
+# conformer-ensemble mode: ligand frames x random rotations, near-duplicate frames merged
+parser.add_argument( "--conformer_ensemble",        action="store_true", default=False)
+parser.add_argument( "--number_rotations",          type=int, default=100)
+parser.add_argument( "--rmsd_cutoff",               type=float, default=0.5)
+parser.add_argument( "--seed",                      type=int, default=0,
+                     help="seeds the ligand frame and rotation draws, a rerun must draw the same ensemble to resume it")
+parser.add_argument( "--scaling_factors",           type=float, nargs=7, default=[0.76, 0.53, 0.55, 0.81, 0.50, 0.54, 9.0],
+                     help="rc_scale rs_scale rm_scale lc_scale ls_scale lm_scale rho")
 
-    nc_handle = nc.Dataset(nc_file, "r")
-    cond1 = nc_handle.variables["lig_positions"][:].shape[0] == number_ligand_samples
-    if not cond1:
-        return False
+args = parser.parse_args()
 
-    cond2 = type(nc_handle.variables["lig_positions"][:]) == np.ndarray
-    if not cond2:
-        return False
 
-    return True
+def is_sampling_done(nc_file, number_rows, deep=False):
+    # files written before the completion marks: every row must be written
+    def lig_positions_written(nc_handle):
+        return type(nc_handle.variables["lig_positions"][:]) == np.ndarray
 
+    return verify(nc_file, variables=["lig_positions"], records={"lig_sample_size": number_rows},
+                  deep=deep, legacy_check=lig_positions_written)
 
-if not is_sampling_done(args.nc_out_file, args.number_ligand_samples):
 
+def load_ligand_samples():
     lig_nc_handle = nc.Dataset(args.ligand_traj_nc_file, "r")
     if args.number_ligand_samples > lig_nc_handle.variables["positions"].shape[0]:
         raise Exception("The number of ligand samples stored in " + args.ligand_traj_nc_file + 
@@ -66,19 +70,48 @@ if not is_sampling_done(args.nc_out_file, args.number_ligand_samples):
         ligand_samples = lig_nc_handle.variables["positions"][sel_ind]
 
     lig_nc_handle.close()
-
-    sampler = Sampling_PL(  args.receptor_prmtop, args.lj_scale_factor, args.receptor_inpcrd,
-                            args.bsite, args.grid_nc_file,
-                            args.ligand_prmtop, args.ligand_inpcrd,
-                            ligand_samples,
-                            args.number_translations_per_ligand_sample_stored,
-                            args.nc_out_file,
-                            temperature=300.)
+    return ligand_samples
+
+
+np.random.seed(args.seed)
+ligand_samples = load_ligand_samples()
+if args.conformer_ensemble:
+    # drawn after the ligand frames, so the same seed gives the same rotations on every rerun
+    rotations = np.array([_random_rotation_matrix() for _ in range(args.number_rotations)])
+    ensemble = ConformerRotationEnsemble(np.array(ligand_samples, dtype=float), rotations,
+                                         rmsd_cutoff=args.rmsd_cutoff)
+    # one row per representative conformer and rotation
+    number_rows = len(ensemble)
+else:
+    number_rows = args.number_ligand_samples
+
+if not is_sampling_done(args.nc_out_file, number_rows):
+
+    if args.conformer_ensemble:
+        start_index = 0
+        if os.path.exists(args.nc_out_file):
+            with nc.Dataset(args.nc_out_file, "r") as out_nc_handle:
+                start_index = int(out_nc_handle.variables["current_rotation_index"][0])
+            print("Resuming %s at row %d of %d" % (args.nc_out_file, start_index, number_rows))
+        sampler = ConformerEnsembleSampling(args.receptor_prmtop, args.lj_scale_factor,
+                                            *args.scaling_factors,
+                                            args.receptor_inpcrd, args.bsite, args.grid_nc_file,
+                                            args.ligand_prmtop, args.ligand_inpcrd,
+                                            ensemble.set_first_step(start_index),
+                                            args.number_translations_per_ligand_sample_stored,
+                                            args.nc_out_file, start_index,
+                                            temperature=300.)
+    else:
+        sampler = Sampling_PL(  args.receptor_prmtop, args.lj_scale_factor, args.receptor_inpcrd,
+                                args.bsite, args.grid_nc_file,
+                                args.ligand_prmtop, args.ligand_inpcrd,
+                                ligand_samples,
+                                args.number_translations_per_ligand_sample_stored,
+                                args.nc_out_file,
+                                temperature=300.)
     sampler.run_sampling()
 
     print("Sampling Done")
 
 else:
     print(args.nc_out_file + " is good, nothing to be done!")
-
-
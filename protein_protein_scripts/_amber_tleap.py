@@ -5,7 +5,11 @@ functions to generate AMBER topology and coordinates files
 from __future__ import print_function
 
 import os
+import re
 import glob
+import hashlib
+import subprocess
+import concurrent.futures
 
 
 def _parse_cofactors_prep_dir(dir):
@@ -107,39 +111,119 @@ def _write_tleap_script(ligand_pdb, receptor_pdb, cofactors_prep, out_dir,
 
 
 TLEAP_FAILED = "TLEAP_FAILED"
+TLEAP_LOG = "tleap.out"
+INPUT_HASH = "tleap_inputs.sha256"
 
+# tleap log line -> failure class, the first match wins
+TLEAP_LOG_FAILURES = [("FATAL", "fatal"),
+                      ("Could not open file", "missing_file"),
+                      ("Unknown residue", "unknown_residue"),
+                      ("does not have a type", "missing_atom_type"),
+                      ("Could not find bond parameter", "missing_parameters"),
+                      ("Could not find angle parameter", "missing_parameters"),
+                      ("Parameter file was not saved", "missing_parameters")]
 
 
-def _run_tleap(tleap_script_file):
+def _output_files(out_dir):
+    files = []
+    for prefix in [LIGAND_OUT_PREFIX, RECEPTOR_OUT_PREFIX, COMPLEX_OUT_PREFIX]:
+        files += [os.path.join(out_dir, prefix + ext) for ext in (".prmtop", ".inpcrd")]
+    return files
+
+
+def _outputs_good(out_dir):
+    for file in _output_files(out_dir):
+        if not os.path.isfile(file) or os.path.getsize(file) == 0:
+            return False
+    return True
+
+
+def _input_hash(tleap_script_file):
+    """
+    sha256 of the tleap script and of every file it loads
+    """
+    run_dir = os.path.dirname(os.path.abspath(tleap_script_file))
+    sha = hashlib.sha256()
+    script = open(tleap_script_file, "rb").read()
+    sha.update(script)
+    for line in script.decode().splitlines():
+        # also "receptor = loadpdb receptor_modelled.pdb"
+        match = re.search(r"\bload\w*\s+(\S+)", line, re.IGNORECASE)
+        if match is None:
+            continue
+        file = os.path.join(run_dir, match.group(1))
+        if os.path.isfile(file):
+            sha.update(open(file, "rb").read())
+    return sha.hexdigest()
+
+
+def _is_up_to_date(tleap_script_file):
+    run_dir = os.path.dirname(os.path.abspath(tleap_script_file))
+    hash_file = os.path.join(run_dir, INPUT_HASH)
+    if not os.path.isfile(hash_file) or not _outputs_good(run_dir):
+        return False
+    return open(hash_file, "r").read().strip() == _input_hash(tleap_script_file)
+
+
+def _classify_tleap_log(log, returncode, out_dir):
+    """
+    :param log: str, stdout and stderr of tleap
+    :param returncode: int
+    :param out_dir: str
+    :return: None if tleap succeeded, otherwise (failure class, log line or message)
+    """
+    for line in log.splitlines():
+        for pattern, failure in TLEAP_LOG_FAILURES:
+            if pattern in line:
+                return failure, line.strip()
+    errors = re.search(r"Errors = (\d+)", log)
+    if errors is not None and int(errors.group(1)) > 0:
+        return "errors", errors.group(0)
+    if returncode != 0:
+        return "exit_status", "tleap exited with %d" % returncode
+    if not _outputs_good(out_dir):
+        return "missing_outputs", "not all of the prmtop and inpcrd files were written"
+    return None
+
+
+def _run_tleap(tleap_script_file, timeout=None):
+    """
+    run tleap in the directory of tleap_script_file, without changing the cwd of this process,
+    so that several can run at once
+    :param tleap_script_file: str
+    :param timeout: float or None, seconds
+    :return: None if tleap succeeded, otherwise (failure class, message)
+    The log goes to TLEAP_LOG; a failure also writes TLEAP_FAILED with its class and message.
+    """
     if not os.path.isfile(tleap_script_file):
         raise RuntimeError("%s does not exist" % tleap_script_file)
 
     tleap_script = os.path.abspath(tleap_script_file)
-    cwd = os.getcwd()
     run_dir = os.path.dirname(tleap_script)
     script_name = os.path.basename(tleap_script)
-
-    os.chdir(run_dir)
-    print("\n\n\n\nRunning tleap for " + tleap_script_file)
-    print("cwd", os.getcwd())
-    os.system("tleap -f %s" % script_name)
-
-    # check results
-
-    prmtop_files = glob.glob("*.prmtop")
-    if len(prmtop_files) != 3:
-        os.system("touch "+TLEAP_FAILED)
+    failed_file = os.path.join(run_dir, TLEAP_FAILED)
+    for file in [failed_file, os.path.join(run_dir, INPUT_HASH)]:
+        if os.path.exists(file):
+            os.remove(file)
+
+    try:
+        result = subprocess.run(["tleap", "-f", script_name], cwd=run_dir, stdout=subprocess.PIPE,
+                                stderr=subprocess.STDOUT, universal_newlines=True, timeout=timeout)
+        log = result.stdout
+        failure = _classify_tleap_log(log, result.returncode, run_dir)
+    except FileNotFoundError:
+        log = ""
+        failure = "not_found", "tleap is not in PATH"
+    except subprocess.TimeoutExpired as e:
+        log = e.stdout.decode() if isinstance(e.stdout, bytes) else (e.stdout or "")
+        failure = "timeout", "tleap did not finish in %s s" % timeout
+
+    open(os.path.join(run_dir, TLEAP_LOG), "w").write(log)
+    if failure is None:
+        open(os.path.join(run_dir, INPUT_HASH), "w").write(_input_hash(tleap_script) + "\n")
     else:
-        for file in prmtop_files:
-            if not os.path.exists(file):
-                os.system("touch "+TLEAP_FAILED)
-                break
-            else:
-                if os.path.getsize(file) == 0:
-                    os.system("touch "+TLEAP_FAILED)
-                    break
-    os.chdir(cwd)
-    return None
+        open(failed_file, "w").write("%s: %s\n" % failure)
+    return failure
 
 
 LIGAND_PDB_INP = "ligand_modelled.pdb"
@@ -151,10 +235,13 @@ COMPLEX_OUT_PREFIX = "complex"
 TLEAP = "setup.tleap"
 
 
-def generate_prmtop(cofactors_frcmod_dir):
+def generate_prmtop(cofactors_frcmod_dir, nr_workers=None, force=False, timeout=None):
     """
     :param cofactors_prep_dir: str
-    :return: None
+    :param nr_workers: int or None, number of tleap runs at once, defaults to the available CPUs
+    :param force: bool, if False skip complexes whose inputs are unchanged since their last good run
+    :param timeout: float or None, seconds per tleap run
+    :return: dict, complex name -> None if it succeeded or was skipped, else (failure class, message)
     """
     complex_names = glob.glob("*")
     complex_names = [os.path.basename(d) for d in complex_names if os.path.isdir(d)]
@@ -164,20 +251,34 @@ def generate_prmtop(cofactors_frcmod_dir):
     if len(complex_names) == 0:
         print("Do nothing!")
         return None
-    print("Generating amber top for ...")
+    if nr_workers is None:
+        nr_workers = len(os.sched_getaffinity(0)) if hasattr(os, "sched_getaffinity") else os.cpu_count()
+
+    tleap_script_files = {}
+    results = {}
     for complex_name in complex_names:
-        print(complex_name)
         out_dir = os.path.abspath(complex_name)
         _write_tleap_script(LIGAND_PDB_INP, RECEPTOR_PDB_INP, cofactors_prep, out_dir,
                             LIGAND_OUT_PREFIX, RECEPTOR_OUT_PREFIX, COMPLEX_OUT_PREFIX, TLEAP)
-
         tleap_script_file = os.path.join(out_dir, TLEAP)
-        _run_tleap(tleap_script_file)
+        if not force and _is_up_to_date(tleap_script_file):
+            print(complex_name, "is up to date, skipped")
+            results[complex_name] = None
+        else:
+            tleap_script_files[complex_name] = tleap_script_file
+
+    print("Generating amber top for %d complexes with %d workers" % (len(tleap_script_files), nr_workers))
+    # tleap is an external process, threads are enough to keep nr_workers of them busy
+    with concurrent.futures.ThreadPoolExecutor(max_workers=max(1, nr_workers)) as executor:
+        futures = {executor.submit(_run_tleap, file, timeout): name for name, file in tleap_script_files.items()}
+        for future in concurrent.futures.as_completed(futures):
+            complex_name = futures[future]
+            results[complex_name] = future.result()
+            print(complex_name, "done" if results[complex_name] is None else TLEAP_FAILED)
 
     print("Done with Amber")
     print("Checking for failed ...")
     for complex_name in complex_names:
-        if os.path.exists(os.path.join(complex_name, TLEAP_FAILED)):
-            print(complex_name, TLEAP_FAILED)
-    return None
-
+        if results[complex_name] is not None:
+            print(complex_name, TLEAP_FAILED, "%s: %s" % results[complex_name])
+    return results
@@ -11,6 +11,8 @@ import os
 import copy
 import glob
 
+from _pdb_reader import PdbAtoms, read_header_value
+
 MODELLED_PDB_SUBFIX = "_modelled.pdb"
 MODELLED_RESIDUES = "REMARK  MODELLED RESIDUES:"
 ATOM = "ATOM"
@@ -129,28 +131,28 @@ class ChainCombine(object):
         assert len(chain) == 1, "chain must be a single letter"
         infile = os.path.join(modelling_dir, pdb_id + chain + MODELLED_PDB_SUBFIX)
         pdb_data = {}
-        with open(infile, "r") as F:
-            for line in F:
-                if MODELLED_RESIDUES in line:
-                    pdb_data["modelled_residues"] = eval(line.strip(MODELLED_RESIDUES))
-                    break
-            pdb_data["atoms"] = [ line.strip() for line in F if line.startswith(ATOM)]
+        pdb_data["modelled_residues"] = read_header_value(infile, MODELLED_RESIDUES)
+        if pdb_data["modelled_residues"] is None:
+            raise RuntimeError("%s has no %s line" % (infile, MODELLED_RESIDUES))
+        pdb_data["modelled_residues"] = list(pdb_data["modelled_residues"])
+        atoms = PdbAtoms(infile, records=(ATOM,))
+        pdb_data["atoms"] = atoms.get_lines()
 
-            res_list = self._count_residues(pdb_data["atoms"])
-            modelled_residues = {"nter" : [], "loops" : [], "cter" : []}
+        res_list = atoms.unique_residues()
+        modelled_residues = {"nter" : [], "loops" : [], "cter" : []}
 
-            if len(pdb_data["modelled_residues"]) > 0 and pdb_data["modelled_residues"][0][0] == res_list[0]:
-                modelled_residues["nter"].append(pdb_data["modelled_residues"][0])
-                pdb_data["modelled_residues"].pop(0)
+        if len(pdb_data["modelled_residues"]) > 0 and pdb_data["modelled_residues"][0][0] == res_list[0]:
+            modelled_residues["nter"].append(pdb_data["modelled_residues"][0])
+            pdb_data["modelled_residues"].pop(0)
 
-            if len(pdb_data["modelled_residues"]) > 0 and pdb_data["modelled_residues"][-1][-1] == res_list[-1]:
-                modelled_residues["cter"].append(pdb_data["modelled_residues"][-1])
-                pdb_data["modelled_residues"].pop(-1)
+        if len(pdb_data["modelled_residues"]) > 0 and pdb_data["modelled_residues"][-1][-1] == res_list[-1]:
+            modelled_residues["cter"].append(pdb_data["modelled_residues"][-1])
+            pdb_data["modelled_residues"].pop(-1)
 
-            modelled_residues["loops"] = pdb_data["modelled_residues"]
-            pdb_data["modelled_residues"] = modelled_residues
+        modelled_residues["loops"] = pdb_data["modelled_residues"]
+        pdb_data["modelled_residues"] = modelled_residues
 
-            pdb_data["residues"] = res_list
+        pdb_data["residues"] = res_list
         return pdb_data
 
     def _count_residues(self, atom_list):
@@ -301,11 +303,11 @@ class ChainCombine(object):
         return pdb_data
 
     def _load_ions_cofactors_file(self, file):
+        atoms = PdbAtoms(file, records=(HETATM, TER))
         pdb_data = {}
-        with open(file, "r") as F:
-            pdb_data["atoms"] = [line.strip() for line in F if (line.startswith(HETATM) or line.startswith(TER))]
-        pdb_data["natoms"]   = len([line for line in pdb_data["atoms"] if line.startswith(HETATM)])
-        pdb_data["nresidues"] = len([line for line in pdb_data["atoms"] if line.startswith(TER)])
+        pdb_data["atoms"] = atoms.get_lines()
+        pdb_data["natoms"]   = int(atoms.record_mask(HETATM).sum())
+        pdb_data["nresidues"] = int(atoms.record_mask(TER).sum())
         return pdb_data
 
 
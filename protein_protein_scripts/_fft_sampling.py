@@ -11,6 +11,7 @@ import numpy as np
 
 sys.path.append("../bpmfwfft")
 from bpmfwfft.fft_sampling import Sampling
+from bpmfwfft.nc_integrity import verify
 
 BSITE_FILE = None
 
@@ -23,7 +24,9 @@ def sampling(rec_prmtop, lj_sigma_scal_fact,
                 lig_prmtop, lig_inpcrd, 
                 lig_coor_nc, nr_lig_conf,
                 energy_sample_size_per_ligand,
-                output_nc, output_dir):
+                output_nc, output_dir,
+                restraint_file=None, max_violated_restraint_groups=0,
+                desolvation_weight=None, store_density_map=False):
     lig_nc_handle = netCDF4.Dataset(lig_coor_nc, "r")
     if os.path.exists(output_nc):
         start_index = netCDF4.Dataset(output_nc, "r").variables["current_rotation_index"][:][0]
@@ -50,7 +53,11 @@ def sampling(rec_prmtop, lj_sigma_scal_fact,
                             energy_sample_size_per_ligand,
                             output_nc,
                             start_index,
-                            temperature=300.)
+                            temperature=300.,
+                            restraint_file=restraint_file,
+                            max_violated_restraint_groups=max_violated_restraint_groups,
+                            desolvation_weight=desolvation_weight,
+                            store_density_map=store_density_map)
 
         sampler.run_sampling()
         if start_index + nr_lig_conf >= total_rotations:
@@ -63,27 +70,19 @@ def sampling(rec_prmtop, lj_sigma_scal_fact,
     return None
 
 
-def is_sampling_nc_good(nc_file, nr_extracted_lig_conf):
-    if not os.path.exists(nc_file):
-        return False
+def _lig_positions_written(nc_handle):
+    return type(nc_handle.variables["lig_positions"][:]) == np.ndarray
 
-    try:
-        nc_handle = netCDF4.Dataset(nc_file, "r")
-    except RuntimeError as e:
-        print(nc_file)
-        print(e)
-        return True
-    else:
-        pass
-    cond1 = nc_handle.variables["lig_positions"][:].shape[0] == nr_extracted_lig_conf
-    if not cond1:
-        return False
-
-    cond2 = type(nc_handle.variables["lig_positions"][:]) == np.ndarray
-    if not cond2:
-        return False
 
-    return True
+def is_sampling_nc_good(nc_file, nr_extracted_lig_conf, deep=False):
+    """
+    :param nc_file: str
+    :param nr_extracted_lig_conf: int, number of ligand rotations the file must hold
+    :param deep: bool, if True also check the checksums, see nc_integrity.verify
+    :return: bool
+    """
+    return verify(nc_file, variables=["lig_positions"], records={"lig_sample_size": nr_extracted_lig_conf},
+                  deep=deep, legacy_check=_lig_positions_written)
 
 
 def parse_nr_ligand_confs(submit_file):
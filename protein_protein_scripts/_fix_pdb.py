@@ -3,11 +3,13 @@
 define class to handle pdb files
 """
 
+import numpy as np
 import modeller
 import modeller.automodel
 import Bio.SeqIO
 
 from _modeller_model import run_modeller
+from _pdb_reader import PdbAtoms
 
 
 class AddMissing(object):
@@ -18,7 +20,7 @@ class AddMissing(object):
         self._file = pdb_file
         self._check_pdb()
         self._id = pdb_file[:-4]
-        self._text_lines = open(pdb_file, "r").readlines()
+        self._atoms = PdbAtoms(pdb_file, records=("ATOM",))
 
         self._structureX_seq_header = self._structureX_seq_from_modeller()
         self._full_sequences = self._full_seq_from_Bio()
@@ -153,17 +155,14 @@ class AddMissing(object):
         """
         res_ranges = {}
         for chain in self._chains_list:
-
-            chain_text_lines = []
-            for line in self._text_lines:
-                if line[0:4] == "ATOM" and line[21:22] == chain:
-                    chain_text_lines.append(line)
-
-            if len(chain_text_lines) == 0:
+            chain_atoms = np.flatnonzero(self._atoms.chain_mask(chain))
+            if len(chain_atoms) == 0:
                 raise RuntimeError("%s does not have chain %s"%(self._file, chain))
 
-            start = chain_text_lines[0][22:27]
-            end   = chain_text_lines[-1][22:27]
+            # as in the pdb, with the insertion code
+            first, last = self._atoms.atoms[[chain_atoms[0], chain_atoms[-1]]]
+            start = "%4d%s" % (first["resid"], first["icode"] or " ")
+            end   = "%4d%s" % (last["resid"], last["icode"] or " ")
             res_ranges[chain] = (start, end)
         return res_ranges
 
@@ -1,8 +1,10 @@
 """
+restrained energy minimization of modelled loops, then of the whole complex, with OpenMM
 """
 from __future__ import print_function
 
 import os
+import concurrent.futures
 
 import numpy as np
 import simtk.openmm
@@ -53,67 +55,102 @@ def _combine_res_to_minimize_rec_lig(rec_res_to_minimize, lig_res_to_minimize):
     return all_res_to_minimize
 
 
-def openMM_minimize(in_dir, out_dir, out_pdb="min.pdb", minimize_all=False):
+NONBONDED_METHODS = {"NoCutoff": simtk.openmm.app.NoCutoff,
+                     # reaction field beyond the cutoff
+                     "CutoffNonPeriodic": simtk.openmm.app.CutoffNonPeriodic}
+FREEZE_METHODS = ["mass", "restraint"]
+RESTRAINT_K = 1.0e5     # kJ/mol/nm^2
+
+
+def _energy(context):
+    state = context.getState(getEnergy=True)
+    return state.getPotentialEnergy().value_in_unit(simtk.unit.kilocalorie_per_mole)
+
+
+def openMM_minimize(in_dir, out_dir, out_pdb="min.pdb", minimize_all=False,
+                    nonbonded_method="NoCutoff", nonbonded_cutoff=12.0,
+                    freeze_method="mass", platform_name=None, threads=None):
     """
     if minimize_all, the whole complex will be minimize
     res_to_minimize:    list of residue indices (starting 1) allowed to move
 
+    The loop stage and the whole complex stage run on one system and one context.
+    The atoms outside the loops are held either by zero masses, restored with a reinitialize
+    that keeps the positions, or by harmonic restraints to their start, switched off for the
+    whole complex stage.
+
     :param in_dir:
     :param out_dir:
     :param out_pdb:
     :param minimize_all:
+    :param nonbonded_method: str, one of NONBONDED_METHODS; CutoffNonPeriodic for large complexes
+    :param nonbonded_cutoff: float, in angstrom, used with CutoffNonPeriodic
+    :param freeze_method: str, "mass" or "restraint"
+    :param platform_name: str or None, OpenMM platform, None lets OpenMM choose
+    :param threads: int or None, threads of the CPU platform
     :return:
     """
+    assert nonbonded_method in NONBONDED_METHODS, "nonbonded_method must be one of %s" % list(NONBONDED_METHODS)
+    assert freeze_method in FREEZE_METHODS, "freeze_method must be one of %s" % FREEZE_METHODS
+
     rec_res_to_minimize = os.path.join(in_dir, REC_MIN_LIST)
     lig_res_to_minimize = os.path.join(in_dir, LIG_MIN_LIST)
     res_to_minimize = _combine_res_to_minimize_rec_lig(rec_res_to_minimize, lig_res_to_minimize)
-    res_to_minimize = [i-1 for i in res_to_minimize]    # make it start 0
+    res_to_minimize = set([i-1 for i in res_to_minimize])    # make it start 0
 
     prmtop = simtk.openmm.app.AmberPrmtopFile( os.path.join(in_dir, COMPLEX_PRMTOP) )
     inpcrd = simtk.openmm.app.AmberInpcrdFile( os.path.join(in_dir, COMPLEX_INPCRD) )
-    system = prmtop.createSystem(nonbondedMethod = simtk.openmm.app.NoCutoff, 
-            constraints = None, implicitSolvent = None)
-
-    atoms = prmtop.topology.atoms()
-    for i, atom in enumerate(atoms):
-        if atom.residue.index not in res_to_minimize:
+    system = prmtop.createSystem(nonbondedMethod=NONBONDED_METHODS[nonbonded_method],
+                                 nonbondedCutoff=nonbonded_cutoff*simtk.unit.angstrom,
+                                 constraints=None, implicitSolvent=None)
+
+    frozen = [i for i, atom in enumerate(prmtop.topology.atoms()) if atom.residue.index not in res_to_minimize]
+    masses = [system.getParticleMass(i) for i in frozen]
+    if freeze_method == "mass":
+        for i in frozen:
             system.setParticleMass(i, 0*simtk.unit.dalton)
+    else:
+        restraint = simtk.openmm.CustomExternalForce("0.5*k_restraint*((x-x0)^2 + (y-y0)^2 + (z-z0)^2)")
+        restraint.addGlobalParameter("k_restraint", RESTRAINT_K)
+        for name in ["x0", "y0", "z0"]:
+            restraint.addPerParticleParameter(name)
+        positions = inpcrd.positions.value_in_unit(simtk.unit.nanometer)
+        for i in frozen:
+            restraint.addParticle(i, list(positions[i]))
+        system.addForce(restraint)
 
     integrator = simtk.openmm.VerletIntegrator(0.001*simtk.unit.picoseconds)
-    simulation = simtk.openmm.app.Simulation( prmtop.topology, system, integrator )
-    simulation.context.setPositions( inpcrd.positions )
-    #simulation.reporters.append(mdtraj.reporters.DCDReporter(out_prefix + ".dcd", 100))
-
-    state = simulation.context.getState(getEnergy=True)
-    energy = state.getPotentialEnergy()
-    print("Energy before loop minimization ", energy.value_in_unit(simtk.unit.kilocalorie_per_mole))
-
+    if platform_name is None:
+        context = simtk.openmm.Context(system, integrator)
+    else:
+        platform = simtk.openmm.Platform.getPlatformByName(platform_name)
+        properties = {"Threads": str(threads)} if (platform_name == "CPU" and threads is not None) else {}
+        context = simtk.openmm.Context(system, integrator, platform, properties)
+    context.setPositions( inpcrd.positions )
+
+    print("Energy before loop minimization ", _energy(context))
     print("Loop minimizing ...")
-    simulation.minimizeEnergy()
-
-    state = simulation.context.getState(getEnergy=True, getPositions=True)
-    energy = state.getPotentialEnergy()
-    print("Energy after loop minimization ", energy.value_in_unit(simtk.unit.kilocalorie_per_mole))
+    simtk.openmm.LocalEnergyMinimizer.minimize(context)
+    print("Energy after loop minimization ", _energy(context))
 
     #----
     print("Whole minimizing ...")
-    positions = state.getPositions()
-    prmtop = simtk.openmm.app.AmberPrmtopFile( os.path.join(in_dir, COMPLEX_PRMTOP) )
-    system = prmtop.createSystem(nonbondedMethod = simtk.openmm.app.NoCutoff,
-            constraints = None, implicitSolvent = None)
-    integrator = simtk.openmm.VerletIntegrator(0.001*simtk.unit.picoseconds)
-    simulation = simtk.openmm.app.Simulation( prmtop.topology, system, integrator )
-    simulation.context.setPositions( positions )
-    simulation.minimizeEnergy(tolerance=1.*simtk.unit.kilojoule_per_mole, maxIterations=2000)
-
-    state = simulation.context.getState(getEnergy=True, getPositions=True)
+    if freeze_method == "mass":
+        for i, mass in zip(frozen, masses):
+            system.setParticleMass(i, mass)
+        context.reinitialize(preserveState=True)
+    else:
+        context.setParameter("k_restraint", 0.)
+    simtk.openmm.LocalEnergyMinimizer.minimize(context, 1.*simtk.unit.kilojoule_per_mole, 2000)
+
+    state = context.getState(getEnergy=True, getPositions=True)
     energy = state.getPotentialEnergy()
     print("Energy after whole minimization ", energy.value_in_unit(simtk.unit.kilocalorie_per_mole))
 
     positions = state.getPositions()
     crd = np.array( positions.value_in_unit(simtk.unit.angstrom), dtype=float )
 
-    simtk.openmm.app.PDBFile.writeFile(simulation.topology, state.getPositions(), 
+    simtk.openmm.app.PDBFile.writeFile(prmtop.topology, positions,
             open( os.path.join(out_dir, out_pdb), 'w') )
 
     rec_natoms = _read_natoms( os.path.join(in_dir, REC_INPCRD) )
@@ -123,10 +160,46 @@ def openMM_minimize(in_dir, out_dir, out_pdb="min.pdb", minimize_all=False):
     _write_inpcrd(rec_crd, os.path.join(out_dir, REC_INPCRD))
     _write_inpcrd(lig_crd, os.path.join(out_dir, LIG_INPCRD))
 
+    del context, integrator
     print("Minimizing done!")
     return None
 
 
+def _minimize_one(in_dir, out_dir, kwargs):
+    if not os.path.isdir(out_dir):
+        os.makedirs(out_dir)
+    try:
+        openMM_minimize(in_dir, out_dir, **kwargs)
+    except Exception as e:
+        return "%s: %s" % (type(e).__name__, e)
+    return None
+
+
+def openMM_minimize_many(dirs, nr_workers=None, **kwargs):
+    """
+    minimize many complexes in a pool of worker processes, each with its own context
+    :param dirs: list of (in_dir, out_dir)
+    :param nr_workers: int or None, defaults to the available CPUs
+    :param kwargs: passed to openMM_minimize; with the CPU platform the threads are shared among workers
+    :return: dict, in_dir -> None if it succeeded, otherwise the error message
+    """
+    if nr_workers is None:
+        nr_workers = len(os.sched_getaffinity(0)) if hasattr(os, "sched_getaffinity") else os.cpu_count()
+    nr_workers = max(1, min(nr_workers, len(dirs)))
+    if kwargs.get("platform_name") == "CPU" and kwargs.get("threads") is None:
+        cpus = len(os.sched_getaffinity(0)) if hasattr(os, "sched_getaffinity") else os.cpu_count()
+        kwargs["threads"] = max(1, cpus // nr_workers)
+
+    results = {}
+    with concurrent.futures.ProcessPoolExecutor(max_workers=nr_workers) as executor:
+        futures = {executor.submit(_minimize_one, in_dir, out_dir, kwargs): in_dir for in_dir, out_dir in dirs}
+        for future in concurrent.futures.as_completed(futures):
+            in_dir = futures[future]
+            results[in_dir] = future.result()
+            print("Minimized", in_dir, "" if results[in_dir] is None else "FAILED " + results[in_dir])
+    return results
+
+
 def _read_natoms(inpcrd):
     with open(inpcrd, "r") as F:
         F.readline()
@@ -135,13 +208,16 @@ def _read_natoms(inpcrd):
 
 
 def _write_inpcrd(crd, file):
-    out_str = """default_name\n"""
-    out_str += """%6d\n"""%len(crd)
-    for i in range(len(crd)):
-        out_str += """%12.7f%12.7f%12.7f"""%( crd[i][0], crd[i][1], crd[i][2] )
-        if (i+1)%2 == 0:
-            out_str += """\n"""
-    open( file, "w").write( out_str )
+    """
+    six numbers per line, two atoms, as AMBER does
+    """
+    values = np.asarray(crd, dtype=float).ravel()
+    nfull = (values.shape[0] // 6) * 6
+    lines = ["%12.7f" * 6 % tuple(row) for row in values[:nfull].reshape(-1, 6)]
+    if nfull < values.shape[0]:
+        lines.append("%12.7f" * (values.shape[0] - nfull) % tuple(values[nfull:]))
+    with open(file, "w") as F:
+        F.write("default_name\n")
+        F.write("%6d\n" % len(crd))
+        F.write("\n".join(lines) + "\n")
     return None
-
-
@@ -0,0 +1,212 @@
+"""
+fixed-width PDB reader shared by the preparation scripts
+
+The file is memory-mapped and the records are decoded column by column with numpy, not line by
+line, into a structured array. Masks over that array select atoms by chain, residue name or id
+and element, and the original lines can be taken back for the selected atoms.
+"""
+
+from __future__ import print_function
+
+import ast
+import mmap
+
+import numpy as np
+
+LINE_WIDTH = 80
+SPACE = ord(" ")
+
+# name -> (first column, last column + 1, dtype), columns start at 0
+PDB_COLUMNS = {"record":    (0, 6, "U6"),
+               "serial":    (6, 11, int),
+               "name":      (12, 16, "U4"),
+               "altloc":    (16, 17, "U1"),
+               "resname":   (17, 20, "U3"),
+               "chain":     (21, 22, "U1"),
+               "resid":     (22, 26, int),
+               "icode":     (26, 27, "U1"),
+               "x":         (30, 38, float),
+               "y":         (38, 46, float),
+               "z":         (46, 54, float),
+               "occupancy": (54, 60, float),
+               "bfactor":   (60, 66, float),
+               "element":   (76, 78, "U2")}
+
+
+def _line_bounds(data):
+    """
+    :param data: 1d array of uint8, the whole file
+    :return: (starts, lengths), 1d arrays of int, without the line endings
+    """
+    ends = np.flatnonzero(data == ord("\n"))
+    if data.shape[0] > 0 and data[-1] != ord("\n"):
+        ends = np.append(ends, data.shape[0])
+    starts = np.concatenate([[0], ends[:-1] + 1]).astype(np.int64)
+    lengths = ends - starts
+    # \r\n
+    carriage = (lengths > 0) & (data[np.maximum(ends - 1, 0)] == ord("\r"))
+    lengths = lengths - carriage
+    return starts, lengths
+
+
+def _columns(data, starts, lengths, width):
+    """
+    :return: 2d array of uint8, (nlines, width), padded with spaces past the end of a line
+    """
+    # data padded so that no line runs past the end, seen as overlapping rows of width bytes
+    padded = np.concatenate([data, np.full(width, SPACE, dtype=np.uint8)])
+    rows = np.lib.stride_tricks.sliding_window_view(padded, width)[starts]
+    cols = np.arange(width)
+    return np.where(cols < lengths[:, np.newaxis], rows, np.uint8(SPACE))
+
+
+def _is_record(heads, records):
+    """
+    :param heads: 2d array of uint8, (nlines, 6), the record names
+    :param records: list of str
+    :return: 1d array of bool
+    """
+    keep = np.zeros(heads.shape[0], dtype=bool)
+    for record in records:
+        name = np.frombuffer(record.ljust(6).encode(), dtype=np.uint8)
+        keep |= (heads == name).all(axis=1)
+    return keep
+
+
+def _decode_number(block):
+    """
+    right-justified fixed-point numbers, as PDB writes them, from their digits
+    :param block: 2d array of uint8
+    :return: 1d array of float; blank fields are 0
+    """
+    width = block.shape[1]
+    digits = block - np.uint8(ord("0"))
+    is_digit = digits <= 9
+    digits = np.where(is_digit, digits, np.uint8(0))
+    cols = np.arange(width)
+    is_dot = block == ord(".")
+    has_dot = is_dot.any(axis=1)
+    # the decimal point, or just after the last digit of an integer
+    last_digit = width - np.argmax(is_digit[:, ::-1], axis=1)
+    point = np.where(has_dot, is_dot.argmax(axis=1), last_digit)
+    decimals = np.where(has_dot, width - 1 - point, 0)
+    # the digits as an integer, exact in float, then one division, so that "1.100" gives 1.1
+    if np.all(point == point[0]) and np.all(decimals == decimals[0]):
+        # the usual case, one format for the whole column: a dot product with the place values
+        exponents = np.where(cols < point[0], point[0] - cols - 1, point[0] - cols) + decimals[0]
+        values = np.dot(digits.astype(float), 10.0 ** np.maximum(exponents, 0)) / 10.0 ** decimals[0]
+    else:
+        point = point[:, np.newaxis]
+        exponents = np.where(cols < point, point - cols - 1, point - cols) + decimals[:, np.newaxis]
+        values = (digits * 10.0 ** np.maximum(exponents, 0)).sum(axis=1) / 10.0 ** decimals
+    return np.where((block == ord("-")).any(axis=1), -values, values)
+
+
+def _decode(block, dtype):
+    """
+    :param block: 2d array of uint8, one fixed-width field of every line
+    :return: 1d array of dtype; blank numbers are 0
+    """
+    if dtype is float:
+        return _decode_number(block)
+    if dtype is int:
+        return np.rint(_decode_number(block)).astype(int)
+    # bytes widened to UCS4 code points are already a unicode array
+    text = np.ascontiguousarray(block, dtype=np.uint32).view("U%d" % block.shape[1]).ravel()
+    return np.char.strip(text).astype(dtype)
+
+
+def read_header_value(pdb_file, prefix):
+    """
+    python literal following prefix on the first line that contains it, e.g. the
+    "REMARK  MODELLED RESIDUES:" list written by _modeller_model
+    :param pdb_file: str
+    :param prefix: str
+    :return: the literal, or None if no line contains prefix
+    """
+    with open(pdb_file, "r") as F:
+        for line in F:
+            if prefix in line:
+                return ast.literal_eval(line.split(prefix, 1)[1].strip())
+    return None
+
+
+class PdbAtoms(object):
+    def __init__(self, pdb_file, records=("ATOM", "HETATM")):
+        """
+        :param pdb_file: str
+        :param records: tuple of str, records to keep, in file order, e.g. ("HETATM", "TER")
+        """
+        self._file = pdb_file
+        with open(pdb_file, "rb") as F:
+            try:
+                buffer = mmap.mmap(F.fileno(), 0, access=mmap.ACCESS_READ)
+            except ValueError:
+                # mmap of an empty file
+                buffer = None
+            data = np.frombuffer(buffer, dtype=np.uint8) if buffer is not None else np.zeros(0, dtype=np.uint8)
+
+            starts, lengths = _line_bounds(data)
+            keep = _is_record(_columns(data, starts, lengths, 6), records)
+            starts, lengths = starts[keep], lengths[keep]
+            block = _columns(data, starts, lengths, max(LINE_WIDTH, int(lengths.max(initial=0))))
+            del data
+            if buffer is not None:
+                buffer.close()
+
+        self._lines = np.ascontiguousarray(block, dtype=np.uint32).view("U%d" % block.shape[1]).ravel()
+        self.atoms = np.zeros(block.shape[0], dtype=[(name, dtype) for name, (_, _, dtype) in PDB_COLUMNS.items()])
+        for name, (first, last, dtype) in PDB_COLUMNS.items():
+            self.atoms[name] = _decode(block[:, first:last], dtype)
+
+    def __len__(self):
+        return self.atoms.shape[0]
+
+    def get_crd(self, mask=None):
+        """
+        :return: 2d array, (natoms, 3)
+        """
+        atoms = self.atoms if mask is None else self.atoms[mask]
+        return np.stack([atoms["x"], atoms["y"], atoms["z"]], axis=1)
+
+    def get_lines(self, mask=None):
+        """
+        :param mask: 1d array of bool or None for all
+        :return: list of str, the original lines, without trailing spaces and line endings
+        """
+        lines = self._lines if mask is None else self._lines[mask]
+        return np.char.rstrip(lines).tolist()
+
+    def record_mask(self, records):
+        """
+        :param records: str or list of str, e.g. "ATOM"
+        """
+        return np.isin(self.atoms["record"], np.atleast_1d(records))
+
+    def chain_mask(self, chains):
+        """
+        :param chains: str or list of one-letter str
+        """
+        return np.isin(self.atoms["chain"], np.atleast_1d(chains))
+
+    def resname_mask(self, resnames):
+        return np.isin(self.atoms["resname"], np.atleast_1d(resnames))
+
+    def resid_mask(self, first, last):
+        """
+        residues first to last, inclusive
+        """
+        return (self.atoms["resid"] >= first) & (self.atoms["resid"] <= last)
+
+    def element_mask(self, elements):
+        """
+        :param elements: str or list of str, upper case, e.g. ["C", "ZN"]
+        """
+        return np.isin(np.char.upper(self.atoms["element"]), np.atleast_1d(elements))
+
+    def unique_residues(self, mask=None):
+        """
+        :return: sorted list of int, residue ids
+        """
+        resids = self.atoms["resid"] if mask is None else self.atoms["resid"][mask]
+        return np.unique(resids).tolist()
@@ -12,6 +12,7 @@ import netCDF4
 sys.path.append("../bpmfwfft")
 from bpmfwfft.IO import InpcrdLoad
 from bpmfwfft.grids import Grid, RecGrid
+from bpmfwfft.nc_integrity import verify
 
 
 def _distance(coord1, coord2):
@@ -95,20 +96,8 @@ def rec_grid_cal(prmtop, lj_scale, sc_scale, ss_scale, sm_scale, rho,
     return None
 
 
-def is_nc_grid_good(nc_grid_file):
-    if not os.path.exists(nc_grid_file):
-        return False
-
-    if os.path.getsize(nc_grid_file) == 0:
-        return False
-
-    nc_handle = netCDF4.Dataset(nc_grid_file, "r")
-    nc_keys = nc_handle.variables.keys()
-    grid_keys = Grid().get_allowed_keys()
-    for key in grid_keys:
-        if key not in nc_keys:
-            return False
-    return True
+def is_nc_grid_good(nc_grid_file, deep=False):
+    return verify(nc_grid_file, variables=Grid().get_required_keys(), deep=deep)
 
 
 def get_grid_size_from_nc(grid_nc_file):
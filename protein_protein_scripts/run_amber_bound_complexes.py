@@ -19,6 +19,10 @@ parser.add_argument("--cofactors_frcmod_dir", type=str, default="cofactors_frcmo
 
 parser.add_argument("--modeller_dir", type=str, default="modeller")
 
+parser.add_argument("--tleap_workers", type=int, default=None, help="tleap runs at once, default all CPUs")
+parser.add_argument("--force_tleap", action="store_true", default=False,
+                    help="rerun tleap even for complexes whose inputs did not change")
+
 args = parser.parse_args()
 
 AFFINITY_FILES = ["affinity_v1.tsv",  "affinity_v2.tsv"]
@@ -39,6 +43,6 @@ b_complexes = aff.get_bound_complexes()
 
 write_b_receptor_ligand_pdbs(b_complexes, args.modeller_dir, args.ions_cofactors_dir,
                              ter_cutoff=TER_CUTOFF, loop_cutoff=LOOP_CUTOFF)
-generate_prmtop(args.cofactors_frcmod_dir)
+generate_prmtop(args.cofactors_frcmod_dir, nr_workers=args.tleap_workers, force=args.force_tleap)
 print("Done")
 
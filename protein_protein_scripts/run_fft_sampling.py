@@ -26,6 +26,13 @@ parser.add_argument("--lig_ensemble_dir",              type=str, default="rotati
 
 parser.add_argument("--energy_sample_size_per_ligand", type=int, default=1000)
 parser.add_argument("--nr_lig_conf",                   type=int, default=100)
+parser.add_argument("--restraint_name",                type=str, default="restraints.dat",
+                    help="distance restraints in amber_dir, used if the file exists")
+parser.add_argument("--max_violated_restraint_groups", type=int, default=0)
+parser.add_argument("--desolvation_weight",            type=float, default=0.1322,
+                    help="weight of the desolvation term, 0 to leave it out")
+parser.add_argument("--store_density_map",             action="store_true", default=False,
+                    help="write the translational log density map to the sampling nc file")
 
 parser.add_argument("--out_dir",                       type=str, default="out")
 
@@ -145,6 +152,10 @@ python {this_script}  \
         --ls_scale {args.ls_scale:.6f} \
         --lm_scale {args.lm_scale:.6f} \
         --nr_lig_conf {args.nr_lig_conf} \
+        --restraint_name {args.restraint_name} \
+        --max_violated_restraint_groups {args.max_violated_restraint_groups} \
+        --desolvation_weight {args.desolvation_weight:.6f} \
+        {"--store_density_map" if args.store_density_map else ""} \
         --energy_sample_size_per_ligand {args.energy_sample_size_per_ligand} \n'''
 
         fft_sampling_nc_file = os.path.join(out_dir, FFT_SAMPLING_NC)
@@ -267,6 +278,10 @@ python {this_script}  \
         --ls_scale {args.ls_scale:.6f} \
         --lm_scale {args.lm_scale:.6f} \
         --nr_lig_conf {args.nr_lig_conf} \
+        --restraint_name {args.restraint_name} \
+        --max_violated_restraint_groups {args.max_violated_restraint_groups} \
+        --desolvation_weight {args.desolvation_weight:.6f} \
+        {"--store_density_map" if args.store_density_map else ""} \
         --energy_sample_size_per_ligand {args.energy_sample_size_per_ligand} \n'''
 
         fft_sampling_nc_file = os.path.join(com_dir, FFT_SAMPLING_NC)
@@ -308,6 +323,10 @@ else:
     output_nc = os.path.join(args.out_dir, FFT_SAMPLING_NC)
     output_dir = args.out_dir
 
+    restraint_file = os.path.join(args.amber_dir, args.restraint_name)
+    if not os.path.exists(restraint_file):
+        restraint_file = None
+
     sampling(rec_prmtop, lj_sigma_scal_fact,
              rc_scale, rs_scale, rm_scale,
              lc_scale, ls_scale, lm_scale,
@@ -316,4 +335,8 @@ else:
              lig_prmtop, lig_inpcrd,
              lig_coor_nc, nr_lig_conf,
              energy_sample_size_per_ligand,
-             output_nc, output_dir)
+             output_nc, output_dir,
+             restraint_file=restraint_file,
+             max_violated_restraint_groups=args.max_violated_restraint_groups,
+             desolvation_weight=args.desolvation_weight,
+             store_density_map=args.store_density_map)
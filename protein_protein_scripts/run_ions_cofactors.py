@@ -6,7 +6,10 @@ from __future__ import print_function
 import os
 import argparse
 
+import numpy as np
+
 from _affinity_data import AffinityData
+from _pdb_reader import PdbAtoms
 
 parser = argparse.ArgumentParser()
 parser.add_argument("--affinity_dir", type=str, default="affinity")
@@ -21,11 +24,6 @@ args = parser.parse_args()
 AFFINITY_DATA_FILES = ["affinity_v1.tsv",  "affinity_v2.tsv"]
 AFFINITY_DATA_FILES = [os.path.join(args.affinity_dir, file) for file in AFFINITY_DATA_FILES]
 
-CHAIN_POS = (21, 22)
-RES_NAME_POS = (17, 20)
-RES_ID_POS = (22, 26)
-ATOM_NAME_POS = (12, 17)
-
 ACCEPTED_IONS = ["MG", "CA", "FE", "ZN", "SR"]
 ACCEPTED_COFACTORS = ["ADP", "ATP", "GDP", "GTP"]
 
@@ -40,47 +38,32 @@ def _extract_ions_cofactors_from_pdb(pdb_file, chains, ions_cofactors, out_dir):
     id+chain+"_ions_cofactors.pdb"
     """
     id = os.path.basename(pdb_file)[:-4]
-    all_hetatm = [line for line in open(pdb_file, "r") if line.startswith("HETATM")]
-    if len(all_hetatm) == 0:
+    hetatm = PdbAtoms(pdb_file, records=("HETATM",))
+    if len(hetatm) == 0:
         print(pdb_file + " does not have any HETATM")
         return None
 
-    i, j = CHAIN_POS
-    all_hetatm = [line for line in all_hetatm if line[i:j] in chains]
-    if len(all_hetatm) == 0:
+    selected = hetatm.chain_mask(chains)
+    if not selected.any():
         print(pdb_file + " does not have any HETATM with chain in ", chains)
         return None
 
-    i, j = RES_NAME_POS
-    all_hetatm = [line for line in all_hetatm if line[i:j].strip() in ions_cofactors]
-    if len(all_hetatm) == 0:
+    selected &= hetatm.resname_mask(ions_cofactors)
+    if not selected.any():
         print(pdb_file + " does not have any HETATM with resname in ", ions_cofactors)
         return None
 
-    atom_records = {}
-    for i, line in enumerate(all_hetatm):
-        current_resid = int(line[RES_ID_POS[0] : RES_ID_POS[1]])
-
-        chain = line[CHAIN_POS[0] : CHAIN_POS[1]]
-        if chain not in atom_records.keys():
-            atom_records[chain] = {}
+    atoms = hetatm.atoms[selected]
+    lines = hetatm.get_lines(selected)
+    # a TER after the last atom of every residue
+    is_last = np.append(atoms["resid"][1:] != atoms["resid"][:-1], True)
 
-        resname = line[RES_NAME_POS[0] : RES_NAME_POS[1]].strip()
-        try:
-            len(atom_records[chain][resname])
-        except KeyError:
-            atom_records[chain][resname] = []
-
-        atom_records[chain][resname].append(line)
-
-        if i+1 < len(all_hetatm):
-            next_resid = int(all_hetatm[i+1][RES_ID_POS[0] : RES_ID_POS[1]])
-        else:
-            next_resid = current_resid
-            atom_records[chain][resname].append("TER\n")
-
-        if current_resid != next_resid:
-            atom_records[chain][resname].append("TER\n")
+    atom_records = {}
+    for atom, line, last in zip(atoms, lines, is_last):
+        records = atom_records.setdefault(atom["chain"], {}).setdefault(atom["resname"], [])
+        records.append(line + "\n")
+        if last:
+            records.append("TER\n")
 
     if not os.path.isdir(out_dir):
         os.system("mkdir "+out_dir)
@@ -110,15 +93,10 @@ def extract_ions_cofactors_from_database(acepted_ions, acepted_cofactors,
             pdb_id = complex[:4].lower()
             chains = complex.split("_")[-1]
             chains = [c for c in chains if c != ":"]
-            with open(os.path.join(original_pdb_dir, pdb_id+".pdb"), "r") as F:
-                for line in F:
-                    if line.startswith("HETATM"):
-                        chain = line[CHAIN_POS[0] : CHAIN_POS[1]]
-                        res = line[RES_NAME_POS[0] : RES_NAME_POS[1]].strip()
-                        if (chain in chains) and (res in acepted_residues):
-                            if complex not in sel.keys():
-                                sel[complex] = []
-                            sel[complex].append(res)
+            hetatm = PdbAtoms(os.path.join(original_pdb_dir, pdb_id+".pdb"), records=("HETATM",))
+            selected = hetatm.chain_mask(chains) & hetatm.resname_mask(acepted_residues)
+            if selected.any():
+                sel.setdefault(complex, []).extend(hetatm.atoms["resname"][selected].tolist())
 
     for complex in ions_cofactors_bound.keys():
         a = ions_cofactors_bound[complex].split(",")
@@ -9,7 +9,7 @@ import sys
 import glob
 import argparse
 
-from _loop_energy_minimize import openMM_minimize
+from _loop_energy_minimize import openMM_minimize, openMM_minimize_many
 
 
 parser = argparse.ArgumentParser()
@@ -17,6 +17,14 @@ parser.add_argument("--amber_dir", type=str, default="amber")
 parser.add_argument("--minimize_all",  action="store_true", default=False)
 
 parser.add_argument("--submit",  action="store_true", default=False)
+parser.add_argument("--batch",   action="store_true", default=False,
+                    help="minimize every complex in amber_dir here, in a pool of worker processes")
+parser.add_argument("--nr_workers", type=int, default=None)
+
+parser.add_argument("--nonbonded_method", type=str, default="NoCutoff", help="NoCutoff or CutoffNonPeriodic")
+parser.add_argument("--nonbonded_cutoff", type=float, default=12.0, help="angstrom")
+parser.add_argument("--freeze_method",    type=str, default="mass", help="mass or restraint")
+parser.add_argument("--platform",         type=str, default=None)
 
 parser.add_argument("--in_dir",  type=str, default="inp")
 parser.add_argument("--out_dir", type=str, default="out")
@@ -25,7 +33,21 @@ parser.add_argument("--out_pdb", type=str, default="complex.pdb")
 args = parser.parse_args()
 
 
-if args.submit:
+minimize_kwargs = {"nonbonded_method": args.nonbonded_method, "nonbonded_cutoff": args.nonbonded_cutoff,
+                   "freeze_method": args.freeze_method, "platform_name": args.platform}
+
+if args.batch:
+    amber_dir = os.path.abspath(args.amber_dir)
+    amber_sub_dirs = glob.glob(os.path.join(amber_dir, "*"))
+    amber_sub_dirs = [dir for dir in amber_sub_dirs if os.path.isdir(dir)]
+    dirs = [(dir, os.path.abspath(os.path.basename(dir))) for dir in amber_sub_dirs]
+    results = openMM_minimize_many(dirs, nr_workers=args.nr_workers, out_pdb=args.out_pdb,
+                                   minimize_all=args.minimize_all, **minimize_kwargs)
+    for in_dir, error in results.items():
+        if error is not None:
+            print("FAILED", in_dir, error)
+
+elif args.submit:
 
     this_script = os.path.abspath(sys.argv[0])
 
@@ -57,9 +79,13 @@ date
 python ''' + this_script + \
         ''' --in_dir ''' + in_dir + \
         ''' --out_dir ''' + out_dir + \
-        ''' --out_pdb ''' + args.out_pdb + '''\n'''
+        ''' --out_pdb ''' + args.out_pdb + \
+        ''' --nonbonded_method ''' + args.nonbonded_method + \
+        ''' --nonbonded_cutoff ''' + str(args.nonbonded_cutoff) + \
+        ''' --freeze_method ''' + args.freeze_method + '''\n'''
         open(qsub_file, "w").write( qsub_script)
         os.system("qsub %s" %qsub_file)
 
 else:
-    openMM_minimize( args.in_dir, args.out_dir, out_pdb=args.out_pdb, minimize_all=args.minimize_all)
+    openMM_minimize( args.in_dir, args.out_dir, out_pdb=args.out_pdb, minimize_all=args.minimize_all,
+                     **minimize_kwargs)